@@ -47,6 +47,23 @@ void GetUbxChecksumU4(OUT       U4* pChk_a,
     *pChk_b = chk_b;
 }
 
+void UpdateUbxChecksumU4(INOUT U4*       pChk_a,
+                         INOUT U4*       pChk_b,
+                         IN    const U4* pData,
+                         IN    size_t    numBytes)
+{
+    U4 chk_a = *pChk_a;
+    U4 chk_b = *pChk_b;
+    numBytes /= 4;
+    while (numBytes--)
+    {
+        chk_a += *pData++;
+        chk_b += chk_a;
+    }
+    *pChk_a = chk_a;
+    *pChk_b = chk_b;
+}
+
 BOOL CheckUbxChecksumU4(IN const U4* pData,
                         IN size_t    numBytes)
 {
@@ -58,16 +75,28 @@ BOOL CheckUbxChecksumU4(IN const U4* pData,
 }
 
 
-U2 GetUbxChecksumU1(IN const U1* pData,
-                    IN size_t    length)
+void UpdateUbxChecksumU1(INOUT U1*       pChk_a,
+                         INOUT U1*       pChk_b,
+                         IN    const U1* pData,
+                         IN    size_t    length)
 {
-    U1 chk_a = 0;
-    U1 chk_b = 0;
+    U1 chk_a = *pChk_a;
+    U1 chk_b = *pChk_b;
     while (length--)
     {
         chk_a += *pData++;
         chk_b += chk_a;
     }
+    *pChk_a = chk_a;
+    *pChk_b = chk_b;
+}
+
+U2 GetUbxChecksumU1(IN const U1* pData,
+                    IN size_t    length)
+{
+    U1 chk_a = 0;
+    U1 chk_b = 0;
+    UpdateUbxChecksumU1(&chk_a, &chk_b, pData, length);
     return ((U2)(chk_b)<<8) | (U2)(chk_a);
 }
 
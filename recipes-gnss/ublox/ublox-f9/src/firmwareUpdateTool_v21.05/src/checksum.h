@@ -60,6 +60,21 @@ BOOL CheckUbxChecksumU4(IN const U4* pData,
 unsigned short GetUbxChecksumU1(IN const U1* pData,
                                 IN size_t    length);
 
+//! Continue UBX checksum over pData
+/*!
+    Adds pData to a checksum calculated over preceding data, allows to
+    calculate the checksum of a message as it is received piece by piece.
+
+    \param pChk_a    pointer to first byte of checksum, 0 before the first call
+    \param pChk_b    pointer to second byte of checksum, 0 before the first call
+    \param pData     pointer to Data to calculate checksum on
+    \param length    length of data to calculate checksum on
+*/
+void UpdateUbxChecksumU1(INOUT U1*       pChk_a,
+                         INOUT U1*       pChk_b,
+                         IN    const U1* pData,
+                         IN    size_t    length);
+
 //! Calculate UBX checksum over pData
 /*!
     Calculates the checksum over pData and returns it.
@@ -74,5 +89,20 @@ void GetUbxChecksumU4(OUT U4 * pChk_a,
                       IN  const U4 * pData,
                       IN  size_t numBytes);
 
+//! Continue UBX checksum on words over pData
+/*!
+    Adds pData to a checksum calculated over preceding data, allows to
+    calculate the checksum of an image read piece by piece.
+
+    \param pChk_a    pointer to first word of checksum, 0 before the first call
+    \param pChk_b    pointer to second word of checksum, 0 before the first call
+    \param pData     pointer to Data to calculate checksum on
+    \param numBytes  length of data in bytes to calculate checksum on, a multiple of 4
+*/
+void UpdateUbxChecksumU4(INOUT U4*       pChk_a,
+                         INOUT U4*       pChk_b,
+                         IN    const U4* pData,
+                         IN    size_t    numBytes);
+
 #endif
 
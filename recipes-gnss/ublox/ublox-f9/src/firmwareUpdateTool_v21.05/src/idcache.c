@@ -0,0 +1,211 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+/*!
+  \file
+  \brief  Cache of receiver properties that don't change between updates
+
+  The cache is a text file with one line per receiver, the fields are
+  separated by tabs:
+
+  \code
+  key  ROM CRC  JEDEC ID  FIS (hex)
+  \endcode
+
+  Unknown properties are written as "-".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "idcache.h"
+
+#define IDC_LINE_SIZE   (IDC_KEY_SIZE + 2 * IDC_FIS_SIZE + 64) //!< maximum length of a line
+
+//! write bytes as hex digits
+/*!
+    \param pDst    receives the digits and the terminating zero, 2 * size + 1 characters
+    \param pData   bytes to convert
+    \param size    number of bytes
+*/
+static void idcToHex(CH* pDst, const U1* pData, size_t size)
+{
+    size_t ix;
+    for (ix = 0; ix < size; ix++)
+    {
+        sprintf(pDst + 2 * ix, "%02X", pData[ix]);
+    }
+    pDst[2 * size] = 0;
+}
+
+//! parse a line of the cache file
+/*!
+    \param pLine   line, modified
+    \param pEntry  receives the properties if the key matches
+    \return #TRUE if the line belongs to \a pEntry->key
+*/
+static BOOL idcParse(CH* pLine, IDC_ENTRY_t* pEntry)
+{
+    CH* pField[4] = { pLine, NULL, NULL, NULL };
+    U4 ix;
+    pLine[strcspn(pLine, "\r\n")] = 0;
+    for (ix = 1; ix < NUMOF(pField); ix++)
+    {
+        CH* pTab = strchr(pField[ix - 1], '\t');
+        if (!pTab)
+        {
+            return FALSE;
+        }
+        *pTab = 0;
+        pField[ix] = pTab + 1;
+    }
+    if (strcmp(pField[0], pEntry->key) != 0)
+    {
+        return FALSE;
+    }
+    pEntry->romCrcValid = (*pField[1] != '-');
+    pEntry->romCrc = (U4)strtoul(pField[1], NULL, 16);
+    pEntry->jedecValid = (*pField[2] != '-');
+    pEntry->jedec = (U4)strtoul(pField[2], NULL, 16);
+    pEntry->fisSize = 0;
+    const size_t len = strlen(pField[3]);
+    if ((*pField[3] != '-') && !(len % 2) && (len / 2 <= sizeof(pEntry->fis)))
+    {
+        for (ix = 0; ix < len / 2; ix++)
+        {
+            CH digits[3] = { pField[3][2 * ix], pField[3][2 * ix + 1], 0 };
+            pEntry->fis[ix] = (U1)strtoul(digits, NULL, 16);
+        }
+        pEntry->fisSize = len / 2;
+    }
+    return TRUE;
+}
+
+void idcMakeKey(OUT IDC_ENTRY_t* pEntry,
+                IN  const U1*    pUniqId,
+                IN  size_t       uniqIdSize,
+                IN  const CH*    pPort,
+                IN  const CH*    pHwVer,
+                IN  const CH*    pSwVer)
+{
+    memset(pEntry, 0, sizeof(*pEntry));
+    if (pUniqId && uniqIdSize && (4 + 2 * uniqIdSize < sizeof(pEntry->key)))
+    {
+        strcpy(pEntry->key, "uid:");
+        idcToHex(pEntry->key + 4, pUniqId, uniqIdSize);
+    }
+    else
+    {
+        snprintf(pEntry->key, sizeof(pEntry->key), "port:%s|%s|%s", pPort, pHwVer, pSwVer);
+    }
+    // the tabs separate the fields
+    CH* pTab;
+    while ((pTab = strchr(pEntry->key, '\t')) != NULL)
+    {
+        *pTab = ' ';
+    }
+}
+
+BOOL idcLookup(IN    const CH*    fileName,
+               INOUT IDC_ENTRY_t* pEntry)
+{
+    FILE* stream = fopen(fileName, "r");
+    if (!stream)
+    {
+        return FALSE;
+    }
+    CH line[IDC_LINE_SIZE];
+    BOOL found = FALSE;
+    while (!found && fgets(line, sizeof(line), stream))
+    {
+        found = idcParse(line, pEntry);
+    }
+    fclose(stream);
+    return found;
+}
+
+BOOL idcStore(IN const CH*          fileName,
+              IN const IDC_ENTRY_t* pEntry)
+{
+    CH tmpName[FILENAME_MAX];
+    if (strlen(fileName) + 5 > sizeof(tmpName))
+    {
+        return FALSE;
+    }
+    sprintf(tmpName, "%s.tmp", fileName);
+    FILE* out = fopen(tmpName, "w");
+    if (!out)
+    {
+        return FALSE;
+    }
+
+    // copy the entries of the other receivers
+    FILE* in = fopen(fileName, "r");
+    CH line[IDC_LINE_SIZE];
+    if (in)
+    {
+        IDC_ENTRY_t other;
+        while (fgets(line, sizeof(line), in))
+        {
+            strcpy(other.key, pEntry->key);
+            CH copy[IDC_LINE_SIZE];
+            strcpy(copy, line);
+            if (!idcParse(copy, &other))
+            {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+
+    CH romCrc[16] = "-";
+    CH jedec[16] = "-";
+    CH fis[2 * IDC_FIS_SIZE + 1] = "-";
+    if (pEntry->romCrcValid)
+    {
+        sprintf(romCrc, "%08X", pEntry->romCrc);
+    }
+    if (pEntry->jedecValid)
+    {
+        sprintf(jedec, "%08X", pEntry->jedec);
+    }
+    if (pEntry->fisSize)
+    {
+        idcToHex(fis, pEntry->fis, pEntry->fisSize);
+    }
+    fprintf(out, "%s\t%s\t%s\t%s\n", pEntry->key, romCrc, jedec, fis);
+
+    BOOL success = (fclose(out) == 0);
+#ifdef WIN32
+    // rename doesn't replace an existing file
+    remove(fileName);
+#endif
+    success = success && (rename(tmpName, fileName) == 0);
+    if (!success)
+    {
+        remove(tmpName);
+    }
+    return success;
+}
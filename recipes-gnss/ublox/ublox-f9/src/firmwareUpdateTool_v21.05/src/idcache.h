@@ -0,0 +1,95 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+/*!
+  \file
+  \brief  Cache of receiver properties that don't change between updates
+*/
+
+#ifndef __IDCACHE_H
+#define __IDCACHE_H
+
+#include <stddef.h>
+#include "types.h"
+
+#define IDC_KEY_SIZE    128     //!< maximum length of a key including the terminating zero
+#define IDC_FIS_SIZE    256     //!< maximum size of a cached FIS
+
+//! cached properties of one receiver
+typedef struct IDC_ENTRY_s
+{
+    CH     key[IDC_KEY_SIZE];   //!< identity of the receiver, see idcMakeKey()
+    BOOL   romCrcValid;         //!< romCrc is known
+    U4     romCrc;              //!< CRC of the ROM
+    BOOL   jedecValid;          //!< jedec is known
+    U4     jedec;               //!< JEDEC ID of the flash
+    size_t fisSize;             //!< size of fis, 0 if not known
+    U1     fis[IDC_FIS_SIZE];   //!< FIS read from the receiver
+} IDC_ENTRY_t;
+
+//! Build the key of a receiver
+/*!
+    The unique ID of the chip identifies the receiver wherever it is
+    connected. Without it the receiver is identified by the port and the
+    versions it reports, this entry is not found anymore after the firmware
+    is changed.
+
+    \param pEntry     \b OUT: entry receiving the key, all properties are cleared
+    \param pUniqId    \b IN: unique ID (payload of SEC-UNIQID), NULL if not available
+    \param uniqIdSize \b IN: size of \a pUniqId
+    \param pPort      \b IN: port name
+    \param pHwVer     \b IN: hardware version from MON-VER
+    \param pSwVer     \b IN: software version from MON-VER
+*/
+void idcMakeKey(OUT IDC_ENTRY_t* pEntry,
+                IN  const U1*    pUniqId,
+                IN  size_t       uniqIdSize,
+                IN  const CH*    pPort,
+                IN  const CH*    pHwVer,
+                IN  const CH*    pSwVer);
+
+//! Look up a receiver in the cache file
+/*!
+    \param fileName   \b IN: name of the cache file
+    \param pEntry     \b INOUT: key set by idcMakeKey(), receives the cached properties
+    \return #TRUE if the receiver was found
+*/
+BOOL idcLookup(IN    const CH*    fileName,
+               INOUT IDC_ENTRY_t* pEntry);
+
+//! Store a receiver in the cache file
+/*!
+    Replaces the entry with the same key or appends a new one. The file is
+    rewritten and renamed, so readers never see a partial file. Concurrent
+    calls within the process have to be serialized by the caller.
+
+    \param fileName   \b IN: name of the cache file, created if it doesn't exist
+    \param pEntry     \b IN: entry to store
+    \return #TRUE on success
+*/
+BOOL idcStore(IN const CH*          fileName,
+              IN const IDC_ENTRY_t* pEntry);
+
+#endif //__IDCACHE_H
@@ -132,6 +132,12 @@ U4 ValidateImage(IN FWHEADER_t const *pImage,
     }
     //magic word found and pointers seem to be OK, check CRC
     U4 crcpos = (pImage->v1.pEnd & ~0x1) - pImage->v1.pBase;
+    if ((crcpos < 4) || (crcpos + 8 > fileSize))
+    {
+        // the image may be mapped, don't read beyond the file
+        MESSAGE(MSG_LEV2, "Image end beyond the file");
+        return FALSE;
+    }
     U4 crcrange = crcpos - 4; // CRC starts behind magic word
     BOOL crcOk = CheckUbxChecksumU4((U4*)((U1*)pImage+4), crcrange);
 
@@ -141,15 +147,7 @@ U4 ValidateImage(IN FWHEADER_t const *pImage,
     // 7 bits of the highest byte of the hardware info word
     if (crcOk)
     {
-        memset(verString, 0, sizeof(verString));
-        if ((pImage->v1.pVersion & 0xFF800000) == EXT2_BASE)
-        {
-            CH* FwVerStr = (CH*)((U1*)pImage + (pImage->v1.pVersion - pImage->v1.pBase));
-            if (FwVerStr < (CH*)((U1*)pImage + fileSize))
-            {
-                strncpy(verString, FwVerStr, sizeof(verString));
-            }
-        }
+        GetImageVersion(pImage, fileSize, verString, sizeof(verString));
 
         MESSAGE(MSG_LEV2, "Image (file size %u) for u-blox%d accepted", fileSize, generation / 10);
         MESSAGE(MSG_LEV2, "Image Ver '%s'", verString);
@@ -160,6 +158,34 @@ U4 ValidateImage(IN FWHEADER_t const *pImage,
     return crcOk ? generation : 0;
 }
 
+BOOL GetImageVersion(IN  FWHEADER_t const *pImage,
+                     IN  const size_t      fileSize,
+                     OUT CH*               pVersion,
+                     IN  const size_t      size)
+{
+    memset(pVersion, 0, size);
+    if ((fileSize < sizeof(FWHEADER_t)) || (size < 1) ||
+        ((pImage->v1.pVersion & 0xFF800000) != EXT2_BASE) ||
+        (pImage->v1.pVersion < pImage->v1.pBase))
+    {
+        return FALSE;
+    }
+    const U4 offset = pImage->v1.pVersion - pImage->v1.pBase;
+    if (offset >= fileSize)
+    {
+        return FALSE;
+    }
+    // the string may end with the image, don't read beyond it
+    const CH* FwVerStr = (const CH*)pImage + offset;
+    size_t len = 0;
+    while ((len < size - 1) && (offset + len < fileSize) && FwVerStr[len])
+    {
+        len++;
+    }
+    memcpy(pVersion, FwVerStr, len);
+    return (len > 0);
+}
+
 
 
 BOOL OpenAndBufferFile(IN  const CH*    BinaryFileName,
@@ -223,3 +249,90 @@ BOOL OpenAndBufferFile(IN  const CH*    BinaryFileName,
     return TRUE;
 }
 
+BOOL MapImageFile(IN  const CH*    BinaryFileName,
+                  OUT IMG_FILE_t*  pFile)
+{
+    memset(pFile, 0, sizeof(*pFile));
+    if (!BinaryFileName || !strlen(BinaryFileName))
+    {
+        MESSAGE(MSG_ERR, "File '%s' is not valid", BinaryFileName);
+        return FALSE;
+    }
+    pFile->pData = (const U1*)FILE_MAP(BinaryFileName, &pFile->size);
+    if (pFile->pData)
+    {
+        pFile->mapped = TRUE;
+        MESSAGE(MSG_DBG, "Image file mapped, %u bytes", (U4)pFile->size);
+        return TRUE;
+    }
+    // not mappable (a pipe or an empty file), read it
+    FWHEADER_t* pContent = NULL;
+    if (!OpenAndBufferFile(BinaryFileName, &pContent, &pFile->size))
+    {
+        return FALSE;
+    }
+    pFile->pData = (const U1*)pContent;
+    return TRUE;
+}
+
+void UnmapImageFile(IN IMG_FILE_t* pFile)
+{
+    if (pFile->mapped)
+    {
+        FILE_UNMAP(pFile->pData, pFile->size);
+    }
+    else
+    {
+        free((void*)pFile->pData);
+    }
+    memset(pFile, 0, sizeof(*pFile));
+}
+
+void InitImageSegments(OUT IMG_SEGMENTS_t* pImage,
+                       IN  const void*     pData,
+                       IN  size_t          size)
+{
+    memset(pImage, 0, sizeof(*pImage));
+    pImage->pBody = (const U1*)pData;
+    pImage->bodySize = size;
+    pImage->padSize = (4 - (size & 0x3)) & 0x3;
+}
+
+size_t GetImageSegmentsSize(IN const IMG_SEGMENTS_t* pImage)
+{
+    return pImage->prefixSize + pImage->bodySize + pImage->padSize;
+}
+
+void ReadImageSegments(IN  const IMG_SEGMENTS_t* pImage,
+                       IN  size_t                offset,
+                       OUT void*                 pDst,
+                       IN  size_t                size)
+{
+    assert(offset + size <= GetImageSegmentsSize(pImage));
+    U1* pOut = (U1*)pDst;
+    // prefix
+    if (offset < pImage->prefixSize)
+    {
+        const size_t n = MIN(size, pImage->prefixSize - offset);
+        memcpy(pOut, pImage->pPrefix + offset, n);
+        pOut += n;
+        offset += n;
+        size -= n;
+    }
+    if (!size)
+    {
+        return;
+    }
+    offset -= pImage->prefixSize;
+    // image
+    if (offset < pImage->bodySize)
+    {
+        const size_t n = MIN(size, pImage->bodySize - offset);
+        memcpy(pOut, pImage->pBody + offset, n);
+        pOut += n;
+        offset += n;
+        size -= n;
+    }
+    // padding
+    memset(pOut, 0xFF, size);
+}
@@ -74,6 +74,93 @@ U4 ValidateImage(IN FWHEADER_t const *pImage,
                  OUT FWFOOTERINFO_t  *pFwFooter);
 
 
+//! Get the version string of a firmware image
+/*!
+    The version string of u-blox 5 to 8 images, as reported by the firmware
+    in MON-VER. Images of later generations are scrambled and have none.
+    \param pImage        pointer to buffer containing firmware image file contents
+    \param fileSize      Size of Buffer containing Image
+    \param pVersion      receives the zero terminated version string, empty if not found
+    \param size          size of \a pVersion
+    \return TRUE if a version string was found, FALSE else
+*/
+BOOL GetImageVersion(IN  FWHEADER_t const *pImage,
+                     IN  const size_t      fileSize,
+                     OUT CH*               pVersion,
+                     IN  const size_t      size);
+
+
+//! Image file loaded with MapImageFile()
+typedef struct IMG_FILE_s
+{
+    const U1*    pData;         //!< content of the file, NULL if not loaded
+    size_t       size;          //!< size of the file
+    BOOL         mapped;        //!< content mapped read-only, otherwise allocated
+} IMG_FILE_t;
+
+//! Image as downloaded to the receiver
+/*!
+    The image is put together from segments instead of being copied into
+    one buffer: an optional prefix (the FIS written in front of u-blox 9
+    images), the image itself and the 0xFF bytes padding it to a multiple
+    of 4 bytes.
+*/
+typedef struct IMG_SEGMENTS_s
+{
+    const U1*    pPrefix;       //!< data in front of the image, NULL if none
+    size_t       prefixSize;    //!< size of the prefix
+    const U1*    pBody;         //!< image
+    size_t       bodySize;      //!< size of the image
+    size_t       padSize;       //!< number of 0xFF bytes after the image
+} IMG_SEGMENTS_t;
+
+//! Map an image file into memory
+/*!
+    Maps the file read-only, so the image doesn't take memory of its own.
+    Files that can't be mapped are read into an allocated buffer.
+    \param BinaryFileName    Filename of file to open
+    \param pFile             receives the image file, to be released with UnmapImageFile()
+    \return TRUE if the file could be loaded, FALSE else
+*/
+BOOL MapImageFile(IN  const CH*    BinaryFileName,
+                  OUT IMG_FILE_t*  pFile);
+
+//! Release an image file loaded with MapImageFile()
+/*!
+    \param pFile             image file, may be empty
+*/
+void UnmapImageFile(IN IMG_FILE_t* pFile);
+
+//! Set up the segments of an image without prefix
+/*!
+    \param pImage            receives the segments
+    \param pData             image
+    \param size              size of the image, padded with 0xFF to a multiple of 4 bytes
+*/
+void InitImageSegments(OUT IMG_SEGMENTS_t* pImage,
+                       IN  const void*     pData,
+                       IN  size_t          size);
+
+//! Get the size of an image put together from segments
+/*!
+    \param pImage            image
+    \return size of all segments
+*/
+size_t GetImageSegmentsSize(IN const IMG_SEGMENTS_t* pImage);
+
+//! Copy a part of an image put together from segments
+/*!
+    \param pImage            image
+    \param offset            offset in the image
+    \param pDst              receives the data
+    \param size              number of bytes to copy, offset + size must not exceed the image
+*/
+void ReadImageSegments(IN  const IMG_SEGMENTS_t* pImage,
+                       IN  size_t                offset,
+                       OUT void*                 pDst,
+                       IN  size_t                size);
+
+
 //! Open file and buffer it in RAM
 /*!
     Opens a file with platform-independent method (file streams) and copies the
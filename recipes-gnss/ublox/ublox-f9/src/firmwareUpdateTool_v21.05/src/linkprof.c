@@ -0,0 +1,194 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+/*!
+  \file
+  \brief  Link parameters learned in an update, kept for the next update of the same receiver
+
+  A profile is a text file with one "name value" pair per line. Unknown
+  names are ignored, missing ones are 0.
+*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "linkprof.h"
+
+//! a field of LNK_PROFILE_t as stored in the file
+typedef struct LNK_FIELD_s
+{
+    const CH* name;             //!< name in the file
+    size_t    offset;           //!< offset in LNK_PROFILE_t
+} LNK_FIELD_t;
+
+//! fields of the profile file
+static const LNK_FIELD_t lnkFields[] =
+{
+    { "updates",       offsetof(LNK_PROFILE_t, updates)      },
+    { "baudrate",      offsetof(LNK_PROFILE_t, baudrate)     },
+    { "window",        offsetof(LNK_PROFILE_t, window)       },
+    { "erase_ahead",   offsetof(LNK_PROFILE_t, eraseAhead)   },
+    { "ack_rtt",       offsetof(LNK_PROFILE_t, ackRtt)       },
+    { "ack_rtt_max",   offsetof(LNK_PROFILE_t, ackRttMax)    },
+    { "erase_time",    offsetof(LNK_PROFILE_t, eraseTime)    },
+    { "erase_time_max",offsetof(LNK_PROFILE_t, eraseTimeMax) },
+    { "write_retries", offsetof(LNK_PROFILE_t, writeRetries) },
+    { "erase_retries", offsetof(LNK_PROFILE_t, eraseRetries) },
+};
+
+//! build the file name of a profile
+/*!
+    Characters of the key not safe in a file name are replaced with '_'.
+
+    \param dir     state directory
+    \param key     identity of the receiver and the transport
+    \param pName   receives the file name
+    \param size    size of \a pName
+    \return #TRUE if the name fits
+*/
+static BOOL lnkFileName(const CH* dir, const CH* key, CH* pName, size_t size)
+{
+    const size_t dirLen = strlen(dir);
+    const size_t keyLen = strlen(key);
+    if (dirLen + keyLen + 16 > size)
+    {
+        return FALSE;
+    }
+    sprintf(pName, "%s/link-", dir);
+    CH* pKey = pName + strlen(pName);
+    size_t ix;
+    for (ix = 0; ix < keyLen; ix++)
+    {
+        const CH c = key[ix];
+        pKey[ix] = ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                    (c >= '0' && c <= '9') || c == '.' || c == '-') ? c : '_';
+    }
+    strcpy(pKey + keyLen, ".txt");
+    return TRUE;
+}
+
+BOOL lnkLoad(IN  const CH*      dir,
+             IN  const CH*      key,
+             OUT LNK_PROFILE_t* pProfile)
+{
+    CH fileName[FILENAME_MAX];
+    memset(pProfile, 0, sizeof(*pProfile));
+    if (!lnkFileName(dir, key, fileName, sizeof(fileName)))
+    {
+        return FALSE;
+    }
+    FILE* stream = fopen(fileName, "r");
+    if (!stream)
+    {
+        return FALSE;
+    }
+    BOOL found = FALSE;
+    CH line[LNK_KEY_SIZE + 32];
+    while (fgets(line, sizeof(line), stream))
+    {
+        // the value is the rest of the line, the line buffer bounds it
+        CH name[32];
+        int pos = 0;
+        if (sscanf(line, "%31s %n", name, &pos) != 1)
+        {
+            continue;
+        }
+        CH* value = line + pos;
+        value[strcspn(value, "\r\n")] = '\0';
+        if (!*value)
+        {
+            continue;
+        }
+        if (strcmp(name, "key") == 0)
+        {
+            // two keys may map to the same file name
+            found = (strcmp(value, key) == 0);
+            continue;
+        }
+        size_t ix;
+        for (ix = 0; ix < NUMOF(lnkFields); ix++)
+        {
+            if (strcmp(name, lnkFields[ix].name) == 0)
+            {
+                unsigned long v = 0;
+                sscanf(value, "%lu", &v);
+                *(U4*)((U1*)pProfile + lnkFields[ix].offset) = (U4)v;
+            }
+        }
+    }
+    fclose(stream);
+    if (!found)
+    {
+        memset(pProfile, 0, sizeof(*pProfile));
+    }
+    return found;
+}
+
+BOOL lnkStore(IN const CH*            dir,
+              IN const CH*            key,
+              IN const LNK_PROFILE_t* pProfile)
+{
+    CH fileName[FILENAME_MAX];
+    CH tmpName[FILENAME_MAX + 4];
+    if (!lnkFileName(dir, key, fileName, sizeof(fileName)))
+    {
+        return FALSE;
+    }
+    sprintf(tmpName, "%s.tmp", fileName);
+    FILE* out = fopen(tmpName, "w");
+    if (!out)
+    {
+        return FALSE;
+    }
+    fprintf(out, "key %s\n", key);
+    size_t ix;
+    for (ix = 0; ix < NUMOF(lnkFields); ix++)
+    {
+        fprintf(out, "%s %u\n", lnkFields[ix].name,
+                *(const U4*)((const U1*)pProfile + lnkFields[ix].offset));
+    }
+    BOOL success = (fclose(out) == 0);
+#ifdef WIN32
+    // rename doesn't replace an existing file
+    remove(fileName);
+#endif
+    success = success && (rename(tmpName, fileName) == 0);
+    if (!success)
+    {
+        remove(tmpName);
+    }
+    return success;
+}
+
+BOOL lnkRemove(IN const CH* dir,
+               IN const CH* key)
+{
+    CH fileName[FILENAME_MAX];
+    if (!lnkFileName(dir, key, fileName, sizeof(fileName)))
+    {
+        return FALSE;
+    }
+    return (remove(fileName) == 0);
+}
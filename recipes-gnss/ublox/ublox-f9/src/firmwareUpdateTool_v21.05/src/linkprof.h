@@ -0,0 +1,89 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+/*!
+  \file
+  \brief  Link parameters learned in an update, kept for the next update of the same receiver
+*/
+
+#ifndef __LINKPROF_H
+#define __LINKPROF_H
+
+#include "types.h"
+
+#define LNK_KEY_SIZE    192     //!< maximum length of a key including the terminating zero
+
+//! link profile of one receiver on one transport
+typedef struct LNK_PROFILE_s
+{
+    U4 updates;                 //!< number of successful updates the profile was learned from
+    U4 baudrate;                //!< baudrate (or bus clock) during the download
+    U4 window;                  //!< number of writes queued in the receiver
+    U4 eraseAhead;              //!< number of erases queued in the receiver
+    U4 ackRtt;                  //!< average write acknowledge round trip time [ms]
+    U4 ackRttMax;               //!< longest write acknowledge round trip time [ms]
+    U4 eraseTime;               //!< average sector erase time [ms]
+    U4 eraseTimeMax;            //!< longest sector erase time [ms]
+    U4 writeRetries;            //!< writes sent again after a timeout
+    U4 eraseRetries;            //!< erases sent again after a timeout
+} LNK_PROFILE_t;
+
+//! Load the link profile of a receiver
+/*!
+    \param dir        \b IN: state directory
+    \param key        \b IN: identity of the receiver and the transport
+    \param pProfile   \b OUT: receives the profile
+    \return #TRUE if a profile was found
+*/
+BOOL lnkLoad(IN  const CH*      dir,
+             IN  const CH*      key,
+             OUT LNK_PROFILE_t* pProfile);
+
+//! Store the link profile of a receiver
+/*!
+    Every key is stored in its own file in \a dir, named after the key.
+    The file is written to a temporary file and renamed.
+
+    \param dir        \b IN: state directory, has to exist
+    \param key        \b IN: identity of the receiver and the transport
+    \param pProfile   \b IN: profile to store
+    \return #TRUE on success
+*/
+BOOL lnkStore(IN const CH*            dir,
+              IN const CH*            key,
+              IN const LNK_PROFILE_t* pProfile);
+
+//! Remove the link profile of a receiver
+/*!
+    The next update of the receiver starts with the default link parameters.
+
+    \param dir        \b IN: state directory
+    \param key        \b IN: identity of the receiver and the transport
+    \return #TRUE if a profile was removed
+*/
+BOOL lnkRemove(IN const CH* dir,
+               IN const CH* key);
+
+#endif //__LINKPROF_H
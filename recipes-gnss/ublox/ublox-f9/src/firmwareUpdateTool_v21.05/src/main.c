@@ -52,9 +52,12 @@
   The tool supports also the following interfaces:
   <ul>
     <li>Serial port</li>
-    <li>Serial port over Ethernet</li>
+    <li>Serial port over Ethernet (Comtrol DeviceMaster or RFC 2217)</li>
     <li>SPI with the Aardvark tool (http://www.totalphase.com)</li>
     <li>I2C with the Diolan U2C-12 converter (http://www.diolan.com)</li>
+    <li>I2C over the Linux i2c-dev interface (/dev/i2c-N)</li>
+    <li>SPI over the Linux spidev interface (/dev/spidevX.Y)</li>
+    <li>Serial port shared with other applications, see mux.c</li>
   </ul>
 
   <b>Important information for version 1.7.2.0 and newer</b>:<br/>
@@ -75,6 +78,7 @@
 #include "version.h"
 #include "platform.h"
 #include "updateCore.h"
+#include "mux.h"
 
 #ifdef WIN32
 #ifdef _DEBUG
@@ -119,6 +123,16 @@ typedef struct CL_ARGUMENTS_s
     BOOL            noFisMerging;       //!< Don't merge the image with anything
     unsigned int    updateRam;          //!< Update RAM
     BOOL            usbAltMode;         //!< Use USB alternative mode
+    const char*     MuxSocket;          //!< Share the port on this socket instead of updating
+    BOOL            Fleet;              //!< Update the receivers on all ports given
+    unsigned int    FleetParallel;      //!< Maximum number of receivers updated at once (0: all)
+    unsigned int    NumPorts;           //!< Number of ports given
+    const char*     Ports[UPD_FLEET_MAX_PORTS]; //!< All ports given
+    BOOL            Inventory;          //!< Identify the receivers on all ports given instead of updating
+    unsigned int    InventoryDepth;     //!< What to read from the receivers, see UPD_INVENTORY_t
+    const char*     IdCacheFileName;    //!< File caching the identity of the receivers
+    const char*     StateDir;           //!< Directory keeping the link profiles of the receivers
+    unsigned int    SkipCurrent;        //!< Skip receivers running the image already, see UPD_PARAMS_t
 } CL_ARGUMENTS_t;
 typedef CL_ARGUMENTS_t* CL_ARGUMENTS_pt; //!< pointer to CL_ARGUMENTS_t type
 
@@ -147,6 +161,12 @@ typedef enum ARG_e
     NO_FIS_MERGING,     //!< Don't merge the image with anything.
     UPDATE_RAM,         //!< Update RAM with external image
     USB_ALT_MODE,       //!< Use USB alternative mode for firmware update
+    MUX_SOCKET,         //!< Share the port on a Unix domain socket
+    FLEET,              //!< Update the receivers on all ports concurrently
+    INVENTORY,          //!< Identify the receivers on all ports concurrently
+    ID_CACHE,           //!< Cache the identity of the receivers in a file
+    STATE_DIR,          //!< Keep the link profiles of the receivers in a directory
+    SKIP_CURRENT,       //!< Don't update receivers running the image already
 } ARG_t;
 typedef ARG_t* ARG_pt; //!< pointer to ARG_t type
 
@@ -180,6 +200,16 @@ const CL_ARGUMENTS_t defaultargs =
     FALSE,               //NoFisMerging
     FALSE,               //UpdateRam
     FALSE,               //usbAltMode
+    "",                  //MuxSocket
+    FALSE,               //Fleet
+    0,                   //FleetParallel
+    0,                   //NumPorts
+    { NULL },            //Ports
+    FALSE,               //Inventory
+    0,                   //InventoryDepth
+    "",                  //IdCacheFileName
+    "",                  //StateDir
+    0,                   //SkipCurrent
 };
 
 //! known arguments and according identifier
@@ -204,6 +234,14 @@ static ARG_ASSOC_t knownArgs[] =
     {"--no-fis",    NO_FIS_MERGING },
     {"--up-ram",    UPDATE_RAM     },
     {"--usb-alt",   USB_ALT_MODE   },
+    {"--fleet",     FLEET          },
+    {"--inventory", INVENTORY      },
+    {"--id-cache",  ID_CACHE       },
+    {"--state-dir", STATE_DIR      },
+    {"--skip-current", SKIP_CURRENT },
+#ifdef ENABLE_MUX_SUPPORT
+    {"--mux",       MUX_SOCKET     },
+#endif //ENABLE_MUX_SUPPORT
 };
 
 //! Set program options
@@ -244,12 +282,18 @@ BOOL SetArgument(IN ARG_t option, IN char const * value, OUT CL_ARGUMENTS_pt cla
 
     case PORT:
         clargs->ComPort = value;
+        if (clargs->NumPorts < NUMOF(clargs->Ports))
+        {
+            clargs->Ports[clargs->NumPorts++] = value;
+        }
 
         // do not send training sequence over SPI/I2C
         if((strncmp(clargs->ComPort, "I2C", 3) == 0) ||
            (strncmp(clargs->ComPort, "U2C", 3) == 0) ||
            (strncmp(clargs->ComPort, "SPI", 3) == 0) ||
-           (strncmp(clargs->ComPort, "SPU", 3) == 0))
+           (strncmp(clargs->ComPort, "SPU", 3) == 0) ||
+           (strncmp(clargs->ComPort, "/dev/i2c-", 9) == 0) ||
+           (strncmp(clargs->ComPort, "/dev/spidev", 11) == 0))
         {
             // set the 0
             clargs->TrainingSequence = 0;
@@ -257,13 +301,23 @@ BOOL SetArgument(IN ARG_t option, IN char const * value, OUT CL_ARGUMENTS_pt cla
 
         // check for I2C port
         if((strncmp(clargs->ComPort, "I2C", 3) == 0) ||
-           (strncmp(clargs->ComPort, "U2C", 3) == 0) )
+           (strncmp(clargs->ComPort, "U2C", 3) == 0) ||
+           (strncmp(clargs->ComPort, "/dev/i2c-", 9) == 0))
         {
             // set the default baudrates
             clargs->Baudrate     = BaudrateDefaultI2C;
             clargs->BaudrateSafe = BaudrateDefaultI2C;
             clargs->BaudrateUpd  = BaudrateDefaultI2C;
         }
+
+        // check for spidev port
+        if (strncmp(clargs->ComPort, "/dev/spidev", 11) == 0)
+        {
+            // set the default SPI clock
+            clargs->Baudrate     = BaudrateDefaultSpiDev;
+            clargs->BaudrateSafe = BaudrateDefaultSpiDev;
+            clargs->BaudrateUpd  = BaudrateDefaultSpiDev;
+        }
         break;
 
     case HELP:
@@ -306,7 +360,9 @@ BOOL SetArgument(IN ARG_t option, IN char const * value, OUT CL_ARGUMENTS_pt cla
         if((strncmp(clargs->ComPort, "I2C", 3) == 0) ||
            (strncmp(clargs->ComPort, "U2C", 3) == 0) ||
            (strncmp(clargs->ComPort, "SPI", 3) == 0) ||
-           (strncmp(clargs->ComPort, "SPU", 3) == 0))
+           (strncmp(clargs->ComPort, "SPU", 3) == 0) ||
+           (strncmp(clargs->ComPort, "/dev/i2c-", 9) == 0) ||
+           (strncmp(clargs->ComPort, "/dev/spidev", 11) == 0))
         {
             // set the 0
             clargs->TrainingSequence = 0;
@@ -332,6 +388,26 @@ BOOL SetArgument(IN ARG_t option, IN char const * value, OUT CL_ARGUMENTS_pt cla
     case USB_ALT_MODE:
         clargs->usbAltMode = (atoi(value) != 0);
         break;
+    case MUX_SOCKET:
+        clargs->MuxSocket = value;
+        break;
+    case FLEET:
+        clargs->Fleet = TRUE;
+        clargs->FleetParallel = (unsigned int)atoi(value);
+        break;
+    case INVENTORY:
+        clargs->Inventory = TRUE;
+        clargs->InventoryDepth = (unsigned int)atoi(value);
+        break;
+    case ID_CACHE:
+        clargs->IdCacheFileName = value;
+        break;
+    case STATE_DIR:
+        clargs->StateDir = value;
+        break;
+    case SKIP_CURRENT:
+        clargs->SkipCurrent = (unsigned int)atoi(value);
+        break;
     default:
         Usage();
         break;
@@ -354,6 +430,11 @@ void Usage(void)
         MESSAGE_PLAIN("    %s [--help] [--version] [-F flash.xml] [-f flash.txt] [--fis-only] [-p port]\n", exename);
         MESSAGE_PLAIN("    [-b baudcur[:baudsafe[:baudupd]]] [-s 1] [-v 0] [-a 0] [-E 1] [-R 0] [-t 1] [-C 0] [--no-fis 0]\n");
         MESSAGE_PLAIN("    firmware.bin\n");
+        MESSAGE_PLAIN("    %s --fleet n -p port [-p port ...] [options] firmware.bin\n", exename);
+        MESSAGE_PLAIN("    %s --inventory n -p port [-p port ...] [-b baud] [-t 1] [-v 0]\n", exename);
+#ifdef ENABLE_MUX_SUPPORT
+        MESSAGE_PLAIN("    %s [-v 0] [-p port] [-b baud] --mux socket\n", exename);
+#endif //ENABLE_MUX_SUPPORT
         MESSAGE_PLAIN("\n");
         MESSAGE_PLAIN("EXIT STATUS\n");
         MESSAGE_PLAIN("    0 on success\n");
@@ -375,6 +456,7 @@ void Usage(void)
         MESSAGE_PLAIN("                 second baudrate after colon is used after safeboot\n");
         MESSAGE_PLAIN("                 third baudrate after second colon is used during update\n");
         MESSAGE_PLAIN("                  (defaults: %u:%u:%u\n", defaultargs.Baudrate, defaultargs.BaudrateSafe, defaultargs.BaudrateUpd);
+        MESSAGE_PLAIN("                 I2C bus clock: 100000, 400000 or 1000000 (Fast-mode Plus)\n");
         MESSAGE_PLAIN("    -p         choose port (default: %s)\n", defaultargs.ComPort);
         MESSAGE_PLAIN("                 \\\\.\\COMy      - serial (RS232) port y (Windows)\n");
         MESSAGE_PLAIN("                 /dev/ttySy    - serial (RS232) port y (Linux)\n");
@@ -382,15 +464,31 @@ void Usage(void)
         MESSAGE_PLAIN("                   windows maps names 'COM1..9' to '\\\\.\\COM1..9', \n");
         MESSAGE_PLAIN("                   for ports > 9 use \\\\.\\COMy for device name\n");
         MESSAGE_PLAIN("                 I2C[y[:0xaa]]   - Aardvark I2C device y (default 0),\n");
-        MESSAGE_PLAIN("                                   slave address aa (default 0x42)\n");
+        MESSAGE_PLAIN("                                   slave address aa (default 0x42),\n");
+        MESSAGE_PLAIN("                                   several addresses (:0xaa,0xbb,...) update\n");
+        MESSAGE_PLAIN("                                   the receivers on the bus at once\n");
         MESSAGE_PLAIN("                 SPI[y]          - Aardvark SPI device y (default 0),\n");
         MESSAGE_PLAIN("                 U2C[y[:0xaa]]   - Diolan I2C device y (default 0),\n");
         MESSAGE_PLAIN("                                   slave address aa (default 0x42)\n");
         MESSAGE_PLAIN("                 SPU[y]          - Diolan SPI device y (default 0)\n");
+#ifdef ENABLE_I2CDEV_SUPPORT
+        MESSAGE_PLAIN("                 /dev/i2c-y[:0xaa] - Linux i2c-dev bus y,\n");
+        MESSAGE_PLAIN("                                   slave address aa (default 0x42),\n");
+        MESSAGE_PLAIN("                                   several addresses as for I2C\n");
+#endif //ENABLE_I2CDEV_SUPPORT
+#ifdef ENABLE_SPIDEV_SUPPORT
+        MESSAGE_PLAIN("                 /dev/spidevx.y[:n] - Linux spidev device x.y,\n");
+        MESSAGE_PLAIN("                                   max. n bytes per transfer (default 4096),\n");
+        MESSAGE_PLAIN("                                   -b sets the SPI clock in Hz\n");
+#endif //ENABLE_SPIDEV_SUPPORT
         MESSAGE_PLAIN("                 host:port       - network, e.g. through comtrol devicemaster,\n");
-#ifdef WIN32
-        MESSAGE_PLAIN("                 STDIO           - communicate with receiver over stdin and stdout\n");
-#endif //ifdef WIN32
+        MESSAGE_PLAIN("                 rfc2217://host:port - network, terminal server supporting RFC 2217\n");
+        MESSAGE_PLAIN("                                   (baudrate set on the data connection)\n");
+        MESSAGE_PLAIN("                 STDIO           - communicate with receiver over stdin and stdout,\n");
+        MESSAGE_PLAIN("                                   status and requests to the parent on stderr\n");
+#ifdef ENABLE_MUX_SUPPORT
+        MESSAGE_PLAIN("                 unix:socket     - port shared by %s --mux socket\n", exename);
+#endif //ENABLE_MUX_SUPPORT
         MESSAGE_PLAIN("    -s         enter safeboot before updating\n");
         MESSAGE_PLAIN("                 (default: %i)\n", defaultargs.DoSafeBoot);
         MESSAGE_PLAIN("    -v         verbose mode on (1), including packet dump (2) or off (0)\n");
@@ -411,6 +509,34 @@ void Usage(void)
         MESSAGE_PLAIN("                 (default: %i)\n", defaultargs.updateRam);
         MESSAGE_PLAIN("    --usb-alt  use USB alternative mode for firmware update\n");
         MESSAGE_PLAIN("                 (default: %i)\n", defaultargs.usbAltMode);
+        MESSAGE_PLAIN("    --fleet    update the receivers on all ports given with -p, n at once\n");
+        MESSAGE_PLAIN("                 (0: all at once). Quoted wildcards in a port name\n");
+        MESSAGE_PLAIN("                 are expanded ('/dev/ttyUSB*'). The image is loaded once,\n");
+        MESSAGE_PLAIN("                 a summary per port is printed at the end.\n");
+        MESSAGE_PLAIN("    --id-cache remember the ROM CRC, the flash and the FIS read from the receivers\n");
+        MESSAGE_PLAIN("                 in the given file and skip reading them again in later\n");
+        MESSAGE_PLAIN("                 updates. Receivers are recognized by their unique chip ID,\n");
+        MESSAGE_PLAIN("                 older ones by port and version.\n");
+        MESSAGE_PLAIN("    --state-dir keep the link parameters measured in an update (acknowledge\n");
+        MESSAGE_PLAIN("                 times, erase times, retries) per receiver and transport in\n");
+        MESSAGE_PLAIN("                 the given existing directory and start the next update of\n");
+        MESSAGE_PLAIN("                 the receiver with timeouts and queue depths tuned to them.\n");
+        MESSAGE_PLAIN("    --skip-current don't update a receiver running the image already, checked\n");
+        MESSAGE_PLAIN("                 before safeboot: 1 same version in MON-VER and image,\n");
+        MESSAGE_PLAIN("                 2 also the same CRC over the image range on the flash\n");
+        MESSAGE_PLAIN("                 (images without version string, u-blox 9 and later). 0: off\n");
+        MESSAGE_PLAIN("    --inventory don't update, identify the receivers on all ports given with -p\n");
+        MESSAGE_PLAIN("                 at once and print a tab separated table to stdout: port,\n");
+        MESSAGE_PLAIN("                 baudrate, hardware, generation, ROM, ROM CRC, software,\n");
+        MESSAGE_PLAIN("                 firmware and flash JEDEC ID. Serial ports are autobauded.\n");
+        MESSAGE_PLAIN("                 n: 0 versions only, 1 also the ROM version,\n");
+        MESSAGE_PLAIN("                 2 also the flash (receivers in safeboot only)\n");
+#ifdef ENABLE_MUX_SUPPORT
+        MESSAGE_PLAIN("    --mux      don't update, share the port (-p) at the baudrate (-b) with\n");
+        MESSAGE_PLAIN("                 all clients connecting to the given Unix domain socket.\n");
+        MESSAGE_PLAIN("                 An update through unix:socket pauses the other clients from\n");
+        MESSAGE_PLAIN("                 the safeboot command until the receiver is rebooted.\n");
+#endif //ENABLE_MUX_SUPPORT
         MESSAGE_PLAIN("\n");
         MESSAGE_PLAIN("EXAMPLES\n");
         MESSAGE_PLAIN("    erase whole flash content:\n");
@@ -424,6 +550,23 @@ void Usage(void)
         MESSAGE_PLAIN("      %s -p I2C0 -b 100000 \n", exename);
         MESSAGE_PLAIN("      <firmware.bin>\n");
         MESSAGE_PLAIN("\n");
+        MESSAGE_PLAIN("    update three receivers sharing an I2C bus:\n");
+        MESSAGE_PLAIN("      %s -p I2C0:0x42,0x43,0x44 -b 400000 <firmware.bin>\n", exename);
+        MESSAGE_PLAIN("\n");
+        MESSAGE_PLAIN("    update all receivers on USB serial adapters, four at once:\n");
+        MESSAGE_PLAIN("      %s --fleet 4 -p '/dev/ttyUSB*' -b 9600:9600:115200 <firmware.bin>\n", exename);
+        MESSAGE_PLAIN("\n");
+        MESSAGE_PLAIN("    list the receivers on USB serial adapters with their ROM versions:\n");
+        MESSAGE_PLAIN("      %s --inventory 1 -p '/dev/ttyUSB*' -p '/dev/ttyACM*' > receivers.tsv\n", exename);
+        MESSAGE_PLAIN("\n");
+#ifdef ENABLE_MUX_SUPPORT
+        MESSAGE_PLAIN("    share a serial port and update through it while gpsd keeps running:\n");
+        MESSAGE_PLAIN("      %s -p /dev/ttyS0 -b 9600 --mux /run/ubxmux &\n", exename);
+        MESSAGE_PLAIN("      socat pty,link=/dev/gnss0,raw unix-connect:/run/ubxmux &\n");
+        MESSAGE_PLAIN("      gpsd /dev/gnss0\n");
+        MESSAGE_PLAIN("      %s -p unix:/run/ubxmux -b 9600:9600:115200 <firmware.bin>\n", exename);
+        MESSAGE_PLAIN("\n");
+#endif //ENABLE_MUX_SUPPORT
         MESSAGE_PLAIN("AUTHOR\n");
         MESSAGE_PLAIN("    u-blox software development team (www.u-blox.com)\n");
         MESSAGE_PLAIN("\n");
@@ -497,7 +640,8 @@ BOOL ParseArguments(IN int argc, IN char const * const argv[], OUT CL_ARGUMENTS_
         }
     }
     // either eraseOnly operation or the binary firmware image name must be set
-    if (!clargs->EraseOnly && (!clargs->BinaryFileName || !*clargs->BinaryFileName) && !clargs->fisOnly)
+    if (!clargs->EraseOnly && (!clargs->BinaryFileName || !*clargs->BinaryFileName) && !clargs->fisOnly &&
+        !*clargs->MuxSocket && !clargs->Inventory)
     {
         Usage();
         return FALSE;
@@ -511,13 +655,46 @@ int main(int argc, char* argv[])
 {
 
     CL_ARGUMENTS_t clArgs;
+    LOG_CTX_t log;
     BOOL success = FALSE;
     exename = argv[0];
 
     if(ParseArguments(argc, (const char * const*) argv, &clArgs))
     {
+        // the updates log to the console like the front end
+        LOG_INIT(&log, clArgs.Verbose, NULL);
+        LOG_BIND(&log);
         CONSOLE_INIT();
 
+#ifdef ENABLE_MUX_SUPPORT
+        if (*clArgs.MuxSocket)
+        {
+            success = MuxServe(clArgs.ComPort, clArgs.Baudrate, clArgs.MuxSocket);
+            CONSOLE_DONE();
+            return (success) ? SUCCESS : ERROR_UPDATE;
+        }
+#endif //ENABLE_MUX_SUPPORT
+
+        if (clArgs.Inventory)
+        {
+            const UPD_PARAMS_t params =
+            {
+                NULL, NULL, NULL,
+                clArgs.Baudrate, clArgs.BaudrateSafe, clArgs.BaudrateUpd,
+                FALSE, FALSE, TRUE, FALSE, FALSE, clArgs.TrainingSequence,
+                FALSE, FALSE, FALSE, FALSE, clArgs.Verbose, FALSE, NULL, NULL, 0
+            };
+            const UPD_INVENTORY_t depth =
+                (clArgs.InventoryDepth >= 2) ? UPD_INVENTORY_FLASH :
+                (clArgs.InventoryDepth == 1) ? UPD_INVENTORY_ROM :
+                                               UPD_INVENTORY_VERSION;
+            success = clArgs.NumPorts ?
+                UpdateInventory(&params, clArgs.Ports, clArgs.NumPorts, depth) :
+                UpdateInventory(&params, &clArgs.ComPort, 1, depth);
+            CONSOLE_DONE();
+            return (success) ? SUCCESS : ERROR_UPDATE;
+        }
+
 
         MESSAGE_PLAIN("----------CMD line arguments-----------\n"                                                          );
         MESSAGE_PLAIN("Image file:        %s\n", clArgs.BinaryFileName                                                     );
@@ -536,28 +713,33 @@ int main(int argc, char* argv[])
         MESSAGE_PLAIN("Merging FIS:       %i\n", clArgs.noFisMerging                                                       );
         MESSAGE_PLAIN("Update RAM:        %u\n", clArgs.updateRam                                                          );
         MESSAGE_PLAIN("Use USB alt:       %i\n", clArgs.usbAltMode);
+        MESSAGE_PLAIN("Identity cache:    %s\n", (*clArgs.IdCacheFileName ? clArgs.IdCacheFileName : "<none>"));
+        MESSAGE_PLAIN("State directory:   %s\n", (*clArgs.StateDir ? clArgs.StateDir : "<none>"));
+        MESSAGE_PLAIN("Skip current:      %u\n", clArgs.SkipCurrent);
         MESSAGE_PLAIN("---------------------------------------\n");
 
-        success = UpdateFirmware(clArgs.BinaryFileName,
-                                 clArgs.FlashDefFileName,
-                                 clArgs.FisFileName,
-                                 clArgs.ComPort,
-                                 clArgs.Baudrate,
-                                 clArgs.BaudrateSafe,
-                                 clArgs.BaudrateUpd,
-                                 clArgs.DoSafeBoot,
-                                 clArgs.DoReset,
-                                 clArgs.Autobaud,
-                                 clArgs.EraseWholeFlash,
-                                 clArgs.EraseOnly,
-                                 clArgs.TrainingSequence,
-                                 clArgs.chipErase,
-                                 clArgs.noFisMerging,
-                                 clArgs.updateRam,
-                                 clArgs.usbAltMode,
-                                 clArgs.Verbose,
-                                 clArgs.fisOnly);
+        const UPD_PARAMS_t params =
+        {
+            clArgs.BinaryFileName, clArgs.FlashDefFileName, clArgs.FisFileName,
+            clArgs.Baudrate, clArgs.BaudrateSafe, clArgs.BaudrateUpd,
+            clArgs.DoSafeBoot, clArgs.DoReset, clArgs.Autobaud,
+            clArgs.EraseWholeFlash, clArgs.EraseOnly, clArgs.TrainingSequence,
+            clArgs.chipErase, clArgs.noFisMerging, (clArgs.updateRam != 0),
+            clArgs.usbAltMode, clArgs.Verbose, clArgs.fisOnly,
+            clArgs.IdCacheFileName, clArgs.StateDir, clArgs.SkipCurrent
+        };
+        if (clArgs.Fleet)
+        {
+            success = clArgs.NumPorts ?
+                UpdateFleet(&params, clArgs.Ports, clArgs.NumPorts, clArgs.FleetParallel) :
+                UpdateFleet(&params, &clArgs.ComPort, 1, clArgs.FleetParallel);
+        }
+        else
+        {
+            success = UpdatePort(&params, clArgs.ComPort);
+        }
 
+        MESSAGE(MSG_LEV2, "Peak memory use %u kB", MEM_PEAK());
         MESSAGE(MSG_LEV2, "Firmware Update %s", (success) ? "SUCCESS\n" :"FAILED\n");
         CONSOLE_DONE();
     }
@@ -350,6 +350,20 @@ static BOOL isElementOrAttr( XML_HNDL_t const *xmlData
     return result;
 }
 
+//! Get the next byte of the XML file
+/*!
+    \param    xmlData      XML parser handler
+    \param    byte         Receives the byte
+    \return   1 if a byte was read, 0 at the end of the file
+*/
+static int xmlRead(XML_HNDL_t *xmlData, char *byte)
+{
+    if(xmlData->pos >= xmlData->size)
+        return 0;
+    *byte = xmlData->data[xmlData->pos++];
+    return 1;
+}
+
 //! Find the next value for the passed element or attribute name in an XML file
 /*! If only a tag is passed to this function it will search for the
     content of the next tag element of this name. If additionally an attribute
@@ -380,7 +394,7 @@ static long long findNextInXml(XML_HNDL_t *xmlData, char const * tag, char const
     {
         // Every read error is handled as unexpected EOF
         char byte;
-        int rd=read(xmlData->fd, &byte, sizeof(byte));
+        int rd=xmlRead(xmlData, &byte);
         if( rd == sizeof(byte))
         {
             yxml_ret_t ret=yxml_parse(&xmlData->state, byte);
@@ -604,7 +618,7 @@ BOOL buildXmlTree( XML_HNDL_t *xmlData
         assert(curr && dataRoot);
         // Every read error is handled as unexpected EOF
         char byte;
-        int rd=read(xmlData->fd, &byte, sizeof(byte));
+        int rd=xmlRead(xmlData, &byte);
         if( rd == sizeof(byte))
         {
             yxml_ret_t ret = yxml_parse(&xmlData->state, byte);
@@ -1409,11 +1423,91 @@ MERGEFIS_RETVAL_t mergefis_load(char **fis, size_t *fisSize, const char *fisFile
     if(!fis || !fisSize || !fisFile)
         return MERGEFIS_UNKNOWN;
 
-    //open the FIS XML file
-    XML_HNDL_t xmlData;
-    xmlData.fd = open(fisFile, O_RDONLY);
-    if ( xmlData.fd < 0 )
+    MERGEFIS_DB_t db;
+    MERGEFIS_RETVAL_t result=mergefis_db_open(&db, fisFile);
+    if(result==MERGEFIS_OK)
+        result=mergefis_db_load(fis, fisSize, &db, jedec);
+    mergefis_db_close(&db);
+    return result;
+}
+
+MERGEFIS_RETVAL_t mergefis_db_open(MERGEFIS_DB_t *db, const char *fisFile)
+{
+    if(!db)
+        return MERGEFIS_UNKNOWN;
+    memset(db, 0, sizeof(*db));
+    if(!fisFile)
+        return MERGEFIS_UNKNOWN;
+
+    //read the FIS XML file at once, the parser gets it byte by byte
+    FILE *stream=fopen(fisFile, "rb");
+    if(!stream)
+        return MERGEFIS_FILE_NOT_FOUND;
+    size_t allocMemory=0;
+    BOOL fail=FALSE;
+    for(;;)
+    {
+        if(db->size == allocMemory)
+        {
+            allocMemory += 64 * 1024;
+            char *data=realloc(db->data, allocMemory);
+            if(!data)
+            {
+                fail=TRUE;
+                break;
+            }
+            db->data=data;
+        }
+        size_t rd=fread(db->data + db->size, 1, allocMemory - db->size, stream);
+        if(rd == 0)
+        {
+            fail=ferror(stream) ? TRUE : FALSE;
+            break;
+        }
+        db->size += rd;
+    }
+    fclose(stream);
+    if(fail)
+    {
+        mergefis_db_close(db);
         return MERGEFIS_FILE_NOT_FOUND;
+    }
+
+    // Parse the whole file once to make sure it is not malformed
+    XML_HNDL_t *xmlData=malloc(sizeof(XML_HNDL_t));
+    if(!xmlData)
+    {
+        mergefis_db_close(db);
+        return MERGEFIS_UNKNOWN;
+    }
+    xmlData->data=db->data;
+    xmlData->size=db->size;
+    xmlData->pos=0;
+    yxml_init(&xmlData->state, xmlData->buf, sizeof(xmlData->buf));
+    yxml_ret_t ret=YXML_OK;
+    char byte;
+    while((ret >= YXML_OK) && xmlRead(xmlData, &byte))
+    {
+        ret=yxml_parse(&xmlData->state, byte);
+    }
+    if(ret >= YXML_OK)
+        ret=yxml_eof(&xmlData->state);
+    db->wellFormed=(ret == YXML_OK);
+    free(xmlData);
+    return MERGEFIS_OK;
+}
+
+MERGEFIS_RETVAL_t mergefis_db_load(char **fis, size_t *fisSize, const MERGEFIS_DB_t *db, const unsigned int jedec)
+{
+    if(!fis || !fisSize || !db)
+        return MERGEFIS_UNKNOWN;
+    if(!db->data)
+        return MERGEFIS_FILE_NOT_FOUND;
+
+    XML_HNDL_t xmlData;
+    xmlData.data = db->data;
+    xmlData.size = db->size;
+    xmlData.pos = 0;
 
     MERGEFIS_RETVAL_t result=MERGEFIS_UNKNOWN;
 
@@ -1422,8 +1516,7 @@ MERGEFIS_RETVAL_t mergefis_load(char **fis, size_t *fisSize, const char *fisFile
     char *revision=NULL;
     findNextInXml(&xmlData, "flash", "revision", &revision); // optional
     // reinitialize yxml, to make sure we start from the beginning again
-    if(lseek(xmlData.fd, 0, SEEK_SET)==1)
-        return MERGEFIS_UNKNOWN;
+    xmlData.pos = 0;
     yxml_init(&xmlData.state, xmlData.buf, sizeof(xmlData.buf));
     char *version=NULL;
     long long versionStrLen=findNextInXml(&xmlData, "flash", "fisVersion", &version);
@@ -1440,49 +1533,26 @@ MERGEFIS_RETVAL_t mergefis_load(char **fis, size_t *fisSize, const char *fisFile
             result=MERGEFIS_VERSION_ERROR;
 
         // Only if the previous operations were all successful
-        // it is required to parse until the end of the file
-        // to make sure the XML is not malformed
-        if(result==MERGEFIS_OK)
-        {
-            // Read and parse the remaining parts of the XML
-            // to make sure it is not malformed
-            yxml_ret_t ret=YXML_EEOF;
-            BOOL exitLoop = FALSE;
-            do
-            {
-                // Every read error is handled as unexpected EOF
-                ret=YXML_EEOF;
-                char byte;
-                int rd = read(xmlData.fd, &byte, sizeof(byte));
-                if( rd == sizeof(byte))
-                {
-                    ret=yxml_parse(&xmlData.state, byte);
-                    // Error case?
-                    if(ret < YXML_OK)
-                        exitLoop = TRUE;
-                }
-                else if (rd == 0)
-                {
-                    ret=yxml_eof(&xmlData.state);
-                    exitLoop = TRUE;
-                }
-
-            } while(!exitLoop);
-
-            // yxml_eof must now have ended with YXML_OK,
-            // otherwise the file is malformed
-            if(ret != YXML_OK)
-                result = MERGEFIS_INCORRECT_XML;
-
-        }
+        // the structure of the whole file matters, checked by
+        // mergefis_db_open() already
+        if(result==MERGEFIS_OK && !db->wellFormed)
+            result = MERGEFIS_INCORRECT_XML;
     }
 
     free(revision);
     free(version);
-    close(xmlData.fd);
     return result;
 }
 
+void mergefis_db_close(MERGEFIS_DB_t *db)
+{
+    if(!db)
+        return;
+    free(db->data);
+    db->data=NULL;
+    db->size=0;
+}
+
 MERGEFIS_RETVAL_t mergefis_merge(char *pData, unsigned int ImageSize, char const *fis)
 {
     //merge the images
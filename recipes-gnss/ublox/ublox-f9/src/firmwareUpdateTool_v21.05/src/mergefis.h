@@ -121,7 +121,9 @@ typedef struct DRV_SPI_MEM_FIS_s {
 //! XML parser handler used to extract all information from an XML file
 typedef struct
 {
-    int fd;                             //!< File descriptor of the XML file
+    const char *data;                   //!< Content of the XML file
+    size_t size;                        //!< Size of the content
+    size_t pos;                         //!< Position of the parser in the content
     yxml_t state;                       //!< State of the parser
     char buf[4096];                     //!< Buffer used by the parser
 } XML_HNDL_t;
@@ -149,6 +151,41 @@ typedef enum {
 */
 MERGEFIS_RETVAL_t mergefis_load(char **fis, size_t *fisSize, const char *fisFile, const unsigned int jedec);
 
+//! FIS file read into memory, to get the FIS of several devices from it
+typedef struct
+{
+    char *data;                         //!< Content of the FIS file, NULL if it could not be read
+    size_t size;                        //!< Size of the content
+    BOOL wellFormed;                    //!< XML structure of the whole file is correct
+} MERGEFIS_DB_t;
+
+//! Read the FIS file into memory
+/*! Reads the FIS file and checks the XML structure of the whole file once,
+    mergefis_db_load() then only has to find the device.
+
+    \param    db           FIS file to initialize, to be released with mergefis_db_close()
+    \param    fisFile      Path to the FIS file
+    \return   MERGEFIS_OK, MERGEFIS_FILE_NOT_FOUND if the file could not be read
+*/
+MERGEFIS_RETVAL_t mergefis_db_open(MERGEFIS_DB_t *db, const char *fisFile);
+
+//! Get the image of the FIS from a FIS file read into memory
+/*! Same as mergefis_load(), may be called concurrently for the same \a db.
+
+    \param    fis          Pointer to pointer of the FIS image
+    \param    fisSize      Size of the allocated structure
+    \param    db           FIS file read with mergefis_db_open()
+    \param    jedec        JEDEC of the device the FIS image should be retrieved for
+    \return   success / error code
+*/
+MERGEFIS_RETVAL_t mergefis_db_load(char **fis, size_t *fisSize, const MERGEFIS_DB_t *db, const unsigned int jedec);
+
+//! Release a FIS file read with mergefis_db_open()
+/*!
+    \param    db           FIS file
+*/
+void mergefis_db_close(MERGEFIS_DB_t *db);
+
 //! Merge the flash image with the corresponding FIS data
 /*!
     \param    pData        Pointer to the flash image
@@ -0,0 +1,609 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+/*!
+  \file
+  \brief  Share a serial port between GNSS consumers and the update tool
+
+  The multiplexer owns the serial port and serves it on a Unix domain
+  socket. Consumers like gpsd connect to the socket directly or through
+  a pty, e.g. <code>socat pty,link=/dev/gnss0,raw unix-connect:/run/ubxmux</code>.
+  The update tool connects with the port name <code>unix:/run/ubxmux</code>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mux.h"
+#include "ubxmsg.h"
+
+#ifdef ENABLE_MUX_SUPPORT
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+
+#define MUX_MAX_CLIENTS     16      //!< maximum number of connected clients
+#define MUX_LINE_SIZE       64      //!< maximum length of a control line
+#define MUX_BUF_SIZE        4096    //!< size of the transfer buffer
+#define MUX_POLL_INTERVAL   1       //!< poll interval [ms] for ports without descriptor
+#define MUX_SEND_TIMEOUT    1000    //!< time [ms] the update tool may stall the port
+
+//! role of a multiplexer client
+typedef enum MUX_ROLE_e
+{
+    MUX_NEW = 0,        //!< nothing received yet, served like a consumer
+    MUX_CONTROL,        //!< sending a control line
+    MUX_CONSUMER,       //!< consumer of the receiver output
+    MUX_UPDATER,        //!< update tool owning the port
+    MUX_RELEASED        //!< update tool after UPD-RBOOT, writes are dropped
+} MUX_ROLE_t;
+
+//! multiplexer client
+typedef struct MUX_CLIENT_s
+{
+    int         fd;                     //!< socket, -1 if the slot is free
+    MUX_ROLE_t  role;                   //!< role of the client
+    U4          lineLen;                //!< number of bytes in \a line
+    CH          line[MUX_LINE_SIZE];    //!< control line received so far
+} MUX_CLIENT_t;
+
+//! multiplexer state
+typedef struct MUX_DATA_s
+{
+    SER_HANDLE_pt port;                 //!< shared serial port
+    U4            baudrate;             //!< baudrate of the consumers
+    int           listenFd;             //!< listening socket
+    MUX_CLIENT_t  client[MUX_MAX_CLIENTS]; //!< connected clients
+    MUX_CLIENT_t* pUpdater;             //!< client performing an update, NULL if none
+    BOOL          paused;               //!< consumers are not served, the receiver is in safeboot
+    U4            framePos;             //!< position in the UBX frame sent by the update tool, 0 between frames
+    U1            frameClass;           //!< class of that frame
+    U1            frameId;              //!< message id of that frame
+    U4            frameLen;             //!< payload length of that frame
+} MUX_DATA_t;
+
+static volatile sig_atomic_t s_muxStop = 0; //!< set when the multiplexer is terminated
+
+static void muxSignal(int sig)
+{
+    ((void)sig);
+    s_muxStop = 1;
+}
+
+//! send data to a client
+/*!
+    \param c     client
+    \param p     data to send
+    \param size  number of bytes
+    \param wait  wait until the client accepts the data, drop it otherwise
+    \return #TRUE if all data was sent
+*/
+static BOOL muxSend(MUX_CLIENT_t* c, const void* p, U4 size, BOOL wait)
+{
+    const U1* pData = (const U1*)p;
+    while (size)
+    {
+        ssize_t ret = send(c->fd, pData, size, 0);
+        if (ret > 0)
+        {
+            pData += ret;
+            size  -= (U4)ret;
+        }
+        else if ((ret < 0) && (errno == EINTR))
+        {
+            continue;
+        }
+        else if ((ret < 0) && (errno == EAGAIN || errno == EWOULDBLOCK) && wait)
+        {
+            fd_set fds;
+            struct timeval tv = { MUX_SEND_TIMEOUT / 1000, (MUX_SEND_TIMEOUT % 1000) * 1000 };
+            FD_ZERO(&fds);
+            FD_SET(c->fd, &fds);
+            if (select(c->fd + 1, NULL, &fds, NULL, &tv) <= 0)
+                return FALSE;
+        }
+        else
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+//! send a reply line to a client
+static void muxReply(MUX_CLIENT_t* c, const CH* reply)
+{
+    CH line[MUX_LINE_SIZE];
+    int len = snprintf(line, sizeof(line), "%s\n", reply);
+    muxSend(c, line, (U4)len, TRUE);
+}
+
+//! give the port back to the consumers
+/*!
+    Restores the baudrate of the consumers once all data of the update
+    tool has left the port.
+
+    \param mux  multiplexer state
+*/
+static void muxRelease(MUX_DATA_t* mux)
+{
+    if (mux->pUpdater && (mux->pUpdater->fd >= 0))
+    {
+        mux->pUpdater->role = MUX_RELEASED;
+    }
+    mux->pUpdater = NULL;
+    mux->framePos = 0;
+    if (mux->port->baudrate != mux->baudrate)
+    {
+        int fd = SER_FD(mux->port);
+        if (fd >= 0)
+            tcdrain(fd);
+        if (!SER_BAUDRATE(mux->port, mux->baudrate))
+            MESSAGE(MSG_WARN, "could not restore %u baud", mux->baudrate);
+    }
+    if (mux->paused)
+    {
+        MESSAGE(MSG_LEV1, "Resuming consumers");
+    }
+    mux->paused = FALSE;
+}
+
+//! disconnect a client
+static void muxClose(MUX_DATA_t* mux, MUX_CLIENT_t* c)
+{
+    MESSAGE(MSG_DBG, "client %i disconnected", c->fd);
+    close(c->fd);
+    c->fd = -1;
+    if (c == mux->pUpdater)
+    {
+        MESSAGE(MSG_LEV1, "Update tool disconnected");
+        muxRelease(mux);
+    }
+}
+
+//! forward data of the update tool to the port
+/*!
+    Follows the UBX frames sent by the update tool, so the firmware inside
+    UPD-FLWRI can't be taken for a command. Watches for UPD-SAFE, which
+    pauses the consumers, and for the end of UPD-RBOOT, after which the
+    port is handed back to the consumers.
+
+    \param mux   multiplexer state
+    \param p     data received from the update tool
+    \param size  number of bytes
+*/
+static void muxUpdaterData(MUX_DATA_t* mux, const U1* p, U4 size)
+{
+    U4 i;
+    for (i = 0; i < size; i++)
+    {
+        switch (mux->framePos)
+        {
+        case 0:
+            // anything between frames, e.g. the training sequence
+            if (p[i] == UBX_SYNC_CHAR_1)
+                mux->framePos = 1;
+            break;
+        case 1:
+            if (p[i] == UBX_SYNC_CHAR_2)
+                mux->framePos = 2;
+            else if (p[i] != UBX_SYNC_CHAR_1)
+                mux->framePos = 0;
+            break;
+        case 2:
+            mux->frameClass = p[i];
+            mux->framePos++;
+            break;
+        case 3:
+            mux->frameId = p[i];
+            mux->framePos++;
+            if ((mux->frameClass == UBX_CLASS_UPD) && (mux->frameId == UBX_UPD_SAFE) && !mux->paused)
+            {
+                MESSAGE(MSG_LEV1, "Safeboot commanded, pausing consumers");
+                mux->paused = TRUE;
+            }
+            break;
+        case 4:
+            mux->frameLen = p[i];
+            mux->framePos++;
+            break;
+        case 5:
+            mux->frameLen |= (U4)p[i] << 8;
+            mux->framePos++;
+            break;
+        default:
+            // payload and checksum
+            if (++mux->framePos < UBX_HEAD_SIZE + mux->frameLen + 2)
+                break;
+            mux->framePos = 0;
+            if ((mux->frameClass == UBX_CLASS_UPD) && (mux->frameId == UBX_UPD_RBOOT))
+            {
+                SER_WRITE(mux->port, p, i + 1);
+                MESSAGE(MSG_LEV1, "Receiver rebooted");
+                muxRelease(mux);
+                return;
+            }
+            break;
+        }
+    }
+    if (size && (SER_WRITE(mux->port, p, size) != size))
+    {
+        MESSAGE(MSG_WARN, "could not write all data to the port");
+    }
+}
+
+static int muxReadClient(MUX_DATA_t* mux, MUX_CLIENT_t* c);
+
+//! handle a complete control line
+/*!
+    \param mux  multiplexer state
+    \param c    client which sent the line
+    \return #FALSE if the client was disconnected
+*/
+static BOOL muxControl(MUX_DATA_t* mux, MUX_CLIENT_t* c)
+{
+    if (strcmp(c->line, MUX_CMD_UPDATE) == 0)
+    {
+        if (mux->pUpdater)
+        {
+            MESSAGE(MSG_WARN, "update already running, rejecting client %i", c->fd);
+            muxReply(c, MUX_REPLY_BUSY);
+            muxClose(mux, c);
+            return FALSE;
+        }
+        MESSAGE(MSG_LEV1, "Update tool connected");
+        c->role       = MUX_UPDATER;
+        mux->pUpdater = c;
+        mux->framePos = 0;
+        muxReply(c, MUX_REPLY_OK);
+        return TRUE;
+    }
+
+    if (strncmp(c->line, MUX_CMD_BAUD, strlen(MUX_CMD_BAUD)) == 0)
+    {
+        U4 br = (U4)strtoul(c->line + strlen(MUX_CMD_BAUD), NULL, 10);
+        BOOL ok = TRUE;
+        int i;
+        // the request follows data the update tool has already sent, this has
+        // to reach the receiver at the old baudrate
+        if (mux->pUpdater)
+        {
+            while (muxReadClient(mux, mux->pUpdater) > 0)
+                /*nop*/;
+        }
+        // the update tool may still ask for its baudrate after UPD-RBOOT
+        for (i = 0; i < MUX_MAX_CLIENTS; i++)
+        {
+            if ((mux->client[i].fd >= 0) && (mux->client[i].role == MUX_RELEASED))
+                break;
+        }
+        if (br && (i == MUX_MAX_CLIENTS) && (br != mux->port->baudrate))
+        {
+            int fd = SER_FD(mux->port);
+            if (fd >= 0)
+                tcdrain(fd);
+            ok = SER_BAUDRATE(mux->port, br);
+            if (!ok)
+                MESSAGE(MSG_WARN, "could not switch port to %u baud", br);
+            else if (!mux->pUpdater)
+                mux->baudrate = br;
+            MESSAGE(MSG_DBG, "port at %u baud", mux->port->baudrate);
+        }
+        muxReply(c, ok && br ? MUX_REPLY_OK : MUX_REPLY_ERR);
+        muxClose(mux, c);
+        return FALSE;
+    }
+
+    MESSAGE(MSG_WARN, "unknown request from client %i", c->fd);
+    muxReply(c, MUX_REPLY_ERR);
+    muxClose(mux, c);
+    return FALSE;
+}
+
+//! forward data of a consumer to the port
+static void muxConsumerData(MUX_DATA_t* mux, const void* p, U4 size)
+{
+    // the update tool has exclusive access to the receiver
+    if (!mux->pUpdater && size)
+    {
+        SER_WRITE(mux->port, p, size);
+    }
+}
+
+//! read and dispatch data of a client
+/*!
+    \param mux  multiplexer state
+    \param c    client
+    \return number of bytes read, 0 if none available, -1 if the client
+            was disconnected
+*/
+static int muxReadClient(MUX_DATA_t* mux, MUX_CLIENT_t* c)
+{
+    U1 buf[MUX_BUF_SIZE];
+    ssize_t len = recv(c->fd, buf, sizeof(buf), 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (len <= 0)
+    {
+        muxClose(mux, c);
+        return -1;
+    }
+
+    U4 pos = 0;
+    if ((c->role == MUX_NEW) && (buf[0] == '#'))
+    {
+        c->role    = MUX_CONTROL;
+        c->lineLen = 0;
+    }
+    while ((c->role == MUX_CONTROL) && (pos < (U4)len))
+    {
+        c->line[c->lineLen++] = (CH)buf[pos++];
+        c->line[c->lineLen]   = '\0';
+        if (strncmp(c->line, MUX_CMD_PREFIX, MIN(c->lineLen, strlen(MUX_CMD_PREFIX))) != 0)
+        {
+            // no control line, the consumer talks to the receiver
+            c->role = MUX_CONSUMER;
+            muxConsumerData(mux, c->line, c->lineLen);
+        }
+        else if (c->line[c->lineLen - 1] == '\n')
+        {
+            if (!muxControl(mux, c))
+                return -1;
+        }
+        else if (c->lineLen == sizeof(c->line) - 1)
+        {
+            MESSAGE(MSG_WARN, "request of client %i too long", c->fd);
+            muxReply(c, MUX_REPLY_ERR);
+            muxClose(mux, c);
+            return -1;
+        }
+    }
+    if (pos < (U4)len)
+    {
+        if (c->role == MUX_UPDATER)
+        {
+            muxUpdaterData(mux, buf + pos, (U4)len - pos);
+        }
+        else if (c->role != MUX_RELEASED)
+        {
+            c->role = MUX_CONSUMER;
+            muxConsumerData(mux, buf + pos, (U4)len - pos);
+        }
+    }
+    return (int)len;
+}
+
+//! pass data of the receiver to the clients
+static void muxBroadcast(MUX_DATA_t* mux, const U1* p, U4 size)
+{
+    int i;
+    for (i = 0; i < MUX_MAX_CLIENTS; i++)
+    {
+        MUX_CLIENT_t* c = &mux->client[i];
+        if ((c->fd < 0) || (c->role == MUX_CONTROL))
+            continue;
+        if (c == mux->pUpdater)
+        {
+            if (!muxSend(c, p, size, TRUE))
+                MESSAGE(MSG_WARN, "update tool does not accept data");
+        }
+        else if (!mux->paused && !muxSend(c, p, size, FALSE))
+        {
+            MESSAGE(MSG_DBGV, "client %i too slow, %u bytes dropped", c->fd, size);
+        }
+    }
+}
+
+//! create the listening socket
+static int muxListen(const CH* sockPath)
+{
+    struct sockaddr_un sa;
+    if (strlen(sockPath) >= sizeof(sa.sun_path))
+    {
+        MESSAGE(MSG_ERR, "socket path too long: %s", sockPath);
+        return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, sockPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        MESSAGE(MSG_ERR, "unable to create socket: %s", strerror(errno));
+        return -1;
+    }
+    // remove a socket left behind by a previous instance, but don't steal a used one
+    if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0)
+    {
+        MESSAGE(MSG_ERR, "%s is served by another process", sockPath);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    unlink(sockPath);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((fd < 0) ||
+        (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) ||
+        (listen(fd, MUX_MAX_CLIENTS) < 0))
+    {
+        MESSAGE(MSG_ERR, "unable to listen on %s: %s", sockPath, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+//! accept a new client
+static void muxAccept(MUX_DATA_t* mux)
+{
+    int fd = accept(mux->listenFd, NULL, NULL);
+    int i;
+    if (fd < 0)
+        return;
+    for (i = 0; i < MUX_MAX_CLIENTS; i++)
+    {
+        if (mux->client[i].fd < 0)
+            break;
+    }
+    if (i == MUX_MAX_CLIENTS)
+    {
+        MESSAGE(MSG_WARN, "too many clients");
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    mux->client[i].fd      = fd;
+    mux->client[i].role    = MUX_NEW;
+    mux->client[i].lineLen = 0;
+    MESSAGE(MSG_DBG, "client %i connected", fd);
+}
+
+BOOL MuxServe(IN const CH* port,
+              IN U4        baudrate,
+              IN const CH* sockPath)
+{
+    MUX_DATA_t mux;
+    U1 buf[MUX_BUF_SIZE];
+    int i;
+
+    memset(&mux, 0, sizeof(mux));
+    for (i = 0; i < MUX_MAX_CLIENTS; i++)
+    {
+        mux.client[i].fd = -1;
+    }
+    mux.baudrate = baudrate;
+
+    mux.port = SER_OPEN(port);
+    if (!mux.port)
+    {
+        MESSAGE(MSG_ERR, "Could not open port %s", port);
+        return FALSE;
+    }
+    if (SER_CAPS(mux.port) & SER_CAP_FF_FILTER)
+    {
+        // the update tool writes in arbitrary chunks, the filter needs complete messages
+        MESSAGE(MSG_ERR, "%s can not be shared", port);
+        SER_CLOSE(mux.port);
+        return FALSE;
+    }
+    if (!SER_BAUDRATE(mux.port, baudrate))
+    {
+        MESSAGE(MSG_ERR, "Could not set %u baud on %s", baudrate, port);
+        SER_CLOSE(mux.port);
+        return FALSE;
+    }
+    mux.listenFd = muxListen(sockPath);
+    if (mux.listenFd < 0)
+    {
+        SER_CLOSE(mux.port);
+        return FALSE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT,  muxSignal);
+    signal(SIGTERM, muxSignal);
+    MESSAGE(MSG_LEV1, "Sharing %s at %u baud on %s", port, baudrate, sockPath);
+
+    while (!s_muxStop)
+    {
+        int portFd = (SER_CAPS(mux.port) & SER_CAP_WAITABLE_FD) ? SER_FD(mux.port) : -1;
+        int maxFd  = MAX(mux.listenFd, portFd);
+        struct timeval tv = { 0, MUX_POLL_INTERVAL * 1000 };
+        fd_set fds;
+
+        FD_ZERO(&fds);
+        FD_SET(mux.listenFd, &fds);
+        if (portFd >= 0)
+            FD_SET(portFd, &fds);
+        for (i = 0; i < MUX_MAX_CLIENTS; i++)
+        {
+            if (mux.client[i].fd >= 0)
+            {
+                FD_SET(mux.client[i].fd, &fds);
+                maxFd = MAX(maxFd, mux.client[i].fd);
+            }
+        }
+        if (select(maxFd + 1, &fds, NULL, NULL, (portFd >= 0) ? NULL : &tv) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            MESSAGE(MSG_ERR, "select failed: %s", strerror(errno));
+            break;
+        }
+
+        // receiver output first, the update tool waits for it
+        if ((portFd < 0) || FD_ISSET(portFd, &fds))
+        {
+            U4 len = SER_READ(mux.port, buf, sizeof(buf));
+            if (len)
+            {
+                muxBroadcast(&mux, buf, len);
+            }
+            else if (portFd >= 0)
+            {
+                // readable without data: the device is gone, e.g. a USB
+                // receiver re-enumerating after safeboot or reboot
+                MESSAGE(MSG_LEV1, "Port closed, reopening");
+                if (!SER_REENUM(mux.port, TRUE))
+                {
+                    MESSAGE(MSG_ERR, "Could not reopen port %s", port);
+                    break;
+                }
+            }
+        }
+        for (i = 0; i < MUX_MAX_CLIENTS; i++)
+        {
+            if ((mux.client[i].fd >= 0) && FD_ISSET(mux.client[i].fd, &fds))
+                muxReadClient(&mux, &mux.client[i]);
+        }
+        if (FD_ISSET(mux.listenFd, &fds))
+        {
+            muxAccept(&mux);
+        }
+    }
+
+    for (i = 0; i < MUX_MAX_CLIENTS; i++)
+    {
+        if (mux.client[i].fd >= 0)
+            close(mux.client[i].fd);
+    }
+    close(mux.listenFd);
+    unlink(sockPath);
+    SER_CLOSE(mux.port);
+    return !!s_muxStop;
+}
+
+#endif //ENABLE_MUX_SUPPORT
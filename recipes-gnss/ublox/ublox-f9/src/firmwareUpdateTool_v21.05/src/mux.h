@@ -0,0 +1,77 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+/*!
+  \file
+  \brief  Share a serial port between GNSS consumers and the update tool
+*/
+
+#ifndef __MUX_H
+#define __MUX_H
+
+#include "types.h"
+#include "platform.h"
+
+/*! \name Multiplexer protocol
+    A client connecting to the multiplexer socket receives everything the
+    receiver sends. Data written by a client is forwarded to the receiver,
+    unless it starts with one of the control lines below.
+@{ */
+#define MUX_PORT_PREFIX     "unix:"             //!< port name prefix of the update tool, followed by the socket path
+#define MUX_CMD_PREFIX      "#UBXMUX "          //!< start of every control line
+#define MUX_CMD_UPDATE      "#UBXMUX UPDATE\n"  //!< take over the port for a firmware update
+#define MUX_CMD_BAUD        "#UBXMUX BAUD "     //!< set the baudrate (followed by the value and a newline), the connection is closed afterwards
+#define MUX_REPLY_OK        "#UBXMUX OK"        //!< request accepted
+#define MUX_REPLY_BUSY      "#UBXMUX BUSY"      //!< request rejected, another update is running
+#define MUX_REPLY_ERR       "#UBXMUX ERR"       //!< request failed
+/*! @} */
+
+#ifdef ENABLE_MUX_SUPPORT
+
+//! Serve a serial port on a Unix domain socket
+/*!
+    Opens \a port and shares it with any number of clients connecting to
+    \a sockPath until the process is terminated.
+
+    While no update is running, all clients receive the receiver output and
+    may send commands to it. A client announcing an update with
+    #MUX_CMD_UPDATE gets exclusive write access, the other clients keep
+    receiving until the update tool commands the safeboot (UPD-SAFE). They
+    are served again as soon as the update tool has sent UPD-RBOOT or has
+    disconnected, and the port is switched back to \a baudrate.
+
+    \param port      \b IN: name of the serial port to share
+    \param baudrate  \b IN: baudrate the consumers expect
+    \param sockPath  \b IN: path of the socket to create
+    \return #TRUE if terminated by SIGINT or SIGTERM, #FALSE if the port or
+            the socket can not be opened or the port is lost
+*/
+BOOL MuxServe(IN const CH* port,
+              IN U4        baudrate,
+              IN const CH* sockPath);
+
+#endif //ENABLE_MUX_SUPPORT
+
+#endif //__MUX_H
@@ -34,14 +34,17 @@
 #include "spi_read_buffer.h"
 
 #include "ubxmsg.h"
+#include "checksum.h"
 
 #ifdef ENABLE_AARDVARK_SUPPORT
 # include "aardvark.h"
 #endif //ENABLE_AARDVARK_SUPPORT
 
 #ifdef WIN32
+# include <winsock2.h>
+# include <ws2tcpip.h>
 # include <windows.h>
-# include <winsock.h>
+# include <psapi.h>
 # include <wininet.h>
 # include <stdio.h>
 # include <io.h>
@@ -63,11 +66,14 @@
 # endif
 
 # include <sys/time.h>
+# include <sys/resource.h>
 # include <sys/fcntl.h>
 # include <sys/file.h>
 # include <sys/stat.h>
+# include <sys/mman.h>
 # include <sys/socket.h>
 # include <sys/select.h>
+# include <sys/uio.h>
 # include <sys/types.h>
 # include <netinet/in.h>
 # include <netinet/tcp.h>
@@ -76,8 +82,26 @@
 # include <signal.h>
 # include <errno.h>
 # include <unistd.h>
+# include <pthread.h>
+# include <glob.h>
 #endif
 
+#if defined(ENABLE_I2CDEV_SUPPORT) || defined(ENABLE_SPIDEV_SUPPORT)
+# include <sys/ioctl.h>
+#endif
+#ifdef ENABLE_I2CDEV_SUPPORT
+# include <linux/i2c.h>
+# include <linux/i2c-dev.h>
+#endif //ENABLE_I2CDEV_SUPPORT
+#ifdef ENABLE_SPIDEV_SUPPORT
+# include <linux/spi/spidev.h>
+#endif //ENABLE_SPIDEV_SUPPORT
+
+#ifdef ENABLE_MUX_SUPPORT
+# include <sys/un.h>
+# include "mux.h"
+#endif //ENABLE_MUX_SUPPORT
+
 #ifdef ENABLE_DIOLAN_SUPPORT
 #include "u2cbridge.h"    // Diolan support
 #endif //ENABLE_DIOLAN_SUPPORT
@@ -86,30 +110,68 @@
 #ifdef ENABLE_NET_SUPPORT
 # ifndef WIN32
 #  define SOCKADDR struct sockaddr                  //!< cross-platform compatibility
-#  define SOCKADDR_IN struct sockaddr_in            //!< cross-platform compatibility
-#  define HOSTENT struct hostent                    //!< cross-platform compatibility
 #  define FDSET  fd_set                             //!< cross-platform compatibility
 #  define TIMEVAL struct timeval                    //!< cross-platform compatibility
 #  define closesocket(s) close(s)                   //!< cross-platform compatibility
 #  define LAST_ERR() errno                          //!< cross-platform compatibility
 #  define LAST_NET_ERR() errno                      //!< cross-platform compatibility
+#  define NET_WOULDBLOCK() ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINPROGRESS)) //!< cross-platform compatibility
 # else
 #  define FDSET FD_SET                       //!< cross-platform compatibility
 #  define LAST_ERR()     GetLastError()      //!< cross-platform compatibility
 #  define LAST_NET_ERR() WSAGetLastError()   //!< cross-platform compatibility
+#  define NET_WOULDBLOCK() (WSAGetLastError() == WSAEWOULDBLOCK) //!< cross-platform compatibility
 # endif
+# define NET_CONNECT_TIMEOUT  5000           //!< time to wait for a connection [ms]
+# define NET_WRITE_TIMEOUT    5000           //!< time to wait for space in the send buffer [ms]
+# define NET_SOCKET_BUFFER   (4*UBX_MAX_FRAME_SIZE) //!< size of the socket buffers
+# define NET_TX_BUFFER        UBX_MAX_FRAME_SIZE    //!< size of the buffer coalescing writes
+# define NET_RX_HOLD          4096           //!< data kept while waiting for a RFC 2217 reply
+# define NET_HTTP_PORT        "80"           //!< default HTTP port of the terminal servers, see NET_SET_HTTP_PORT()
+# define NET_RFC2217_PREFIX   "rfc2217://"   //!< port name prefix of RFC 2217 servers
+# define NET_RFC2217_TIMEOUT  2000           //!< time to wait for a RFC 2217 reply [ms]
+
+/*! \name Telnet (RFC 854) and COM-PORT-OPTION (RFC 2217) codes
+@{ */
+# define TELNET_SE            240            //!< end of sub-negotiation
+# define TELNET_SB            250            //!< start of sub-negotiation
+# define TELNET_WILL          251            //!< sender wants to enable an option
+# define TELNET_WONT          252            //!< sender refuses an option
+# define TELNET_DO            253            //!< sender wants the peer to enable an option
+# define TELNET_DONT          254            //!< sender wants the peer to disable an option
+# define TELNET_IAC           255            //!< interpret as command
+# define TELNET_BINARY          0            //!< option: 8 bit transmission
+# define TELNET_SGA             3            //!< option: suppress go ahead
+# define TELNET_COM_PORT       44            //!< option: COM-PORT-OPTION
+# define RFC2217_SET_BAUDRATE   1            //!< client command: set baudrate
+# define RFC2217_SET_DATASIZE   2            //!< client command: set data bits
+# define RFC2217_SET_PARITY     3            //!< client command: set parity
+# define RFC2217_SET_STOPSIZE   4            //!< client command: set stop bits
+# define RFC2217_SERVER_OFFSET 100           //!< added to the command in the server replies
+/*! @} */
 #endif
 
 
 #define DEFAULT_I2C_ADDR    0x42             //!< default slave address
-#define I2C_SLEEPTIME        50              //!< time to sleep on full rx buffer to give msgpp time to consume payload
+#define I2C_SLEEPTIME        50              //!< longest time to sleep on full rx buffer to give msgpp time to consume payload
+#define I2C_REG_LENGTH     0xFD              //!< first register of the number of bytes available (high byte)
+#define I2C_PREFETCH         32              //!< stream bytes read together with the length registers
+#define I2C_ADAPTER_MAX       4              //!< maximum number of Aardvark adapters open for I2C at once
+#define I2CDEV_MAX_XFER    8192              //!< maximum i2c-dev message length
+#define I2CDEV_NACK_RETRIES  20              //!< writes rejected by the receiver retried before giving up
+#define SPIDEV_XFER_DEFAULT 4096             //!< default spidev transfer size (kernel default bufsiz)
+#define SPI_READ_MIN         16              //!< smallest SPI dummy read
+#define SPI_READ_INIT        64              //!< initial SPI dummy read size
+#define SPI_READ_MAX       4096              //!< largest SPI dummy read
+#define SPI_IDLE_MAX          8              //!< longest interval between SPI dummy reads while the receiver is idle [ms]
+#define I2C_IDLE_MAX          8              //!< longest interval between I2C length queries while the receiver is idle [ms]
+#define FLWRI_HEAD_SIZE (UBX_HEAD_SIZE + 8)  //!< UBX header, address and size of a UPD-FLWRI frame
+#define FLWRI_OVERHEAD  (UBX_FRAME_SIZE + 8) //!< bytes added by splitting a UPD-FLWRI frame in two
 
 //#define AARDVARK_DEBUG_PIN                 //!< set a GPIO pin on error
 
 
 
-int verbose = 0;
-
 
 
 
@@ -137,6 +199,223 @@ U4 TIME_GET(void)
 #endif
 }
 
+U4 TIME_CPU(void)
+{
+#ifdef WIN32
+    FILETIME ftCreate, ftExit, ftKernel, ftUser;
+    if (!GetProcessTimes(GetCurrentProcess(), &ftCreate, &ftExit, &ftKernel, &ftUser))
+        return 0;
+    // 100 ns units
+    ULONGLONG t = ((((ULONGLONG)ftKernel.dwHighDateTime) << 32) | ftKernel.dwLowDateTime) +
+                  ((((ULONGLONG)ftUser.dwHighDateTime)   << 32) | ftUser.dwLowDateTime);
+    return (U4)(t / 10000);
+#else
+    struct rusage ru;
+    return (getrusage(RUSAGE_SELF,&ru)==0) ?
+        (U4)((ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)*1000 +
+             (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)/1000) : 0;
+#endif
+}
+
+//=====================================================================
+// FILES AND MEMORY
+//=====================================================================
+
+const void* FILE_MAP(const CH* name, size_t* pSize)
+{
+#ifdef WIN32
+    HANDLE hFile = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return NULL;
+    LARGE_INTEGER size;
+    void* p = NULL;
+    if (GetFileSizeEx(hFile, &size) && (size.QuadPart > 0) &&
+        ((ULONGLONG)size.QuadPart <= (size_t)-1))
+    {
+        HANDLE hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMap)
+        {
+            // the view keeps the mapping alive
+            p = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(hMap);
+        }
+    }
+    CloseHandle(hFile);
+    if (p)
+        *pSize = (size_t)size.QuadPart;
+    return p;
+#else
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void* p = NULL;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+    {
+        // the mapping stays valid after closing the file
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            p = NULL;
+    }
+    close(fd);
+    if (p)
+        *pSize = (size_t)st.st_size;
+    return p;
+#endif
+}
+
+void FILE_UNMAP(const void* p, size_t size)
+{
+    if (!p)
+        return;
+#ifdef WIN32
+    UnmapViewOfFile(p);
+#else
+    munmap((void*)p, size);
+#endif
+}
+
+U4 MEM_PEAK(void)
+{
+#ifdef WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    return GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ?
+        (U4)(pmc.PeakWorkingSetSize / 1024) : 0;
+#else
+    struct rusage ru;
+    // kB on Linux
+    return (getrusage(RUSAGE_SELF,&ru)==0) ? (U4)ru.ru_maxrss : 0;
+#endif
+}
+
+//=====================================================================
+// THREADS
+//=====================================================================
+
+//! thread started by THREAD_START()
+struct THREAD_s
+{
+#ifdef WIN32
+    HANDLE    h;                  //!< thread handle
+#else
+    pthread_t id;                 //!< thread id
+#endif
+    void    (*pfn)(void* pArg);   //!< function run by the thread
+    void*     pArg;               //!< argument of pfn
+};
+
+//! mutex created by MUTEX_CREATE()
+struct MUTEX_s
+{
+#ifdef WIN32
+    CRITICAL_SECTION cs;          //!< critical section
+#else
+    pthread_mutex_t  mutex;       //!< mutex
+#endif
+};
+
+//! serializes the first use of the process-wide state (registered transports, shared adapters)
+#ifdef WIN32
+static SRWLOCK s_platformLock = SRWLOCK_INIT;
+# define PLATFORM_LOCK()    AcquireSRWLockExclusive(&s_platformLock)   //!< lock the process-wide state
+# define PLATFORM_UNLOCK()  ReleaseSRWLockExclusive(&s_platformLock)   //!< unlock the process-wide state
+#else
+static pthread_mutex_t s_platformLock = PTHREAD_MUTEX_INITIALIZER;
+# define PLATFORM_LOCK()    pthread_mutex_lock(&s_platformLock)        //!< lock the process-wide state
+# define PLATFORM_UNLOCK()  pthread_mutex_unlock(&s_platformLock)      //!< unlock the process-wide state
+#endif
+
+//! entry point of the threads, runs the function given to THREAD_START()
+#ifdef WIN32
+static DWORD WINAPI THREAD_MAIN(LPVOID pArg)
+#else
+static void* THREAD_MAIN(void* pArg)
+#endif
+{
+    THREAD_pt thread = (THREAD_pt)pArg;
+    thread->pfn(thread->pArg);
+    return 0;
+}
+
+THREAD_pt THREAD_START(void (*pfn)(void* pArg), void* pArg)
+{
+    THREAD_pt thread = (THREAD_pt)malloc(sizeof(*thread));
+    if (!thread)
+        return NULL;
+    thread->pfn  = pfn;
+    thread->pArg = pArg;
+#ifdef WIN32
+    thread->h = CreateThread(NULL, 0, THREAD_MAIN, thread, 0, NULL);
+    if (thread->h == NULL)
+#else
+    if (pthread_create(&thread->id, NULL, THREAD_MAIN, thread) != 0)
+#endif
+    {
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void THREAD_JOIN(THREAD_pt thread)
+{
+#ifdef WIN32
+    WaitForSingleObject(thread->h, INFINITE);
+    CloseHandle(thread->h);
+#else
+    pthread_join(thread->id, NULL);
+#endif
+    free(thread);
+}
+
+MUTEX_pt MUTEX_CREATE(void)
+{
+    MUTEX_pt mutex = (MUTEX_pt)malloc(sizeof(*mutex));
+    if (!mutex)
+        return NULL;
+#ifdef WIN32
+    InitializeCriticalSection(&mutex->cs);
+#else
+    if (pthread_mutex_init(&mutex->mutex, NULL) != 0)
+    {
+        free(mutex);
+        return NULL;
+    }
+#endif
+    return mutex;
+}
+
+void MUTEX_LOCK(MUTEX_pt mutex)
+{
+#ifdef WIN32
+    EnterCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_lock(&mutex->mutex);
+#endif
+}
+
+void MUTEX_UNLOCK(MUTEX_pt mutex)
+{
+#ifdef WIN32
+    LeaveCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_unlock(&mutex->mutex);
+#endif
+}
+
+void MUTEX_DELETE(MUTEX_pt mutex)
+{
+    if (!mutex)
+        return;
+#ifdef WIN32
+    DeleteCriticalSection(&mutex->cs);
+#else
+    pthread_mutex_destroy(&mutex->mutex);
+#endif
+    free(mutex);
+}
+
 //=====================================================================
 // COM PORT IO
 //=====================================================================
@@ -302,7 +581,6 @@ U4 COM_WRITE(HANDLE h, const void* p, U4 size)
 #endif
 }
 
-#ifdef WIN32
 //! write data to stdout
 /*!
     \param p    Pointer to data to write
@@ -311,13 +589,36 @@ U4 COM_WRITE(HANDLE h, const void* p, U4 size)
 */
 U4 STDOUT_WRITE(const void* p, U4 size)
 {
+#ifdef WIN32
     I4 dw = write(1,p,size);
+#else
+    // the pipe may be non-blocking, wait until the parent has consumed the data
+    I4 dw = 0;
+    while ((U4)dw < size)
+    {
+        ssize_t ret = write(STDOUT_FILENO, (const U1*)p + dw, size - dw);
+        if (ret > 0)
+        {
+            dw += ret;
+        }
+        else if ((ret < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+        {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(STDOUT_FILENO, &fds);
+            select(STDOUT_FILENO+1, NULL, &fds, NULL, NULL);
+        }
+        else
+        {
+            break;
+        }
+    }
+#endif
     if ((U4)dw != size)
         MESSAGE(MSG_ERR, "can not write all data (req: %li, actual: %li)", size, dw);
 
     return dw>0?(U4)dw:0;
 }
-#endif //ifdef WIN32
 
 //! Read data from device
 /*!
@@ -344,7 +645,6 @@ U4 COM_READ(HANDLE h, void* p, U4 size)
 #endif
 }
 
-#ifdef WIN32
 //! Read data from stdin
 /*!
     \param p    Pointer to user-allocated buffer of at least \a size size
@@ -353,20 +653,26 @@ U4 COM_READ(HANDLE h, void* p, U4 size)
 */
 U4 STDIN_READ(void* p, U4 size)
 {
+#ifdef WIN32
     DWORD dw = 0;
     HANDLE hStdIn = GetStdHandle(STD_INPUT_HANDLE);
     ReadFile(hStdIn, p, size, &dw, NULL);
+#else
+    // stdin is non-blocking, see STDIO_SER_OPEN()
+    I4 dw = read(STDIN_FILENO, p, size);
+#endif
 
     return dw>0 ? (U4)dw : 0;
 }
-#endif //ifdef WIN32
 
-#ifdef WIN32
+//! ask the parent process to change the baudrate
+/*!
+    \param br   baudrate to set
+*/
 void STDIN_SETBAUD(int br)
 {
     MESSAGE_PLAIN("<AC>Setbaud %i<\\AC>", br);
 }
-#endif //ifdef WIN32
 
 //! discard all characters from the output or input buffer
 /*!
@@ -402,6 +708,252 @@ void COM_FLUSH(HANDLE h)
 }
 
 
+//=====================================================================
+// SPI READ BUFFER
+//=====================================================================
+
+#if defined(ENABLE_AARDVARK_SUPPORT) || defined(ENABLE_DIOLAN_SUPPORT) || defined(ENABLE_SPIDEV_SUPPORT)
+
+//! full-duplex transfer function of a SPI adapter
+/*!
+    \param h        handle to device
+    \param pArg     adapter specific argument
+    \param pTx      data to clock out
+    \param pRx      buffer receiving the data clocked in, same size as \a pTx
+    \param size     number of bytes to transfer
+    \return #TRUE on success
+*/
+typedef BOOL (*SPI_XFER_FN)(HANDLE h, void* pArg, const U1* pTx, U1* pRx, U4 size);
+
+static U1 s_spiIdle[SPI_READ_MAX];           //!< idle bytes clocked out by dummy reads
+
+//! initialize a SPI read buffer
+/*!
+    \param pRb      pointer to the read buffer
+*/
+static void SPI_RB_INIT(SPI_READBUFFER_pt pRb)
+{
+    memset(pRb, 0, sizeof(*pRb));
+    pRb->readSize = SPI_READ_INIT;
+    PLATFORM_LOCK();
+    if (s_spiIdle[0] != 0xFF)
+    {
+        memset(s_spiIdle, 0xFF, sizeof(s_spiIdle));
+    }
+    PLATFORM_UNLOCK();
+}
+
+//! get the contiguous free space at the end of a SPI read buffer
+/*!
+    \param pRb      pointer to the read buffer
+    \param pRoom    receives the number of bytes that may be stored at the returned pointer
+    \return pointer to the free space
+*/
+static U1* SPI_RB_TAIL(SPI_READBUFFER_pt pRb, U4* pRoom)
+{
+    U4 wr = (pRb->rd + pRb->size) % sizeof(pRb->buffer);
+    *pRoom = MIN(sizeof(pRb->buffer) - pRb->size, sizeof(pRb->buffer) - wr);
+    return pRb->buffer + wr;
+}
+
+//! account a write transfer to a SPI read buffer
+/*!
+    \param pRb      pointer to the read buffer
+    \param size     number of bytes transferred
+    \param keep     #TRUE if the data clocked in at SPI_RB_TAIL() has to be kept
+*/
+static void SPI_RB_PUT(SPI_READBUFFER_pt pRb, U4 size, BOOL keep)
+{
+    if (keep)
+    {
+        pRb->size += size;
+    }
+    pRb->writeXfers++;
+    pRb->writeBytes += size;
+    // a reply is expected, poll again without delay
+    pRb->idleDelay = 0;
+}
+
+//! take data out of a SPI read buffer
+/*!
+    \param pRb      pointer to the read buffer
+    \param p        buffer receiving the data
+    \param size     size of \a p
+    \return number of bytes copied
+*/
+static U4 SPI_RB_GET(SPI_READBUFFER_pt pRb, U1* p, U4 size)
+{
+    size = MIN(size, pRb->size);
+    U4 part = MIN(size, sizeof(pRb->buffer) - pRb->rd);
+    memcpy(p, pRb->buffer + pRb->rd, part);
+    memcpy(p + part, pRb->buffer, size - part);
+    pRb->rd    = (pRb->rd + size) % sizeof(pRb->buffer);
+    pRb->size -= size;
+    if (!pRb->size)
+    {
+        // keep the free space contiguous
+        pRb->rd = 0;
+    }
+    return size;
+}
+
+//! number of bytes missing to complete the last UBX frame started in a chunk
+/*!
+    \param p        received data
+    \param size     size of \a p
+    \return number of bytes missing, 0 if no frame is incomplete
+*/
+static U4 SPI_UBX_MISSING(const U1* p, U4 size)
+{
+    U4 i = 0;
+    while (i + 1 < size)
+    {
+        if ((p[i] != UBX_SYNC_CHAR_1) || (p[i+1] != UBX_SYNC_CHAR_2))
+        {
+            i++;
+            continue;
+        }
+        if (i + UBX_HEAD_SIZE > size)
+        {
+            // the length is not yet known
+            return i + UBX_FRAME_SIZE - size;
+        }
+        U4 end = i + UBX_FRAME_SIZE + (p[i+4] | ((U4)p[i+5] << 8));
+        if (end > size)
+        {
+            return end - size;
+        }
+        i = end;
+    }
+    return 0;
+}
+
+//! read data from a SPI port
+/*!
+    Returns the data clocked in during writes first. Otherwise idle bytes
+    are clocked out to fetch data from the receiver. The size of this dummy
+    read doubles while the transfers return data only and halves while they
+    return mostly idle bytes. A UBX frame started in a dummy read is completed
+    with a second transfer of the missing size. While the receiver is idle,
+    the interval between dummy reads grows up to #SPI_IDLE_MAX ms, received
+    data and writes restart polling without delay.
+
+    \param pRb      pointer to the read buffer
+    \param h        handle to device
+    \param pArg     argument passed to \a pfnXfer
+    \param pfnXfer  transfer function of the adapter
+    \param maxXfer  maximum size of one transfer
+    \param p        pointer to user-allocated buffer of at least \a size size to receive data
+    \param size     number of bytes to read
+    \return number of bytes read
+*/
+static U4 SPI_RB_READ(SPI_READBUFFER_pt pRb, HANDLE h, void* pArg, SPI_XFER_FN pfnXfer,
+                      U4 maxXfer, U1* p, U4 size)
+{
+    if (pRb->size)
+    {
+        return SPI_RB_GET(pRb, p, size);
+    }
+
+    U4 now = TIME_GET();
+    if (pRb->idleDelay && ((now - pRb->idleTime) < pRb->idleDelay))
+    {
+        return 0;
+    }
+    maxXfer = MIN(maxXfer, SPI_READ_MAX);
+    U4 got = MIN(MIN(size, maxXfer), pRb->readSize);
+    if (!got || !pfnXfer(h, pArg, s_spiIdle, p, got))
+    {
+        return 0;
+    }
+    pRb->readXfers++;
+    pRb->readBytes += got;
+
+    U4 first = 0;
+    while ((first < got) && (p[first] == 0xFF))
+    {
+        first++;
+    }
+    if (first == got)
+    {
+        // we received only FFs -> discard and poll less often
+        pRb->idleTime  = now;
+        pRb->idleDelay = pRb->idleDelay ? MIN(2 * pRb->idleDelay, SPI_IDLE_MAX) : 1;
+        pRb->readSize  = MAX(pRb->readSize / 2, SPI_READ_MIN);
+        return 0;
+    }
+    pRb->idleDelay = 0;
+
+    // adapt the next dummy read to the density of the data received
+    U4 last = got;
+    while (p[last-1] == 0xFF)
+    {
+        last--;
+    }
+    U4 missing = MIN(MIN(SPI_UBX_MISSING(p + first, got - first), size - got), maxXfer);
+    if ((last == got) && !missing)
+    {
+        pRb->readSize = MIN(2 * pRb->readSize, SPI_READ_MAX);
+    }
+    else if (4 * (last - first) < got)
+    {
+        pRb->readSize = MAX(pRb->readSize / 2, SPI_READ_MIN);
+    }
+
+    if (missing && pfnXfer(h, pArg, s_spiIdle, p + got, missing))
+    {
+        pRb->readXfers++;
+        pRb->readBytes += missing;
+        got  += missing;
+        last  = got;
+    }
+    pRb->readData += last - first;
+    return got;
+}
+
+//! report the transfer statistics of a SPI port
+/*!
+    \param pRb      pointer to the read buffer
+*/
+static void SPI_RB_STATS(const SPI_READBUFFER_t* pRb)
+{
+    MESSAGE(MSG_DBG, "SPI writes: %u transfers, %u bytes",
+            pRb->writeXfers, pRb->writeBytes);
+    MESSAGE(MSG_DBG, "SPI reads: %u transfers, %u bytes clocked, %u bytes data, %u data bytes per transfer",
+            pRb->readXfers, pRb->readBytes, pRb->readData,
+            pRb->readXfers ? pRb->readData / pRb->readXfers : 0);
+}
+
+//! wait until the next dummy read of a SPI port is due
+/*!
+    Returns at once if data is buffered, otherwise waits until the idle
+    interval has elapsed (at least 1 ms), but not longer than \a timeout.
+
+    \param pRb      pointer to the read buffer
+    \param timeout  longest time to wait [ms]
+*/
+static void SPI_RB_WAIT(const SPI_READBUFFER_t* pRb, U4 timeout)
+{
+    if (pRb->size)
+    {
+        return;
+    }
+    U4 wait = 1;
+    if (pRb->idleDelay)
+    {
+        U4 elapsed = TIME_GET() - pRb->idleTime;
+        wait = (elapsed < pRb->idleDelay) ? pRb->idleDelay - elapsed : 0;
+    }
+    wait = MIN(wait, timeout);
+    if (wait)
+    {
+        TIME_SLEEP(wait);
+    }
+}
+
+#endif
+
+
 //=====================================================================
 // DIOLAN I2C PORT IO
 //=====================================================================
@@ -599,10 +1151,7 @@ HANDLE SPU_OPEN(const CH* name, void **pData)
         MESSAGE(MSG_ERR,"Could not get memory for read buffer");
         return (HANDLE)NULL;
     }
-    memset(*pData,0,sizeof(SPI_READBUFFER_t));
-    SPI_READBUFFER_pt pBuf = (SPI_READBUFFER_pt)(*pData);
-    pBuf->pBuffer = pBuf->buffer;
-    pBuf->size = 0;
+    SPI_RB_INIT((SPI_READBUFFER_pt)(*pData));
 
     HANDLE dev = U2C_OpenDevice(devIndex);
 
@@ -666,43 +1215,53 @@ U4 SPU_WRITE(HANDLE h, SPI_READBUFFER_pt pReadBuf, const void* p, U4 size)
 {
     // manage read buffer. as SPI always performs a read access and a write access at the
     //  same time, we temporarily store the data read and return it on an SPI_READ call
-    U4 room = sizeof(pReadBuf->buffer)-(pReadBuf->size);
-    U4 transfSize = MIN(room, size);
-    if (!transfSize)
-    {
-        return 0;
-    }
-
-    U2C_SingleIoWrite(h, 5, FALSE); // slave select
     U4 alreadyTransferred = 0;
-    while (transfSize)
+    U2C_SingleIoWrite(h, 5, FALSE); // slave select
+    while (alreadyTransferred < size)
     {
         // Diolan allows single-transfers of no more than 256 byte
-        U2 thisSize = (U2)MIN(transfSize, 256);
+        U4 room;
+        U1* pRx = SPI_RB_TAIL(pReadBuf, &room);
+        U2 thisSize = (U2)MIN(MIN(size - alreadyTransferred, room), 256);
+        if (!thisSize)
+        {
+            break;
+        }
 
         // perform write/read
         U2C_RESULT res = U2C_SpiReadWrite(h,            // handle
             (U1*)p+alreadyTransferred,                  // write buffer
-            (BYTE*)pReadBuf->pBuffer + pReadBuf->size,  // read buffer pointer
+            (BYTE*)pRx,                                 // read buffer pointer
             (U2)thisSize);                              // r/w size
 
         if (res != U2C_SUCCESS)
         {
             MESSAGE(MSG_ERR, "SPI write data: %s (%d)", U2C_StatusString(res), res);
-            U2C_SingleIoWrite(h,5,TRUE); // slave deselect
-            return alreadyTransferred;
+            break;
         }
 
-        pReadBuf->size     += thisSize;
+        SPI_RB_PUT(pReadBuf, thisSize, TRUE);
         alreadyTransferred += thisSize;
-        transfSize         -= thisSize;
-
     }
     U2C_SingleIoWrite(h, 5, TRUE); // slave deselect
-    return (U4)size;
+    return alreadyTransferred;
+}
+
+//! dummy read transfer of the Diolan adapter
+static BOOL SPU_XFER(HANDLE h, void* pArg, const U1* pTx, U1* pRx, U4 size)
+{
+    // U2C_SpiRead clocks out idle bytes
+    U2C_SingleIoWrite(h, 5, FALSE); // slave select
+    U2C_RESULT res = U2C_SpiRead(h, pRx, (U2)size);
+    U2C_SingleIoWrite(h, 5, TRUE); // slave deselect
+    if (res != U2C_SUCCESS)
+    {
+        MESSAGE(MSG_ERR, "SPU read data: %s (%d)", U2C_StatusString(res), res);
+        return FALSE;
+    }
+    return TRUE;
 }
 
-#define COMPSZ 50 //!< number of subsequent bytes at start of reception buffer compared for equality with 0xFF
 //! read data from SPI port
 /*!
     \param h        handle to device
@@ -713,65 +1272,154 @@ U4 SPU_WRITE(HANDLE h, SPI_READBUFFER_pt pReadBuf, const void* p, U4 size)
 */
 U4 SPU_READ(HANDLE h, SPI_READBUFFER_pt pReadBuf, void* p, U4 size)
 {
-    if (pReadBuf->size)
-    {
-        // we have data buffered from last write access
-        size = MIN(pReadBuf->size, size);
-        memcpy(p, pReadBuf->pBuffer,size);
-        pReadBuf->pBuffer += size;
-        pReadBuf->size    -= size;
-        memmove(pReadBuf->buffer, pReadBuf->pBuffer, pReadBuf->size);
-        pReadBuf->pBuffer = pReadBuf->buffer;
-    }
-    else
-    {
-        // there's no buffered data -> perform a read with dummy write
-        // setup a dummy FF buffer to perform dummy write
-        U1 tmpBuf[COMPSZ];
-        memset(tmpBuf, 0xFF, sizeof(tmpBuf));
-        size = MIN(MIN(256, size), sizeof(tmpBuf));
-        U2 size1 = (U2)(MIN(size, COMPSZ));
-
-        // first read some bytes and check if they are all FF
-        // perform read
-        U2C_SingleIoWrite(h, 5, FALSE); // slave select
-        U2C_RESULT res = U2C_SpiRead(h, (U1*)p, size1);
-        U2C_SingleIoWrite(h, 5, TRUE); // slave deselect
-        if (res != U2C_SUCCESS)
-        {
-            MESSAGE(MSG_ERR, "SPU read data1: %s (%d)", U2C_StatusString(res), res);
-            return 0;
-        }
+    // Diolan allows single-transfers of no more than 256 byte
+    return SPI_RB_READ(pReadBuf, h, NULL, SPU_XFER, 256, (U1*)p, size);
+}
 
-        if (memcmp(p,tmpBuf,size1) != 0)
-        {
-            if (size > size1)
-            {
-                // some bytes are not FF, so we have data. the UPD messages are short,
-                // so perform only short read accesses. the longer messages are normally fetched
-                // as a side effect of the longer write access when writing packets
-                p     = (void*)((U1*)p+size1);
-                U2C_SingleIoWrite(h,5,FALSE); // slave select
-                U2C_RESULT res = U2C_SpiRead(h, (U1*)p, (U2)(size-size1));
-                U2C_SingleIoWrite(h,5,TRUE); // slave deselect
-                if (res != U2C_SUCCESS)
-                {
-                    MESSAGE(MSG_ERR, "SPI read data2: %s (%d)", U2C_StatusString(res), res);
-                    return size1;
-                }
-            }
-        }
-        else
-        {
-            // we received only FFs -> discard
-            return 0;
-        }
+#endif //ENABLE_DIOLAN_SUPPORT
+
+//=====================================================================
+// I2C PORT DATA
+//=====================================================================
+
+#if defined(ENABLE_AARDVARK_SUPPORT) || defined(ENABLE_I2CDEV_SUPPORT)
+
+//! I2C port data (stored in SER_HANDLE_t::pData)
+typedef struct I2C_DATA_s
+{
+    U4 pending;                              //!< bytes known to be pending, read from the stream register without querying the length
+    U4 bitrate;                              //!< bus clock [Hz]
+    U4 backoff;                              //!< time to wait after the next rejected write [ms], 0 after an accepted write
+    U4 idleTime;                             //!< time of the last length query that found nothing pending
+    U4 idleDelay;                            //!< interval between length queries while the receiver is idle [ms], 0 if active
+    U4 queries;                              //!< number of length queries
+    U4 idleQueries;                          //!< number of length queries that found nothing pending
+    U4 reads;                                //!< number of stream register reads
+    U4 readBytes;                            //!< number of data bytes read
+    U4 writes;                               //!< number of write transactions
+    U4 writeBytes;                           //!< number of bytes accepted by the receiver
+#ifdef ENABLE_I2CDEV_SUPPORT
+    int            fd;                       //!< file descriptor of the i2c-dev bus, -1 if the transfers are replaced
+    I2CDEV_XFER_FN pfnTransfer;              //!< transfer function of an i2c-dev port
+    void*          pXferArg;                 //!< argument of pfnTransfer
+#endif //ENABLE_I2CDEV_SUPPORT
+} I2C_DATA_t;
+typedef I2C_DATA_t* I2C_DATA_pt;             //!< pointer to I2C_DATA_t type
+
+//! allocate the I2C port data
+/*!
+    \param pData    pointer to receive the port data
+    \return #TRUE on success
+*/
+static BOOL I2C_DATA_ALLOC(void **pData)
+{
+    I2C_DATA_pt pI2c = (I2C_DATA_pt)malloc(sizeof(I2C_DATA_t));
+    *pData = pI2c;
+    if (!pI2c)
+    {
+        MESSAGE(MSG_ERR,"Could not get memory for port data");
+        return FALSE;
     }
+    memset(pI2c, 0, sizeof(*pI2c));
+    pI2c->bitrate = BaudrateDefaultI2C;
+    return TRUE;
+}
 
-    return size;
+//! check if the length query can be skipped
+/*!
+    \param pI2c     pointer to the port data
+    \return #TRUE if nothing is known to be pending and the receiver was
+            found idle less than the idle interval ago
+*/
+static BOOL I2C_IDLE(const I2C_DATA_t* pI2c)
+{
+    return !pI2c->pending && pI2c->idleDelay &&
+           ((TIME_GET() - pI2c->idleTime) < pI2c->idleDelay);
 }
 
-#endif //ENABLE_DIOLAN_SUPPORT
+//! account for a length query and adapt the idle interval
+/*!
+    The interval starts at 1 ms and doubles with each query finding
+    nothing up to #I2C_IDLE_MAX, it is reset as soon as data is pending.
+
+    \param pI2c     pointer to the port data
+    \param got      number of stream bytes read along with the length
+*/
+static void I2C_QUERIED(I2C_DATA_pt pI2c, U4 got)
+{
+    pI2c->queries++;
+    pI2c->readBytes += got;
+    if (got || pI2c->pending)
+    {
+        pI2c->idleDelay = 0;
+        return;
+    }
+    pI2c->idleQueries++;
+    pI2c->idleTime  = TIME_GET();
+    pI2c->idleDelay = pI2c->idleDelay ? MIN(2 * pI2c->idleDelay, I2C_IDLE_MAX) : 1;
+}
+
+//! wait until querying the receiver is worthwhile
+/*!
+    Returns at once if data is pending, otherwise waits until the idle
+    interval has elapsed (at least 1 ms), but not longer than \a timeout.
+
+    \param pI2c     pointer to the port data
+    \param timeout  longest time to wait [ms]
+*/
+static void I2C_WAIT(const I2C_DATA_t* pI2c, U4 timeout)
+{
+    if (pI2c->pending)
+    {
+        return;
+    }
+    U4 wait = 1;
+    if (pI2c->idleDelay)
+    {
+        U4 elapsed = TIME_GET() - pI2c->idleTime;
+        wait = (elapsed < pI2c->idleDelay) ? pI2c->idleDelay - elapsed : 0;
+    }
+    wait = MIN(wait, timeout);
+    if (wait)
+    {
+        TIME_SLEEP(wait);
+    }
+}
+
+//! report the transaction statistics of an I2C port
+/*!
+    \param pI2c     pointer to the port data
+*/
+static void I2C_STATS(const I2C_DATA_t* pI2c)
+{
+    MESSAGE(MSG_DBG, "I2C writes: %u transactions, %u bytes",
+            pI2c->writes, pI2c->writeBytes);
+    MESSAGE(MSG_DBG, "I2C reads: %u length queries (%u idle), %u stream reads, %u bytes",
+            pI2c->queries, pI2c->idleQueries, pI2c->reads, pI2c->readBytes);
+}
+
+//! wait after a write the receiver rejected (rx buffer full)
+/*!
+    The first wait is the time the rejected data occupies the bus, it
+    doubles with each further rejected write up to #I2C_SLEEPTIME.
+
+    \param pI2c     pointer to the port data
+    \param size     size of the rejected write
+*/
+static void I2C_BACKOFF(I2C_DATA_pt pI2c, U4 size)
+{
+    if (!pI2c->backoff)
+    {
+        // 9 clocks per byte
+        pI2c->backoff = MAX(1, (size * 9 * 1000) / pI2c->bitrate);
+    }
+    U4 wait = MIN(pI2c->backoff, I2C_SLEEPTIME);
+    pI2c->backoff = MIN(2 * wait, I2C_SLEEPTIME);
+    TIME_SLEEP(wait);
+}
+
+#endif
+
 
 //=====================================================================
 // AARDVARK I2C PORT IO
@@ -779,13 +1427,27 @@ U4 SPU_READ(HANDLE h, SPI_READBUFFER_pt pReadBuf, void* p, U4 size)
 
 #ifdef ENABLE_AARDVARK_SUPPORT
 
+//! Aardvark opened for I2C, shared by the ports of the receivers on its bus
+typedef struct I2C_ADAPTER_s
+{
+    int      devIndex;                       //!< device index
+    Aardvark dev;                            //!< device handle
+    U4       users;                          //!< number of open ports, 0 if unused
+} I2C_ADAPTER_t;
+
+static I2C_ADAPTER_t s_i2cAdapters[I2C_ADAPTER_MAX]; //!< open Aardvark I2C adapters
+
 //! open I2C port
 /*!
+    Several ports with different slave addresses may be open on one
+    Aardvark, they share the device handle.
+
     \param name     name of the I2C port ("I2C0:0x42", "I2C1:0x42", ...)
     \param pAddr    pointer to receive i2c address
+    \param pData    pointer to receive the port data this function will allocate
     \return handle to the device
 */
-HANDLE I2C_OPEN(const CH* name, int *pAddr)
+HANDLE I2C_OPEN(const CH* name, int *pAddr, void **pData)
 {
     int devIndex = atoi(name+3);
     int i2cAddr;
@@ -800,47 +1462,119 @@ HANDLE I2C_OPEN(const CH* name, int *pAddr)
     {
         devIndex = 0;
     }
-    // get access to aardvark
-    Aardvark dev = aa_open(devIndex);
-
     MESSAGE(MSG_DBG,"aardvark port %d I2C address 0x%x",devIndex,i2cAddr);
 
-    // bail on invalid dev handle
-    if ((int)dev <= 0)
+    // share the aardvark if already open for another receiver
+    I2C_ADAPTER_t* pAdapter = NULL;
+    int ix;
+    PLATFORM_LOCK();
+    for (ix = 0; ix < I2C_ADAPTER_MAX; ix++)
     {
-        MESSAGE(MSG_ERR, "%s", aa_status_string((int)dev));
+        if (s_i2cAdapters[ix].users && (s_i2cAdapters[ix].devIndex == devIndex))
+        {
+            pAdapter = &s_i2cAdapters[ix];
+            break;
+        }
+        if (!s_i2cAdapters[ix].users && !pAdapter)
+        {
+            pAdapter = &s_i2cAdapters[ix];
+        }
+    }
+    if (!pAdapter)
+    {
+        PLATFORM_UNLOCK();
+        MESSAGE(MSG_ERR, "Too many aardvark devices open");
+        *pAddr = 0;
+        *pData = 0;
+        return (HANDLE)0;
+    }
+    if (!I2C_DATA_ALLOC(pData))
+    {
+        PLATFORM_UNLOCK();
         *pAddr = 0;
         return (HANDLE)0;
     }
+    if (!pAdapter->users)
+    {
+        // get access to aardvark
+        Aardvark dev = aa_open(devIndex);
+
+        // bail on invalid dev handle
+        if ((int)dev <= 0)
+        {
+            PLATFORM_UNLOCK();
+            MESSAGE(MSG_ERR, "%s", aa_status_string((int)dev));
+            free(*pData);
+            *pAddr = 0;
+            *pData = 0;
+            return (HANDLE)0;
+        }
+        // enable I2C mode
+        aa_configure(dev,  AA_CONFIG_GPIO_I2C);
+        // enable pullups
+        aa_i2c_pullup(dev, AA_I2C_PULLUP_BOTH);
+        pAdapter->devIndex = devIndex;
+        pAdapter->dev      = dev;
+    }
+    pAdapter->users++;
+    PLATFORM_UNLOCK();
 
     *pAddr = i2cAddr;
-    // enable I2C mode
-    aa_configure(dev,  AA_CONFIG_GPIO_I2C);
-    // enable pullups
-    aa_i2c_pullup(dev, AA_I2C_PULLUP_BOTH);
-    return (HANDLE)dev;
+    return (HANDLE)pAdapter->dev;
 }
 
 //! close I2C port
 /*!
+    The Aardvark is closed when the last port on it is closed.
+
     \param h    handle to device
 */
 void I2C_CLOSE(HANDLE h)
 {
+    int ix;
+    PLATFORM_LOCK();
+    for (ix = 0; ix < I2C_ADAPTER_MAX; ix++)
+    {
+        if (s_i2cAdapters[ix].users && (s_i2cAdapters[ix].dev == (Aardvark)h))
+        {
+            if (--s_i2cAdapters[ix].users)
+            {
+                PLATFORM_UNLOCK();
+                return;
+            }
+            break;
+        }
+    }
     aa_close((Aardvark)h);
+    PLATFORM_UNLOCK();
 }
 
 //! set baudrate of I2C device
 /*!
+    Supports Fast-mode Plus (1 MHz), the Aardvark limits the clock to the
+    maximum it supports.
+
     \param h    handle to device
+    \param pI2c pointer to the port data
     \param br   baudrate to set
     \return #TRUE
 */
-BOOL I2C_BAUDRATE(HANDLE h,
-                  U4     br)
+BOOL I2C_BAUDRATE(HANDLE      h,
+                  I2C_DATA_pt pI2c,
+                  U4          br)
 {
-    br = aa_i2c_bitrate((Aardvark)h,br/1000);
-    MESSAGE(MSG_DBG, "Baudrate %dkHz",br);
+    int khz = aa_i2c_bitrate((Aardvark)h,br/1000);
+    if (khz <= 0)
+    {
+        MESSAGE(MSG_ERR, "I2C set bitrate: %s (%d)", aa_status_string(khz), khz);
+        return TRUE;
+    }
+    if ((U4)khz * 1000 < br)
+    {
+        MESSAGE(MSG_WARN, "I2C clock limited to %dkHz", khz);
+    }
+    pI2c->bitrate = (U4)khz * 1000;
+    MESSAGE(MSG_DBG, "Baudrate %dkHz",khz);
     return TRUE;
 }
 
@@ -848,24 +1582,34 @@ BOOL I2C_BAUDRATE(HANDLE h,
 /*!
     \param h                handle to device
     \param deviceAddress    address of the I2C device
+    \param pI2c             pointer to the port data
     \param p                pointer to data to write
     \param size             size of data to write
     \return number of bytes written
 */
-U4 I2C_WRITE(HANDLE h, int deviceAddress, const void* p, U4 size)
+U4 I2C_WRITE(HANDLE h, int deviceAddress, I2C_DATA_pt pI2c, const void* p, U4 size)
 {
     u16 writtenBytes;
+    // the register pointer may not be at the stream register anymore
+    pI2c->pending = 0;
     int status = aa_i2c_write_ext((Aardvark)h,(u16)deviceAddress,AA_I2C_NO_FLAGS,(u16)size,(u08*)p,&writtenBytes);
     if (status < 0)
     {
         MESSAGE(MSG_ERR, "I2C_WRITE write data:%s (%d)", aa_status_string((int)status),status);
         return 0;
     }
+    pI2c->writes++;
+    pI2c->writeBytes += writtenBytes;
+    // a reply is to be expected, stop throttling the length queries
+    pI2c->idleDelay = 0;
     if (writtenBytes < size)
     {
         // rxbuffer seems to be full
-        //MESSAGE(MSG_DBG,"wait",size);
-        aa_sleep_ms(I2C_SLEEPTIME);
+        I2C_BACKOFF(pI2c, size);
+    }
+    else
+    {
+        pI2c->backoff = 0;
     }
     return (U4)writtenBytes;
 }
@@ -898,18 +1642,30 @@ const CH* I2C_STATUS_STR(int status)
     }
 }
 
-//! read number of pending bytes from I2C port
+//! read number of pending bytes and the first bytes of the stream
 /*!
+    Sets the register pointer to the length registers 0xFD/0xFE and reads
+    them together with up to \a size bytes of the data stream at 0xFF in
+    one combined (repeated start) transaction. The register pointer of the
+    receiver stays at 0xFF after the length registers were read.
+
     \param h                handle to device
     \param deviceAddress    address of the I2C device
-    \return number of bytes pending
+    \param p                pointer to buffer receiving the stream bytes, may be NULL if \a size is 0
+    \param size             number of stream bytes to read along with the length
+    \param pPending         pointer to receive the number of pending bytes
+    \return number of valid stream bytes written to \a p
 */
-U4 I2C_PENDING(HANDLE h, int deviceAddress)
+static U4 I2C_READ_COMBINED(HANDLE h, int deviceAddress, void* p, U4 size, U4* pPending)
 {
-    // set address
-    const u08 sizeAddr = 0xFD;
+    const u08 regAddr = I2C_REG_LENGTH;
+    u08 buf[2 + I2C_PREFETCH];
     u16 writtenBytes = 0;
-    int status = aa_i2c_write_ext((Aardvark)h,(u16)deviceAddress,AA_I2C_NO_STOP,1,&sizeAddr,&writtenBytes);
+    u16 readBytes = 0;
+    size = MIN(size, I2C_PREFETCH);
+    *pPending = 0;
+    int status = aa_i2c_write_read((Aardvark)h,(u16)deviceAddress,AA_I2C_NO_FLAGS,
+                                   1,&regAddr,&writtenBytes,(u16)(2 + size),buf,&readBytes);
     if (status != 0)
     {
 #ifdef AARDVARK_DEBUG_PIN
@@ -918,57 +1674,91 @@ U4 I2C_PENDING(HANDLE h, int deviceAddress)
         TIME_SLEEP(5);
         aa_gpio_set((Aardvark)h, 0);
 #endif //AARDVARK_DEBUG_PIN
+        // write status in the low byte, read status in the high byte
+        if (status > 0)
+        {
+            status = (status & 0xFF) ? (status & 0xFF) : (status >> 8);
+        }
         const char * status_string = aa_status_string((int)status);
         if (!status_string) status_string = I2C_STATUS_STR(status);
-        MESSAGE(MSG_ERR, "I2C_PENDING write ext addr: %s (%d)", status_string, status);
+        MESSAGE(MSG_ERR, "I2C read length: %s (%d)", status_string, status);
         status = aa_i2c_free_bus((Aardvark)h);
         if (status != 0)
         {
             status_string = aa_status_string((int)status);
             if (!status_string) status_string = I2C_STATUS_STR(status);
-            MESSAGE(MSG_ERR, "I2C_PENDING free bus: %s (%d)", status_string, status);
+            MESSAGE(MSG_ERR, "I2C free bus: %s (%d)", status_string, status);
         }
         return 0;
     }
-    // read length
-    u16 readBytes  = 0;
-    u08 bytesAvail[2] = {0};
-    status = aa_i2c_read_ext((Aardvark)h,(u16)deviceAddress,AA_I2C_NO_FLAGS,(u16)2,bytesAvail,&readBytes);
-    if (status != 0)
+    if (readBytes < 2)
     {
-#ifdef AARDVARK_DEBUG_PIN
-        aa_gpio_set((Aardvark)h, AA_GPIO_MISO);
-        aa_gpio_direction((Aardvark)h, AA_GPIO_MISO);
-        TIME_SLEEP(10);
-        aa_gpio_set((Aardvark)h, 0);
-#endif //AARDVARK_DEBUG_PIN
-        const char * status_string = aa_status_string((int)status);
-        if (!status_string) status_string = I2C_STATUS_STR(status);
-        MESSAGE(MSG_ERR, "I2C_PENDING read data: %s (%d)", status_string, status);
         return 0;
     }
-    // minimum of both lengths
-    u16 length = (bytesAvail[0]<<8) + bytesAvail[1];
-    return length;
+    U4 pending = (buf[0]<<8) + buf[1];
+    if (pending == 0xFFFF)
+    {
+        // nothing on the bus answered with a length (e.g. receiver booting)
+        pending = 0;
+    }
+    size = MIN(MIN(size, pending), (U4)readBytes - 2);
+    if (size)
+    {
+        memcpy(p, &buf[2], size);
+    }
+    *pPending = pending - size;
+    return size;
+}
+
+//! read number of pending bytes from I2C port
+/*!
+    \param h                handle to device
+    \param deviceAddress    address of the I2C device
+    \param pI2c             pointer to the port data
+    \return number of bytes pending
+*/
+U4 I2C_PENDING(HANDLE h, int deviceAddress, I2C_DATA_pt pI2c)
+{
+    if (!pI2c->pending && !I2C_IDLE(pI2c))
+    {
+        I2C_READ_COMBINED(h, deviceAddress, NULL, 0, &pI2c->pending);
+        I2C_QUERIED(pI2c, 0);
+    }
+    return pI2c->pending;
 }
 
 //! read data from I2C port
 /*!
+    Queries the number of pending bytes along with the first bytes of the
+    stream. The remaining pending bytes are read directly from the stream
+    register, also by subsequent calls, until a write intervenes.
+
     \param h                handle to device
     \param deviceAddress    address of the I2C device
+    \param pI2c             pointer to the port data
     \param p                pointer to user-allocated buffer of at least \a size size to receive data
     \param size             number of bytes to read
     \return number of bytes read
 */
-U4 I2C_READ(HANDLE h, int deviceAddress, void* p, U4 size)
+U4 I2C_READ(HANDLE h, int deviceAddress, I2C_DATA_pt pI2c, void* p, U4 size)
 {
-    u16 length = (u16)I2C_PENDING(h, deviceAddress);
-    u16 readBytes = 0;
-    length = length > size ? (u16)size : length;
-    // read data
+    U4 readBytes = 0;
+    if (I2C_IDLE(pI2c))
+    {
+        // the receiver was idle a moment ago, spare the bus
+        return 0;
+    }
+    if (!pI2c->pending)
+    {
+        readBytes = I2C_READ_COMBINED(h, deviceAddress, p, size, &pI2c->pending);
+        I2C_QUERIED(pI2c, readBytes);
+    }
+    u16 length = (u16)MIN(MIN(pI2c->pending, size - readBytes), 0xFFFF);
     if (length)
     {
-        int status = aa_i2c_read_ext((Aardvark)h,(u16)deviceAddress,AA_I2C_NO_FLAGS,length,(u08*)p,&readBytes);
+        // the register pointer is at the stream register, continue reading
+        u16 streamBytes = 0;
+        int status = aa_i2c_read_ext((Aardvark)h,(u16)deviceAddress,AA_I2C_NO_FLAGS,length,(u08*)p + readBytes,&streamBytes);
         if (status != 0)
         {
 #ifdef AARDVARK_DEBUG_PIN
@@ -980,563 +1770,2330 @@ U4 I2C_READ(HANDLE h, int deviceAddress, void* p, U4 size)
             const char * status_string = aa_status_string((int)status);
             if (!status_string)    status_string = I2C_STATUS_STR(status);
             MESSAGE(MSG_ERR, "I2C_READ read data: %s (%d)", status_string, status);
-            return 0;
+            pI2c->pending = 0;
+            return readBytes;
         }
+        pI2c->reads++;
+        pI2c->readBytes += streamBytes;
+        readBytes       += streamBytes;
+        pI2c->pending   -= MIN(pI2c->pending, streamBytes);
     }
-    else
-    {
-        aa_i2c_free_bus((Aardvark)h);
-        readBytes = 0;
-    }
-    return (U4)readBytes;
+    return readBytes;
 }
 
 #endif //ENABLE_AARDVARK_SUPPORT
 
 
-#ifdef ENABLE_AARDVARK_SUPPORT
 //=====================================================================
-// AARDVARK SPI PORT IO
+// LINUX I2C-DEV PORT IO
 //=====================================================================
 
-//! open SPI port
+#ifdef ENABLE_I2CDEV_SUPPORT
+
+static I2CDEV_XFER_FN s_pfnI2cDevTransfer = NULL; //!< transfer replacing the bus of new i2c-dev ports, see I2CDEV_SET_TRANSFER()
+static void*          s_pI2cDevXferArg    = NULL; //!< argument of s_pfnI2cDevTransfer
+
+void I2CDEV_SET_TRANSFER(I2CDEV_XFER_FN pfn, void* pArg)
+{
+    PLATFORM_LOCK();
+    s_pfnI2cDevTransfer = pfn;
+    s_pI2cDevXferArg    = pArg;
+    PLATFORM_UNLOCK();
+}
+
+//! perform a write and/or a read in one combined transaction with I2C_RDWR
+static BOOL I2CDEV_TRANSFER(void* pArg, U2 addr, const U1* pTx, U4 txSize, U1* pRx, U4 rxSize)
+{
+    I2C_DATA_pt pI2c = (I2C_DATA_pt)pArg;
+    struct i2c_msg msgs[2];
+    struct i2c_rdwr_ioctl_data xfer;
+    xfer.msgs  = msgs;
+    xfer.nmsgs = 0;
+    if (txSize)
+    {
+        msgs[xfer.nmsgs].addr  = addr;
+        msgs[xfer.nmsgs].flags = 0;
+        msgs[xfer.nmsgs].len   = (__u16)txSize;
+        msgs[xfer.nmsgs].buf   = (__u8*)pTx;
+        xfer.nmsgs++;
+    }
+    if (rxSize)
+    {
+        msgs[xfer.nmsgs].addr  = addr;
+        msgs[xfer.nmsgs].flags = I2C_M_RD;
+        msgs[xfer.nmsgs].len   = (__u16)rxSize;
+        msgs[xfer.nmsgs].buf   = pRx;
+        xfer.nmsgs++;
+    }
+    return ioctl(pI2c->fd, I2C_RDWR, &xfer) >= 0;
+}
+
+//! open I2C bus through the Linux i2c-dev interface
 /*!
-    \param name     name of the SPI port ("SPI0", "SPI1", ...)
-    \param pData    pointer to receive read buffer memory this function will allocate
+    \param name     name of the I2C bus ("/dev/i2c-1", "/dev/i2c-1:0x42", ...)
+    \param pAddr    pointer to receive i2c address
+    \param pData    pointer to receive the port data this function will allocate
     \return handle to the device
 */
-HANDLE SPI_OPEN(const CH* name, void **pData)
+HANDLE I2CDEV_OPEN(const CH* name, int *pAddr, void **pData)
 {
-    int devIndex;
-    // find device index
-    int parsedFields = sscanf(name+3,"%d",&devIndex);
-    // assign defaults
-    if (parsedFields < 1)
+    CH path[64];
+    int i2cAddr = DEFAULT_I2C_ADDR;
+    strncpy(path, name, sizeof(path)-1);
+    path[sizeof(path)-1] = 0;
+    CH *pSep = strchr(path, ':');
+    if (pSep)
     {
-        devIndex = 0;
+        *pSep = 0;
+        if (sscanf(pSep+1, "0x%x", &i2cAddr) != 1)
+        {
+            i2cAddr = DEFAULT_I2C_ADDR;
+        }
     }
-    // get access to aardvark
-    Aardvark dev = aa_open(devIndex);
 
-    MESSAGE(MSG_DBG,"aardvark port %d SPI ",devIndex);
+    if (!I2C_DATA_ALLOC(pData))
+    {
+        *pAddr = 0;
+        return (HANDLE)0;
+    }
+    I2C_DATA_pt pI2c = (I2C_DATA_pt)(*pData);
+    pI2c->fd = -1;
+    PLATFORM_LOCK();
+    pI2c->pfnTransfer = s_pfnI2cDevTransfer;
+    pI2c->pXferArg    = s_pI2cDevXferArg;
+    PLATFORM_UNLOCK();
+    if (pI2c->pfnTransfer)
+    {
+        MESSAGE(MSG_DBG,"i2c-dev %s replaced, I2C address 0x%x",path,i2cAddr);
+        *pAddr = i2cAddr;
+        return (HANDLE)-1;
+    }
 
-    // bail on invalid dev handle
-    if ((int)dev < 0)
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
     {
-        MESSAGE(MSG_ERR, "%s", aa_status_string((int)dev));
+        MESSAGE(MSG_ERR, "Could not open %s: %s", path, strerror(errno));
+        free(*pData);
+        *pAddr = 0;
         *pData = 0;
         return (HANDLE)0;
     }
 
-    // get memory for read buffer
-    *pData = malloc(sizeof(SPI_READBUFFER_t));
-    if (!*pData)
+    unsigned long funcs = 0;
+    if ((ioctl(fd, I2C_FUNCS, &funcs) < 0) || !(funcs & I2C_FUNC_I2C))
     {
-        MESSAGE(MSG_ERR,"Could not get memory for read buffer");
+        MESSAGE(MSG_ERR, "%s does not support combined I2C transfers", path);
+        close(fd);
+        free(*pData);
+        *pAddr = 0;
+        *pData = 0;
         return (HANDLE)0;
     }
-    memset(*pData,0,sizeof(SPI_READBUFFER_t));
-    SPI_READBUFFER_pt pBuf = (SPI_READBUFFER_pt)(*pData);
-    pBuf->pBuffer = pBuf->buffer;
-    pBuf->size = 0;
+    pI2c->fd          = fd;
+    pI2c->pfnTransfer = I2CDEV_TRANSFER;
+    pI2c->pXferArg    = pI2c;
 
-    // enable SPI mode
-    aa_configure(dev,  AA_CONFIG_SPI_GPIO);
-    // configure
-    aa_spi_configure(dev, AA_SPI_POL_RISING_FALLING, AA_SPI_PHASE_SAMPLE_SETUP, AA_SPI_BITORDER_MSB);
-    aa_spi_master_ss_polarity(dev, AA_SPI_SS_ACTIVE_LOW);
-    return (HANDLE)dev;
+    MESSAGE(MSG_DBG,"i2c-dev %s I2C address 0x%x",path,i2cAddr);
+    *pAddr = i2cAddr;
+    return (HANDLE)fd;
 }
 
-//! close SPI port
+//! close I2C bus
 /*!
-    \param h handle to device
+    \param h    handle to device
+    \param pI2c pointer to the port data
 */
-void SPI_CLOSE(HANDLE h)
+void I2CDEV_CLOSE(HANDLE h, I2C_DATA_pt pI2c)
 {
-    aa_close((Aardvark)h);
+    ((void)h);
+    if (pI2c->fd >= 0)
+    {
+        close(pI2c->fd);
+    }
 }
 
-//! set baudrate of SPI device
+//! set baudrate of I2C bus
 /*!
+    The bus clock of a SoC I2C controller is defined by the kernel (device
+    tree) and can't be changed from user space.
+
     \param h    handle to device
     \param br   baudrate to set
     \return #TRUE
 */
-BOOL SPI_BAUDRATE(HANDLE h,
-                  U4     br)
+BOOL I2CDEV_BAUDRATE(HANDLE h,
+                     U4     br)
 {
-    br = aa_spi_bitrate((Aardvark)h,br/1000);
-    MESSAGE(MSG_DBG, "Baudrate %dkHz",br);
+    ((void)h);
+    MESSAGE(MSG_DBG, "Baudrate of i2c-dev bus defined by kernel, ignoring %dkHz", br/1000);
     return TRUE;
 }
 
-//! write data to SPI port
+//! write data to I2C bus
 /*!
-    \param h        handle to device
-    \param pReadBuf pointer to device buffer structure
-    \param p        pointer to data to write
-    \param size     size of data to write
-    \return number of bytes written
+    A write the receiver rejects (receive buffer full) is retried after
+    waiting, see I2C_BACKOFF(), up to #I2CDEV_NACK_RETRIES times, other
+    errors fail the write.
+
+    \param h                handle to device
+    \param deviceAddress    address of the I2C device
+    \param pI2c             pointer to the port data
+    \param p                pointer to data to write
+    \param size             size of data to write
+    \return number of bytes written, 0 on failure
 */
-U4 SPI_WRITE(HANDLE h, SPI_READBUFFER_pt pReadBuf, const void* p, U4 size)
+U4 I2CDEV_WRITE(HANDLE h, int deviceAddress, I2C_DATA_pt pI2c, const void* p, U4 size)
 {
-    // manage read buffer. as SPI always performs a read access and a write access at the
-    //  same time, we temporarily store the data read and return it on an SPI_READ call
-    U4 room = sizeof(pReadBuf->buffer)-(pReadBuf->size);
-    size = MIN(room, size);
-
-    // perform write/read
-    int status = aa_spi_write((Aardvark)h,(u16)size,(u08*)p,(u16)size,(u08*)(pReadBuf->pBuffer + pReadBuf->size));
-    if (status < 0)
+    ((void)h);
+    size = MIN(size, I2CDEV_MAX_XFER);
+    // the register pointer may not be at the stream register anymore
+    pI2c->pending = 0;
+    pI2c->writes++;
+    // a reply is to be expected, stop throttling the length queries
+    pI2c->idleDelay = 0;
+    U4 retries = 0;
+    while (!pI2c->pfnTransfer(pI2c->pXferArg, (U2)deviceAddress, (const U1*)p, size, NULL, 0))
     {
-        MESSAGE(MSG_ERR, "SPI_WRITE write data:%s (%d)", aa_status_string((int)status),status);
-        return 0;
+        if (((errno != EREMOTEIO) && (errno != EAGAIN)) || (retries == I2CDEV_NACK_RETRIES))
+        {
+            MESSAGE(MSG_ERR, "I2CDEV_WRITE write data: %s", strerror(errno));
+            return 0;
+        }
+        // rxbuffer seems to be full (slave NACKs), retry once it had time to drain
+        MESSAGE(MSG_DBG, "I2CDEV_WRITE: %s", strerror(errno));
+        I2C_BACKOFF(pI2c, size);
+        retries++;
     }
-
-    pReadBuf->size += size;
+    pI2c->writeBytes += size;
+    pI2c->backoff = 0;
     return size;
 }
 
-#define COMPSZ 50 //!< number of subsequent bytes at start of reception buffer compared for equality with 0xFF
-//! read data from SPI port
+//! read number of pending bytes and the first bytes of the stream
 /*!
-    \param h        handle to device
-    \param pReadBuf pointer to device buffer structure
-    \param p        pointer to user-allocated buffer of at least \a size size to receive data
-    \param size     number of bytes to read
-    \return number of bytes read
-*/
+    Sets the register pointer to the length registers 0xFD/0xFE and reads
+    them together with up to \a size bytes of the data stream at 0xFF in
+    one combined (repeated start) transaction. The register pointer of the
+    receiver stays at 0xFF after the length registers were read.
+
+    \param pI2c             pointer to the port data
+    \param deviceAddress    address of the I2C device
+    \param p                pointer to buffer receiving the stream bytes, may be NULL if \a size is 0
+    \param size             number of stream bytes to read along with the length
+    \param pPending         pointer to receive the number of pending bytes
+    \return number of valid stream bytes written to \a p
+*/
+static U4 I2CDEV_READ_COMBINED(I2C_DATA_pt pI2c, int deviceAddress, void* p, U4 size, U4* pPending)
+{
+    const U1 regAddr = I2C_REG_LENGTH;
+    U1 buf[2 + I2C_PREFETCH];
+    size = MIN(size, I2C_PREFETCH);
+    *pPending = 0;
+    if (!pI2c->pfnTransfer(pI2c->pXferArg, (U2)deviceAddress, &regAddr, 1, buf, 2 + size))
+    {
+        MESSAGE(MSG_ERR, "I2CDEV read length: %s", strerror(errno));
+        return 0;
+    }
+    U4 pending = (buf[0]<<8) + buf[1];
+    if (pending == 0xFFFF)
+    {
+        // nothing on the bus answered with a length (e.g. receiver booting)
+        pending = 0;
+    }
+    size = MIN(size, pending);
+    if (size)
+    {
+        memcpy(p, &buf[2], size);
+    }
+    *pPending = pending - size;
+    return size;
+}
+
+//! read number of pending bytes from I2C bus
+/*!
+    \param h                handle to device
+    \param deviceAddress    address of the I2C device
+    \param pI2c             pointer to the port data
+    \return number of bytes pending
+*/
+U4 I2CDEV_PENDING(HANDLE h, int deviceAddress, I2C_DATA_pt pI2c)
+{
+    ((void)h);
+    if (!pI2c->pending && !I2C_IDLE(pI2c))
+    {
+        I2CDEV_READ_COMBINED(pI2c, deviceAddress, NULL, 0, &pI2c->pending);
+        I2C_QUERIED(pI2c, 0);
+    }
+    return pI2c->pending;
+}
+
+//! read data from I2C bus
+/*!
+    Queries the number of pending bytes along with the first bytes of the
+    stream. The remaining pending bytes are read directly from the stream
+    register, also by subsequent calls, until a write intervenes.
+
+    \param h                handle to device
+    \param deviceAddress    address of the I2C device
+    \param pI2c             pointer to the port data
+    \param p                pointer to user-allocated buffer of at least \a size size to receive data
+    \param size             number of bytes to read
+    \return number of bytes read
+*/
+U4 I2CDEV_READ(HANDLE h, int deviceAddress, I2C_DATA_pt pI2c, void* p, U4 size)
+{
+    ((void)h);
+    U4 readBytes = 0;
+    if (I2C_IDLE(pI2c))
+    {
+        // the receiver was idle a moment ago, spare the bus
+        return 0;
+    }
+    if (!pI2c->pending)
+    {
+        readBytes = I2CDEV_READ_COMBINED(pI2c, deviceAddress, p, size, &pI2c->pending);
+        I2C_QUERIED(pI2c, readBytes);
+    }
+    U4 length = MIN(MIN(pI2c->pending, size - readBytes), I2CDEV_MAX_XFER);
+    if (length)
+    {
+        // the register pointer is at the stream register now, continue reading
+        if (!pI2c->pfnTransfer(pI2c->pXferArg, (U2)deviceAddress, NULL, 0, (U1*)p + readBytes, length))
+        {
+            MESSAGE(MSG_ERR, "I2CDEV_READ read data: %s", strerror(errno));
+            pI2c->pending = 0;
+            return readBytes;
+        }
+        pI2c->reads++;
+        pI2c->readBytes += length;
+        readBytes       += length;
+        pI2c->pending   -= length;
+    }
+    return readBytes;
+}
+
+#endif //ENABLE_I2CDEV_SUPPORT
+
+
+#ifdef ENABLE_AARDVARK_SUPPORT
+//=====================================================================
+// AARDVARK SPI PORT IO
+//=====================================================================
+
+//! open SPI port
+/*!
+    \param name     name of the SPI port ("SPI0", "SPI1", ...)
+    \param pData    pointer to receive read buffer memory this function will allocate
+    \return handle to the device
+*/
+HANDLE SPI_OPEN(const CH* name, void **pData)
+{
+    int devIndex;
+    // find device index
+    int parsedFields = sscanf(name+3,"%d",&devIndex);
+    // assign defaults
+    if (parsedFields < 1)
+    {
+        devIndex = 0;
+    }
+    // get access to aardvark, the library is loaded on the first use
+    PLATFORM_LOCK();
+    Aardvark dev = aa_open(devIndex);
+
+    MESSAGE(MSG_DBG,"aardvark port %d SPI ",devIndex);
+
+    // bail on invalid dev handle
+    if ((int)dev < 0)
+    {
+        PLATFORM_UNLOCK();
+        MESSAGE(MSG_ERR, "%s", aa_status_string((int)dev));
+        *pData = 0;
+        return (HANDLE)0;
+    }
+
+    // enable SPI mode
+    aa_configure(dev,  AA_CONFIG_SPI_GPIO);
+    // configure
+    aa_spi_configure(dev, AA_SPI_POL_RISING_FALLING, AA_SPI_PHASE_SAMPLE_SETUP, AA_SPI_BITORDER_MSB);
+    aa_spi_master_ss_polarity(dev, AA_SPI_SS_ACTIVE_LOW);
+    PLATFORM_UNLOCK();
+
+    // get memory for read buffer
+    *pData = malloc(sizeof(SPI_READBUFFER_t));
+    if (!*pData)
+    {
+        MESSAGE(MSG_ERR,"Could not get memory for read buffer");
+        return (HANDLE)0;
+    }
+    SPI_RB_INIT((SPI_READBUFFER_pt)(*pData));
+    return (HANDLE)dev;
+}
+
+//! close SPI port
+/*!
+    \param h handle to device
+*/
+void SPI_CLOSE(HANDLE h)
+{
+    aa_close((Aardvark)h);
+}
+
+//! set baudrate of SPI device
+/*!
+    \param h    handle to device
+    \param br   baudrate to set
+    \return #TRUE
+*/
+BOOL SPI_BAUDRATE(HANDLE h,
+                  U4     br)
+{
+    br = aa_spi_bitrate((Aardvark)h,br/1000);
+    MESSAGE(MSG_DBG, "Baudrate %dkHz",br);
+    return TRUE;
+}
+
+//! write data to SPI port
+/*!
+    \param h        handle to device
+    \param pReadBuf pointer to device buffer structure
+    \param p        pointer to data to write
+    \param size     size of data to write
+    \return number of bytes written
+*/
+U4 SPI_WRITE(HANDLE h, SPI_READBUFFER_pt pReadBuf, const void* p, U4 size)
+{
+    // manage read buffer. as SPI always performs a read access and a write access at the
+    //  same time, we temporarily store the data read and return it on an SPI_READ call
+    U4 done = 0;
+    while (done < size)
+    {
+        U4 room;
+        U1* pRx = SPI_RB_TAIL(pReadBuf, &room);
+        U4 thisSize = MIN(size - done, room);
+        if (!thisSize)
+        {
+            break;
+        }
+
+        // perform write/read
+        int status = aa_spi_write((Aardvark)h,(u16)thisSize,(u08*)p + done,(u16)thisSize,(u08*)pRx);
+        if (status < 0)
+        {
+            MESSAGE(MSG_ERR, "SPI_WRITE write data:%s (%d)", aa_status_string((int)status),status);
+            break;
+        }
+        SPI_RB_PUT(pReadBuf, thisSize, TRUE);
+        done += thisSize;
+    }
+    return done;
+}
+
+//! dummy read transfer of the Aardvark adapter
+static BOOL SPI_XFER(HANDLE h, void* pArg, const U1* pTx, U1* pRx, U4 size)
+{
+    int status = aa_spi_write((Aardvark)h, (u16)size, (u08*)pTx, (u16)size, (u08*)pRx);
+    if (status < 0)
+    {
+        MESSAGE(MSG_ERR, "SPI_READ read data:%s (%d)", aa_status_string(status), status);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//! read data from SPI port
+/*!
+    \param h        handle to device
+    \param pReadBuf pointer to device buffer structure
+    \param p        pointer to user-allocated buffer of at least \a size size to receive data
+    \param size     number of bytes to read
+    \return number of bytes read
+*/
 U4 SPI_READ(HANDLE h, SPI_READBUFFER_pt pReadBuf, void* p, U4 size)
 {
-    if (pReadBuf->size)
-    { // we have data buffered from last write access
-        size = MIN(pReadBuf->size, size);
-        memcpy(p, pReadBuf->pBuffer, size);
-        pReadBuf->pBuffer += size;
-        pReadBuf->size -= size;
-        memmove(pReadBuf->buffer, pReadBuf->pBuffer, pReadBuf->size);
-        pReadBuf->pBuffer = pReadBuf->buffer;
+    return SPI_RB_READ(pReadBuf, h, NULL, SPI_XFER, 0xFFFF, (U1*)p, size);
+}
+
+#endif // ENABLE_AARDVARK_SUPPORT
+
+
+//=====================================================================
+// LINUX SPIDEV PORT IO
+//=====================================================================
+
+#ifdef ENABLE_SPIDEV_SUPPORT
+
+//! spidev port data (stored in SER_HANDLE_t::pData)
+typedef struct SPIDEV_DATA_s
+{
+    SPI_READBUFFER_t readBuf;                //!< data clocked in during writes
+    U4               xferSize;               //!< maximum size of one transfer
+    U4               speed;                  //!< SPI clock in Hz
+    int              fd;                     //!< file descriptor of the device, -1 if the transfers are replaced
+    SPIDEV_XFER_FN   pfnTransfer;            //!< transfer function
+    void*            pXferArg;               //!< argument of pfnTransfer
+} SPIDEV_DATA_t;
+typedef SPIDEV_DATA_t* SPIDEV_DATA_pt;       //!< pointer to SPIDEV_DATA_t type
+
+static SPIDEV_XFER_FN s_pfnSpiDevTransfer = NULL; //!< transfer replacing the device of new spidev ports, see SPIDEV_SET_TRANSFER()
+static void*          s_pSpiDevXferArg    = NULL; //!< argument of s_pfnSpiDevTransfer
+
+void SPIDEV_SET_TRANSFER(SPIDEV_XFER_FN pfn, void* pArg)
+{
+    PLATFORM_LOCK();
+    s_pfnSpiDevTransfer = pfn;
+    s_pSpiDevXferArg    = pArg;
+    PLATFORM_UNLOCK();
+}
+
+//! perform a full-duplex transfer with SPI_IOC_MESSAGE
+static BOOL SPIDEV_TRANSFER(void* pArg, U4 speed, const U1* pTx, U1* pRx, U4 size)
+{
+    SPIDEV_DATA_pt pDev = (SPIDEV_DATA_pt)pArg;
+    struct spi_ioc_transfer tr;
+    memset(&tr, 0, sizeof(tr));
+    tr.tx_buf        = (unsigned long)pTx;
+    tr.rx_buf        = (unsigned long)pRx;
+    tr.len           = size;
+    tr.speed_hz      = speed;
+    tr.bits_per_word = 8;
+    if (ioctl(pDev->fd, SPI_IOC_MESSAGE(1), &tr) < 0)
+    {
+        MESSAGE(MSG_ERR, "SPIDEV transfer: %s", strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//! open SPI port through the Linux spidev interface
+/*!
+    \param name     name of the SPI device ("/dev/spidev0.0", "/dev/spidev0.0:8192", ...),
+                    the optional number after the colon defines the maximum transfer size
+    \param pData    pointer to receive the port data this function will allocate
+    \return handle to the device
+*/
+HANDLE SPIDEV_OPEN(const CH* name, void **pData)
+{
+    CH path[64];
+    U4 xferSize = SPIDEV_XFER_DEFAULT;
+    strncpy(path, name, sizeof(path)-1);
+    path[sizeof(path)-1] = 0;
+    CH *pSep = strchr(path, ':');
+    if (pSep)
+    {
+        *pSep = 0;
+        xferSize = (U4)atoi(pSep+1);
+        if (!xferSize)
+        {
+            xferSize = SPIDEV_XFER_DEFAULT;
+        }
     }
-    else
+
+    // get memory for read buffer
+    *pData = malloc(sizeof(SPIDEV_DATA_t));
+    if (!*pData)
     {
-        // there's no buffered data -> perform a read with dummy write
-        // setup a dummy FF buffer to perform dummy write
-        u08 tmpBuf[COMPSZ];
-        memset(tmpBuf, 0xFF, sizeof(tmpBuf));
-        size = MIN(size, sizeof(tmpBuf));
-        U2 size1 = (U2)MIN(size, COMPSZ);
+        MESSAGE(MSG_ERR,"Could not get memory for read buffer");
+        return (HANDLE)0;
+    }
+    memset(*pData,0,sizeof(SPIDEV_DATA_t));
+    SPIDEV_DATA_pt pDev = (SPIDEV_DATA_pt)(*pData);
+    SPI_RB_INIT(&pDev->readBuf);
+    pDev->xferSize        = xferSize;
+    pDev->speed           = BaudrateDefaultSpiDev;
+    pDev->fd              = -1;
+    PLATFORM_LOCK();
+    pDev->pfnTransfer     = s_pfnSpiDevTransfer;
+    pDev->pXferArg        = s_pSpiDevXferArg;
+    PLATFORM_UNLOCK();
+    if (pDev->pfnTransfer)
+    {
+        MESSAGE(MSG_DBG,"spidev %s replaced, transfer size %u",path,xferSize);
+        return (HANDLE)-1;
+    }
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        MESSAGE(MSG_ERR, "Could not open %s: %s", path, strerror(errno));
+        free(*pData);
+        *pData = 0;
+        return (HANDLE)0;
+    }
+
+    // CPOL=0, CPHA=0, MSB first, 8 bit words
+    U1 mode = SPI_MODE_0;
+    U1 bits = 8;
+    if ((ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0) ||
+        (ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0))
+    {
+        MESSAGE(MSG_ERR, "Could not configure %s: %s", path, strerror(errno));
+        close(fd);
+        free(*pData);
+        *pData = 0;
+        return (HANDLE)0;
+    }
+    pDev->fd              = fd;
+    pDev->pfnTransfer     = SPIDEV_TRANSFER;
+    pDev->pXferArg        = pDev;
+
+    MESSAGE(MSG_DBG,"spidev %s, transfer size %u",path,xferSize);
+    return (HANDLE)fd;
+}
+
+//! close SPI port
+/*!
+    \param h handle to device
+    \param pDev pointer to device data structure
+*/
+void SPIDEV_CLOSE(HANDLE h, SPIDEV_DATA_pt pDev)
+{
+    if (pDev->fd >= 0)
+    {
+        close(pDev->fd);
+    }
+}
+
+//! set clock of SPI device
+/*!
+    \param h    handle to device
+    \param pDev pointer to device data structure
+    \param br   SPI clock to set [Hz]
+    \return #TRUE
+*/
+BOOL SPIDEV_BAUDRATE(HANDLE h, SPIDEV_DATA_pt pDev, U4 br)
+{
+    U4 speed = br;
+    if ((pDev->fd >= 0) && (ioctl(pDev->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0))
+    {
+        MESSAGE(MSG_ERR, "SPIDEV set speed: %s", strerror(errno));
+        return FALSE;
+    }
+    pDev->speed = br;
+    MESSAGE(MSG_DBG, "Baudrate %dkHz",br/1000);
+    return TRUE;
+}
+
+//! write data to SPI port
+/*!
+    The data is clocked out in transfers of at most SPIDEV_DATA_t::xferSize
+    bytes. The data clocked in at the same time is kept in the read buffer and
+    returned on subsequent SPIDEV_READ calls; transfers that clocked in idle
+    bytes (0xFF) only are dropped. While the read buffer is full, the data
+    clocked in is dropped as well.
 
-        // first read some bytes and check if they are all FF
-        int written = aa_spi_write((Aardvark)h, size1, tmpBuf, size1, (u08*)p);
-        if (written == AA_SPI_WRITE_ERROR)
+    \param h        handle to device
+    \param pDev     pointer to device data structure
+    \param p        pointer to data to write
+    \param size     size of data to write
+    \return number of bytes written
+*/
+U4 SPIDEV_WRITE(HANDLE h, SPIDEV_DATA_pt pDev, const void* p, U4 size)
+{
+    SPI_READBUFFER_pt pReadBuf = &pDev->readBuf;
+    U1 overflow[SPI_READ_MAX];
+    U4 done = 0;
+    while (done < size)
+    {
+        U4 room;
+        U1* pRx = SPI_RB_TAIL(pReadBuf, &room);
+        if (!room)
         {
-            MESSAGE(MSG_ERR, "SPI_READ read data1:%s (%d)", aa_status_string((int)written), written);
-            return 0;
+            // the data received wasn't read yet, drop what comes in rather than stall the write
+            pRx  = overflow;
+            room = sizeof(overflow);
         }
-        if (memcmp(p, tmpBuf, size1) != 0)
+        U4 thisSize = MIN(MIN(size - done, pDev->xferSize), room);
+        if (!pDev->pfnTransfer(pDev->pXferArg, pDev->speed, (const U1*)p + done, pRx, thisSize))
         {
-            if (size > size1)
-            {
-                // some bytes are not FF, so we have data. the UPD messages are short,
-                // so perform only short read accesses. the longer messages are normally fetched
-                // as a side effect of the longer write access when writing packets
-                p = (void*)((U1*)p + size1);
-                int written2 = aa_spi_write((Aardvark)h, (u16)size - size1, tmpBuf, (u16)size - size1, (u08*)p);
-                if (written2 == AA_SPI_WRITE_ERROR)
-                {
-                    MESSAGE(MSG_ERR, "SPI_READ read data2:%s (%d)", aa_status_string((int)written2), written2);
-                    return size1;
-                }
-            }
+            break;
         }
-        else
+        U4 i = 0;
+        while ((i < thisSize) && (pRx[i] == 0xFF))
         {
-            // we received only FFs -> discard
-            return 0;
+            i++;
+        }
+        if ((i < thisSize) && (pRx == overflow))
+        {
+            MESSAGE(MSG_WARN, "SPIDEV_WRITE: read buffer full, %u bytes received dropped", thisSize - i);
         }
+        // keep the data received
+        SPI_RB_PUT(pReadBuf, thisSize, (i < thisSize) && (pRx != overflow));
+        done += thisSize;
     }
-    return size;
+    return done;
+}
+
+//! dummy read transfer of a spidev port
+static BOOL SPIDEV_XFER(HANDLE h, void* pArg, const U1* pTx, U1* pRx, U4 size)
+{
+    SPIDEV_DATA_pt pDev = (SPIDEV_DATA_pt)pArg;
+    return pDev->pfnTransfer(pDev->pXferArg, pDev->speed, pTx, pRx, size);
+}
+
+//! read data from SPI port
+/*!
+    \param h        handle to device
+    \param pDev     pointer to device data structure
+    \param p        pointer to user-allocated buffer of at least \a size size to receive data
+    \param size     number of bytes to read
+    \return number of bytes read
+*/
+U4 SPIDEV_READ(HANDLE h, SPIDEV_DATA_pt pDev, void* p, U4 size)
+{
+    return SPI_RB_READ(&pDev->readBuf, h, pDev, SPIDEV_XFER, pDev->xferSize, (U1*)p, size);
+}
+
+#endif //ENABLE_SPIDEV_SUPPORT
+
+
+//=====================================================================
+// NET PORT IO
+//=====================================================================
+
+#ifdef ENABLE_NET_SUPPORT
+
+static CH s_netHttpPort[32] = NET_HTTP_PORT; //!< HTTP port of the terminal servers, see NET_SET_HTTP_PORT()
+
+void NET_SET_HTTP_PORT(const CH* port)
+{
+    PLATFORM_LOCK();
+    strncpy(s_netHttpPort, port ? port : NET_HTTP_PORT, sizeof(s_netHttpPort)-1);
+    s_netHttpPort[sizeof(s_netHttpPort)-1] = 0;
+    PLATFORM_UNLOCK();
+}
+
+//! split a port name into host and service
+/*!
+    Accepts host:port and [address]:port for IPv6 addresses.
+
+    \param name      port name
+    \param host      buffer receiving the host name
+    \param hostSize  size of \a host
+    \param port      buffer receiving the port
+    \param portSize  size of \a port
+    \return #TRUE on success
+*/
+static BOOL NET_SPLIT(const CH* name, CH* host, size_t hostSize, CH* port, size_t portSize)
+{
+    const CH* pHost = name;
+    const CH* pSep  = strrchr(name, ':');
+    size_t hostLen;
+    if (name[0] == '[')
+    {
+        pHost = name + 1;
+        pSep  = strchr(name, ']');
+        if (!pSep || (pSep[1] != ':'))
+            return FALSE;
+        hostLen = pSep - pHost;
+        pSep++;
+    }
+    else
+    {
+        if (!pSep)
+            return FALSE;
+        hostLen = pSep - pHost;
+    }
+    if ((hostLen == 0) || (hostLen >= hostSize) || (strlen(pSep + 1) >= portSize))
+        return FALSE;
+    memcpy(host, pHost, hostLen);
+    host[hostLen] = '\0';
+    strcpy(port, pSep + 1);
+    return TRUE;
+}
+
+//! switch a socket to non-blocking mode or back
+/*!
+    \param sock         socket
+    \param nonBlocking  #TRUE for non-blocking mode
+*/
+static void NET_NONBLOCKING(SOCKET sock, BOOL nonBlocking)
+{
+#ifdef WIN32
+    u_long mode = nonBlocking ? 1 : 0;
+    ioctlsocket(sock, FIONBIO, &mode);
+#else
+    int flags = fcntl(sock, F_GETFL);
+    fcntl(sock, F_SETFL, nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+#endif
+}
+
+//! wait until a socket is ready
+/*!
+    \param sock     socket
+    \param write    wait for writing if #TRUE, for reading otherwise
+    \param timeout  time to wait [ms]
+    \return #TRUE if the socket is ready
+*/
+static BOOL NET_WAIT(SOCKET sock, BOOL write, U4 timeout)
+{
+    FDSET fds;
+    FD_ZERO(&fds);
+    FD_SET(sock,&fds);
+    TIMEVAL tv = { timeout / 1000, (timeout % 1000) * 1000 };
+    return select(sock+1, write ? NULL : &fds, write ? &fds : NULL, NULL, &tv) > 0;
+}
+
+//! connect a blocking TCP socket
+/*!
+    Tries all addresses \a host resolves to, IPv4 and IPv6, and gives up
+    on each one after #NET_CONNECT_TIMEOUT.
+
+    \param host     host name or address
+    \param port     port number or service name
+    \return connected socket, #INVALID_SOCKET on failure
+*/
+static SOCKET NET_CONNECT(const CH* host, const CH* port)
+{
+    struct addrinfo hints;
+    struct addrinfo* pInfo = NULL;
+    struct addrinfo* pAddr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &pInfo);
+    if (err)
+    {
+        MESSAGE(MSG_ERR, "Cannot resolve hostname %s: %s", host, gai_strerror(err));
+        return INVALID_SOCKET;
+    }
+
+    SOCKET sock = INVALID_SOCKET;
+    for (pAddr = pInfo; pAddr; pAddr = pAddr->ai_next)
+    {
+        sock = socket(pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol);
+        if (sock == INVALID_SOCKET)
+            continue;
+
+        // the socket buffers have to hold the writes in flight, the
+        // receive buffer size has to be set before connecting
+        int bufSize = NET_SOCKET_BUFFER;
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&bufSize, sizeof(bufSize));
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&bufSize, sizeof(bufSize));
+
+        CH addrStr[64] = "?";
+        getnameinfo(pAddr->ai_addr, (int)pAddr->ai_addrlen, addrStr, sizeof(addrStr), NULL, 0, NI_NUMERICHOST);
+        MESSAGE(MSG_DBG, "opening port %s on host %s (%s)", port, host, addrStr);
+
+        // connect without blocking to apply the timeout
+        NET_NONBLOCKING(sock, TRUE);
+        BOOL connected = (connect(sock, pAddr->ai_addr, (int)pAddr->ai_addrlen) != SOCKET_ERROR);
+        if (!connected && NET_WOULDBLOCK() && NET_WAIT(sock, TRUE, NET_CONNECT_TIMEOUT))
+        {
+            int soErr = 0;
+            socklen_t len = sizeof(soErr);
+            connected = (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&soErr, &len) == 0) && (soErr == 0);
+        }
+        if (connected)
+        {
+            NET_NONBLOCKING(sock, FALSE);
+            break;
+        }
+        MESSAGE(MSG_DBG, "connection to %s failed", addrStr);
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(pInfo);
+    if (sock == INVALID_SOCKET)
+    {
+        MESSAGE(MSG_ERR,"connection to socket failed");
+    }
+    return sock;
+}
+
+//! Open a network port
+/*!
+    The socket is non-blocking, writes are sent without delay (no Nagle).
+
+    \param name        name for port, format hostname:port or [address]:port
+    \return handle to port
+*/
+HANDLE NET_OPEN(const CH* name)
+{
+    CH host[256];
+    CH port[32];
+    if (!NET_SPLIT(name, host, sizeof(host), port, sizeof(port)))
+    {
+        MESSAGE(MSG_ERR, "invalid network port %s", name);
+        return (HANDLE)0;
+    }
+#ifdef WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2,2),&wsaData))
+    {
+        MESSAGE(MSG_ERR,"WinSock not available");
+        return 0;
+    }
+    else
+    {
+        if (LOBYTE(wsaData.wVersion) != 2 ||
+            HIBYTE(wsaData.wVersion) != 2 )
+        {
+            MESSAGE(MSG_ERR,"no WinSock 2.2");
+            WSACleanup();
+            return 0;
+        }
+    }
+#endif
+
+    SOCKET sock = NET_CONNECT(host, port);
+    if (sock == INVALID_SOCKET)
+    {
+#ifdef WIN32
+        WSACleanup();
+#endif
+        return (HANDLE)0;
+    }
+
+    // every frame is a request the receiver is waiting for, don't let
+    // Nagle hold it back until the previous one is acknowledged
+    int noDelay = 1;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay)) == SOCKET_ERROR)
+    {
+        MESSAGE(MSG_WARN, "could not disable Nagle: %d", LAST_NET_ERR());
+    }
+    NET_NONBLOCKING(sock, TRUE);
+
+    return (HANDLE)sock;
+}
+
+//! Write data to net
+/*!
+    \param h    Handle to net socket
+    \param p    Pointer to user-allocated buffer of at least \a size size
+    \param size Number of bytes to write to device
+    \return number of bytes which were written to device
+*/
+U4 NET_WRITE(HANDLE h, const void* p, U4 size)
+{
+    SOCKET sock = (SOCKET)h;
+    U4 written = 0;
+    while (written < size)
+    {
+        int ret = send(sock,(const char*)p + written,size - written,0);
+        if (ret != SOCKET_ERROR)
+        {
+            written += (U4)ret;
+        }
+        else if (!NET_WOULDBLOCK() || !NET_WAIT(sock, TRUE, NET_WRITE_TIMEOUT))
+        {
+            MESSAGE(MSG_ERR,"write to socket failed: %d",LAST_NET_ERR());
+            break;
+        }
+    }
+    return written;
+}
+
+//! Read data from net
+/*!
+    \param h    Handle to net socket
+    \param p    Pointer to user-allocated buffer of at least \a size size
+    \param size Number of bytes to read from device
+    \return number of bytes which were read from device
+*/
+U4 NET_READ(HANDLE h, void* p, U4 size)
+{
+    SOCKET sock = (SOCKET)h;
+    // the socket is non-blocking
+    int ret = recv(sock,(char *)p,size,0);
+    if (ret == SOCKET_ERROR)
+    {
+        if (!NET_WOULDBLOCK())
+        {
+            MESSAGE(MSG_ERR,"read from socket failed: %d",LAST_NET_ERR());
+        }
+        return 0;
+    }
+    return (U4)ret;
+}
+
+//! close net socket
+/*!
+    \param h    Handle to device
+*/
+void NET_CLOSE(HANDLE h)
+{
+    SOCKET sock = (SOCKET)h;
+    closesocket(sock);
+#ifdef WIN32
+    WSACleanup();
+#endif
+}
+
+//! Set baudrate of Ethernet device
+/*!
+    \param h    handle to device
+    \param br   baudrate to set
+    \return #TRUE
+*/
+BOOL NET_BAUDRATE(SER_HANDLE_pt h,
+                  U4     br)
+{
+    char serverName[256];
+    char portStr[32];
+    if (!NET_SPLIT(h->pName, serverName, sizeof(serverName), portStr, sizeof(portStr)))
+    {
+        MESSAGE(MSG_ERR,"failed extracting host name: %s",h->pName);
+        return FALSE;
+    }
+    int portNum = (atoi(portStr) % 100)-1; // only use the two least significant digits
+    MESSAGE(MSG_DBG,"setting port %d on %s to %d baud",portNum,serverName,br);
+    char requestStr[128];
+
+    // prepare request URL to be sent to ttycat
+    sprintf(requestStr,"/goform/setPortConfig?portNum=%d&baudRate=%u&portEnable=1&listenEnable=1",portNum,br);
+    MESSAGE(MSG_DBG,"req: %s",requestStr);
+
+    // prepare and connect socket to HTTP port of ttycat
+    char httpPort[sizeof(s_netHttpPort)];
+    PLATFORM_LOCK();
+    strcpy(httpPort, s_netHttpPort);
+    PLATFORM_UNLOCK();
+    SOCKET sock = NET_CONNECT(serverName, httpPort);
+    if (sock == INVALID_SOCKET)
+    {
+        return FALSE;
+    }
+
+    // no construct HTTP request header
+    char httpRequest[512];
+    sprintf(httpRequest,
+             "GET %s HTTP/1.1\r\n"
+             "User-Agent: FWUpdateG5/linux\r\n"
+             "Host: %s\r\n"
+             "Connection: Keep-Alive\r\n"
+             "Cache-Control: no-cache\r\n"
+             "\r\n",requestStr,serverName);
+    //MESSAGE(MSG_DBG,"request: %s",httpRequest);
+
+    // send request
+    int ret = send(sock,(const char*)httpRequest,strlen(httpRequest),0);
+    if (ret == SOCKET_ERROR)
+    {
+        MESSAGE(MSG_ERR,"sending request failed");
+        closesocket(sock);
+        return FALSE;
+    }
+
+    // get response
+    char httpResponse[512];
+    ret = recv(sock,httpResponse,sizeof(httpResponse),0);
+    if (ret == SOCKET_ERROR)
+    {
+        MESSAGE(MSG_ERR,"receiving response failed");
+        closesocket(sock);
+        return FALSE;
+    }
+    int status;
+    if (sscanf(httpResponse,"HTTP/1.1 %d ",&status))
+    {
+        MESSAGE(MSG_DBG,"status: %d",status);
+        if (status != 200 && status != 302) // comtrol devicemaster sends redirection
+        {
+            MESSAGE(MSG_ERR,"response returned failing status");
+            closesocket(sock);
+            return FALSE;
+        }
+    }
+    //MESSAGE(MSG_DBG,"response: %s",httpResponse);
+    closesocket(sock);
+    return TRUE;
+}
+
+#endif //ENABLE_NET_SUPPORT
+
+
+
+//=====================================================================
+// MUX PORT IO
+//=====================================================================
+
+#ifdef ENABLE_MUX_SUPPORT
+
+//! connect to the multiplexer and send a request
+/*!
+    \param path     path of the multiplexer socket
+    \param request  control line to send
+    \return connected socket, -1 on failure
+*/
+static int MUX_CONNECT(const CH* path, const CH* request)
+{
+    struct sockaddr_un sa;
+    if (strlen(path) >= sizeof(sa.sun_path))
+    {
+        MESSAGE(MSG_ERR, "socket path too long: %s", path);
+        return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        MESSAGE(MSG_ERR, "unable to create socket");
+        return -1;
+    }
+    if (connect(sock, (const SOCKADDR*)&sa, sizeof(sa)) < 0)
+    {
+        MESSAGE(MSG_ERR, "connection to %s failed: %s", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    if (send(sock, request, strlen(request), 0) != (ssize_t)strlen(request))
+    {
+        MESSAGE(MSG_ERR, "sending request failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+//! wait for the reply of the multiplexer
+/*!
+    Receiver data passed on before the reply is discarded.
+
+    \param sock     socket connected to the multiplexer
+    \param timeout  time to wait [ms]
+    \return #TRUE if the request was accepted
+*/
+static BOOL MUX_REPLY(int sock, U4 timeout)
+{
+    CH line[32];
+    U4 len = 0;
+    U4 start = TIME_GET();
+    while ((TIME_GET() - start) < timeout)
+    {
+        FDSET fds;
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        TIMEVAL tv = { 0, 10000 };
+        if (select(sock+1, &fds, NULL, NULL, &tv) <= 0)
+            continue;
+        CH c;
+        if (recv(sock, &c, 1, 0) != 1)
+            break;
+        if (c != '\n')
+        {
+            if (len < sizeof(line) - 1)
+                line[len++] = c;
+            continue;
+        }
+        line[len] = '\0';
+        if (strcmp(line, MUX_REPLY_OK) == 0)
+            return TRUE;
+        if (strncmp(line, MUX_CMD_PREFIX, strlen(MUX_CMD_PREFIX)) == 0)
+        {
+            MESSAGE(MSG_ERR, "multiplexer refused request: %s", line + strlen(MUX_CMD_PREFIX));
+            return FALSE;
+        }
+        len = 0;
+    }
+    MESSAGE(MSG_ERR, "no reply from multiplexer");
+    return FALSE;
+}
+
+//! Open a port shared by the multiplexer
+/*!
+    Takes over the port for the update, the multiplexer stops passing
+    data of other clients to the receiver.
+
+    \param name     name for port, format unix:path
+    \return handle to port
+*/
+HANDLE MUX_OPEN(const CH* name)
+{
+    int sock = MUX_CONNECT(name + strlen(MUX_PORT_PREFIX), MUX_CMD_UPDATE);
+    if (sock < 0)
+        return (HANDLE)0;
+    if (!MUX_REPLY(sock, 2000))
+    {
+        close(sock);
+        return (HANDLE)0;
+    }
+    NET_NONBLOCKING(sock, TRUE);
+    return (HANDLE)sock;
+}
+
+//! Set baudrate of a port shared by the multiplexer
+/*!
+    The request is sent on a separate connection, such that it can not
+    be mixed up with data for the receiver.
+
+    \param h    handle to device
+    \param br   baudrate to set
+    \return #TRUE if success, #FALSE else
+*/
+BOOL MUX_BAUDRATE(SER_HANDLE_pt h, U4 br)
+{
+    CH request[32];
+    sprintf(request, MUX_CMD_BAUD "%u\n", br);
+    int sock = MUX_CONNECT(h->pName + strlen(MUX_PORT_PREFIX), request);
+    if (sock < 0)
+        return FALSE;
+    BOOL ok = MUX_REPLY(sock, 2000);
+    close(sock);
+    return ok;
+}
+
+#endif //ENABLE_MUX_SUPPORT
+
+
+
+
+//=====================================================================
+// TRANSPORT BACKENDS
+//=====================================================================
+
+#ifndef WIN32
+//! write several buffer segments to a file descriptor
+/*!
+    \param fd       file descriptor
+    \param pIov     segments to write
+    \param count    number of segments
+    \return number of bytes written
+*/
+static U4 FD_WRITEV(int fd, const SER_IOVEC_t* pIov, U4 count)
+{
+    struct iovec iov[16];
+    U4 total = 0;
+    while (count)
+    {
+        U4 n = MIN(count, sizeof(iov)/sizeof(iov[0]));
+        U4 want = 0;
+        U4 i;
+        for (i = 0; i < n; i++)
+        {
+            iov[i].iov_base = (void*)pIov[i].p;
+            iov[i].iov_len  = pIov[i].size;
+            want += pIov[i].size;
+        }
+        ssize_t dw = writev(fd, iov, (int)n);
+        if (dw > 0)
+        {
+            total += (U4)dw;
+        }
+        if ((dw < 0) || ((U4)dw != want))
+        {
+            MESSAGE(MSG_ERR, "can not write all data (req: %u, actual: %li)", want, (long)dw);
+            break;
+        }
+        pIov  += n;
+        count -= n;
+    }
+    return total;
+}
+#endif //ifndef WIN32
+
+// serial COM port
+static BOOL COM_SER_MATCH(const CH* name)
+{
+    // any name not taken by the other transports is a COM port
+    ((void)name);
+    return TRUE;
+}
+
+static BOOL COM_SER_OPEN(SER_HANDLE_pt h, const CH* name)
+{
+    h->handle = COM_OPEN(name);
+    return h->handle != (HANDLE)0;
+}
+
+static void COM_SER_CLOSE(SER_HANDLE_pt h)
+{
+    // not reopened after a failed re-enumeration
+    if (h->handle != (HANDLE)0)
+    {
+        COM_CLOSE(h->handle);
+    }
+}
+
+static U4 COM_SER_WRITE(SER_HANDLE_pt h, const void* p, U4 size)
+{
+    return COM_WRITE(h->handle,p,size);
+}
+
+static U4 COM_SER_READ(SER_HANDLE_pt h, void* p, U4 size)
+{
+    return COM_READ(h->handle,p,size);
+}
+
+static BOOL COM_SER_BAUDRATE(SER_HANDLE_pt h, U4 br)
+{
+    return COM_BAUDRATE(h->handle,br);
+}
+
+static SER_REENUM_t COM_SER_REENUM(SER_HANDLE_pt h, BOOL IsUsb, U4 attempt, U4* pWait)
+{
+    *pWait = 1000;
+    if (attempt == 0)
+    {
+        // the port vanishes while the receiver re-enumerates
+        COM_CLOSE(h->handle);
+        h->handle = (HANDLE)0;
+        return SER_REENUM_PENDING;
+    }
+    h->handle = COM_OPEN(h->pName);
+    if (h->handle)
+    {
+        return COM_BAUDRATE(h->handle, h->baudrate) ? SER_REENUM_DONE : SER_REENUM_FAILED;
+    }
+    return (attempt <= 10) ? SER_REENUM_PENDING : SER_REENUM_FAILED;
+}
+
+static void COM_SER_CLEAR(SER_HANDLE_pt h)
+{
+    COM_CLEAR(h->handle);
+}
+
+static void COM_SER_FLUSH(SER_HANDLE_pt h)
+{
+    COM_FLUSH(h->handle);
+}
+
+#ifndef WIN32
+static U4 COM_SER_WRITEV(SER_HANDLE_pt h, const SER_IOVEC_t* pIov, U4 count)
+{
+    return FD_WRITEV((int)h->handle, pIov, count);
+}
+
+static int COM_SER_FD(SER_HANDLE_pt h)
+{
+    return (int)h->handle;
+}
+#endif //ifndef WIN32
+
+static SER_OPS_t s_serOpsCom =
+{
+    "COM", COM,
+#ifdef WIN32
+    SER_CAP_FULL_DUPLEX, 0, FALSE,
+#else
+    SER_CAP_FULL_DUPLEX | SER_CAP_WAITABLE_FD | SER_CAP_SCATTER_WRITE, 0, FALSE,
+#endif
+    COM_SER_MATCH, COM_SER_OPEN, COM_SER_CLOSE, COM_SER_WRITE, COM_SER_READ, COM_SER_BAUDRATE,
+#ifdef WIN32
+    NULL,
+#else
+    COM_SER_WRITEV,
+#endif
+    COM_SER_REENUM, NULL, COM_SER_CLEAR, COM_SER_FLUSH,
+#ifdef WIN32
+    NULL,
+#else
+    COM_SER_FD,
+#endif
+    NULL,
+    NULL
+};
+
+// stdin/stdout
+#ifndef WIN32
+static int s_stdinFlags = -1; //!< flags of stdin before STDIO_SER_OPEN()
+#endif //ifndef WIN32
+
+static BOOL STDIO_SER_MATCH(const CH* name)
+{
+    return (strncmp(name, "STDIO", 5) == 0 || strncmp(name, "stdio", 5) == 0);
+}
+
+static BOOL STDIO_SER_OPEN(SER_HANDLE_pt h, const CH* name)
+{
+    h->handle = (HANDLE) -1; // Indicates stdin/stdout. Never used -> unique identifier
+#ifdef WIN32
+    // Make sure windows does not replace "\n" to "\r\n"
+    if(_setmode(fileno(stdout), O_BINARY) == -1)
+    {
+        // In case of error abort here
+        h->handle = (HANDLE)0;
+    }
+#else
+    // reads must not block, the parent process may send nothing for a while
+    s_stdinFlags = fcntl(STDIN_FILENO, F_GETFL);
+    if ((s_stdinFlags == -1) ||
+        (fcntl(STDIN_FILENO, F_SETFL, s_stdinFlags | O_NONBLOCK) == -1))
+    {
+        MESSAGE(MSG_ERR, "Could not configure stdin: %s", strerror(errno));
+        h->handle = (HANDLE)0;
+    }
+#endif
+    return h->handle != (HANDLE)0;
+}
+
+static void STDIO_SER_CLOSE(SER_HANDLE_pt h)
+{
+#ifndef WIN32
+    // the pipe is shared with the parent, restore its flags
+    if (s_stdinFlags != -1)
+    {
+        fcntl(STDIN_FILENO, F_SETFL, s_stdinFlags);
+        s_stdinFlags = -1;
+    }
+#endif //ifndef WIN32
+}
+
+static U4 STDIO_SER_WRITE(SER_HANDLE_pt h, const void* p, U4 size)
+{
+    return STDOUT_WRITE(p,size);
+}
+
+static U4 STDIO_SER_READ(SER_HANDLE_pt h, void* p, U4 size)
+{
+    return STDIN_READ(p,size);
+}
+
+static BOOL STDIO_SER_BAUDRATE(SER_HANDLE_pt h, U4 br)
+{
+    STDIN_SETBAUD(br);
+    return TRUE; // There is no baudrate here
+}
+
+static SER_REENUM_t STDIO_SER_REENUM(SER_HANDLE_pt h, BOOL IsUsb, U4 attempt, U4* pWait)
+{
+    if (attempt == 0)
+    {
+        MESSAGE_PLAIN("<AC>Reenum %i<\\AC>", IsUsb);
+        *pWait = 1000;   // Pause to allow host to perform operation
+        return SER_REENUM_PENDING;
+    }
+    *pWait = 0;
+    return SER_REENUM_DONE;
+}
+
+#ifndef WIN32
+static int STDIO_SER_FD(SER_HANDLE_pt h)
+{
+    return STDIN_FILENO;
+}
+#endif //ifndef WIN32
+
+static SER_OPS_t s_serOpsStdio =
+{
+#ifdef WIN32
+    "STDIO", STDINOUT, SER_CAP_FULL_DUPLEX, 0, TRUE,
+#else
+    "STDIO", STDINOUT, SER_CAP_FULL_DUPLEX | SER_CAP_WAITABLE_FD, 0, TRUE,
+#endif
+    STDIO_SER_MATCH, STDIO_SER_OPEN, STDIO_SER_CLOSE, STDIO_SER_WRITE, STDIO_SER_READ, STDIO_SER_BAUDRATE,
+    NULL, STDIO_SER_REENUM, NULL, NULL, NULL,
+#ifdef WIN32
+    NULL,
+#else
+    STDIO_SER_FD,
+#endif
+    NULL,
+    NULL
+};
+
+#ifdef ENABLE_DIOLAN_SUPPORT
+// Diolan I2C
+static BOOL U2C_SER_MATCH(const CH* name)
+{
+    return (strncmp(name, "U2C",3) == 0 || strncmp(name, "u2c",3) == 0);
+}
+
+static BOOL U2C_SER_OPEN(SER_HANDLE_pt h, const CH* name)
+{
+    int addr = 0;
+    h->handle  = U2C_OPEN(name,&addr);
+    h->devAddr = addr;
+    return h->handle != (HANDLE)0;
+}
+
+static void U2C_SER_CLOSE(SER_HANDLE_pt h)
+{
+    U2C_CLOSE(h->handle);
+}
+
+static U4 U2C_SER_WRITE(SER_HANDLE_pt h, const void* p, U4 size)
+{
+    return U2C_WRITE(h->handle,h->devAddr,p,size);
+}
+
+static U4 U2C_SER_READ(SER_HANDLE_pt h, void* p, U4 size)
+{
+    return U2C_READ(h->handle,h->devAddr,p,size);
+}
+
+static BOOL U2C_SER_BAUDRATE(SER_HANDLE_pt h, U4 br)
+{
+    return U2C_BAUDRATE(h->handle,br);
+}
+
+static U4 U2C_SER_PENDING(SER_HANDLE_pt h)
+{
+    return U2C_PENDING(h->handle, h->devAddr);
+}
+
+static SER_OPS_t s_serOpsU2c =
+{
+    "U2C", U2C, SER_CAP_POLLED, 0, FALSE,
+    U2C_SER_MATCH, U2C_SER_OPEN, U2C_SER_CLOSE, U2C_SER_WRITE, U2C_SER_READ, U2C_SER_BAUDRATE,
+    NULL, NULL, U2C_SER_PENDING, NULL, NULL, NULL, NULL,
+    NULL
+};
+
+// Diolan SPI
+static BOOL SPU_SER_MATCH(const CH* name)
+{
+    return (strncmp(name, "SPU",3) == 0 || strncmp(name, "spu",3) == 0);
+}
+
+static BOOL SPU_SER_OPEN(SER_HANDLE_pt h, const CH* name)
+{
+    h->handle = SPU_OPEN(name,&h->pData);
+    return h->handle != (HANDLE)0;
+}
+
+static void SPU_SER_CLOSE(SER_HANDLE_pt h)
+{
+    SPI_RB_STATS((SPI_READBUFFER_pt)h->pData);
+    SPU_CLOSE(h->handle);
+}
+
+static U4 SPU_SER_WRITE(SER_HANDLE_pt h, const void* p, U4 size)
+{
+    return SPU_WRITE(h->handle,(SPI_READBUFFER_pt)h->pData,p,size);
+}
+
+static U4 SPU_SER_READ(SER_HANDLE_pt h, void* p, U4 size)
+{
+    return SPU_READ(h->handle,(SPI_READBUFFER_pt)h->pData,p,size);
+}
+
+static void SPU_SER_WAIT(SER_HANDLE_pt h, U4 timeout)
+{
+    SPI_RB_WAIT((SPI_READBUFFER_pt)h->pData, timeout);
+}
+
+static BOOL SPU_SER_BAUDRATE(SER_HANDLE_pt h, U4 br)
+{
+    return SPU_BAUDRATE(h->handle,br);
+}
+
+static SER_OPS_t s_serOpsSpu =
+{
+    "SPU", SPU, SER_CAP_POLLED | SER_CAP_FF_FILTER, sizeof(((SPI_READBUFFER_pt)0)->buffer), FALSE,
+    SPU_SER_MATCH, SPU_SER_OPEN, SPU_SER_CLOSE, SPU_SER_WRITE, SPU_SER_READ, SPU_SER_BAUDRATE,
+    NULL, NULL, NULL, NULL, NULL, NULL, SPU_SER_WAIT,
+    NULL
+};
+#endif // ENABLE_DIOLAN_SUPPORT
+
+#ifdef ENABLE_I2CDEV_SUPPORT
+// Linux i2c-dev
+static BOOL I2CDEV_SER_MATCH(const CH* name)
+{
+    return strncmp(name, "/dev/i2c-", 9) == 0;
+}
+
+static BOOL I2CDEV_SER_OPEN(SER_HANDLE_pt h, const CH* name)
+{
+    int addr = 0;
+    h->handle  = I2CDEV_OPEN(name, &addr, &h->pData);
+    h->devAddr = addr;
+    return h->handle != (HANDLE)0;
+}
+
+static void I2CDEV_SER_CLOSE(SER_HANDLE_pt h)
+{
+    I2C_STATS((I2C_DATA_pt)h->pData);
+    I2CDEV_CLOSE(h->handle,(I2C_DATA_pt)h->pData);
+}
+
+static U4 I2CDEV_SER_WRITE(SER_HANDLE_pt h, const void* p, U4 size)
+{
+    return I2CDEV_WRITE(h->handle,h->devAddr,(I2C_DATA_pt)h->pData,p,size);
+}
+
+static U4 I2CDEV_SER_READ(SER_HANDLE_pt h, void* p, U4 size)
+{
+    return I2CDEV_READ(h->handle,h->devAddr,(I2C_DATA_pt)h->pData,p,size);
+}
+
+static BOOL I2CDEV_SER_BAUDRATE(SER_HANDLE_pt h, U4 br)
+{
+    return I2CDEV_BAUDRATE(h->handle,br);
+}
+
+static U4 I2CDEV_SER_PENDING(SER_HANDLE_pt h)
+{
+    return I2CDEV_PENDING(h->handle, h->devAddr, (I2C_DATA_pt)h->pData);
+}
+
+static void I2CDEV_SER_WAIT(SER_HANDLE_pt h, U4 timeout)
+{
+    I2C_WAIT((I2C_DATA_pt)h->pData, timeout);
+}
+
+static SER_OPS_t s_serOpsI2cDev =
+{
+    "I2CDEV", I2CDEV, SER_CAP_POLLED, I2CDEV_MAX_XFER, TRUE,
+    I2CDEV_SER_MATCH, I2CDEV_SER_OPEN, I2CDEV_SER_CLOSE, I2CDEV_SER_WRITE, I2CDEV_SER_READ, I2CDEV_SER_BAUDRATE,
+    NULL, NULL, I2CDEV_SER_PENDING, NULL, NULL, NULL, I2CDEV_SER_WAIT,
+    NULL
+};
+#endif // ENABLE_I2CDEV_SUPPORT
+
+#ifdef ENABLE_SPIDEV_SUPPORT
+// Linux spidev
+static BOOL SPIDEV_SER_MATCH(const CH* name)
+{
+    return strncmp(name, "/dev/spidev", 11) == 0;
+}
+
+static BOOL SPIDEV_SER_OPEN(SER_HANDLE_pt h, const CH* name)
+{
+    h->handle = SPIDEV_OPEN(name, &h->pData);
+    return h->handle != (HANDLE)0;
+}
+
+static void SPIDEV_SER_CLOSE(SER_HANDLE_pt h)
+{
+    SPI_RB_STATS(&((SPIDEV_DATA_pt)h->pData)->readBuf);
+    SPIDEV_CLOSE(h->handle,(SPIDEV_DATA_pt)h->pData);
+}
+
+static U4 SPIDEV_SER_WRITE(SER_HANDLE_pt h, const void* p, U4 size)
+{
+    return SPIDEV_WRITE(h->handle,(SPIDEV_DATA_pt)h->pData,p,size);
+}
+
+static U4 SPIDEV_SER_READ(SER_HANDLE_pt h, void* p, U4 size)
+{
+    return SPIDEV_READ(h->handle,(SPIDEV_DATA_pt)h->pData,p,size);
+}
+
+static BOOL SPIDEV_SER_BAUDRATE(SER_HANDLE_pt h, U4 br)
+{
+    return SPIDEV_BAUDRATE(h->handle,(SPIDEV_DATA_pt)h->pData,br);
+}
+
+static U4 SPIDEV_SER_PENDING(SER_HANDLE_pt h)
+{
+    return ((SPIDEV_DATA_pt)h->pData)->readBuf.size;
+}
+
+static void SPIDEV_SER_WAIT(SER_HANDLE_pt h, U4 timeout)
+{
+    SPI_RB_WAIT(&((SPIDEV_DATA_pt)h->pData)->readBuf, timeout);
+}
+
+static SER_OPS_t s_serOpsSpiDev =
+{
+    "SPIDEV", SPIDEV, SER_CAP_POLLED | SER_CAP_FF_FILTER, sizeof(((SPI_READBUFFER_pt)0)->buffer), TRUE,
+    SPIDEV_SER_MATCH, SPIDEV_SER_OPEN, SPIDEV_SER_CLOSE, SPIDEV_SER_WRITE, SPIDEV_SER_READ, SPIDEV_SER_BAUDRATE,
+    NULL, NULL, SPIDEV_SER_PENDING, NULL, NULL, NULL, SPIDEV_SER_WAIT,
+    NULL
+};
+#endif // ENABLE_SPIDEV_SUPPORT
+
+#ifdef ENABLE_AARDVARK_SUPPORT
+// Aardvark I2C
+static BOOL I2C_SER_MATCH(const CH* name)
+{
+    return strncmp(name, "I2C", 3) == 0;
+}
+
+static BOOL I2C_SER_OPEN(SER_HANDLE_pt h, const CH* name)
+{
+    int addr = 0;
+    h->handle  = I2C_OPEN(name, &addr, &h->pData);
+    h->devAddr = addr;
+    return h->handle != (HANDLE)0;
+}
+
+static void I2C_SER_CLOSE(SER_HANDLE_pt h)
+{
+    I2C_STATS((I2C_DATA_pt)h->pData);
+    I2C_CLOSE(h->handle);
+}
+
+static U4 I2C_SER_WRITE(SER_HANDLE_pt h, const void* p, U4 size)
+{
+    return I2C_WRITE(h->handle,h->devAddr,(I2C_DATA_pt)h->pData,p,size);
+}
+
+static U4 I2C_SER_READ(SER_HANDLE_pt h, void* p, U4 size)
+{
+    return I2C_READ(h->handle,h->devAddr,(I2C_DATA_pt)h->pData,p,size);
+}
+
+static BOOL I2C_SER_BAUDRATE(SER_HANDLE_pt h, U4 br)
+{
+    return I2C_BAUDRATE(h->handle,(I2C_DATA_pt)h->pData,br);
+}
+
+static U4 I2C_SER_PENDING(SER_HANDLE_pt h)
+{
+    return I2C_PENDING(h->handle, h->devAddr, (I2C_DATA_pt)h->pData);
+}
+
+static void I2C_SER_WAIT(SER_HANDLE_pt h, U4 timeout)
+{
+    I2C_WAIT((I2C_DATA_pt)h->pData, timeout);
+}
+
+static SER_OPS_t s_serOpsI2c =
+{
+    "I2C", I2C, SER_CAP_POLLED, 0xFFFF, FALSE,
+    I2C_SER_MATCH, I2C_SER_OPEN, I2C_SER_CLOSE, I2C_SER_WRITE, I2C_SER_READ, I2C_SER_BAUDRATE,
+    NULL, NULL, I2C_SER_PENDING, NULL, NULL, NULL, I2C_SER_WAIT,
+    NULL
+};
+
+// Aardvark SPI
+static BOOL SPI_SER_MATCH(const CH* name)
+{
+    return (strncmp(name, "SPI", 3) == 0 || strncmp(name, "spi", 3) == 0);
+}
+
+static BOOL SPI_SER_OPEN(SER_HANDLE_pt h, const CH* name)
+{
+    h->handle = SPI_OPEN(name, &h->pData);
+    return h->handle != (HANDLE)0;
+}
+
+static void SPI_SER_CLOSE(SER_HANDLE_pt h)
+{
+    SPI_RB_STATS((SPI_READBUFFER_pt)h->pData);
+    SPI_CLOSE(h->handle);
+}
+
+static U4 SPI_SER_WRITE(SER_HANDLE_pt h, const void* p, U4 size)
+{
+    return SPI_WRITE(h->handle,(SPI_READBUFFER_pt)h->pData,p,size);
 }
 
-#endif // ENABLE_AARDVARK_SUPPORT
+static U4 SPI_SER_READ(SER_HANDLE_pt h, void* p, U4 size)
+{
+    return SPI_READ(h->handle,(SPI_READBUFFER_pt)h->pData,p,size);
+}
 
+static BOOL SPI_SER_BAUDRATE(SER_HANDLE_pt h, U4 br)
+{
+    return SPI_BAUDRATE(h->handle,br);
+}
 
-//=====================================================================
-// NET PORT IO
-//=====================================================================
+static void SPI_SER_WAIT(SER_HANDLE_pt h, U4 timeout)
+{
+    SPI_RB_WAIT((SPI_READBUFFER_pt)h->pData, timeout);
+}
+
+static SER_OPS_t s_serOpsSpi =
+{
+    "SPI", SPI, SER_CAP_POLLED | SER_CAP_FF_FILTER, sizeof(((SPI_READBUFFER_pt)0)->buffer), FALSE,
+    SPI_SER_MATCH, SPI_SER_OPEN, SPI_SER_CLOSE, SPI_SER_WRITE, SPI_SER_READ, SPI_SER_BAUDRATE,
+    NULL, NULL, NULL, NULL, NULL, NULL, SPI_SER_WAIT,
+    NULL
+};
+#endif // ENABLE_AARDVARK_SUPPORT
 
 #ifdef ENABLE_NET_SUPPORT
+// network socket
 
-//! Open a network port
+//! telnet receive states
+typedef enum NET_TELNET_e
+{
+    NET_TELNET_DATA = 0,          //!< data
+    NET_TELNET_IAC,               //!< IAC received
+    NET_TELNET_OPT,               //!< option of WILL/WONT/DO/DONT expected
+    NET_TELNET_SB,                //!< inside sub-negotiation
+    NET_TELNET_SB_IAC             //!< IAC received inside sub-negotiation
+} NET_TELNET_t;
+
+//! state of a network port
+typedef struct NET_DATA_s
+{
+    U4 fill;                      //!< number of bytes in \a buf
+    U1 buf[NET_TX_BUFFER];        //!< data not sent yet
+    BOOL rfc2217;                 //!< telnet framing, the baudrate is set in-band (RFC 2217)
+    NET_TELNET_t state;           //!< telnet receive state
+    U1 verb;                      //!< WILL/WONT/DO/DONT waiting for its option
+    U1 sbLen;                     //!< number of bytes in \a sb
+    U1 sb[16];                    //!< sub-negotiation received so far
+    U4 baudAck;                   //!< baudrate last confirmed by the server
+    U4 holdRd;                    //!< read index into \a hold
+    U4 holdFill;                  //!< number of bytes in \a hold
+    U1 hold[NET_RX_HOLD];         //!< data received while waiting for a reply
+} NET_DATA_t;
+typedef NET_DATA_t* NET_DATA_pt;  //!< pointer to NET_DATA_t type
+
+//! send the collected writes
+static BOOL NET_SER_SEND(SER_HANDLE_pt h)
+{
+    NET_DATA_pt pNet = (NET_DATA_pt)h->pData;
+    if (!pNet || !pNet->fill)
+        return TRUE;
+    U4 size = pNet->fill;
+    pNet->fill = 0;
+    return NET_WRITE(h->handle,pNet->buf,size) == size;
+}
+
+//! collect data for sending
 /*!
-    \param name        name for port, format hostname:port
-    \return handle to port
+    Doubles the IAC characters on telnet connections.
+
+    \param h       handle to device
+    \param p       data to send
+    \param size    number of bytes
+    \return #TRUE on success
 */
-HANDLE NET_OPEN(const CH* name)
+static BOOL NET_SER_PUT(SER_HANDLE_pt h, const U1* p, U4 size)
 {
-    CH nameCopy[64];
-    strncpy(nameCopy,name,sizeof(nameCopy)-1);
-#ifdef WIN32
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(1,1),&wsaData))
-    {
-        MESSAGE(MSG_ERR,"WinSock not available");
-        return 0;
-    }
-    else
+    NET_DATA_pt pNet = (NET_DATA_pt)h->pData;
+    while (size)
     {
-        if (LOBYTE(wsaData.wVersion) != 1 ||
-            HIBYTE(wsaData.wVersion) != 1 )
+        U4 room = sizeof(pNet->buf) - pNet->fill;
+        if (room < 2)
         {
-            MESSAGE(MSG_ERR,"no WinSock 1.1");
-            WSACleanup();
-            return 0;
+            if (!NET_SER_SEND(h))
+                return FALSE;
+            continue;
         }
+        // leave room for doubling the last byte
+        U4 n = MIN(size, room - 1);
+        if (pNet->rfc2217)
+        {
+            const U1* pIac = (const U1*)memchr(p, TELNET_IAC, n);
+            if (pIac)
+                n = (U4)(pIac - p) + 1;
+        }
+        memcpy(pNet->buf + pNet->fill, p, n);
+        pNet->fill += n;
+        if (pNet->rfc2217 && (p[n-1] == TELNET_IAC))
+            pNet->buf[pNet->fill++] = TELNET_IAC;
+        p    += n;
+        size -= n;
     }
-#endif
-
-    SOCKET sock = socket( AF_INET, SOCK_STREAM, 0 );
-    if (sock == INVALID_SOCKET)
-    {
-        MESSAGE(MSG_ERR,"unable to create socket");
-#ifdef WIN32
-        WSACleanup();
-#endif
-        return (HANDLE)0;
-    }
-    CH* host    = nameCopy;
-    CH* portStr = strchr(nameCopy,':');
-    if(!portStr)
-        return 0;
-    *portStr = 0;
-    portStr++;
-    U portNum = atoi(portStr);
-
-    SOCKADDR_IN sa;
-    sa.sin_family = AF_INET;
-    sa.sin_port   = htons(portNum);
-    HOSTENT *pHost = gethostbyname(host);
-    if (pHost == NULL)
-    {
-        MESSAGE(MSG_ERR, "Cannot resolve hostname %s!", host);
-        return (HANDLE)0;
-    }
-    struct in_addr* pHexAddress = (struct in_addr*)pHost->h_addr_list[ 0 ];
-    char* dottedAddress = inet_ntoa( *pHexAddress );
-    sa.sin_addr.s_addr = inet_addr( dottedAddress );
-
-    MESSAGE(MSG_DBG,"opening port %d on host %s (%s)",portNum,host,dottedAddress);
+    return TRUE;
+}
 
-    if (connect(sock,(const SOCKADDR*) &sa,
-        sizeof( SOCKADDR_IN )) == SOCKET_ERROR)
+//! send a RFC 2217 command
+/*!
+    \param h       handle to device
+    \param cmd     command, see RFC2217_SET_BAUDRATE etc.
+    \param p       value, most significant byte first
+    \param size    size of the value
+    \return #TRUE on success
+*/
+static BOOL NET_RFC2217_CMD(SER_HANDLE_pt h, U1 cmd, const U1* p, U4 size)
+{
+    U1 msg[16];
+    U4 len = 0;
+    U4 i;
+    msg[len++] = TELNET_IAC;
+    msg[len++] = TELNET_SB;
+    msg[len++] = TELNET_COM_PORT;
+    msg[len++] = cmd;
+    for (i = 0; i < size; i++)
     {
-        MESSAGE(MSG_ERR,"connection to socket failed");
-#ifdef WIN32
-        WSACleanup();
-#endif
-        return (HANDLE)0;
+        msg[len++] = p[i];
+        if (p[i] == TELNET_IAC)
+            msg[len++] = TELNET_IAC;
     }
-
-    return (HANDLE)sock;
+    msg[len++] = TELNET_IAC;
+    msg[len++] = TELNET_SE;
+    return NET_SER_SEND(h) && (NET_WRITE(h->handle,msg,len) == len);
 }
 
-//! Write data to net
+//! answer a telnet option request
 /*!
-    \param h    Handle to net socket
-    \param p    Pointer to user-allocated buffer of at least \a size size
-    \param size Number of bytes to write to device
-    \return number of bytes which were written to device
+    Binary transmission and suppress go ahead are used in both directions,
+    COM-PORT-OPTION by the client only; these were offered when opening.
+    All other options are refused.
+
+    \param h       handle to device
+    \param verb    WILL/WONT/DO/DONT
+    \param opt     option
 */
-U4 NET_WRITE(HANDLE h, const void* p, U4 size)
+static void NET_TELNET_OPTION(SER_HANDLE_pt h, U1 verb, U1 opt)
 {
-    SOCKET sock = (SOCKET)h;
-    int ret = send(sock,(const char*)p,size,0);
-    if (ret == SOCKET_ERROR)
+    BOOL known = (opt == TELNET_BINARY) || (opt == TELNET_SGA) ||
+                 ((opt == TELNET_COM_PORT) && (verb != TELNET_WILL));
+    if ((opt == TELNET_COM_PORT) && (verb == TELNET_DONT))
     {
-        MESSAGE(MSG_ERR,"write to socket failed: %d",LAST_NET_ERR());
-        return 0;
+        MESSAGE(MSG_ERR, "%s does not support RFC 2217", h->pName);
+    }
+    if (!known && ((verb == TELNET_WILL) || (verb == TELNET_DO)))
+    {
+        U1 msg[3] = { TELNET_IAC, (verb == TELNET_WILL) ? TELNET_DONT : TELNET_WONT, opt };
+        NET_SER_SEND(h);
+        NET_WRITE(h->handle,msg,sizeof(msg));
     }
-    return (U4)ret;
 }
 
-//! Read data from net
+//! remove the telnet commands from received data
 /*!
-    \param h    Handle to net socket
-    \param p    Pointer to user-allocated buffer of at least \a size size
-    \param size Number of bytes to read from device
-    \return number of bytes which were read from device
+    Handles option requests and notes the baudrate confirmed by the server.
+
+    \param h       handle to device
+    \param p       received data, replaced by the data without commands
+    \param size    number of bytes received
+    \return number of data bytes
 */
-U4 NET_READ(HANDLE h, void* p, U4 size)
+static U4 NET_TELNET_FILTER(SER_HANDLE_pt h, U1* p, U4 size)
 {
-    SOCKET sock = (SOCKET)h;
-    FDSET fds;
-    FD_ZERO(&fds);
-    FD_SET(sock,&fds);
-    TIMEVAL tv = {0,0};
-    int nReady = select(sock+1,&fds,NULL,NULL,&tv);
-    if (nReady)
+    NET_DATA_pt pNet = (NET_DATA_pt)h->pData;
+    U4 rd;
+    U4 wr = 0;
+    for (rd = 0; rd < size; rd++)
     {
-        int ret = recv(sock,(char *)p,size,0);
-        if (ret == SOCKET_ERROR)
+        U1 c = p[rd];
+        switch (pNet->state)
         {
-            MESSAGE(MSG_ERR,"read from socket failed: %d",LAST_NET_ERR());
-            return 0;
+        case NET_TELNET_DATA:
+            if (c == TELNET_IAC)
+                pNet->state = NET_TELNET_IAC;
+            else
+                p[wr++] = c;
+            break;
+        case NET_TELNET_IAC:
+            pNet->state = NET_TELNET_DATA;
+            if (c == TELNET_IAC)
+            {
+                p[wr++] = c;
+            }
+            else if ((c == TELNET_WILL) || (c == TELNET_WONT) || (c == TELNET_DO) || (c == TELNET_DONT))
+            {
+                pNet->verb  = c;
+                pNet->state = NET_TELNET_OPT;
+            }
+            else if (c == TELNET_SB)
+            {
+                pNet->sbLen = 0;
+                pNet->state = NET_TELNET_SB;
+            }
+            // other commands (NOP, GA, ...) are ignored
+            break;
+        case NET_TELNET_OPT:
+            NET_TELNET_OPTION(h, pNet->verb, c);
+            pNet->state = NET_TELNET_DATA;
+            break;
+        case NET_TELNET_SB:
+            if (c == TELNET_IAC)
+                pNet->state = NET_TELNET_SB_IAC;
+            else if (pNet->sbLen < sizeof(pNet->sb))
+                pNet->sb[pNet->sbLen++] = c;
+            break;
+        case NET_TELNET_SB_IAC:
+            if (c == TELNET_IAC)
+            {
+                if (pNet->sbLen < sizeof(pNet->sb))
+                    pNet->sb[pNet->sbLen++] = c;
+                pNet->state = NET_TELNET_SB;
+                break;
+            }
+            // IAC SE (or a broken sub-negotiation) ends it
+            pNet->state = NET_TELNET_DATA;
+            if ((pNet->sbLen >= 6) && (pNet->sb[0] == TELNET_COM_PORT) &&
+                (pNet->sb[1] == RFC2217_SERVER_OFFSET + RFC2217_SET_BAUDRATE))
+            {
+                pNet->baudAck = ((U4)pNet->sb[2] << 24) | ((U4)pNet->sb[3] << 16) |
+                                ((U4)pNet->sb[4] <<  8) |  (U4)pNet->sb[5];
+                MESSAGE(MSG_DBG, "server confirmed %u baud", pNet->baudAck);
+            }
+            break;
         }
-        return (U4)ret;
     }
-    return 0;
+    return wr;
 }
 
-//! close net socket
-/*!
-    \param h    Handle to device
-*/
-void NET_CLOSE(HANDLE h)
+static BOOL NET_SER_MATCH(const CH* name)
 {
-    SOCKET sock = (SOCKET)h;
-    closesocket(sock);
-#ifdef WIN32
-    WSACleanup();
-#endif
+    return strchr(name, ':') != NULL;
 }
 
-//! Set baudrate of Ethernet device
-/*!
-    \param h    handle to device
-    \param br   baudrate to set
-    \return #TRUE
-*/
-BOOL NET_BAUDRATE(SER_HANDLE_pt h,
-                  U4     br)
+static BOOL NET_SER_OPEN(SER_HANDLE_pt h, const CH* name)
 {
-    char serverName[64];
-    strncpy(serverName,h->pName,sizeof(serverName)-1);
-    char *pEnd = strchr(serverName,':');
-    if (!pEnd)
-    {
-        MESSAGE(MSG_ERR,"failed extracting host name: %s",h->pName);
+    NET_DATA_pt pNet = (NET_DATA_pt)calloc(1, sizeof(NET_DATA_t));
+    h->pData = pNet;
+    if (!pNet)
         return FALSE;
-    }
-    *pEnd = 0; // terminate
-    int portNum = (atoi(++pEnd) % 100)-1; // only use the two least significant digits
-    MESSAGE(MSG_DBG,"setting port %d on %s to %d baud",portNum,serverName,br);
-    char requestStr[128];
-
-    // prepare request URL to be sent to ttycat
-    sprintf(requestStr,"/goform/setPortConfig?portNum=%d&baudRate=%u&portEnable=1&listenEnable=1",portNum,br);
-    MESSAGE(MSG_DBG,"req: %s",requestStr);
-
-    // prepare and connect socket to HTTP port of ttycat
-    SOCKET sock = socket( AF_INET, SOCK_STREAM, 0 );
-    if (sock == INVALID_SOCKET)
+    pNet->rfc2217 = (strncmp(name, NET_RFC2217_PREFIX, strlen(NET_RFC2217_PREFIX)) == 0);
+    if (pNet->rfc2217)
     {
-        MESSAGE(MSG_ERR,"unable to create socket");
-        return FALSE;
+        name += strlen(NET_RFC2217_PREFIX);
     }
-    SOCKADDR_IN sa;
-    sa.sin_family = AF_INET;
-    sa.sin_port   = htons(80);
-    HOSTENT *pHost = gethostbyname(serverName);
-    struct in_addr* pHexAddress = (struct in_addr*)pHost->h_addr_list[ 0 ];
-    char* dottedAddress = inet_ntoa( *pHexAddress );
-    sa.sin_addr.s_addr = inet_addr( dottedAddress );
-    if (connect(sock,(const SOCKADDR*) &sa,
-        sizeof(SOCKADDR_IN)) == SOCKET_ERROR)
-    {
-        MESSAGE(MSG_ERR,"connection to socket failed");
-        closesocket(sock);
+    h->handle = NET_OPEN(name);
+    if (h->handle == (HANDLE)0)
         return FALSE;
+
+    if (pNet->rfc2217)
+    {
+        // 8 bit transparent connection with control of the serial port,
+        // the server answers while the first data is exchanged
+        static const U1 negotiate[] =
+        {
+            TELNET_IAC, TELNET_WILL, TELNET_BINARY,   TELNET_IAC, TELNET_DO, TELNET_BINARY,
+            TELNET_IAC, TELNET_WILL, TELNET_SGA,      TELNET_IAC, TELNET_DO, TELNET_SGA,
+            TELNET_IAC, TELNET_WILL, TELNET_COM_PORT
+        };
+        const U1 dataSize = 8;
+        const U1 parity   = 1; // none
+        const U1 stopSize = 1; // 1 stop bit
+        if ((NET_WRITE(h->handle,negotiate,sizeof(negotiate)) != sizeof(negotiate)) ||
+            !NET_RFC2217_CMD(h, RFC2217_SET_DATASIZE, &dataSize, 1) ||
+            !NET_RFC2217_CMD(h, RFC2217_SET_PARITY,   &parity,   1) ||
+            !NET_RFC2217_CMD(h, RFC2217_SET_STOPSIZE, &stopSize, 1))
+        {
+            NET_CLOSE(h->handle);
+            return FALSE;
+        }
     }
+    return TRUE;
+}
 
-    // no construct HTTP request header
-    char httpRequest[512];
-    sprintf(httpRequest,
-             "GET %s HTTP/1.1\r\n"
-             "User-Agent: FWUpdateG5/linux\r\n"
-             "Host: %s\r\n"
-             "Connection: Keep-Alive\r\n"
-             "Cache-Control: no-cache\r\n"
-             "\r\n",requestStr,serverName);
-    //MESSAGE(MSG_DBG,"request: %s",httpRequest);
+static void NET_SER_CLOSE(SER_HANDLE_pt h)
+{
+    NET_SER_SEND(h);
+    NET_CLOSE(h->handle);
+}
 
-    // send request
-    int ret = send(sock,(const char*)httpRequest,strlen(httpRequest),0);
-    if (ret == SOCKET_ERROR)
+static U4 NET_SER_WRITE(SER_HANDLE_pt h, const void* p, U4 size)
+{
+    if (!h->pData)
+        return NET_WRITE(h->handle,p,size);
+    // frames written in a burst go out in one segment, see SER_FLUSH()
+    return NET_SER_PUT(h,(const U1*)p,size) ? size : 0;
+}
+
+static U4 NET_SER_READ(SER_HANDLE_pt h, void* p, U4 size)
+{
+    NET_DATA_pt pNet = (NET_DATA_pt)h->pData;
+    // whoever reads waits for the answer to what was written
+    NET_SER_SEND(h);
+    if (!pNet || !pNet->rfc2217)
+        return NET_READ(h->handle,p,size);
+
+    // data received while waiting for the server comes first
+    if (pNet->holdFill)
     {
-        MESSAGE(MSG_ERR,"sending request failed");
-        closesocket(sock);
-        return FALSE;
+        U4 n = MIN(size, pNet->holdFill);
+        memcpy(p, pNet->hold + pNet->holdRd, n);
+        pNet->holdRd   += n;
+        pNet->holdFill -= n;
+        if (!pNet->holdFill)
+            pNet->holdRd = 0;
+        return n;
     }
+    return NET_TELNET_FILTER(h,(U1*)p,NET_READ(h->handle,p,size));
+}
 
-    // get response
-    char httpResponse[512];
-    ret = recv(sock,httpResponse,sizeof(httpResponse),0);
-    if (ret == SOCKET_ERROR)
-    {
-        MESSAGE(MSG_ERR,"receiving response failed");
-        closesocket(sock);
+static BOOL NET_SER_BAUDRATE(SER_HANDLE_pt h, U4 br)
+{
+    NET_DATA_pt pNet = (NET_DATA_pt)h->pData;
+    if (!NET_SER_SEND(h))
         return FALSE;
-    }
-    int status;
-    if (sscanf(httpResponse,"HTTP/1.1 %d ",&status))
+    if (!pNet || !pNet->rfc2217)
+        return NET_BAUDRATE(h,br);
+
+    // in-band on the data connection, the data already sent is
+    // transmitted at the old baudrate
+    U1 value[4] = { (U1)(br >> 24), (U1)(br >> 16), (U1)(br >> 8), (U1)br };
+    pNet->baudAck = 0;
+    if (!NET_RFC2217_CMD(h, RFC2217_SET_BAUDRATE, value, sizeof(value)))
+        return FALSE;
+    U4 start = TIME_GET();
+    while (pNet->baudAck == 0)
     {
-        MESSAGE(MSG_DBG,"status: %d",status);
-        if (status != 200 && status != 302) // comtrol devicemaster sends redirection
+        if ((TIME_GET() - start) > NET_RFC2217_TIMEOUT)
         {
-            MESSAGE(MSG_ERR,"response returned failing status");
-            closesocket(sock);
+            MESSAGE(MSG_ERR, "no reply to baudrate request from %s", h->pName);
             return FALSE;
         }
+        if (!NET_WAIT((SOCKET)h->handle, FALSE, 10))
+            continue;
+        U1* pHold = pNet->hold + pNet->holdRd + pNet->holdFill;
+        U4 room = sizeof(pNet->hold) - pNet->holdRd - pNet->holdFill;
+        if (!room)
+        {
+            // keep reading to get the reply, the data is lost
+            U1 discard[256];
+            pHold = discard;
+            room  = sizeof(discard);
+            NET_TELNET_FILTER(h, pHold, NET_READ(h->handle, pHold, room));
+            continue;
+        }
+        pNet->holdFill += NET_TELNET_FILTER(h, pHold, NET_READ(h->handle, pHold, room));
+    }
+    if (pNet->baudAck != br)
+    {
+        MESSAGE(MSG_ERR, "%s set %u instead of %u baud", h->pName, pNet->baudAck, br);
+        return FALSE;
     }
-    //MESSAGE(MSG_DBG,"response: %s",httpResponse);
-    closesocket(sock);
     return TRUE;
 }
 
-#endif //ENABLE_NET_SUPPORT
+static void NET_SER_FLUSH(SER_HANDLE_pt h)
+{
+    NET_SER_SEND(h);
+}
+
+#ifndef WIN32
+static U4 NET_SER_WRITEV(SER_HANDLE_pt h, const SER_IOVEC_t* pIov, U4 count)
+{
+    NET_DATA_pt pNet = (NET_DATA_pt)h->pData;
+    if (pNet && pNet->rfc2217)
+    {
+        // IAC characters have to be doubled
+        U4 total = 0;
+        U4 i;
+        for (i = 0; (i < count) && NET_SER_PUT(h,(const U1*)pIov[i].p,pIov[i].size); i++)
+        {
+            total += pIov[i].size;
+        }
+        return total;
+    }
+    if (!NET_SER_SEND(h))
+        return 0;
+    return FD_WRITEV((int)h->handle, pIov, count);
+}
+
+static int NET_SER_FD(SER_HANDLE_pt h)
+{
+    return (int)h->handle;
+}
+#endif //ifndef WIN32
+
+static SER_OPS_t s_serOpsNet =
+{
+    "NET", NET,
+#ifdef WIN32
+    SER_CAP_FULL_DUPLEX | SER_CAP_WRITE_BUFFERED, 0, TRUE,
+#else
+    SER_CAP_FULL_DUPLEX | SER_CAP_WAITABLE_FD | SER_CAP_SCATTER_WRITE | SER_CAP_WRITE_BUFFERED, 0, TRUE,
+#endif
+    NET_SER_MATCH, NET_SER_OPEN, NET_SER_CLOSE, NET_SER_WRITE, NET_SER_READ, NET_SER_BAUDRATE,
+#ifdef WIN32
+    NULL, NULL, NULL, NULL, NET_SER_FLUSH, NULL, NULL,
+#else
+    NET_SER_WRITEV, NULL, NULL, NULL, NET_SER_FLUSH, NET_SER_FD, NULL,
+#endif
+    NULL
+};
+#endif // ENABLE_NET_SUPPORT
 
+#ifdef ENABLE_MUX_SUPPORT
+// serial port shared by the multiplexer
+static BOOL MUX_SER_MATCH(const CH* name)
+{
+    return strncmp(name, MUX_PORT_PREFIX, strlen(MUX_PORT_PREFIX)) == 0;
+}
+
+static BOOL MUX_SER_OPEN(SER_HANDLE_pt h, const CH* name)
+{
+    h->handle = MUX_OPEN(name);
+    return h->handle != (HANDLE)0;
+}
 
+static SER_OPS_t s_serOpsMux =
+{
+    "MUX", MUX, SER_CAP_FULL_DUPLEX | SER_CAP_WAITABLE_FD | SER_CAP_SCATTER_WRITE, 0, TRUE,
+    MUX_SER_MATCH, MUX_SER_OPEN, NET_SER_CLOSE, NET_SER_WRITE, NET_SER_READ, MUX_BAUDRATE,
+    NET_SER_WRITEV, NULL, NULL, NULL, NULL, NET_SER_FD, NULL,
+    NULL
+};
+#endif // ENABLE_MUX_SUPPORT
 
 
 //=====================================================================
 // GENERIC SERIAL IO
 //=====================================================================
 
+static SER_OPS_t* s_pSerOps = NULL; //!< registered transports, latest first
 
-SER_HANDLE_pt SER_OPEN(const CH* name)
+//! prepend a transport to the list of registered transports
+static void SER_LINK(SER_OPS_t* pOps)
 {
-    SER_TYPE_t serType = COM;
-    HANDLE     handle = (HANDLE)0;
-    SER_HANDLE_pt pSerHandle;
-    void *pData = NULL;
-    int        addr = 0;
+    pOps->pNext = s_pSerOps;
+    s_pSerOps   = pOps;
+}
 
-#ifdef ENABLE_DIOLAN_SUPPORT
-    if (!handle && (strncmp(name, "U2C",3) == 0 || strncmp(name, "u2c",3) == 0))
-    {
-        serType = U2C;
-        handle  = U2C_OPEN(name,&addr);
-    }
-    if (!handle && (strncmp(name, "SPU",3) == 0 || strncmp(name, "spu",3) == 0))
-    {
-        serType = SPU;
-        handle  = SPU_OPEN(name,&pData);
-    }
-#endif // ENABLE_DIOLAN_SUPPORT
-#ifdef ENABLE_AARDVARK_SUPPORT
-    if (!handle && strncmp(name, "I2C", 3) == 0)
-    {
-        serType = I2C;
-        handle = I2C_OPEN(name, &addr);
-    }
-    if (!handle && (strncmp(name, "SPI", 3) == 0 ||
-                    strncmp(name, "spi", 3) == 0))
+//! register the built-in transports, lowest priority first
+static void SER_REGISTER_BUILTIN(void)
+{
+    static BOOL done = FALSE;
+    PLATFORM_LOCK();
+    if (done)
     {
-        serType = SPI;
-        handle = SPI_OPEN(name, &pData);
+        PLATFORM_UNLOCK();
+        return;
     }
-#endif // ENABLE_AARDVARK_SUPPORT
+    done = TRUE;
+
+    SER_LINK(&s_serOpsCom);
+    SER_LINK(&s_serOpsStdio);
 #ifdef ENABLE_NET_SUPPORT
-    if (!handle && strchr(name, ':'))
-    {
-        serType = NET;
-        handle  = NET_OPEN(name);
-    }
-    else
+    SER_LINK(&s_serOpsNet);
 #endif // ENABLE_NET_SUPPORT
-    if (!handle)
+#ifdef ENABLE_MUX_SUPPORT
+    SER_LINK(&s_serOpsMux);
+#endif // ENABLE_MUX_SUPPORT
+#ifdef ENABLE_AARDVARK_SUPPORT
+    SER_LINK(&s_serOpsSpi);
+    SER_LINK(&s_serOpsI2c);
+#endif // ENABLE_AARDVARK_SUPPORT
+#ifdef ENABLE_SPIDEV_SUPPORT
+    SER_LINK(&s_serOpsSpiDev);
+#endif // ENABLE_SPIDEV_SUPPORT
+#ifdef ENABLE_I2CDEV_SUPPORT
+    SER_LINK(&s_serOpsI2cDev);
+#endif // ENABLE_I2CDEV_SUPPORT
+#ifdef ENABLE_DIOLAN_SUPPORT
+    SER_LINK(&s_serOpsSpu);
+    SER_LINK(&s_serOpsU2c);
+#endif // ENABLE_DIOLAN_SUPPORT
+    PLATFORM_UNLOCK();
+}
+
+void SER_INIT(void)
+{
+    SER_REGISTER_BUILTIN();
+}
+
+U4 SER_EXPAND(const CH* pattern, CH* pNames[], U4 max)
+{
+    U4 count = 0;
+#ifndef WIN32
+    if ((pattern[0] == '/') && strpbrk(pattern, "*?["))
     {
-        serType = COM;
-        handle  = COM_OPEN(name);
+        glob_t g;
+        if (glob(pattern, 0, NULL, &g) == 0)
+        {
+            size_t ix;
+            for (ix = 0; (ix < g.gl_pathc) && (count < max); ix++)
+            {
+                pNames[count] = (CH*)malloc(strlen(g.gl_pathv[ix]) + 1);
+                if (!pNames[count])
+                    break;
+                strcpy(pNames[count++], g.gl_pathv[ix]);
+            }
+            if (ix < g.gl_pathc)
+            {
+                MESSAGE(MSG_WARN, "'%s': only the first %u of %u ports used", pattern, count, (U4)g.gl_pathc);
+            }
+        }
+        globfree(&g);
+        return count;
     }
-
-#ifdef WIN32
-    if (!handle && (strncmp(name, "STDIO", 5) == 0 || strncmp(name, "stdio", 5) == 0))
+#endif
+    if (max)
     {
-        serType = STDINOUT;
-        handle  = (HANDLE) -1; // Indicates stdin/stdout. Never used -> unique identifier
-        // Make sure windows does not replace "\n" to "\r\n"
-        if(_setmode(fileno(stdout), O_BINARY) == -1)
+        pNames[0] = (CH*)malloc(strlen(pattern) + 1);
+        if (pNames[0])
         {
-            // In case of error abort here
-            handle = (HANDLE)0;
+            strcpy(pNames[0], pattern);
+            count = 1;
         }
     }
-#endif //ifdef WIN32
+    return count;
+}
+
+void SER_REGISTER(SER_OPS_t* pOps)
+{
+    SER_REGISTER_BUILTIN();
+    PLATFORM_LOCK();
+    SER_LINK(pOps);
+    PLATFORM_UNLOCK();
+}
 
+SER_HANDLE_pt SER_OPEN(const CH* name)
+{
+    SER_OPS_t* pOps;
 
-    if (handle)
+    SER_REGISTER_BUILTIN();
+    for (pOps = s_pSerOps; pOps; pOps = pOps->pNext)
     {
-        pSerHandle = (SER_HANDLE_pt)malloc(sizeof(SER_HANDLE_t));
-        if (pSerHandle)
+        if (!pOps->pfnMatch(name))
+            continue;
+
+        SER_HANDLE_pt pSerHandle = (SER_HANDLE_pt)malloc(sizeof(SER_HANDLE_t));
+        if (!pSerHandle)
+            return NULL;
+        pSerHandle->handle   = (HANDLE)0;   // device handle
+        pSerHandle->type     = pOps->type;  // device type
+        pSerHandle->devAddr  = 0;           // device address
+        pSerHandle->pData    = NULL;        // custom data pointer
+        pSerHandle->pName    = name;        // backup name
+        pSerHandle->baudrate = 0;           // baudrate not set yet
+        pSerHandle->pOps     = pOps;        // transport operations
+        memset(&pSerHandle->ffStats, 0, sizeof(pSerHandle->ffStats));
+        if (pOps->pfnOpen(pSerHandle, name))
         {
-            pSerHandle->handle   = handle;  // device handle
-            pSerHandle->type     = serType; // device type
-            pSerHandle->devAddr  = addr;    // device address
-            pSerHandle->pData    = pData;   // custom data pointer
-            pSerHandle->pName    = name;    // backup name
-            pSerHandle->baudrate = 0;       // baudrate not set yet
+            MESSAGE(MSG_DBG, "%s: %s transport", name, pOps->pName);
             return pSerHandle;
         }
+        if (pSerHandle->pData)
+            free(pSerHandle->pData);
+        free(pSerHandle);
+        if (pOps->exclusive)
+        {
+            // don't fall back to the other port types
+            break;
+        }
     }
     return NULL;
 }
 
 BOOL SER_REENUM(SER_HANDLE_pt h, BOOL IsUsb)
 {
-    MESSAGE(MSG_DBG, "Re-enumerating...");
-    switch(h->type)
+    SER_REENUM_t state;
+    U4 attempt = 0;
+    U4 wait = 0;
+    while ((state = SER_REENUM_STEP(h, IsUsb, attempt++, &wait)) == SER_REENUM_PENDING)
+    {
+        TIME_SLEEP(wait);
+    }
+    return (state == SER_REENUM_DONE);
+}
+
+SER_REENUM_t SER_REENUM_STEP(SER_HANDLE_pt h, BOOL IsUsb, U4 attempt, U4* pWait)
+{
+    if (attempt == 0)
+    {
+        MESSAGE(MSG_DBG, "Re-enumerating...");
+    }
+    *pWait = 0;
+    if (h->pOps->pfnReenum)
     {
-    case COM:
+        const SER_REENUM_t state = h->pOps->pfnReenum(h, IsUsb, attempt, pWait);
+        if (state == SER_REENUM_FAILED)
         {
-            U4 retries = 10;
-            COM_CLOSE(h->handle);
-            do
-            {
-                TIME_SLEEP(1000);
-                h->handle = COM_OPEN(h->pName);
-                if (h->handle)
-                {
-                    return COM_BAUDRATE(h->handle, h->baudrate);
-                }
-            }
-            while ((h->handle == (HANDLE)0) && retries--);
+            MESSAGE(MSG_ERR, "Port '%s' not usable after re-enumerating", h->pName);
         }
-        break;
-
-#ifdef WIN32
-    case STDINOUT:
-        MESSAGE_PLAIN("<AC>Reenum %i<\\AC>", IsUsb);
-        TIME_SLEEP(1000);   // Pause to allow host to perform operation
-        return TRUE;
-#endif //ifdef WIN32
-
-#ifdef ENABLE_AARDVARK_SUPPORT
-    case I2C:
-        TIME_SLEEP(500);
-        return I2C_BAUDRATE(h->handle,h->baudrate);
-    case SPI:
-        TIME_SLEEP(500);
-        return SPI_BAUDRATE(h->handle,h->baudrate);
-#endif // ENABLE_AARDVARK_SUPPORT
-#ifdef ENABLE_DIOLAN_SUPPORT
-    case U2C:
-        TIME_SLEEP(500);
-        return U2C_BAUDRATE(h->handle,h->baudrate);
-    case SPU:
-        TIME_SLEEP(500);
-        return SPU_BAUDRATE(h->handle,h->baudrate);
-#endif // ENABLE_DIOLAN_SUPPORT
-#ifdef ENABLE_NET_SUPPORT
-    case NET:
-        TIME_SLEEP(500);
-        return NET_BAUDRATE(h,h->baudrate);
-#endif // ENABLE_NET_SUPPORT
-    default:
-        break;
+        return state;
     }
-    return FALSE;
+    if (attempt == 0)
+    {
+        // let the port settle before its settings are re-applied
+        *pWait = SER_REENUM_SETTLE;
+        return SER_REENUM_PENDING;
+    }
+    return h->pOps->pfnBaudrate(h, h->baudrate) ? SER_REENUM_DONE : SER_REENUM_FAILED;
+}
+
+//! build a UPD-FLWRI frame
+/*!
+    \param pOut     buffer receiving the frame, \a size + #FLWRI_OVERHEAD bytes
+    \param address  flash address to write to
+    \param pData    data to write
+    \param size     number of bytes to write
+    \return size of the frame
+*/
+static U4 SER_FLWRI_FRAME(U1* pOut, U4 address, const U1* pData, U4 size)
+{
+    UBX_HEAD_t ubxhdr;
+    ubxhdr.prefix  = UBX_PREFIX;
+    ubxhdr.classId = UBX_CLASS_UPD;
+    ubxhdr.msgId   = UBX_UPD_FLWRI;
+    ubxhdr.size    = (U2)(size + 8);
+    memcpy(pOut, &ubxhdr, sizeof(ubxhdr));
+    memcpy(pOut + UBX_HEAD_SIZE, &address, sizeof(address));
+    memcpy(pOut + UBX_HEAD_SIZE + 4, &size, sizeof(size));
+    memcpy(pOut + FLWRI_HEAD_SIZE, pData, size);
+    U2 crc = GetUbxChecksumU1(pOut + UBX_PREFIX_SIZE, FLWRI_HEAD_SIZE - UBX_PREFIX_SIZE + size);
+    memcpy(pOut + FLWRI_HEAD_SIZE + size, &crc, sizeof(crc));
+    return FLWRI_OVERHEAD + size;
 }
 
 U4 SER_WRITE_SPI(SER_HANDLE_pt h,
@@ -1544,334 +4101,154 @@ U4 SER_WRITE_SPI(SER_HANDLE_pt h,
                  U4         size)
 {
     // get the header of the UBX message
-    UBX_HEAD_pt pUbxHdr = (UBX_HEAD_pt)p;
+    const UBX_HEAD_t* pUbxHdr = (const UBX_HEAD_t*)p;
+    // dropping runs of 0xFF never makes the frames longer than the original one
+    U1 frames[UBX_MAX_FRAME_SIZE];
 
     // check for UPD-FLWRI message
-    if(pUbxHdr->classId == UBX_CLASS_UPD && pUbxHdr->msgId == UBX_UPD_FLWRI)
+    if ((size < FLWRI_OVERHEAD) || (size > sizeof(frames)) ||
+        (pUbxHdr->classId != UBX_CLASS_UPD) || (pUbxHdr->msgId != UBX_UPD_FLWRI))
     {
-        // content of UPD-FLWRI message
-        U4 targetAddress = 0;    // address where to write the data to
-        U4 writeSize = 0;        // length of the payload to be written
-
-        U4 startOfData = 0;      // where the data section starts
-        U4 pos = 0;              // current position inside the complete packet
-        U1 *pData = NULL;        // pointer to data section of packet
-        U1 totalFF = 8;          // how many 0xFF in success are allowed
-        U curSearch = 0;         // how man 0xFF have been already found
-
-        // get the content of the UPD-FLWRI message
-        memcpy(&targetAddress, (U4 *)((U1 *)p+sizeof(UBX_HEAD_t)), sizeof(targetAddress));
-        memcpy(&writeSize,     (U4 *)((U1 *)p+sizeof(UBX_HEAD_t)+sizeof(targetAddress)), sizeof(writeSize));
-
-        // set the pointer to the data
-        pData = (U1 *)p + sizeof(UBX_HEAD_t) + sizeof(targetAddress) + sizeof(writeSize);
+        // write data using standard write
+        return h->pOps->pfnWrite(h,p,size);
+    }
 
-        while(pos < writeSize)
+    // content of UPD-FLWRI message
+    U4 targetAddress;        // address where to write the data to
+    U4 writeSize;            // length of the payload to be written
+    memcpy(&targetAddress, (const U1*)p + UBX_HEAD_SIZE,     sizeof(targetAddress));
+    memcpy(&writeSize,     (const U1*)p + UBX_HEAD_SIZE + 4, sizeof(writeSize));
+    writeSize = MIN(writeSize, size - FLWRI_OVERHEAD);
+    const U1* pData = (const U1*)p + FLWRI_HEAD_SIZE;
+
+    // send the data between runs of 0xFF (erased flash) in separate frames.
+    // runs shorter than the overhead of an additional frame are sent along
+    U4 out = 0;              // size of the frames built
+    U4 count = 0;            // number of frames built
+    U4 pos = 0;              // current position inside the data
+    for (;;)
+    {
+        while ((pos < writeSize) && (pData[pos] == 0xFF))
         {
-            // get the current character
-            U1 current = pData[pos];
-
-            // compare to 0xFF
-            if(current == 0xFF)
-            {
-                // increment the 0xFF counter
-                curSearch++;
-            }
-            // something else found
-            else
-            {
-                // check if already more 0xFF have passed than allowed
-                if(curSearch > totalFF)
-                {
-                    // check if anything has to be written
-                    if(pos-startOfData-curSearch)
-                    {
-                        // calculate the new write address and the new size of the payload
-                        U4 writeAddress = targetAddress+startOfData;
-                        U4 newWriteSize    = pos-startOfData-curSearch;
-
-                        CH *pMessage=NULL;
-                        CH *pSendData = (CH*)malloc(newWriteSize+8);
-                        if(!pSendData)
-                            return 0;
-                        size_t Size;
-
-                        // get the data
-                        memcpy(pSendData+0, &writeAddress, 4);
-                        memcpy(pSendData+4, &newWriteSize, 4);
-                        memcpy(pSendData+8, pData+startOfData, newWriteSize);
-
-                        // create UBX message
-                        UbxCreateMessage(UBX_CLASS_UPD, UBX_UPD_FLWRI, pSendData, newWriteSize+8, &pMessage, &Size);
-
-                        // send the data to the receiver
-                        switch(h->type)
-                        {
-#ifdef ENABLE_AARDVARK_SUPPORT
-                        case SPI:
-                            SPI_WRITE(h->handle,(SPI_READBUFFER_pt)h->pData,pMessage,Size);
-                            break;
-#endif // ENABLE_AARDVARK_SUPPORT
-#ifdef ENABLE_DIOLAN_SUPPORT
-                        case SPU:
-                            SPU_WRITE(h->handle,(SPI_READBUFFER_pt)h->pData,pMessage,Size);
-                            break;
-#endif // ENABLE_DIOLAN_SUPPORT
-                        default:
-                            break;
-                        }
-
-                        // cleanup
-                        free(pMessage);
-                        free(pSendData);
-
-                    }
-
-                    // set the start of the new data to the current position (where data was found)
-                    startOfData = pos;
-
-                }
-
-                // reset the 0xFF counter
-                curSearch = 0;
-            }
-
-            // increment the position pointer
             pos++;
         }
-
-
-        // check if anything has to be written
-        if(pos-startOfData-curSearch)
+        if (pos == writeSize)
         {
-            // calculate the new write address and the new size of the payload
-            U4 writeAddress = targetAddress+startOfData;
-            U4 newWriteSize2    = pos-startOfData-curSearch;
-
-            CH *pMessage=NULL;
-            CH *pSendData = (CH*) malloc(newWriteSize2+8);
-            if(!pSendData)
-                return 0;
-            size_t Size;
-
-            // get the data
-            memcpy(pSendData+0, &writeAddress, 4);
-            memcpy(pSendData+4, &newWriteSize2, 4);
-            memcpy(pSendData+8, pData+startOfData, newWriteSize2);
-
-            // create UBX message
-            UbxCreateMessage(UBX_CLASS_UPD, UBX_UPD_FLWRI, pSendData, newWriteSize2+8, &pMessage, &Size);
-
-            // send the data to the receiver
-            switch(h->type)
-            {
-#ifdef ENABLE_AARDVARK_SUPPORT
-            case SPI:
-                SPI_WRITE(h->handle,(SPI_READBUFFER_pt)h->pData,pMessage,Size);
-                break;
-#endif // ENABLE_AARDVARK_SUPPORT
-#ifdef ENABLE_DIOLAN_SUPPORT
-            case SPU:
-                SPU_WRITE(h->handle,(SPI_READBUFFER_pt)h->pData,pMessage,Size);
-                break;
-#endif // ENABLE_DIOLAN_SUPPORT
-            default:
-                break;
-            }
-
-            // cleanup
-            free(pMessage);
-            free(pSendData);
-
+            break;
         }
-        // no data could be found to be written -> send one single byte
-        else
+        U4 start = pos;
+        U4 end = pos;
+        while (pos < writeSize)
         {
-            U4 newSize = 1;       // size is one single byte
-            CH *pMessage=NULL;
-            CH *pSendData = (CH*) malloc(newSize+8);
-            if(!pSendData)
-                return 0;
-
-            U1 newData = 0xFF;    // data is 0xFF
-            size_t Size;
-
-            // get the data
-            memcpy(pSendData+0, &targetAddress, 4);
-            memcpy(pSendData+4, &newSize, 4);
-            memcpy(pSendData+8, &newData, newSize);
-
-            // create the message
-            UbxCreateMessage(UBX_CLASS_UPD, UBX_UPD_FLWRI, pSendData, newSize+8, &pMessage, &Size);
-
-            // send the data to the receiver
-            switch(h->type)
+            if (pData[pos] != 0xFF)
+            {
+                end = ++pos;
+                continue;
+            }
+            U4 gap = pos;
+            while ((gap < writeSize) && (pData[gap] == 0xFF))
+            {
+                gap++;
+            }
+            if ((gap == writeSize) || ((gap - pos) > FLWRI_OVERHEAD))
             {
-#ifdef ENABLE_AARDVARK_SUPPORT
-            case SPI:
-                SPI_WRITE(h->handle,(SPI_READBUFFER_pt)h->pData,pMessage,Size);
-                break;
-#endif // ENABLE_AARDVARK_SUPPORT
-#ifdef ENABLE_DIOLAN_SUPPORT
-            case SPU:
-                SPU_WRITE(h->handle,(SPI_READBUFFER_pt)h->pData,pMessage,Size);
-                break;
-#endif // ENABLE_DIOLAN_SUPPORT
-            default:
                 break;
             }
-
-
-            // cleanup
-            free(pMessage);
-            free(pSendData);
+            pos = gap;
         }
-
-        // fake the number of written bytes
-        // such that the higher levels wont freak out
-        return size;
+        out += SER_FLWRI_FRAME(frames + out, targetAddress + start, pData + start, end - start);
+        count++;
     }
-    // no UPD-FLWRI message
-    else
+    if (!count)
     {
-        // write data using standard write
-        switch(h->type)
-        {
-#ifdef ENABLE_AARDVARK_SUPPORT
-        case SPI:
-            return SPI_WRITE(h->handle,(SPI_READBUFFER_pt)h->pData,p,size);
-#endif // ENABLE_AARDVARK_SUPPORT
-#ifdef ENABLE_DIOLAN_SUPPORT
-        case SPU:
-            return SPU_WRITE(h->handle,(SPI_READBUFFER_pt)h->pData,p,size);
-#endif // ENABLE_DIOLAN_SUPPORT
-        default:
-            return 0;
-        }
+        // no data could be found to be written -> send one single byte
+        const U1 newData = 0xFF;
+        out = SER_FLWRI_FRAME(frames, targetAddress, &newData, 1);
+        count = 1;
     }
+
+    h->ffStats.framesIn++;
+    h->ffStats.bytesIn   += size;
+    h->ffStats.framesOut += count;
+    h->ffStats.bytesOut  += out;
+
+    // send all frames at once, report the original frame as written
+    return (h->pOps->pfnWrite(h,frames,out) == out) ? size : 0;
 }
 
 U4 SER_WRITE(SER_HANDLE_pt h,
             const void    *p,
             U4             size)
 {
-    switch(h->type)
+    if (h->pOps->caps & SER_CAP_FF_FILTER)
     {
-    case COM:
-        return COM_WRITE(h->handle,p,size);
-#ifdef WIN32
-    case STDINOUT:
-        return STDOUT_WRITE(p,size);
-#endif //ifdef WIN32
-
-#ifdef ENABLE_AARDVARK_SUPPORT
-    case I2C:
-        return I2C_WRITE(h->handle,h->devAddr,p,size);
-    case SPI:
-        return SER_WRITE_SPI(h, p, size);
-#endif // ENABLE_AARDVARK_SUPPORT
-#ifdef ENABLE_DIOLAN_SUPPORT
-    case U2C:
-        return U2C_WRITE(h->handle,h->devAddr,p,size);
-    case SPU:
         return SER_WRITE_SPI(h, p, size);
-#endif //ENABLE_DIOLAN_SUPPORT
-#ifdef ENABLE_NET_SUPPORT
-    case NET:
-        return NET_WRITE(h->handle,p,size);
-#endif // ENABLE_NET_SUPPORT
-    default:
-        break;
     }
-    return 0;
+    return h->pOps->pfnWrite(h,p,size);
+}
+
+U4 SER_WRITEV(SER_HANDLE_pt      h,
+              const SER_IOVEC_t* pIov,
+              U4                 count)
+{
+    if (h->pOps->pfnWriteV && !(h->pOps->caps & SER_CAP_FF_FILTER))
+    {
+        return h->pOps->pfnWriteV(h,pIov,count);
+    }
+    if ((count > 1) && (h->pOps->caps & SER_CAP_FF_FILTER))
+    {
+        // the filter needs to see the complete message
+        U4 size = 0;
+        U4 i;
+        for (i = 0; i < count; i++)
+        {
+            size += pIov[i].size;
+        }
+        U1* pBuf = (U1*)malloc(size);
+        if (!pBuf)
+            return 0;
+        size = 0;
+        for (i = 0; i < count; i++)
+        {
+            memcpy(pBuf + size, pIov[i].p, pIov[i].size);
+            size += pIov[i].size;
+        }
+        size = SER_WRITE(h,pBuf,size);
+        free(pBuf);
+        return size;
+    }
+    U4 total = 0;
+    U4 i;
+    for (i = 0; i < count; i++)
+    {
+        U4 written = SER_WRITE(h,pIov[i].p,pIov[i].size);
+        total += written;
+        if (written != pIov[i].size)
+            break;
+    }
+    return total;
 }
 
 U4 SER_READ(SER_HANDLE_pt h,
             void*         p,
             U4            size)
 {
-    switch(h->type)
-    {
-    case COM:
-        return COM_READ(h->handle,p,size);
-#ifdef WIN32
-    case STDINOUT:
-        return STDIN_READ(p,size);
-#endif //ifdef WIN32
-#ifdef ENABLE_AARDVARK_SUPPORT
-    case I2C:
-        return I2C_READ(h->handle,h->devAddr,p,size);
-    case SPI:
-        return SPI_READ(h->handle,(SPI_READBUFFER_pt)h->pData,p,size);
-#endif // ENABLE_AARDVARK_SUPPORT
-#ifdef ENABLE_DIOLAN_SUPPORT
-    case U2C:
-        return U2C_READ(h->handle,h->devAddr,p,size);
-    case SPU:
-        return SPU_READ(h->handle,(SPI_READBUFFER_pt)h->pData,p,size);
-#endif // ENABLE_DIOLAN_SUPPORT
-#ifdef ENABLE_NET_SUPPORT
-    case NET:
-        return NET_READ(h->handle,p,size);
-#endif // ENABLE_NET_SUPPORT
-    default:
-        break;
-    }
-    return 0;
+    return h->pOps->pfnRead(h,p,size);
 }
 
 void SER_CLEAR(SER_HANDLE_pt h)
 {
-    switch(h->type)
+    if (h->pOps->pfnClear)
     {
-    case COM:
-        COM_CLEAR(h->handle);
-        break;
-    default:
-        break;
+        h->pOps->pfnClear(h);
     }
 }
 
 BOOL SER_BAUDRATE(SER_HANDLE_pt h,
                   U4            br)
 {
-    BOOL brSet = FALSE;
     //MESSAGE(MSG_DBG, "platform: switching baudrate to %d baud", br);
-    switch(h->type)
-    {
-    case COM:
-        brSet = COM_BAUDRATE(h->handle,br);
-        break;
-#ifdef WIN32
-    case STDINOUT:
-        STDIN_SETBAUD(br);
-        brSet = TRUE; // There is no baudrate here
-        break;
-#endif //ifdef WIN32
-#ifdef ENABLE_AARDVARK_SUPPORT
-    case I2C:
-        brSet = I2C_BAUDRATE(h->handle,br);
-        break;
-    case SPI:
-        brSet = SPI_BAUDRATE(h->handle,br);
-        break;
-#endif // ENABLE_AARDVARK_SUPPORT
-#ifdef ENABLE_DIOLAN_SUPPORT
-    case SPU:
-        brSet = SPU_BAUDRATE(h->handle,br);
-        break;
-    case U2C:
-        brSet = U2C_BAUDRATE(h->handle,br);
-        break;
-#endif // ENABLE_DIOLAN_SUPPORT
-#ifdef ENABLE_NET_SUPPORT
-    case NET:
-        brSet = NET_BAUDRATE(h,br);
-        break;
-#endif // ENABLE_NET_SUPPORT
-    default:
-        break;
-    }
+    BOOL brSet = h->pOps->pfnBaudrate(h,br);
 
     if (brSet)
     {
@@ -1886,13 +4263,9 @@ void SER_FLUSH(SER_HANDLE_pt h)
     if (!h)
         return;
 
-    switch (h->type)
+    if (h->pOps->pfnFlush)
     {
-    case COM:
-        COM_FLUSH(h->handle);
-        break;
-    default:
-        break;
+        h->pOps->pfnFlush(h);
     }
 }
 
@@ -1901,39 +4274,12 @@ void SER_CLOSE(SER_HANDLE_pt h)
     if (!h)
         return;
 
-    switch(h->type)
+    if (h->ffStats.framesIn)
     {
-    case COM:
-        COM_CLOSE(h->handle);
-        break;
-#ifdef WIN32
-    case STDINOUT:
-        break;
-#endif //ifdef WIN32
-#ifdef ENABLE_AARDVARK_SUPPORT
-    case I2C:
-        I2C_CLOSE(h->handle);
-        break;
-    case SPI:
-        SPI_CLOSE(h->handle);
-        break;
-#endif // ENABLE_AARDVARK_SUPPORT
-#ifdef ENABLE_DIOLAN_SUPPORT
-    case U2C:
-        U2C_CLOSE(h->handle);
-        break;
-    case SPU:
-        SPU_CLOSE(h->handle);
-        break;
-#endif // ENABLE_DIOLAN_SUPPORT
-#ifdef ENABLE_NET_SUPPORT
-    case NET:
-        NET_CLOSE(h->handle);
-        break;
-#endif // ENABLE_NET_SUPPORT
-    default:
-        break;
+        MESSAGE(MSG_DBG, "0xFF filter: %u UPD-FLWRI frames (%u bytes) sent as %u frames (%u bytes)",
+                h->ffStats.framesIn, h->ffStats.bytesIn, h->ffStats.framesOut, h->ffStats.bytesOut);
     }
+    h->pOps->pfnClose(h);
     // free custom data
     if (h->pData)
         free(h->pData);
@@ -1943,24 +4289,60 @@ void SER_CLOSE(SER_HANDLE_pt h)
 
 U4 SER_PENDING(SER_HANDLE_pt h)
 {
-    if (!h)
+    if (!h || !h->pOps->pfnPending)
         return 0;
 
-    switch (h->type)
+    return h->pOps->pfnPending(h);
+}
+
+U4 SER_CAPS(SER_HANDLE_pt h)
+{
+    return h ? h->pOps->caps : 0;
+}
+
+U4 SER_MAXFRAME(SER_HANDLE_pt h)
+{
+    return h ? h->pOps->maxFrame : 0;
+}
+
+int SER_FD(SER_HANDLE_pt h)
+{
+    if (!h || !(h->pOps->caps & SER_CAP_WAITABLE_FD) || !h->pOps->pfnFd)
+        return -1;
+
+    return h->pOps->pfnFd(h);
+}
+
+void SER_WAIT(SER_HANDLE_pt h, U4 timeout)
+{
+    if (!h || !timeout)
+        return;
+
+    // the answer to collected writes would never come
+    if (h->pOps->caps & SER_CAP_WRITE_BUFFERED)
     {
-#ifdef ENABLE_AARDVARK_SUPPORT
-    case I2C:
-        return I2C_PENDING(h->handle, h->devAddr);
-#endif // ENABLE_AARDVARK_SUPPORT
-#ifdef ENABLE_DIOLAN_SUPPORT
-    case U2C:
-        return U2C_PENDING(h->handle, h->devAddr);
-#endif // ENABLE_DIOLAN_SUPPORT
-    case COM:
-    default:
-        break;
+        SER_FLUSH(h);
     }
-    return 0;
+    if (h->pOps->pfnWait)
+    {
+        h->pOps->pfnWait(h, timeout);
+        return;
+    }
+#ifndef WIN32
+    int fd = SER_FD(h);
+    if ((fd >= 0) && (fd < FD_SETSIZE) && !SER_PENDING(h))
+    {
+        fd_set rfds;
+        struct timeval tv;
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        tv.tv_sec  = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        select(fd + 1, &rfds, NULL, NULL, &tv);
+        return;
+    }
+#endif
+    TIME_SLEEP(1);
 }
 
 
@@ -1968,8 +4350,38 @@ U4 SER_PENDING(SER_HANDLE_pt h)
 // STATUS MESSAGES
 //=====================================================================
 
+#ifdef WIN32
+# define THREAD_LOCAL __declspec(thread)    //!< one instance per thread
+#else
+# define THREAD_LOCAL __thread              //!< one instance per thread
+#endif
+
+static THREAD_LOCAL LOG_CTX_t* s_pLogCtx = NULL; //!< log context of the calling thread, see LOG_BIND()
+static U4 s_logTick = 0;                         //!< start time of the messages without log context, see LOG_TICK()
+static LOG_CTX_t* s_pConsoleLog = NULL;          //!< log context of the console, see CONSOLE_INIT()
+
+//! get the start time of the messages without log context
+/*!
+    The start time is taken on first use, the result of TIME_GET() can't
+    initialize a static variable.
+
+    \return start time of the messages without log context
+*/
+static U4 LOG_TICK(void)
+{
+    PLATFORM_LOCK();
+    if (s_logTick == 0)
+    {
+        s_logTick = TIME_GET();
+    }
+    const U4 tick = s_logTick;
+    PLATFORM_UNLOCK();
+    return tick;
+}
+
 void MESSAGE_PLAIN(const CH* format, ...)
 {
+    LOG_CTX_t* pCtx = s_pLogCtx;
     CH mem[1024];
     U4 cnt = 0;
 
@@ -1978,6 +4390,24 @@ void MESSAGE_PLAIN(const CH* format, ...)
     cnt += vsprintf(&mem[cnt], format, args);
     va_end(args);
 
+    if (pCtx && pCtx->pfnOutput)
+    {
+        // the sink gets the lines, not the blank ones laying out the console
+        CH line[1024];
+        CH* pLine = mem;
+        while (*pLine)
+        {
+            CH* pEnd = pLine + strcspn(pLine, "\r\n");
+            if (pEnd > pLine)
+            {
+                int len = pCtx->pPrefix ? sprintf(line, "[%.64s] ", pCtx->pPrefix) : 0;
+                sprintf(&line[len], "%.*s", (int)(pEnd - pLine), pLine);
+                pCtx->pfnOutput(pCtx->pUser, MSG_LEV0, line);
+            }
+            pLine = pEnd + strspn(pEnd, "\r\n");
+        }
+        return;
+    }
 #ifdef WIN32
     HANDLE hErrOut = GetStdHandle(STD_ERROR_HANDLE);
     U4 dw;
@@ -1988,14 +4418,37 @@ void MESSAGE_PLAIN(const CH* format, ...)
 #endif // WIN32
 }
 
+void LOG_INIT(LOG_CTX_t* pCtx, int verbosity, const CH* pPrefix)
+{
+    memset(pCtx, 0, sizeof(*pCtx));
+    pCtx->verbose  = verbosity;
+    pCtx->pPrefix  = pPrefix;
+    pCtx->tick     = TIME_GET();
+    pCtx->savePosX = 1;
+    pCtx->savePosY = 1;
+}
+
+LOG_CTX_t* LOG_BIND(LOG_CTX_t* pCtx)
+{
+    LOG_CTX_t* pPrev = s_pLogCtx;
+    s_pLogCtx = pCtx;
+    return pPrev;
+}
+
+LOG_CTX_t* LOG_CURRENT(void)
+{
+    return s_pLogCtx;
+}
+
+int LOG_VERBOSE(void)
+{
+    return s_pLogCtx ? s_pLogCtx->verbose : 0;
+}
+
 // write to stdout
 void MESSAGE(MSG_LEVEL level, const CH* format, ...)
 {
-    static U4 tick = 0;
-    // Must be done like this because the result of TIME_GET()
-    // can not be the initializer of a compile-time constant
-    if(tick==0)
-        tick=TIME_GET();
+    LOG_CTX_t* pCtx = s_pLogCtx;
 
 #ifdef WIN32
     HANDLE hErrOut = GetStdHandle(STD_ERROR_HANDLE);
@@ -2004,12 +4457,26 @@ void MESSAGE(MSG_LEVEL level, const CH* format, ...)
     // maximum line length
     CH mem[1024];
     U4 cnt;
-    if (level > ((verbose) ? MSG_DBG : MSG_LEV2))
+    if (level > ((LOG_VERBOSE()) ? MSG_DBG : MSG_LEV2))
     {
         return;
     }
     cnt = 0;
-    cnt += sprintf(&mem[cnt], "%5.1f ", 0.001 * (double) (TIME_GET() - tick));
+    cnt += sprintf(&mem[cnt], "%5.1f ", 0.001 * (double) (TIME_GET() - (pCtx ? pCtx->tick : LOG_TICK())));
+    if (pCtx && pCtx->pPrefix)
+    {
+        cnt += sprintf(&mem[cnt], "[%.64s] ", pCtx->pPrefix);
+    }
+    if (pCtx && pCtx->pfnOutput)
+    {
+        // no console colors, the sink gets the plain line
+        va_list args;
+        va_start(args, format);
+        cnt += vsprintf(&mem[cnt], format, args);
+        va_end(args);
+        pCtx->pfnOutput(pCtx->pUser, level, mem);
+        return;
+    }
     switch (level)
     {
 #ifdef _TEST
@@ -2064,7 +4531,10 @@ static BOOL WINAPI CONSOLE_CTRLHANDLER(DWORD dwCtrlType)
     if (dwCtrlType == CTRL_BREAK_EVENT)
     {
         // toggle verbosity
-        verbose = !verbose;
+        if (s_pConsoleLog)
+        {
+            s_pConsoleLog->verbose = !s_pConsoleLog->verbose;
+        }
         return TRUE;
     }
     return FALSE;
@@ -2080,6 +4550,7 @@ static struct termios sCONSOLE_tioSave;
 
 void CONSOLE_INIT(void)
 {
+    s_pConsoleLog = s_pLogCtx;
 #ifdef WIN32
     SetConsoleCtrlHandler(CONSOLE_CTRLHANDLER, TRUE);
 #else
@@ -2098,6 +4569,7 @@ void CONSOLE_INIT(void)
 #endif // WIN32
     sCONSOLE_SAVEPOS_y = 1;
     sCONSOLE_SAVEPOS_x = 1;
+    LOG_TICK();
 }
 
 void CONSOLE_DONE(void)
@@ -2114,6 +4586,14 @@ void CONSOLE_DONE(void)
 
 void CONSOLE_SAVE_POS(U4 offs)
 {
+    if (s_pLogCtx && s_pLogCtx->pfnOutput)
+    {
+        // no console behind the sink
+        return;
+    }
+    // the position is kept per log context
+    int* pX = s_pLogCtx ? &s_pLogCtx->savePosX : &sCONSOLE_SAVEPOS_x;
+    int* pY = s_pLogCtx ? &s_pLogCtx->savePosY : &sCONSOLE_SAVEPOS_y;
 
     // scroll terminal
     U4 i;
@@ -2125,8 +4605,8 @@ void CONSOLE_SAVE_POS(U4 offs)
 #ifdef WIN32
     CONSOLE_SCREEN_BUFFER_INFO info;
     GetConsoleScreenBufferInfo(GetStdHandle(STD_ERROR_HANDLE),&info);
-    sCONSOLE_SAVEPOS_x = info.dwCursorPosition.X;
-    sCONSOLE_SAVEPOS_y = info.dwCursorPosition.Y;
+    *pX = info.dwCursorPosition.X;
+    *pY = info.dwCursorPosition.Y;
 #else // WIN32
     if (isatty(fileno(stderr)))
     {
@@ -2147,29 +4627,35 @@ void CONSOLE_SAVE_POS(U4 offs)
         int x = 0, y = 0;
         if (sscanf(buf+2, "%i;%iR", &y, &x) == 2)
         {
-            sCONSOLE_SAVEPOS_y = y;
-            sCONSOLE_SAVEPOS_x = x;
+            *pY = y;
+            *pX = x;
         }
     }
 #endif // WIN32
-    sCONSOLE_SAVEPOS_y -= offs;
-    if (sCONSOLE_SAVEPOS_y < 1)
+    *pY -= offs;
+    if (*pY < 1)
     {
-        sCONSOLE_SAVEPOS_y = 1;
+        *pY = 1;
     }
 }
 
 void CONSOLE_RESTORE_POS(void)
 {
+    if (s_pLogCtx && s_pLogCtx->pfnOutput)
+    {
+        return;
+    }
+    const int* pX = s_pLogCtx ? &s_pLogCtx->savePosX : &sCONSOLE_SAVEPOS_x;
+    const int* pY = s_pLogCtx ? &s_pLogCtx->savePosY : &sCONSOLE_SAVEPOS_y;
 #ifdef WIN32
     COORD coord;
-    coord.X = (SHORT)sCONSOLE_SAVEPOS_x;
-    coord.Y = (SHORT)sCONSOLE_SAVEPOS_y;
+    coord.X = (SHORT)*pX;
+    coord.Y = (SHORT)*pY;
     SetConsoleCursorPosition(GetStdHandle(STD_ERROR_HANDLE),coord);
 #else
     if (isatty(fileno(stderr)))
     {
-        fprintf(stderr, "\e[%u;%uH", sCONSOLE_SAVEPOS_y, sCONSOLE_SAVEPOS_x);
+        fprintf(stderr, "\e[%u;%uH", *pY, *pX);
         fflush(stderr);
     }
 #endif // WIN32
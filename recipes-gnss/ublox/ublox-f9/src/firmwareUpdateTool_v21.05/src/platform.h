@@ -31,6 +31,7 @@
 #ifndef _PLATFORM_H
 #define _PLATFORM_H
 
+#include <stddef.h>
 #include "types.h"
 
 #define ENABLE_AARDVARK_SUPPORT   //!< AARDVARK USB->I2C/SPI converter
@@ -47,8 +48,14 @@
 
 #define ENABLE_NET_SUPPORT        //!< Network sockets
 
-//! verbosity
-extern int verbose;
+#if !defined(WIN32) && defined(ENABLE_NET_SUPPORT)
+# define ENABLE_MUX_SUPPORT       //!< Serial port shared over a Unix domain socket (see mux.c)
+#endif
+
+#if defined(linux) || defined(__linux__)
+# define ENABLE_I2CDEV_SUPPORT    //!< Linux i2c-dev I2C bus (/dev/i2c-N)
+# define ENABLE_SPIDEV_SUPPORT    //!< Linux spidev SPI bus (/dev/spidevX.Y)
+#endif
 
 // uncomment the line below if two stop bits has to be used
 //#define UART_TWO_STOP_BITS
@@ -62,9 +69,24 @@ typedef enum SER_TYPE_e
     I2C,                          //!< I2C Port over Aardvark
     SPI,                          //!< SPI Port over Aardvark
     SPU,                          //!< SPI Port over Diolan
-    NET                           //!< Serial port over Ethernet
+    NET,                          //!< Serial port over Ethernet
+    I2CDEV,                       //!< I2C Port over Linux i2c-dev
+    SPIDEV,                       //!< SPI Port over Linux spidev
+    MUX,                          //!< Serial port shared by the multiplexer (see mux.h)
+    USR                           //!< transport registered by the application, see SER_REGISTER()
 } SER_TYPE_t;
 
+struct SER_OPS_s;
+
+//! statistics of the 0xFF filter of SER_WRITE_SPI()
+typedef struct SER_FF_STATS_s
+{
+    U4 framesIn;                  //!< UPD-FLWRI frames passed to the filter
+    U4 bytesIn;                   //!< size of the frames passed to the filter
+    U4 framesOut;                 //!< UPD-FLWRI frames sent
+    U4 bytesOut;                  //!< size of the frames sent
+} SER_FF_STATS_t;
+
 //! serial port information handling type
 typedef struct SER_HANDLE_s
 {
@@ -74,6 +96,8 @@ typedef struct SER_HANDLE_s
     const CH*  pName;             //!< opening name of device
     void*      pData;             //!< custom data pointer
     U4         baudrate;          //!< current baudrate
+    const struct SER_OPS_s* pOps; //!< transport operations of the device
+    SER_FF_STATS_t ffStats;       //!< statistics of the 0xFF filter
 } SER_HANDLE_t;
 typedef SER_HANDLE_t* SER_HANDLE_pt; //!< pointer to SER_HANDLE_t type
 
@@ -83,6 +107,11 @@ typedef SER_HANDLE_t* SER_HANDLE_pt; //!< pointer to SER_HANDLE_t type
 //=====================================================================
 #define BaudrateDefaultI2C        100000   //!< The default I2C Baudrate
 
+//=====================================================================
+// SPI DEFAULTS
+//=====================================================================
+#define BaudrateDefaultSpiDev    1000000   //!< The default spidev clock
+
 //=====================================================================
 // TIME FUNCTIONS
 //=====================================================================
@@ -105,6 +134,96 @@ void TIME_SLEEP(U4 time);
 */
 U4   TIME_GET(void);
 
+//! Get CPU Time
+/*!
+    Number of milliseconds the process has spent on the CPU (user and
+    system). Use differences between subsequent calls.
+
+    \return number of milliseconds
+*/
+U4   TIME_CPU(void);
+
+//=====================================================================
+// FILES AND MEMORY
+//=====================================================================
+
+//! Map File
+/*!
+    Maps the whole file read-only into the address space. The pages are
+    read from the file when accessed and can be dropped again by the OS,
+    they don't count as allocated memory.
+
+    \param name \b IN: name of the file
+    \param pSize \b OUT: receives the size of the file
+    \return start of the mapping, NULL if the file can't be mapped (also if it is empty)
+*/
+const void* FILE_MAP(const CH* name, size_t* pSize);
+
+//! Unmap File
+/*!
+    \param p \b IN: mapping returned by FILE_MAP()
+    \param size \b IN: size returned by FILE_MAP()
+*/
+void FILE_UNMAP(const void* p, size_t size);
+
+//! Get Peak Memory
+/*!
+    Largest resident set (working set) of the process so far.
+
+    \return size in kB, 0 if not available
+*/
+U4   MEM_PEAK(void);
+
+//=====================================================================
+// THREADS
+//=====================================================================
+
+typedef struct THREAD_s* THREAD_pt; //!< handle of a thread started by THREAD_START()
+typedef struct MUTEX_s*  MUTEX_pt;  //!< handle of a mutex created by MUTEX_CREATE()
+
+//! Start Thread
+/*!
+    Runs \a pfn with the argument \a pArg in a new thread.
+
+    \param pfn \b IN: function to run
+    \param pArg \b IN: argument passed to \a pfn
+    \return handle to the thread on success, #NULL on failure
+*/
+THREAD_pt THREAD_START(void (*pfn)(void* pArg), void* pArg);
+
+//! Wait for Thread
+/*!
+    Waits until the function run by the thread has returned and releases
+    the handle.
+
+    \param thread \b IN: handle returned by THREAD_START()
+*/
+void THREAD_JOIN(THREAD_pt thread);
+
+//! Create Mutex
+/*!
+    \return handle to the mutex on success, #NULL on failure
+*/
+MUTEX_pt MUTEX_CREATE(void);
+
+//! Lock Mutex
+/*!
+    \param mutex \b IN: handle returned by MUTEX_CREATE()
+*/
+void MUTEX_LOCK(MUTEX_pt mutex);
+
+//! Unlock Mutex
+/*!
+    \param mutex \b IN: handle returned by MUTEX_CREATE()
+*/
+void MUTEX_UNLOCK(MUTEX_pt mutex);
+
+//! Delete Mutex
+/*!
+    \param mutex \b IN: handle returned by MUTEX_CREATE(), may be #NULL
+*/
+void MUTEX_DELETE(MUTEX_pt mutex);
+
 //=====================================================================
 // SERIAL IO
 //=====================================================================
@@ -118,9 +237,32 @@ U4   TIME_GET(void);
 */
 SER_HANDLE_pt SER_OPEN(const CH* name);
 
+//! Expand a Port Name Pattern
+/*!
+    Expands a device path with wildcards ('*', '?' or '[...]'), e.g.
+    "/dev/ttyUSB*", to the matching devices in alphabetical order. Any other
+    port name, and every name on Windows, is taken as it is.
+
+    \param pattern \b IN: port name, optionally with wildcards
+    \param pNames \b OUT: receives the names, to be released with free()
+    \param max \b IN: number of entries in \a pNames
+    \return number of names stored in \a pNames, 0 if nothing matches
+*/
+U4 SER_EXPAND(const CH* pattern, CH* pNames[], U4 max);
+
+//! Initialize Serial IO
+/*!
+    Registers the built-in transports. SER_OPEN() and SER_REGISTER() do this
+    on the first call, call it before opening ports from several threads.
+*/
+void SER_INIT(void);
+
 //! Write to SPI Port
 /*!
-    Write data to SPI port. Successive 0xFF will be filtered out.
+    Write data to SPI port. Runs of 0xFF in the data of an UPD-FLWRI frame
+    are not sent if they are longer than the overhead of an additional
+    frame; the data around them is sent as separate UPD-FLWRI frames in a
+    single write. The frames sent are counted in SER_HANDLE_t::ffStats.
 
     \param h \b IN: handle to open serial port
     \param p \b IN: buffer to data to be written
@@ -200,7 +342,8 @@ void SER_FLUSH(SER_HANDLE_pt h);
 
 //! Re-Enumerate Port
 /*!
-    Re-Enumerates Port, if applicable
+    Re-Enumerates Port, if applicable. Blocks until the port is back, see
+    SER_REENUM_STEP().
 
     \param h \b IN: handle to open serial port
     \param IsUsb \b IN: set to TRUE if serial port is really a USB connection
@@ -208,6 +351,214 @@ void SER_FLUSH(SER_HANDLE_pt h);
 */
 BOOL SER_REENUM(SER_HANDLE_pt h, BOOL IsUsb);
 
+//! state of a port re-enumeration, see SER_REENUM_STEP()
+typedef enum SER_REENUM_e
+{
+    SER_REENUM_PENDING,           //!< not done yet, to be continued after the time returned
+    SER_REENUM_DONE,              //!< port usable again
+    SER_REENUM_FAILED             //!< port lost
+} SER_REENUM_t;
+
+//! time the ports without their own re-enumeration settle before the settings are re-applied [ms]
+#define SER_REENUM_SETTLE   500
+
+//! Re-Enumerate Port, one attempt at a time
+/*!
+    The non-blocking form of SER_REENUM(). Called with \a attempt 0 first
+    and, as long as #SER_REENUM_PENDING is returned, with the next attempt
+    once \a *pWait ms have passed. The port must not be used in between,
+    a USB port is closed until it is back.
+
+    \param h \b IN: handle to open serial port
+    \param IsUsb \b IN: set to TRUE if serial port is really a USB connection
+    \param attempt \b IN: number of the attempt, 0 for the first one
+    \param pWait \b OUT: time to wait before the next attempt [ms]
+    \return state of the re-enumeration
+*/
+SER_REENUM_t SER_REENUM_STEP(SER_HANDLE_pt h, BOOL IsUsb, U4 attempt, U4* pWait);
+
+#ifdef ENABLE_NET_SUPPORT
+//! Set the HTTP Port of the Terminal Servers
+/*!
+    The baudrate of a "host:port" network port is set with an HTTP request
+    to the terminal server (ttycat), by default on port 80 of \a host. This
+    e.g. lets a test serve the request on a port it can bind. Ports opened
+    over RFC 2217 set the baudrate in-band and don't use it.
+
+    \param port \b IN: port or service name, #NULL for the default "80"
+*/
+void NET_SET_HTTP_PORT(const CH* port);
+#endif // ENABLE_NET_SUPPORT
+
+#ifdef ENABLE_I2CDEV_SUPPORT
+//! transfer of an i2c-dev port
+/*!
+    Writes \a txSize bytes to the device and, after a repeated start, reads
+    \a rxSize bytes from it, like one I2C_RDWR ioctl. Either part may be
+    empty.
+
+    \param pArg \b IN: argument of the transfer function
+    \param addr \b IN: address of the I2C device
+    \param pTx \b IN: data to write, may be #NULL if \a txSize is 0
+    \param txSize \b IN: number of bytes to write
+    \param pRx \b OUT: receives the data read, may be #NULL if \a rxSize is 0
+    \param rxSize \b IN: number of bytes to read
+    \return #TRUE on success, #FALSE with errno set: EREMOTEIO or EAGAIN if
+            the device didn't acknowledge the data (receive buffer full),
+            other values are errors
+*/
+typedef BOOL (*I2CDEV_XFER_FN)(void* pArg, U2 addr, const U1* pTx, U4 txSize, U1* pRx, U4 rxSize);
+
+//! Replace the Transfers of the i2c-dev Ports
+/*!
+    The i2c-dev ports opened afterwards don't open their bus but hand
+    every transfer to \a pfn, which e.g. lets a test run an update over
+    "/dev/i2c-1" against a simulated receiver. Ports already open keep
+    their transfer function.
+
+    \param pfn \b IN: transfer function, #NULL to use the i2c-dev buses again
+    \param pArg \b IN: argument passed to \a pfn
+*/
+void I2CDEV_SET_TRANSFER(I2CDEV_XFER_FN pfn, void* pArg);
+#endif // ENABLE_I2CDEV_SUPPORT
+
+#ifdef ENABLE_SPIDEV_SUPPORT
+//! full-duplex transfer of a spidev port
+/*!
+    \param pArg \b IN: argument of the transfer function
+    \param speed \b IN: SPI clock [Hz]
+    \param pTx \b IN: data to clock out
+    \param pRx \b OUT: receives the data clocked in, same size as \a pTx
+    \param size \b IN: number of bytes to transfer
+    \return #TRUE on success
+*/
+typedef BOOL (*SPIDEV_XFER_FN)(void* pArg, U4 speed, const U1* pTx, U1* pRx, U4 size);
+
+//! Replace the Transfers of the spidev Ports
+/*!
+    The spidev ports opened afterwards don't open their device but hand
+    every transfer to \a pfn, which e.g. lets a test run an update over
+    "/dev/spidev0.0" against a simulated receiver. Ports already open
+    keep their transfer function.
+
+    \param pfn \b IN: transfer function, #NULL to use the spidev devices again
+    \param pArg \b IN: argument passed to \a pfn
+*/
+void SPIDEV_SET_TRANSFER(SPIDEV_XFER_FN pfn, void* pArg);
+#endif // ENABLE_SPIDEV_SUPPORT
+
+//=====================================================================
+// TRANSPORT BACKENDS
+//=====================================================================
+
+/*! \name Transport capabilities (SER_OPS_t::caps)
+@{ */
+#define SER_CAP_WAITABLE_FD    0x01 //!< SER_FD() returns a descriptor that can be waited on with select()/poll()
+#define SER_CAP_SCATTER_WRITE  0x02 //!< SER_WRITEV() is handled by the transport without copying
+#define SER_CAP_FULL_DUPLEX    0x04 //!< receive and transmit are independent (half duplex otherwise)
+#define SER_CAP_POLLED         0x08 //!< the host has to poll the receiver for data (I2C/SPI master)
+#define SER_CAP_FF_FILTER      0x10 //!< runs of 0xFF in UPD-FLWRI are not sent (see SER_WRITE_SPI())
+#define SER_CAP_WRITE_BUFFERED 0x20 //!< writes are collected until SER_FLUSH(), SER_WAIT() or the next read
+/*! @} */
+
+//! buffer segment for SER_WRITEV()
+typedef struct SER_IOVEC_s
+{
+    const void* p;                //!< start of the segment
+    U4          size;             //!< size of the segment
+} SER_IOVEC_t;
+
+//! transport operations
+/*!
+    Every communication interface provides one of these tables and
+    registers it with SER_REGISTER(). SER_OPEN() hands the port name to
+    the \a pfnMatch function of every registered transport (latest
+    registration first) and opens the first one accepting it. The
+    optional functions may be NULL.
+*/
+typedef struct SER_OPS_s
+{
+    const CH*  pName;             //!< name of the transport
+    SER_TYPE_t type;              //!< type reported in SER_HANDLE_t::type
+    U4         caps;              //!< capabilities, see SER_CAP_WAITABLE_FD etc.
+    U4         maxFrame;          //!< maximum number of bytes accepted per write, 0 if unlimited
+    BOOL       exclusive;         //!< don't try other transports if \a pfnOpen fails
+
+    BOOL (*pfnMatch)(const CH* name);                     //!< check if the transport handles port \a name
+    BOOL (*pfnOpen)(SER_HANDLE_pt h, const CH* name);     //!< open, set SER_HANDLE_t::handle, devAddr and pData
+    void (*pfnClose)(SER_HANDLE_pt h);                    //!< close, SER_HANDLE_t::pData is freed by the caller
+    U4   (*pfnWrite)(SER_HANDLE_pt h, const void* p, U4 size); //!< write data
+    U4   (*pfnRead)(SER_HANDLE_pt h, void* p, U4 size);   //!< read data, don't block
+    BOOL (*pfnBaudrate)(SER_HANDLE_pt h, U4 br);          //!< set the baudrate
+    U4   (*pfnWriteV)(SER_HANDLE_pt h, const SER_IOVEC_t* pIov, U4 count); //!< optional: write several segments
+    SER_REENUM_t (*pfnReenum)(SER_HANDLE_pt h, BOOL IsUsb, U4 attempt, U4* pWait); //!< optional: one attempt of the re-enumeration, see SER_REENUM_STEP(), default re-applies the baudrate
+    U4   (*pfnPending)(SER_HANDLE_pt h);                  //!< optional: number of bytes available
+    void (*pfnClear)(SER_HANDLE_pt h);                    //!< optional: discard received data
+    void (*pfnFlush)(SER_HANDLE_pt h);                    //!< optional: write buffered data
+    int  (*pfnFd)(SER_HANDLE_pt h);                       //!< optional: descriptor to wait on
+    void (*pfnWait)(SER_HANDLE_pt h, U4 timeout);         //!< optional: wait until reading is worthwhile, default sleeps 1 ms
+
+    struct SER_OPS_s* pNext;      //!< next registered transport, maintained by SER_REGISTER()
+} SER_OPS_t;
+
+//! Register a transport
+/*!
+    The built-in transports are registered on first use. Transports
+    registered by the application take precedence over these, which
+    allows e.g. test harnesses to supply memory-backed links.
+
+    \param pOps \b IN: transport operations, must stay valid while registered
+*/
+void SER_REGISTER(SER_OPS_t* pOps);
+
+//! Get the capabilities of a port
+/*!
+    \param h \b IN: handle to open serial port
+    \return capability bits, see SER_CAP_WAITABLE_FD etc.
+*/
+U4 SER_CAPS(SER_HANDLE_pt h);
+
+//! Get the maximum number of bytes a port accepts per write
+/*!
+    \param h \b IN: handle to open serial port
+    \return maximum size, 0 if not limited
+*/
+U4 SER_MAXFRAME(SER_HANDLE_pt h);
+
+//! Get the descriptor to wait on for received data
+/*!
+    \param h \b IN: handle to open serial port
+    \return descriptor if #SER_CAP_WAITABLE_FD is set, -1 otherwise
+*/
+int SER_FD(SER_HANDLE_pt h);
+
+//! Wait for received data
+/*!
+    Waits until reading the port is worthwhile again, but at most \a timeout
+    milliseconds. Transports with a descriptor (#SER_CAP_WAITABLE_FD) block
+    on it until data arrives, polled transports wait until their next poll
+    of the receiver is due, the others sleep for 1 ms. Writes collected by
+    a transport with #SER_CAP_WRITE_BUFFERED are sent first.
+
+    \param h \b IN: handle to open serial port
+    \param timeout \b IN: maximum time to wait [ms]
+*/
+void SER_WAIT(SER_HANDLE_pt h, U4 timeout);
+
+//! Write several buffer segments to Serial Port
+/*!
+    Writes the segments in one go if the transport supports it
+    (#SER_CAP_SCATTER_WRITE), one after the other otherwise.
+
+    \param h \b IN: handle to open serial port
+    \param pIov \b IN: segments to be written
+    \param count \b IN: number of segments
+    \return number of bytes written
+*/
+U4 SER_WRITEV(SER_HANDLE_pt      h,
+              const SER_IOVEC_t* pIov,
+              U4                 count);
+
 //=====================================================================
 // STATUS MESSAGES
 //=====================================================================
@@ -227,11 +578,60 @@ typedef    enum
     MSG_DBGV   //!< Very verbose debug message
 } MSG_LEVEL;
 
+//! Log context of an update
+/*!
+    Holds the logging state of one update, so several updates can run in
+    one process, each in its own thread. Initialize it with LOG_INIT() and
+    bind it to the thread running the update with LOG_BIND().
+*/
+typedef struct LOG_CTX_s
+{
+    int        verbose;           //!< verbosity (0: rather quiet, 1: not so quiet, 2: dump acknowledges)
+    const CH*  pPrefix;           //!< printed in front of every message, e.g. the port name, NULL for none
+    void     (*pfnOutput)(void* pUser, MSG_LEVEL level, const CH* pLine); //!< receives every message line, NULL to print it to stderr
+    void*      pUser;             //!< argument of pfnOutput
+    U4         tick;              //!< start time, the messages are time stamped relative to it
+    int        savePosX;          //!< column saved by CONSOLE_SAVE_POS()
+    int        savePosY;          //!< row saved by CONSOLE_SAVE_POS()
+} LOG_CTX_t;
+
+//! Initialize Log Context
+/*!
+    \param pCtx \b OUT: log context to initialize
+    \param verbosity \b IN: verbosity of the context
+    \param pPrefix \b IN: printed in front of every message, #NULL for none
+*/
+void LOG_INIT(LOG_CTX_t* pCtx, int verbosity, const CH* pPrefix);
+
+//! Bind Log Context to the Calling Thread
+/*!
+    MESSAGE(), MESSAGE_PLAIN(), CONSOLE_SAVE_POS() and CONSOLE_RESTORE_POS()
+    use the context bound to the calling thread, or print to the console
+    with verbosity 0 if there is none.
+
+    \param pCtx \b IN: log context, #NULL to unbind
+    \return log context bound before, to be restored when done
+*/
+LOG_CTX_t* LOG_BIND(LOG_CTX_t* pCtx);
+
+//! Get the Log Context of the Calling Thread
+/*!
+    \return log context bound to the calling thread, #NULL if there is none
+*/
+LOG_CTX_t* LOG_CURRENT(void);
+
+//! Get the Verbosity of the Calling Thread
+/*!
+    \return verbosity of the bound log context, 0 if there is none
+*/
+int LOG_VERBOSE(void);
+
 //! Print status message
 /*!
     Print status message to standard output.
-    The message is printed if \a level is lower or equal to MSG_LEV2 or \a verbose is TRUE and
-    \a level is lower or equal to MSG_DBG; it is discarded otherwise.
+    The message is printed if \a level is lower or equal to MSG_LEV2 or the verbosity (see
+    LOG_VERBOSE()) is not 0 and \a level is lower or equal to MSG_DBG; it is discarded otherwise.
+    Messages of a thread with a log context are prefixed and output as configured in it.
 
     Messages assigned a message level #MSG_ERR or #MSG_WARN are prefixed with "ERROR:" or "WARNING:",
     respectively. Messages of type #MSG_DBG are prefixed with a hyphen. See details for #MSG_LEVEL
@@ -244,6 +644,15 @@ typedef    enum
 void MESSAGE(MSG_LEVEL level,
              const CH* format, ...);
 
+//! Print text as it is
+/*!
+    Prints \a format to standard error without time stamp and without a
+    line end added. With a log context bound that has an output, every
+    line of the text that isn't empty goes to it instead, at #MSG_LEV0.
+
+    \param format \b IN: format string
+    \param ... \b IN: optional arguments
+*/
 void MESSAGE_PLAIN(const CH* format, ...);
 
 //=====================================================================
@@ -251,6 +660,10 @@ void MESSAGE_PLAIN(const CH* format, ...);
 //=====================================================================
 
 //! initialize console
+/*!
+    The log context bound to the calling thread becomes the one of the
+    console, its verbosity is toggled with Ctrl+Break on Windows.
+*/
 void CONSOLE_INIT(void);
 
 //! cleanup console
@@ -32,10 +32,38 @@
 #include <stdlib.h>
 #include "receiver.h"
 
-const U4 gAutoBaudRates[] = {9600, 115200, 57600, 19200, 38400, 230400};
+const U4 gAutoBaudRates[AUTOBAUD_RATE_COUNT] = {9600, 115200, 57600, 19200, 38400, 230400};
 
 /*!
- * Send raw data to the receiver
+ * Hold back the messages sent next until the link settled
+ *
+ * \param rcv                   receiver control structure
+ * \param time                  time to add to the time already held back
+ */
+static void rcvHoldOff(INOUT RCV_DATA_t *rcv, IN U4 time)
+{
+    assert(rcv);
+    const U4 now = TIME_GET();
+    rcv->mReadyTime = (((I4)(rcv->mReadyTime - now) > 0) ? rcv->mReadyTime : now) + time;
+}
+
+/*!
+ * Sleep until the link settled
+ *
+ * \param rcv                   receiver control structure
+ */
+static void rcvWaitReady(INOUT RCV_DATA_t *rcv)
+{
+    assert(rcv);
+    const I4 remaining = (I4)(rcv->mReadyTime - TIME_GET());
+    if (remaining > 0)
+    {
+        TIME_SLEEP((U4)remaining);
+    }
+}
+
+/*!
+ * Send raw data to the receiver, once the link settled
  *
  * \param rcv                   receiver control structure
  * \param msg                   pointer to the data
@@ -46,6 +74,7 @@ static size_t rcvRawSend(INOUT RCV_DATA_t *rcv, CH* msg, size_t size)
 {
     assert(rcv);
 
+    rcvWaitReady(rcv);
     return SER_WRITE(rcv->mPortHandle, msg, size);
 }
 
@@ -58,8 +87,73 @@ static size_t rcvRawSend(INOUT RCV_DATA_t *rcv, CH* msg, size_t size)
 static void rcvClearBuffer(INOUT RCV_DATA_t *rcv)
 {
     assert(rcv);
-    rcv->mRecBuf.pCurrent = rcv->mRecBuf.Buf;
-    rcv->mRecBuf.pEnd     = rcv->mRecBuf.Buf;
+    rcv->mRecBuf.Rd     = 0;
+    rcv->mRecBuf.Fill   = 0;
+    rcv->mRecBuf.Staged = 0;
+    UbxParserInit(&rcv->mParser);
+}
+
+/*!
+ * Copy a message to a buffer of the message pool
+ *
+ * \param rcv                   receiver control structure
+ * \param pMsg                  message to copy
+ * \param size                  size of the message including the frame
+ * \return pointer to the copy or NULL if out of memory
+ */
+static UBX_HEAD_t* rcvCopyMessage(INOUT RCV_DATA_t *rcv, IN U1 const *pMsg, IN U4 size)
+{
+    assert(rcv);
+    U1* pCopy = NULL;
+    U4 i;
+    for (i = 0; i < RCV_MSG_POOL_COUNT; i++)
+    {
+        if (!rcv->mMsgPool.InUse[i])
+        {
+            rcv->mMsgPool.InUse[i] = TRUE;
+            pCopy = (U1*)rcv->mMsgPool.Buf[i];
+            break;
+        }
+    }
+    if (!pCopy)
+    {
+        // all buffers are still held by the caller
+        pCopy = (U1*)malloc(size);
+        if (!pCopy)
+        {
+            return NULL;
+        }
+    }
+    memcpy(pCopy, pMsg, size);
+    return (UBX_HEAD_t*)pCopy;
+}
+
+/*!
+ * Remove bytes from the front of the receive buffer
+ *
+ * \param rcv                   receiver control structure
+ * \param size                  number of bytes to remove
+ */
+static void rcvConsume(INOUT RCV_DATA_t *rcv, IN U4 size)
+{
+    assert(rcv);
+    RECEIVEBUF_t *pRb = &rcv->mRecBuf;
+    assert(size <= pRb->Fill);
+
+    pRb->Rd   += size;
+    pRb->Fill -= size;
+    if (pRb->Fill == 0)
+    {
+        // start over at the beginning, this keeps the data contiguous
+        pRb->Rd     = 0;
+        pRb->Staged = 0;
+    }
+    else if (pRb->Rd >= RECEIVEBUF_SIZE)
+    {
+        // continue in the wrapped part, the staging area is no longer needed
+        pRb->Rd    -= RECEIVEBUF_SIZE;
+        pRb->Staged = 0;
+    }
 }
 
 /*!
@@ -97,6 +191,7 @@ BOOL rcvConnect(INOUT RCV_DATA_t *rcv, IN const CH* comPort, IN U4 baudrate)
     assert(rcv);
 
     rcv->mPortHandle = NULL;
+    rcv->mReadyTime = TIME_GET();
     MESSAGE(MSG_DBG, "Trying to open port %s", comPort);
     rcv->mPortHandle = SER_OPEN(comPort);
 
@@ -108,6 +203,7 @@ BOOL rcvConnect(INOUT RCV_DATA_t *rcv, IN const CH* comPort, IN U4 baudrate)
 
     // initialize the receiver buffer
     rcvClearBuffer(rcv);
+    memset(rcv->mMsgPool.InUse, 0, sizeof(rcv->mMsgPool.InUse));
 
     // clear the serial port
     SER_CLEAR(rcv->mPortHandle);
@@ -135,7 +231,7 @@ BOOL rcvSendTrainingSequence(INOUT RCV_DATA_t *rcv)
     MESSAGE(MSG_DBG, "Sending training sequence");
     size_t size = sizeof(trainingSequence);
     BOOL success = rcvRawSend(rcv, trainingSequence, size) == size;
-    TIME_SLEEP(10);
+    rcvHoldOff(rcv, TRAINING_TIME);
     return success;
 }
 
@@ -167,6 +263,209 @@ BOOL rcvSendMessage( INOUT RCV_DATA_t *rcv
     return written == Size;
 }
 
+/*!
+ * Check if a message is the reply to a request
+ *
+ * \param req                   request
+ * \param msg                   message received, of class ACK if the request is acknowledged
+ * \return TRUE if it is the reply
+ */
+static BOOL rcvRequestMatch(IN const RCV_REQUEST_t *req, IN const UBX_HEAD_t *msg)
+{
+    U1 classId = msg->classId;
+    U1 msgId = msg->msgId;
+    if (req->ack)
+    {
+        if (msg->size < sizeof(UBX_ACK_ACK_t))
+        {
+            return FALSE;
+        }
+        const UBX_ACK_ACK_t *pAck = (const UBX_ACK_ACK_t*)((const U1*)msg + UBX_HEAD_SIZE);
+        classId = pAck->clsId;
+        msgId = pAck->msgId;
+    }
+    U4 i;
+    for (i = 0; i < req->count; i++)
+    {
+        if (req->ids[i][0] == classId && req->ids[i][1] == msgId)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*!
+ * Wait until a request is answered or timed out
+ *
+ * \param rcv                   receiver control structure
+ * \param req                   request prepared with rcvRequestInit()
+ * \param ppReply               receives the reply, see rcvRequestCheck()
+ * \return state of the request, not RCV_REQ_PENDING
+ */
+static RCV_REQ_STATE_t rcvRequestWait(INOUT RCV_DATA_t *rcv, INOUT RCV_REQUEST_t *req, OUT UBX_HEAD_t **ppReply)
+{
+    RCV_REQ_STATE_t state;
+    while ((state = rcvRequestCheck(rcv, req, ppReply)) == RCV_REQ_PENDING)
+    {
+        rcvWaitUntil(rcv, rcvRequestDeadline(rcv, req));
+    }
+    return state;
+}
+
+BOOL rcvRequestInit( INOUT RCV_REQUEST_t *req
+                   , IN U1 classId
+                   , IN U1 msgId
+                   , IN const CH* payload
+                   , IN U4 payloadSize
+                   , IN BOOL ack
+                   , IN U4 timeout )
+{
+    assert(req);
+    rcvRequestRelease(req);
+    req->ack      = ack;
+    req->timeout  = timeout;
+    req->sends    = RETRY_COUNT;
+    req->sent     = 0;
+    req->deadline = 0;
+    return rcvRequestAdd(req, classId, msgId, payload, payloadSize);
+}
+
+BOOL rcvRequestAdd( INOUT RCV_REQUEST_t *req
+                  , IN U1 classId
+                  , IN U1 msgId
+                  , IN const CH* payload
+                  , IN U4 payloadSize )
+{
+    assert(req);
+    assert( ( payload &&  payloadSize)
+         || (!payload && !payloadSize));
+
+    CH* pMessage;
+    size_t size;
+    if ((req->count == RCV_REQUEST_MSGS) ||
+        !UbxCreateMessage(classId, msgId, payload, payloadSize, &pMessage, &size))
+    {
+        return FALSE;
+    }
+    CH* pFrames = (CH*)realloc(req->pFrames, req->size + size);
+    if (!pFrames)
+    {
+        free(pMessage);
+        return FALSE;
+    }
+    memcpy(pFrames + req->size, pMessage, size);
+    free(pMessage);
+    req->pFrames = pFrames;
+    req->size += size;
+    req->ids[req->count][0] = classId;
+    req->ids[req->count][1] = msgId;
+    req->count++;
+    return TRUE;
+}
+
+RCV_REQ_STATE_t rcvRequestCheck( INOUT RCV_DATA_t *rcv
+                               , INOUT RCV_REQUEST_t *req
+                               , OUT UBX_HEAD_t **ppReply )
+{
+    assert(rcv && req);
+    if (ppReply)
+    {
+        *ppReply = NULL;
+    }
+
+    if (req->sent)
+    {
+        // loop so the message is not retransmitted when the reply to a different
+        // (previous) message is already in the buffer or is received
+        UBX_HEAD_t *msg;
+        while ((msg = rcvReceiveMessage(rcv, 0, req->ack ? UBX_CLASS_ACK : -1, -1)) != NULL)
+        {
+            if (rcvRequestMatch(req, msg))
+            {
+                if (req->ack)
+                {
+                    const BOOL success = (msg->msgId == UBX_ACK_ACK);
+                    rcvReleaseMessage(rcv, msg);
+                    return success ? RCV_REQ_REPLY : RCV_REQ_NAK;
+                }
+                if (ppReply)
+                {
+                    *ppReply = msg;
+                }
+                else
+                {
+                    rcvReleaseMessage(rcv, msg);
+                }
+                return RCV_REQ_REPLY;
+            }
+            rcvReleaseMessage(rcv, msg);
+        }
+        if ((I4)(TIME_GET() - req->deadline) < 0)
+        {
+            return RCV_REQ_PENDING;
+        }
+    }
+
+    // (re)send the messages, but not while the link settles
+    if (req->sent == req->sends)
+    {
+        return RCV_REQ_TIMEOUT;
+    }
+    const U4 now = TIME_GET();
+    if ((I4)(rcv->mReadyTime - now) > 0)
+    {
+        return RCV_REQ_PENDING;
+    }
+    if (req->sent && !req->ack)
+    {
+        MESSAGE(MSG_DBG, "Retry poll");
+    }
+    req->sent++;
+    req->deadline = now + req->timeout;
+    if (rcvRawSend(rcv, req->pFrames, req->size) != req->size)
+    {
+        // retry right away
+        req->deadline = now;
+    }
+    return RCV_REQ_PENDING;
+}
+
+U4 rcvRequestDeadline(IN const RCV_DATA_t *rcv, IN const RCV_REQUEST_t *req)
+{
+    assert(rcv && req);
+    const U4 time = req->sent ? req->deadline : TIME_GET();
+    return ((I4)(rcv->mReadyTime - time) > 0) ? rcv->mReadyTime : time;
+}
+
+void rcvRequestRelease(INOUT RCV_REQUEST_t *req)
+{
+    assert(req);
+    free(req->pFrames);
+    req->pFrames = NULL;
+    req->size = 0;
+    req->count = 0;
+}
+
+void rcvWaitUntil(INOUT RCV_DATA_t *rcv, IN U4 time)
+{
+    assert(rcv);
+    const U4 now = TIME_GET();
+    const I4 remaining = (I4)(time - now);
+    const I4 settling = (I4)(rcv->mReadyTime - now);
+    if (remaining <= 0)
+    {
+        return;
+    }
+    if (settling > 0)
+    {
+        // nothing to read before the link settled
+        TIME_SLEEP((U4)MIN(settling, remaining));
+        return;
+    }
+    SER_WAIT(rcv->mPortHandle, (U4)remaining);
+}
+
 UBX_HEAD_t* rcvPollMessage( INOUT RCV_DATA_t *rcv
                           , IN U1 classId
                           , IN U1 msgId
@@ -178,16 +477,15 @@ UBX_HEAD_t* rcvPollMessage( INOUT RCV_DATA_t *rcv
     assert( ( payload &&  payloadSize)
          || (!payload && !payloadSize));
 
-    U4 retryCount;
-    for(retryCount = 0; retryCount < RETRY_COUNT; retryCount++)
+    RCV_REQUEST_t req;
+    UBX_HEAD_t* msg = NULL;
+    memset(&req, 0, sizeof(req));
+    if (rcvRequestInit(&req, classId, msgId, payload, payloadSize, FALSE, timeout))
     {
-        UBX_HEAD_t* msg = rcvPollMessageOnce(rcv, classId, msgId,  payload, payloadSize, timeout);
-        if(msg != NULL)
-            return msg;
-
-        MESSAGE(MSG_DBG, "Retry poll");
+        rcvRequestWait(rcv, &req, &msg);
     }
-    return NULL;
+    rcvRequestRelease(&req);
+    return msg;
 }
 
 int rcvAckMessage( INOUT RCV_DATA_t *rcv
@@ -201,86 +499,103 @@ int rcvAckMessage( INOUT RCV_DATA_t *rcv
     assert( ( payload &&  payloadSize)
          || (!payload && !payloadSize));
 
-    U4 retryCount;
-    for(retryCount = 0; retryCount < RETRY_COUNT; retryCount++)
+    RCV_REQUEST_t req;
+    RCV_REQ_STATE_t state = RCV_REQ_TIMEOUT;
+    memset(&req, 0, sizeof(req));
+    if (rcvRequestInit(&req, classId, msgId, payload, payloadSize, TRUE, timeout))
     {
-        if( rcvSendMessage(rcv, classId, msgId,  payload, payloadSize) )
-        {
-            const U4 toTime = TIME_GET() + timeout;
-            do // loop so message is not retransmitted when ACK from different (previous) message is already in buffor or is received.
-            {
-                UBX_HEAD_t *ack = rcvReceiveMessage(rcv, toTime - TIME_GET(), UBX_CLASS_ACK, -1);
-                if (ack != NULL)
-                {
-                    UBX_ACK_ACK_t *pAck = (UBX_ACK_ACK_t*)((U1*)ack + UBX_HEAD_SIZE);
-                    if (pAck->clsId == classId &&
-                        pAck->msgId == msgId)
-                    {
-                        BOOL success = ack->msgId == UBX_ACK_ACK;
-                        free(ack);
-                        return success ? 1 : 0;
-                    }
-                    free(ack);
-                }
-            }
-            while (TIME_GET() < toTime);
-        }
+        state = rcvRequestWait(rcv, &req, NULL);
     }
-    return -1;
+    rcvRequestRelease(&req);
+    return (state == RCV_REQ_REPLY) ? 1 : (state == RCV_REQ_NAK) ? 0 : -1;
 }
 
 UBX_HEAD_t* rcvReceiveMessage(INOUT RCV_DATA_t *rcv, IN U4 timeout, IN I4 classId, IN I4 msgId)
 {
     assert(rcv);
+    RECEIVEBUF_t *pRb = &rcv->mRecBuf;
 
     const U4 toTime = TIME_GET() + timeout;
+    BOOL found;
     do
     {
-        U4 availableSize = RECEIVEBUF_SIZE - (rcv->mRecBuf.pEnd - rcv->mRecBuf.pCurrent);
-        U4 received = SER_READ(rcv->mPortHandle, rcv->mRecBuf.pEnd, availableSize);
+        // read into the free space up to the end of the buffer
+        if (pRb->Fill < RECEIVEBUF_SIZE)
+        {
+            U4 wr = (pRb->Rd + pRb->Fill) % RECEIVEBUF_SIZE;
+            U4 availableSize = (wr >= pRb->Rd) ? RECEIVEBUF_SIZE - wr : pRb->Rd - wr;
+            pRb->Fill += SER_READ(rcv->mPortHandle, pRb->Buf + wr, availableSize);
+        }
 
-        rcv->mRecBuf.pEnd += received;
-        U1* pMessageBegin = NULL;
+        // mirror the newly wrapped data to the staging area
+        U4 contiguous = MIN(pRb->Fill, RECEIVEBUF_SIZE - pRb->Rd);
+        U4 staged = MIN(pRb->Fill - contiguous, RECEIVEBUF_STAGING);
+        if (staged > pRb->Staged)
+        {
+            memcpy(pRb->Buf + RECEIVEBUF_SIZE + pRb->Staged, pRb->Buf + pRb->Staged, staged - pRb->Staged);
+            pRb->Staged = staged;
+        }
 
         //parse buffer if a valid UBX message can be found
-        //start at position pCurrent
-        if (UbxSearchMsg(rcv->mRecBuf.pCurrent, rcv->mRecBuf.pEnd - rcv->mRecBuf.pCurrent, &pMessageBegin))
+        //start at position Rd
+        U1* pBegin = pRb->Buf + pRb->Rd;
+        U1* pMessageBegin = pBegin;
+        found = UbxParse(&rcv->mParser, pBegin, contiguous + staged, &pMessageBegin);
+
+        // discard everything before the (possible) message start
+        rcvConsume(rcv, (U4)(pMessageBegin - pBegin));
+
+        if (found)
         {
             UBX_HEAD_t ubxhead;
             memcpy(&ubxhead, pMessageBegin, sizeof(ubxhead));
-            CH* message = (CH*)malloc((ubxhead.size + UBX_FRAME_SIZE)*sizeof(CH));
-            if (!message)
-            {
-                return NULL;
-            }
-
-            // copy the message to the buffer
-            memcpy(message, pMessageBegin, ubxhead.size + UBX_FRAME_SIZE);
-
-            rcv->mRecBuf.pCurrent = pMessageBegin + ubxhead.size + UBX_FRAME_SIZE;
-
-            // move the rest of the data to the beginning of the buffer
-            memmove(rcv->mRecBuf.Buf, rcv->mRecBuf.pCurrent, rcv->mRecBuf.pEnd - rcv->mRecBuf.pCurrent);
-            rcv->mRecBuf.pEnd -= rcv->mRecBuf.pCurrent - rcv->mRecBuf.Buf;
-            rcv->mRecBuf.pCurrent = rcv->mRecBuf.Buf;
+            U4 size = ubxhead.size + UBX_FRAME_SIZE;
 
+            UBX_HEAD_t *message = NULL;
             if ((classId == -1 || classId == ubxhead.classId)
                 && (msgId == -1 || msgId == ubxhead.msgId))
             {
-                return (UBX_HEAD_t*)message;
+                // copy before the message is removed from the buffer
+                message = rcvCopyMessage(rcv, pMessageBegin, size);
+            }
+            rcvConsume(rcv, size);
+            if (message)
+            {
+                return message;
             }
-            free(message);
         }
-        else
+        else if (timeout)
         {
-            TIME_SLEEP(1); // don't loop at 100% CPU
+            // don't loop at 100% CPU, wait for the receiver instead
+            I4 remaining = (I4)(toTime - TIME_GET());
+            SER_WAIT(rcv->mPortHandle, (remaining > 1) ? (U4)remaining : 1);
         }
     }
-    while(TIME_GET() < toTime);
+    // go through all the messages received so far, also without a timeout
+    while(found || (TIME_GET() < toTime));
 
     return NULL;
 }
 
+void rcvReleaseMessage(INOUT RCV_DATA_t *rcv, IN UBX_HEAD_t *msg)
+{
+    assert(rcv);
+    if (!msg)
+    {
+        return;
+    }
+    U4 i;
+    for (i = 0; i < RCV_MSG_POOL_COUNT; i++)
+    {
+        if ((U1*)msg == (U1*)rcv->mMsgPool.Buf[i])
+        {
+            rcv->mMsgPool.InUse[i] = FALSE;
+            return;
+        }
+    }
+    free(msg);
+}
+
 BOOL rcvReenumerate(INOUT RCV_DATA_t *rcv, BOOL isUsbPort)
 {
     assert(rcv);
@@ -301,44 +616,136 @@ BOOL rcvReenumerate(INOUT RCV_DATA_t *rcv, BOOL isUsbPort)
     return result;
 }
 
-UBX_HEAD_t* rcvDoAutobaud(INOUT RCV_DATA_t *rcv, IN BOOL sendTraining)
+SER_REENUM_t rcvReenumerateStep( INOUT RCV_DATA_t *rcv
+                               , IN BOOL isUsbPort
+                               , IN U4 attempt
+                               , OUT U4 *pWait )
 {
     assert(rcv);
-    U4 retryCount = 0;
-    U4 autoBaudIndex = 0;
+    assert(pWait);
+    *pWait = 0;
+    if (rcv->mPortHandle->type == COM && !isUsbPort)
+    {
+        return SER_REENUM_DONE;
+    }
+    const SER_REENUM_t state = SER_REENUM_STEP(rcv->mPortHandle, isUsbPort, attempt, pWait);
+    if (state == SER_REENUM_FAILED)
+    {
+        MESSAGE(MSG_ERR, "Reconnect failed.");
+    }
+    return state;
+}
 
-    for(;;)
+UBX_HEAD_t* rcvDoAutobaud(INOUT RCV_DATA_t *rcv, IN BOOL sendTraining)
+{
+    assert(rcv);
+    RCV_AUTOBAUD_t ab;
+    UBX_HEAD_t* msg = NULL;
+    memset(&ab, 0, sizeof(ab));
+    if (rcvAutobaudStart(&ab, sendTraining))
     {
-        UBX_HEAD_t* msg = rcvPollMessage(rcv, UBX_CLASS_MON, UBX_MON_VER, NULL, 0, AUTOBAUD_TIMEOUT);
-        if(msg != NULL)
+        while (rcvAutobaudCheck(rcv, &ab, &msg) == RCV_REQ_PENDING)
         {
-            MESSAGE(MSG_DBG,"Detected Baudrate is %d", rcv->mPortHandle->baudrate);
-            return msg;
+            rcvWaitUntil(rcv, rcvAutobaudDeadline(rcv, &ab));
         }
+    }
+    rcvRequestRelease(&ab.req);
+    return msg;
+}
 
-        if (retryCount++ <= RETRY_COUNT_AUTOBAUD)
+BOOL rcvAutobaudStart(INOUT RCV_AUTOBAUD_t *ab, IN BOOL sendTraining)
+{
+    assert(ab);
+    ab->training = sendTraining;
+    ab->trainingPending = FALSE;
+    ab->retries = 0;
+    ab->index = 0;
+    return rcvRequestInit(&ab->req, UBX_CLASS_MON, UBX_MON_VER, NULL, 0, FALSE, AUTOBAUD_TIMEOUT);
+}
+
+RCV_REQ_STATE_t rcvAutobaudCheck( INOUT RCV_DATA_t *rcv
+                                , INOUT RCV_AUTOBAUD_t *ab
+                                , OUT UBX_HEAD_t **ppMonVer )
+{
+    assert(rcv && ab && ppMonVer);
+    *ppMonVer = NULL;
+    if (ab->trainingPending)
+    {
+        // send the training sequence once the new baudrate settled
+        if ((I4)(rcv->mReadyTime - TIME_GET()) <= 0)
         {
-            MESSAGE(MSG_DBG,"...retrying autobaud");
+            rcvSendTrainingSequence(rcv);
+            ab->trainingPending = FALSE;
         }
-        else if(autoBaudIndex < NUMOF(gAutoBaudRates))
-        {
-            // advance to the next baudrate
-            MESSAGE(MSG_DBG, "Retrying with baudrate %d", gAutoBaudRates[autoBaudIndex]);
-            rcvSetBaud(rcv, gAutoBaudRates[autoBaudIndex]);
+        return RCV_REQ_PENDING;
+    }
 
-            // send the training sequence
-            if(sendTraining)
-                rcvSendTrainingSequence(rcv);
+    RCV_REQ_STATE_t state = rcvRequestCheck(rcv, &ab->req, ppMonVer);
+    if (state == RCV_REQ_REPLY)
+    {
+        MESSAGE(MSG_DBG,"Detected Baudrate is %d", rcv->mPortHandle->baudrate);
+        return state;
+    }
+    if (state == RCV_REQ_PENDING)
+    {
+        return state;
+    }
 
-            ++autoBaudIndex;
-            retryCount = 0;
-        }
-        else
+    if (ab->retries++ <= RETRY_COUNT_AUTOBAUD)
+    {
+        MESSAGE(MSG_DBG,"...retrying autobaud");
+    }
+    else if(ab->index < NUMOF(gAutoBaudRates))
+    {
+        // advance to the next baudrate
+        MESSAGE(MSG_DBG, "Retrying with baudrate %d", gAutoBaudRates[ab->index]);
+        rcvSetBaud(rcv, gAutoBaudRates[ab->index]);
+
+        // send the training sequence
+        ab->trainingPending = ab->training;
+
+        ++ab->index;
+        ab->retries = 0;
+    }
+    else
+    {
+        MESSAGE(MSG_ERR, "Unable to Communicate on any Baudrate");
+        return RCV_REQ_TIMEOUT;
+    }
+    // poll again
+    ab->req.sent = 0;
+    return RCV_REQ_PENDING;
+}
+
+U4 rcvAutobaudDeadline(IN const RCV_DATA_t *rcv, IN const RCV_AUTOBAUD_t *ab)
+{
+    assert(rcv && ab);
+    // also the time the pending training sequence is sent
+    return rcvRequestDeadline(rcv, &ab->req);
+}
+
+UBX_HEAD_t* rcvProbe( INOUT RCV_DATA_t *rcv
+                    , IN U4 baud
+                    , IN BOOL sendTraining
+                    , IN U4 timeout )
+{
+    assert(rcv);
+    if (baud && (baud != rcv->mPortHandle->baudrate))
+    {
+        // no settling delay, a reply garbled by the switch just times out
+        rcvClearBuffer(rcv);
+        if (!SER_BAUDRATE(rcv->mPortHandle, baud))
         {
-            MESSAGE(MSG_ERR, "Unable to Communicate on any Baudrate");
+            MESSAGE(MSG_DBG, "Could not set baudrate %u", baud);
             return NULL;
         }
+        SER_CLEAR(rcv->mPortHandle);
     }
+
+    if (sendTraining)
+        rcvSendTrainingSequence(rcv);
+
+    return rcvPollMessageOnce(rcv, UBX_CLASS_MON, UBX_MON_VER, NULL, 0, timeout);
 }
 
 BOOL rcvSetBaud(INOUT RCV_DATA_t *rcv, int baud)
@@ -354,13 +761,14 @@ BOOL rcvSetBaud(INOUT RCV_DATA_t *rcv, int baud)
         MESSAGE(MSG_ERR, "Could not configure communications port.");
         return FALSE;
     }
-    TIME_SLEEP(200);
+    rcvHoldOff(rcv, BAUD_SETTLE_TIME);
     return TRUE;
 }
 
 void rcvFlushBuffer(INOUT RCV_DATA_t *rcv)
 {
     assert(rcv);
+    rcvWaitReady(rcv);
     SER_CLEAR(rcv->mPortHandle);
     rcvClearBuffer(rcv);
 
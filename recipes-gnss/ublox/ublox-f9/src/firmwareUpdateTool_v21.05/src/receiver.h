@@ -37,36 +37,112 @@
 //! receive buffer size
 #define RECEIVEBUF_SIZE     65536
 
+//! size of the staging area behind the receive buffer
+#define RECEIVEBUF_STAGING  UBX_MAX_FRAME_SIZE
+
+//! number of message buffers handed out by rcvReceiveMessage() without heap allocation
+#define RCV_MSG_POOL_COUNT      4
+
 //! timeout for autobauding
 #define AUTOBAUD_TIMEOUT      300
 
 //! timeout for getting a polled message
 #define POLL_TIMEOUT         1000
 
+//! timeout of rcvProbe(), long enough for a MON-VER reply at 9600 baud
+#define PROBE_TIMEOUT         500
+
+//! time the link settles after a baudrate change before anything is sent
+#define BAUD_SETTLE_TIME      200
+
+//! time the receiver gets after the training sequence before anything is sent
+#define TRAINING_TIME          10
+
 //! Number of retries when autobauding
 #define RETRY_COUNT_AUTOBAUD    5
 
 //! Number of retries for status messages (except for erase/write)
 #define RETRY_COUNT             3
 
+//! Number of baudrates to use when autobauding
+#define AUTOBAUD_RATE_COUNT     6
+
 //! List of baudrates to use when autobauding
-extern const U4 gAutoBaudRates[];
+extern const U4 gAutoBaudRates[AUTOBAUD_RATE_COUNT];
 
 //! The receive buffer to write into
+/*!
+    Circular buffer of #RECEIVEBUF_SIZE bytes. Data wrapping around the end of
+    the buffer is mirrored into the staging area following it, so that a
+    message starting before the end can always be parsed in place.
+*/
 typedef struct RECEIVEBUF_s
 {
-    U1  Buf[RECEIVEBUF_SIZE];   //!< buffer containing received data
-    U1* pCurrent;               //!< pointer to begin of valid data
-    U1* pEnd;                   //!< pointer to end of valid data
+    U1  Buf[RECEIVEBUF_SIZE + RECEIVEBUF_STAGING]; //!< circular buffer followed by the staging area
+    U4  Rd;                     //!< index of the first valid byte
+    U4  Fill;                   //!< number of valid bytes
+    U4  Staged;                 //!< number of bytes from the buffer start mirrored to the staging area
 } RECEIVEBUF_t;
 
+//! Buffers for the messages returned to the caller
+typedef struct RCV_MSG_POOL_s
+{
+    U4   Buf[RCV_MSG_POOL_COUNT][UBX_MAX_FRAME_SIZE/sizeof(U4)]; //!< message buffers (U4 for alignment)
+    BOOL InUse[RCV_MSG_POOL_COUNT];  //!< buffer handed out and not released yet
+} RCV_MSG_POOL_t;
+
 //! Structure that defines a connection
 typedef struct
 {
     RECEIVEBUF_t mRecBuf;            //!< local instance of the receive buffer
+    UBX_PARSER_t mParser;            //!< parser state of the receive buffer
+    RCV_MSG_POOL_t mMsgPool;         //!< buffers for the received messages
     SER_HANDLE_t *mPortHandle;       //!< handle of the port connected to
+    U4 mReadyTime;                   //!< nothing is sent before this time (see TIME_GET()), the link settles
 } RCV_DATA_t;
 
+//! state of a request, see rcvRequestCheck()
+typedef enum RCV_REQ_STATE_e
+{
+    RCV_REQ_PENDING,                 //!< no reply yet, check again until rcvRequestDeadline()
+    RCV_REQ_REPLY,                   //!< reply received, ACK-ACK for an acknowledged message
+    RCV_REQ_NAK,                     //!< ACK-NAK received for an acknowledged message
+    RCV_REQ_TIMEOUT                  //!< no reply, also after the retries
+} RCV_REQ_STATE_t;
+
+//! maximum number of messages sent with one request
+#define RCV_REQUEST_MSGS        2
+
+//! messages sent to the receiver and the reply waited for, without blocking
+/*!
+    The non-blocking form of rcvPollMessage() and rcvAckMessage(): the
+    messages are sent by rcvRequestCheck(), which returns right away and is
+    called again until the reply arrived or the retries ran out. Must be
+    zeroed before the first rcvRequestInit().
+*/
+typedef struct RCV_REQUEST_s
+{
+    CH*  pFrames;                    //!< messages to send, resent after a timeout
+    size_t size;                     //!< size of the messages
+    U1   ids[RCV_REQUEST_MSGS][2];   //!< class and message id of the messages, a reply to any of them is accepted
+    U4   count;                      //!< number of messages
+    BOOL ack;                        //!< the reply is the ACK-ACK or ACK-NAK of the message
+    U4   timeout;                    //!< time to wait for the reply before the messages are sent again
+    U4   sends;                      //!< number of times the messages are sent at most
+    U4   sent;                       //!< number of times the messages were sent so far
+    U4   deadline;                   //!< time the reply is due
+} RCV_REQUEST_t;
+
+//! MON-VER poll trying the baudrates of #gAutoBaudRates, without blocking
+typedef struct RCV_AUTOBAUD_s
+{
+    RCV_REQUEST_t req;               //!< MON-VER poll at the current baudrate
+    BOOL training;                   //!< send the training sequence after a baudrate change
+    BOOL trainingPending;            //!< training sequence still to be sent
+    U4   retries;                    //!< polls done at the current baudrate
+    U4   index;                      //!< index of the next baudrate to try
+} RCV_AUTOBAUD_t;
+
 /*!
  * Connect to the receiver
  *
@@ -124,6 +200,86 @@ int rcvAckMessage( INOUT RCV_DATA_t *rcv
                  , IN U4 payloadSize
                  , IN U4 timeout );
 
+/*!
+ * Prepare a request: a message to send and the reply to wait for. The
+ * message is sent by the first rcvRequestCheck(), and again RETRY_COUNT
+ * times at most if the reply doesn't arrive within the timeout.
+ *
+ * \param req                   request, zeroed or used before
+ * \param classId               class id of the message to send
+ * \param msgId                 the message id of the message to send
+ * \param payload               pointer to the payload to include in the message, may be NULL
+ * \param payloadSize           size of the payload, must be 0 if payload is NULL
+ * \param ack                   wait for the ACK-ACK or ACK-NAK instead of a message of the same class and id
+ * \param timeout               time to wait for the reply before the message is sent again
+ * \return TRUE if successful, FALSE if out of memory
+ */
+BOOL rcvRequestInit( INOUT RCV_REQUEST_t *req
+                   , IN U1 classId
+                   , IN U1 msgId
+                   , IN const CH* payload
+                   , IN U4 payloadSize
+                   , IN BOOL ack
+                   , IN U4 timeout );
+
+/*!
+ * Add a message to a request prepared with rcvRequestInit(). It is sent
+ * after the first one, a reply to either of them ends the request.
+ *
+ * \param req                   request
+ * \param classId               class id of the message to add
+ * \param msgId                 the message id of the message to add
+ * \param payload               pointer to the payload to include in the message, may be NULL
+ * \param payloadSize           size of the payload, must be 0 if payload is NULL
+ * \return TRUE if successful, FALSE if out of memory or too many messages
+ */
+BOOL rcvRequestAdd( INOUT RCV_REQUEST_t *req
+                  , IN U1 classId
+                  , IN U1 msgId
+                  , IN const CH* payload
+                  , IN U4 payloadSize );
+
+/*!
+ * Send the messages of a request if due and check for the reply, without
+ * waiting. Messages received that aren't the reply are discarded.
+ *
+ * \param rcv                   receiver control structure
+ * \param req                   request prepared with rcvRequestInit()
+ * \param ppReply               receives the reply if RCV_REQ_REPLY is returned and the request
+ *                              isn't acknowledged, must be released with rcvReleaseMessage(),
+ *                              may be NULL
+ * \return state of the request
+ */
+RCV_REQ_STATE_t rcvRequestCheck( INOUT RCV_DATA_t *rcv
+                               , INOUT RCV_REQUEST_t *req
+                               , OUT UBX_HEAD_t **ppReply );
+
+/*!
+ * Get the time rcvRequestCheck() is to be called again at the latest, it
+ * is to be called earlier when data from the receiver arrives.
+ *
+ * \param rcv                   receiver control structure
+ * \param req                   pending request
+ * \return time, see TIME_GET()
+ */
+U4 rcvRequestDeadline(IN const RCV_DATA_t *rcv, IN const RCV_REQUEST_t *req);
+
+/*!
+ * Release the memory of a request
+ *
+ * \param req                   request, zeroed or used before
+ */
+void rcvRequestRelease(INOUT RCV_REQUEST_t *req);
+
+/*!
+ * Wait for data from the receiver, but at most until the given time. Sleeps
+ * while the link settles (see RCV_DATA_t::mReadyTime).
+ *
+ * \param rcv                   receiver control structure
+ * \param time                  time to return at the latest, see TIME_GET()
+ */
+void rcvWaitUntil(INOUT RCV_DATA_t *rcv, IN U4 time);
+
 /*!
  * Receive a message with given class and message id from the receiver. If other messages with
  * different class or message ids are received within the timeout they are discarded.
@@ -132,13 +288,22 @@ int rcvAckMessage( INOUT RCV_DATA_t *rcv
  * \param timeout               wait for timeout
  * \param classId               class id of the message to receive
  * \param msgId                 message id of the message to receive
- * \return pointer to the received message or null if the timeout expired
+ * \return pointer to the received message or null if the timeout expired,
+ *         must be released with rcvReleaseMessage()
  */
 UBX_HEAD_t* rcvReceiveMessage( INOUT RCV_DATA_t *rcv
                              , IN U4 timeout
                              , IN I4 classId
                              , IN I4 msgId );
 
+/*!
+ * Release a message returned by rcvReceiveMessage(), rcvPollMessage() or rcvDoAutobaud()
+ *
+ * \param rcv                   receiver control structure
+ * \param msg                   message to release, may be NULL
+ */
+void rcvReleaseMessage(INOUT RCV_DATA_t *rcv, IN UBX_HEAD_t *msg);
+
 /*!
  * Send a message to the receiver
  *
@@ -166,7 +331,56 @@ BOOL rcvSendMessage( INOUT RCV_DATA_t *rcv
 UBX_HEAD_t* rcvDoAutobaud(INOUT RCV_DATA_t *rcv, IN BOOL sendTrainingSequence);
 
 /*!
- * Reinitialize the connection
+ * Start polling MON-VER trying different baudrates, the non-blocking form
+ * of rcvDoAutobaud()
+ *
+ * \param ab                    autobaud state, zeroed or used before
+ * \param sendTrainingSequence  should the training sequence be sent or not
+ * \return TRUE if successful, FALSE if out of memory
+ */
+BOOL rcvAutobaudStart(INOUT RCV_AUTOBAUD_t *ab, IN BOOL sendTrainingSequence);
+
+/*!
+ * Continue polling MON-VER trying different baudrates, without waiting
+ *
+ * \param rcv                   receiver control structure
+ * \param ab                    autobaud state started with rcvAutobaudStart()
+ * \param ppMonVer              receives the MON-VER message if RCV_REQ_REPLY is returned,
+ *                              must be released with rcvReleaseMessage()
+ * \return RCV_REQ_PENDING until the receiver replied (RCV_REQ_REPLY) or
+ *         communication failed on all baudrates (RCV_REQ_TIMEOUT)
+ */
+RCV_REQ_STATE_t rcvAutobaudCheck( INOUT RCV_DATA_t *rcv
+                                , INOUT RCV_AUTOBAUD_t *ab
+                                , OUT UBX_HEAD_t **ppMonVer );
+
+/*!
+ * Get the time rcvAutobaudCheck() is to be called again at the latest
+ *
+ * \param rcv                   receiver control structure
+ * \param ab                    autobaud state
+ * \return time, see TIME_GET()
+ */
+U4 rcvAutobaudDeadline(IN const RCV_DATA_t *rcv, IN const RCV_AUTOBAUD_t *ab);
+
+/*!
+ * Poll the message MON-VER once at the given baudrate, without the retries
+ * and the settling delays of rcvDoAutobaud(). Used to find the baudrate of
+ * many receivers quickly.
+ *
+ * \param rcv                   receiver control structure
+ * \param baud                  baudrate to try, 0 to keep the current one
+ * \param sendTrainingSequence  should the training sequence be sent or not
+ * \param timeout               time to wait for the reply
+ * \return pointer to the MON-VER message received or NULL if there was no reply
+ */
+UBX_HEAD_t* rcvProbe( INOUT RCV_DATA_t *rcv
+                    , IN U4 baud
+                    , IN BOOL sendTrainingSequence
+                    , IN U4 timeout );
+
+/*!
+ * Reinitialize the connection, waits until the port is back
  *
  * \param rcv                   receiver control structure
  * \param isUsbPort             set to TRUE if connected to a USB port
@@ -175,7 +389,24 @@ UBX_HEAD_t* rcvDoAutobaud(INOUT RCV_DATA_t *rcv, IN BOOL sendTrainingSequence);
 BOOL rcvReenumerate(INOUT RCV_DATA_t *rcv, IN BOOL isUsbPort);
 
 /*!
- * Send the training sequence to the receiver
+ * Reinitialize the connection, one attempt at a time. The non-blocking form
+ * of rcvReenumerate(), see SER_REENUM_STEP().
+ *
+ * \param rcv                   receiver control structure
+ * \param isUsbPort             set to TRUE if connected to a USB port
+ * \param attempt               number of the attempt, 0 for the first one
+ * \param pWait                 receives the time to wait before the next attempt
+ * \return SER_REENUM_PENDING until the port is back (SER_REENUM_DONE)
+ *         or lost (SER_REENUM_FAILED)
+ */
+SER_REENUM_t rcvReenumerateStep( INOUT RCV_DATA_t *rcv
+                               , IN BOOL isUsbPort
+                               , IN U4 attempt
+                               , OUT U4 *pWait );
+
+/*!
+ * Send the training sequence to the receiver. The messages sent next are
+ * held back for TRAINING_TIME.
  *
  * \param rcv                   receiver control structure
  * \return TRUE if successful
@@ -190,7 +421,8 @@ BOOL rcvSendTrainingSequence(INOUT RCV_DATA_t *rcv);
 void rcvFlushBuffer(INOUT RCV_DATA_t *rcv);
 
 /*!
- * Set the baudrate of the connection
+ * Set the baudrate of the connection. The messages sent next are held
+ * back for BAUD_SETTLE_TIME.
  *
  * \param rcv                   receiver control structure
  * \param baud                  baudrate to set
@@ -32,11 +32,24 @@
 #define _SPI_READ_BUFFER_H
 
 
+//! SPI read state
+/*!
+    Holds the data clocked in during writes in a ring buffer, the adaptive
+    dummy read state and transfer statistics.
+*/
 typedef struct SPI_READBUFFER_s
 {
-    U1 buffer[4096];                         //!< buffer containing data
-    U1 *pBuffer;                             //!< pointer to data begin
-    U4  size;                                //!< buffered data size
+    U1 buffer[4096];                         //!< ring buffer containing data
+    U4 rd;                                   //!< index of the oldest byte in buffer
+    U4 size;                                 //!< buffered data size
+    U4 readSize;                             //!< size of the next dummy read, follows the receiver output
+    U4 idleTime;                             //!< time of the last dummy read that returned idle bytes only
+    U4 idleDelay;                            //!< interval between dummy reads while the receiver is idle [ms], 0 if active
+    U4 readXfers;                            //!< number of dummy read transfers
+    U4 readBytes;                            //!< number of bytes clocked in dummy reads
+    U4 readData;                             //!< number of data bytes received in dummy reads
+    U4 writeXfers;                           //!< number of write transfers
+    U4 writeBytes;                           //!< number of bytes written
 } SPI_READBUFFER_t;
 typedef SPI_READBUFFER_t* SPI_READBUFFER_pt; //!< pointer to SPI_READBUFFER_t type
 
@@ -68,115 +68,101 @@ BOOL UbxCreateMessage(IN  U1            ClassId
     return TRUE;
 }
 
-//! Check CRC of UBX packet
-/*!
-    \param pkMsg    pointer to beginning of UBX packet
-    \return TRUE if CRC is correct, FALSE otherwise
-*/
-static BOOL UbxCheckCrc(IN U1 const * pkMsg)
+void UbxParserInit(OUT UBX_PARSER_t * pParser)
 {
-
-    UBX_HEAD_t ubxhdr;
-    memcpy(&ubxhdr, pkMsg, sizeof(ubxhdr));
-    U2 crc =
-        GetUbxChecksumU1((U1*)pkMsg+UBX_PREFIX_SIZE,
-        ubxhdr.size+UBX_FRAME_SIZE-UBX_PREFIX_SIZE-UBX_CHKSUM_SIZE);
-    //crc_b is in high byte
-    U1 crc_a_packet = *(pkMsg+UBX_HEAD_SIZE+ubxhdr.size);
-    U1 crc_b_packet = *(pkMsg+UBX_HEAD_SIZE+ubxhdr.size+1);
-    U1 crc_a_calc = crc & 0x00FF;
-    U1 crc_b_calc = (crc & 0xFF00) >> 8;
-    return ((crc_a_packet == crc_a_calc) && (crc_b_packet == crc_b_calc));
+    pParser->done = 0;
+    pParser->chkA = 0;
+    pParser->chkB = 0;
 }
 
-BOOL UbxSearchMsg( IN  U1 *   pBuffer
-                 , IN  size_t Size
-                 , OUT U1 **  ppMsg)
+BOOL UbxParse( INOUT UBX_PARSER_t * pParser
+             , IN    U1 *           pBuffer
+             , IN    size_t         Size
+             , OUT   U1 **          ppMsg)
 {
-    BOOL valid = FALSE;
-    BOOL ubxSyncFound = FALSE;
-
-    //discard all invalid bytes
-    do
+    for (;;)
     {
-        ubxSyncFound = FALSE;
-
-        //search for UBX prefix
-        while (Size > 2 &&
-               ((*pBuffer     != UBX_SYNC_CHAR_1) ||
-                (*(pBuffer+1) != UBX_SYNC_CHAR_2)) )
-        {
-            pBuffer ++;
-            Size --;
-        }
-
-        if (Size > 2 &&
-            ((*pBuffer     == UBX_SYNC_CHAR_1) &&
-             (*(pBuffer+1) == UBX_SYNC_CHAR_2)))
-        {
-            ubxSyncFound = TRUE;
-        }
-        else
-        {
-            //not a whole sync sequence found, return
-            //discard bytes where no sync was found in
-            *ppMsg = pBuffer;
-            return FALSE;
-        }
-
-        //everything before prefix is crap
-        *ppMsg = pBuffer;
-
-        //check if message is complete and valid
-        if (ubxSyncFound && Size >= UBX_FRAME_SIZE)
+        if (!pParser->done)
         {
-            //found message begin, this could be a valid message
+            //search for UBX prefix, everything before it is crap
+            U1* pSync = (U1*)memchr(pBuffer, UBX_SYNC_CHAR_1, Size);
+            if (!pSync)
+            {
+                *ppMsg = pBuffer + Size;
+                return FALSE;
+            }
+            Size -= pSync - pBuffer;
+            pBuffer = pSync;
+            if (Size < UBX_HEAD_SIZE)
+            {
+                // wait for the header to check the prefix and the length
+                *ppMsg = pBuffer;
+                return FALSE;
+            }
             UBX_HEAD_t ubxhdr;
             memcpy(&ubxhdr, pBuffer, sizeof(ubxhdr));
-            if ((ubxhdr.size + UBX_FRAME_SIZE) > 2*8192)
+            if (pBuffer[1] != UBX_SYNC_CHAR_2)
+            {
+                pBuffer ++;
+                Size --;
+                continue;
+            }
+            if ((ubxhdr.size + UBX_FRAME_SIZE) > UBX_MAX_FRAME_SIZE)
             {
                 // the message length is corrupt, u-blox5 will not send a message
                 // bigger than 16384 bytes, discard this message
                 MESSAGE(MSG_WARN, "Corrupt Packet (0x%02X-0x%02X): msg-length %u > 2*8192",
                     ubxhdr.classId, ubxhdr.msgId, ubxhdr.size);
                 pBuffer ++;
-                *ppMsg = pBuffer;
                 Size --;
+                continue;
             }
-            if (Size >= ubxhdr.size + UBX_FRAME_SIZE)
-            {
-                //check CRC
-                if (UbxCheckCrc(pBuffer))
-                {
-                    {
-                        valid = TRUE;
-                    }
+            // the checksum starts after the prefix
+            pParser->done = UBX_PREFIX_SIZE;
+            pParser->chkA = 0;
+            pParser->chkB = 0;
+        }
 
-                }
-                else
-                {
-                    MESSAGE(MSG_WARN, "Packet (CLSID %02X-%02X): CRC-error", ubxhdr.classId, ubxhdr.msgId);
-                    // discard faulty message from buffer
-                    pBuffer ++;
-                    *ppMsg = pBuffer;
-                    Size --;
-                }
-            }
-            else
-            {
-                // the message header is received completely, but the
-                // payload is not complete. wait for it
-                // MESSAGE(MSG_DBG, "msg incomplete: %d bytes/%d", Size, pHead->size+UBX_FRAME_SIZE);
-                return FALSE;
-            }
+        *ppMsg = pBuffer;
+
+        UBX_HEAD_t ubxhdr;
+        memcpy(&ubxhdr, pBuffer, sizeof(ubxhdr));
+        const U4 chkEnd = UBX_HEAD_SIZE + ubxhdr.size;
+
+        // continue the checksum with the newly received bytes
+        U4 avail = (U4)MIN(Size, chkEnd);
+        if (avail > pParser->done)
+        {
+            UpdateUbxChecksumU1(&pParser->chkA, &pParser->chkB, pBuffer + pParser->done, avail - pParser->done);
+            pParser->done = avail;
         }
-        else
+        if (Size < chkEnd + UBX_CHKSUM_SIZE)
         {
-            // either there are no more valid messages in buffer or the received
-            // message is not complete yet.
+            // the message is not complete yet, wait for it
             return FALSE;
         }
-    } while (!valid);
-    return valid;
+
+        // check CRC
+        U1 chkA = pParser->chkA;
+        U1 chkB = pParser->chkB;
+        UbxParserInit(pParser);
+        if ((pBuffer[chkEnd] == chkA) && (pBuffer[chkEnd+1] == chkB))
+        {
+            return TRUE;
+        }
+        MESSAGE(MSG_WARN, "Packet (CLSID %02X-%02X): CRC-error", ubxhdr.classId, ubxhdr.msgId);
+        // discard faulty message from buffer
+        pBuffer ++;
+        Size --;
+    }
+}
+
+BOOL UbxSearchMsg( IN  U1 *   pBuffer
+                 , IN  size_t Size
+                 , OUT U1 **  ppMsg)
+{
+    UBX_PARSER_t parser;
+    UbxParserInit(&parser);
+    return UbxParse(&parser, pBuffer, Size, ppMsg);
 }
 
@@ -82,6 +82,16 @@ typedef struct UBX_CFG_PRT_s
     U1    pad0;                   //!< Padding
 } UBX_CFG_PRT_t;
 
+/*! UBX-CFG-PRT port identifiers
+ *  @{
+ */
+#define UBX_CFG_PRT_PORT_I2C    0  //!< DDC (I2C) port
+#define UBX_CFG_PRT_PORT_UART1  1  //!< UART1 port
+#define UBX_CFG_PRT_PORT_UART2  2  //!< UART2 port
+#define UBX_CFG_PRT_PORT_USB    3  //!< USB port
+#define UBX_CFG_PRT_PORT_SPI    4  //!< SPI port
+/*! @} */
+
 //! UBX-UPD-IMG message payload
 typedef struct APP_UBX_UPD_IMG_PAYLOAD_s
 {
@@ -96,6 +106,7 @@ typedef struct APP_UBX_UPD_IMG_PAYLOAD_s
 #define UBX_CHKSUM_SIZE 2u                             //!< UBX Protocol Checksum Size in bytes
 #define UBX_HEAD_SIZE sizeof(UBX_HEAD_t)               //!< UBX Protocol Header Size
 #define UBX_FRAME_SIZE (UBX_HEAD_SIZE+UBX_CHKSUM_SIZE) //!< Total size of the UBX Frame
+#define UBX_MAX_FRAME_SIZE (2*8192)                    //!< Largest UBX Frame sent by a receiver
 //@}
 
 //! Used UBX message class and identifiers
@@ -106,6 +117,7 @@ enum UBX_ID_e
     UBX_CLASS_CFG   = 0x06,         //!< Class configuration
     UBX_CLASS_UPD   = 0x09,         //!< Class update
     UBX_CLASS_MON   = 0x0A,         //!< Class monitor
+    UBX_CLASS_SEC   = 0x27,         //!< Class security
 
     // class ACK
     UBX_ACK_NAK     = 0x00,         //!< Not acknowledged           (PUB 10+)
@@ -114,6 +126,7 @@ enum UBX_ID_e
     // class CFG
     UBX_CFG_PORT    = 0x00,         //!< Configure port             (PUB 10+)
     UBX_CFG_RST     = 0x04,         //!< Reset receiver             (PUB 10+)
+    UBX_CFG_VALSET  = 0x8A,         //!< Set configuration items    (PUB 27+)
 
     // class UPD
     UBX_UPD_AUTHREAD  = 0x20,       //!< Read with signature        (RD 18+)
@@ -137,6 +150,9 @@ enum UBX_ID_e
     // class MON
     UBX_MON_VER       = 0x04,       //!< version information        (PUB 10+)
 
+    // class SEC
+    UBX_SEC_UNIQID    = 0x03,       //!< unique chip ID             (PUB 18+)
+
 
 };
 
@@ -160,6 +176,42 @@ BOOL UbxCreateMessage( IN  U1            ClassId
                      , OUT CH**          ppMessage
                      , OUT size_t*       pMsgSize );
 
+//! State of the incremental UBX parser
+/*! Keeps the progress on a possible message start between calls to
+    UbxParse(), so that bytes already examined are not scanned again.
+*/
+typedef struct UBX_PARSER_s
+{
+    U4 done;                      //!< bytes of the current frame covered by the checksum, 0 while searching
+    U1 chkA;                      //!< first byte of the partial checksum
+    U1 chkB;                      //!< second byte of the partial checksum
+} UBX_PARSER_t;
+
+//! Reset the incremental UBX parser
+/*! Has to be called before the first call to UbxParse() and whenever
+    the buffered data is discarded.
+    \param pParser        parser state
+*/
+void UbxParserInit( OUT UBX_PARSER_t * pParser );
+
+//! Search for UBX message, continuing where the last call stopped
+/*! Same as UbxSearchMsg(), but the state kept in \a pParser allows to
+    continue the search when more data has arrived. \a pBuffer has to point
+    to the possible message start returned by the previous call (or after the
+    message found), i.e. the caller discards the bytes before it.
+    \param pParser        parser state
+    \param pBuffer        Buffer containing received stream
+    \param Size           Number of characters in Buffer
+    \param ppMsg          pointer to the first message found if return value
+                          is TRUE, else pointer to the first occurrence of a
+                          possible message start (where crap is discarded)
+    \return TRUE if a valid message was found, FALSE else
+*/
+BOOL UbxParse( INOUT UBX_PARSER_t * pParser
+             , IN    U1 *           pBuffer
+             , IN    size_t         Size
+             , OUT   U1 **          ppMsg );
+
 //! Search for UBX message header
 /*! Search buffer for valid UBX message
     \param pBuffer        Buffer containing received stream
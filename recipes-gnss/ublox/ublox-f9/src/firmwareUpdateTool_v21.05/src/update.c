@@ -53,17 +53,28 @@
 #include "version.h"
 #include "updateCore.h"
 #include "checksum.h"
+#include "idcache.h"
+#include "linkprof.h"
 
 
 
 #define HW_IMG_MAGIC_DOM    ( ('U' <<  0) | ('B' <<  8) | ('X' << 16) | ('8' << 24) ) //!< EXT image magic word for DOM
-static MERGEFIS_RETVAL_t getNoFisMergingData(char **fis, size_t *fisSize, RCV_DATA_t * rx)
+#define UPD_MAX_TARGETS     16      //!< maximum number of receivers updated at once (sharing an I2C bus)
+#define UPD_PORT_NAME_SIZE  128     //!< maximum length of a port name including the terminating zero
+#define UPD_FIS_CACHE_SIZE  8       //!< number of flash devices the FIS is kept for in a fleet update
+//! get the FIS from the reply to the UPD-FIS poll
+/*!
+    \param fis      receives the FIS, to be released with free()
+    \param fisSize  receives the size of the FIS
+    \param fisMsg   reply to the UPD-FIS poll, NULL if it timed out
+    \return success / error code
+*/
+static MERGEFIS_RETVAL_t getNoFisMergingData(char **fis, size_t *fisSize, const UBX_HEAD_t *fisMsg)
 {
-    if (!fis || !fisSize || !rx)
+    if (!fis || !fisSize)
         return MERGEFIS_UNKNOWN;
 
     MERGEFIS_RETVAL_t ret = MERGEFIS_UNKNOWN;
-    UBX_HEAD_t *fisMsg = rcvPollMessage(rx, UBX_CLASS_UPD, UBX_UPD_FIS, 0, 0, POLL_TIMEOUT);
 
     if (!fisMsg)
     {
@@ -96,7 +107,6 @@ static MERGEFIS_RETVAL_t getNoFisMergingData(char **fis, size_t *fisSize, RCV_DA
         {
             MESSAGE(MSG_ERR, "Received unexpected answer.");
         }
-        free(fisMsg);
     }
 
 
@@ -161,48 +171,249 @@ static int extractHwGeneration(UBX_HEAD_t* monVer)
 
 
 
-static BOOL verifyImage(RCV_DATA_t *pRx, FWHEADER_t const *pData, U4 fileSize, U4 address, BOOL updateRam, U4 version)
+//! copy a string of the UBX-MON-VER payload
+/*!
+    \param monVer      UBX-MON-VER message
+    \param offset      offset of the string in the payload
+    \param size        size of the string field including the terminating zero
+    \param pDst        receives the string, at least \a size bytes
+    \return #TRUE if the field is present and zero terminated
+*/
+static BOOL monVerString(UBX_HEAD_t const *monVer, U4 offset, U4 size, CH* pDst)
+{
+    const CH* pSrc = (const CH*)monVer + UBX_HEAD_SIZE + offset;
+    pDst[0] = 0;
+    if ((offset + size > monVer->size) || !memchr(pSrc, 0, size))
+    {
+        return FALSE;
+    }
+    strcpy(pDst, pSrc);
+    return TRUE;
+}
+
+//! ROM size of a receiver generation
+/*!
+    \param  generation  hardware generation, see extractHwGeneration()
+    \return             size of the ROM, 0 if unknown
+*/
+static U4 romSize(U4 generation)
+{
+    return
+        (generation == 50) ? 384*1024 : // 384kB ROM in u-blox5
+        (generation == 51 ||
+         generation == 60) ? 448*1024 : // 448kB ROM in G51 && u-blox6
+        (generation == 70) ? 512*1024 : // 512kB ROM in u-blox7
+        (generation == 80) ? 544*1024 : // 544kB ROM in u-blox8
+        (generation == 90) ? 672*1024 : // 650kB ROM in u-blox9
+         0;
+}
+
+//! Identify the ROM version by its CRC
+/*!
+    \param  crcVal      CRC of the ROM, see readRomCrc()
+    \return             ROM version (major * 100 + minor), 0 if unknown
+*/
+static U4 romVersion(U4 crcVal)
+{
+    return (crcVal == 0x00000000) ? 200 : // u-blox5
+           (crcVal == 0xE046F6C8) ? 300 :
+           (crcVal == 0x3CB3E4FF) ? 400 :
+           (crcVal == 0x806AF596) ? 500 :
+           (crcVal == 0xEA00D0BD) ? 510 :
+           (crcVal == 0xB5CD6FC1) ? 600 : // u-blox6
+           (crcVal == 0x2BA123BA) ? 601 :
+           (crcVal == 0x288646C9) ? 602 :
+           (crcVal == 0xB94D4114) ? 701 :
+           (crcVal == 0x494DF1F9) ? 703 :
+           (crcVal == 0xd5fce753) ?  10 : // u-blox7 ROM0.10
+           (crcVal == 0xfce598b1) ?  11 : //         ROM0.11
+           (crcVal == 0xed152ade) ?  14 : //         ROM0.14
+           (crcVal == 0x100E368D) ? 100 : //         ROM1.00
+           (crcVal == 0xDFAA666C) ?  21 : // u-blox8 ROM0.21
+           (crcVal == 0x041D115D) ?  22 : // u-blox8 ROM0.22
+           (crcVal == 0xA15AF099) ? 201 : // u-blox8 ROM2.01
+           (crcVal == 0x2FEF89EA) ? 301 : //         ROM3.01
+           (crcVal == 0x1893C329) ? 351 : //         ROM3.51
+           (crcVal == 0xCAAF619C) ? 40  : // u-blox9 ROM0.40
+           (crcVal == 0xDD3FE36C) ? 101 : //         ROM1.01
+           (crcVal == 0x118B2060) ? 102 : //         ROM1.02
+           (crcVal == 0x3BFC8935) ? 404 : //         ROM4.04
+           0;
+}
+
+//! UPD-AUTHREAD of the CRC stored at the end of the u-blox 8 ROM
+static const U1 romCrcAuth[] = { 0x9C, 0x59, 0xC5, 0x22, 0xEC, 0x34, 0x1A, 0x1A, 0x30, 0xCC, 0xB1, 0xFB, 0x69, 0xCB, 0xAD, 0x9A, 0x41, 0x83, 0x6E, 0xDD, 0x27, 0xE4, 0xFB, 0xA6, 0x8C, 0x71, 0xE3, 0xAB, 0x8A, 0xA4, 0x0D, 0x20, 0xFC, 0x7F, 0x08, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Read u-blox8 CRC auth
+
+//! Prepare reading the CRC of the ROM
+/*!
+    \param  pReq        request to prepare, see rcvRequestInit()
+    \param  generation  hardware generation, see extractHwGeneration()
+    \param  romPoll     poll UBX-UPD-ROM (u-blox 9 and later) instead of reading the
+                        CRC stored at the end of the ROM
+    \return             #TRUE on success, the CRC is taken from the reply with romCrcReply()
+*/
+static BOOL romCrcRequest(RCV_REQUEST_t *pReq, U4 generation, BOOL romPoll)
+{
+    if (romPoll)
+    {
+        MESSAGE(MSG_DBG, "Sending ROM CRC Poll");
+        return rcvRequestInit(pReq, UBX_CLASS_UPD, UBX_UPD_ROM, NULL, 0, FALSE, POLL_TIMEOUT);
+    }
+
+    U4 CRCSize = 4;
+    U4 romBase = (generation >= 70) ? 0x00000000 : 0x00200000;
+    U4 payload[3] = { romBase + romSize(generation) - CRCSize, CRCSize, 0 };
+    MESSAGE(MSG_DBG, "Sending ROM CRC-Mix-Read");
+    // depending on the ROM the receiver replies to one of them
+    return rcvRequestInit(pReq, UBX_CLASS_UPD, UBX_UPD_UPLOAD, (CH *)payload, sizeof(payload), FALSE, POLL_TIMEOUT) &&
+           rcvRequestAdd(pReq, UBX_CLASS_UPD, UBX_UPD_AUTHREAD, (CH *)romCrcAuth, sizeof(romCrcAuth));
+}
+
+//! Get the CRC of the ROM from the reply to romCrcRequest()
+/*!
+    \param  msg         reply
+    \return             CRC of the ROM
+*/
+static U4 romCrcReply(UBX_HEAD_t const *msg)
+{
+    U4 crcVal;
+    const U4 offset = (msg->msgId == UBX_UPD_ROM)    ? 2 * sizeof(U4) :
+                      (msg->msgId == UBX_UPD_UPLOAD) ? 12 : sizeof(romCrcAuth);
+    memcpy(&crcVal, (const U1*)msg + UBX_HEAD_SIZE + offset, sizeof(crcVal));
+    return crcVal;
+}
+
+//! Read the CRC of the ROM
+/*!
+    \param  pRx         connection to the receiver
+    \param  generation  hardware generation, see extractHwGeneration()
+    \param  romPoll     see romCrcRequest()
+    \param  pCrc        receives the CRC
+    \return             #TRUE on success
+*/
+static BOOL readRomCrc(RCV_DATA_t *pRx, U4 generation, BOOL romPoll, U4 *pCrc)
+{
+    RCV_REQUEST_t req;
+    UBX_HEAD_t *msg = NULL;
+    memset(&req, 0, sizeof(req));
+    if (romCrcRequest(&req, generation, romPoll))
+    {
+        while (rcvRequestCheck(pRx, &req, &msg) == RCV_REQ_PENDING)
+        {
+            rcvWaitUntil(pRx, rcvRequestDeadline(pRx, &req));
+        }
+    }
+    rcvRequestRelease(&req);
+    if (msg == NULL)
+    {
+        return FALSE;
+    }
+    *pCrc = romCrcReply(msg);
+    rcvReleaseMessage(pRx, msg);
+    return TRUE;
+}
+
+
+
+//! Prepare comparing the CRC of an image with the memory of the receiver
+/*!
+    \param pReq        request to prepare, see rcvRequestInit()
+    \param pImage      image
+    \param address     address of the image on the receiver
+    \param updateRam   image is in the RAM instead of the flash
+    \param version     version of the UPD-CRC message
+    \return #TRUE on success, the result is taken from the reply with imageCrcReply()
+*/
+static BOOL imageCrcRequest(RCV_REQUEST_t *pReq, const IMG_SEGMENTS_t *pImage, U4 address, BOOL updateRam, U4 version)
 {
-    assert(pRx && pData);
+    assert(pReq && pImage);
 
-    U4* pImage = (U4*)pData;
-    U4 imageSize = fileSize;
+    U4 imageSize = (U4)GetImageSegmentsSize(pImage);
     // compute a fletcher32 checksum of the image as loaded to the flash
     // we don't want to care about the checksums done internally by the FW here...
+    // the image is made of segments, go through it in chunks of whole words
     U4 a = 0;
     U4 b = 0;
-    GetUbxChecksumU4(&a, &b, pImage, imageSize);
+    U4 chunk[1024];
+    U4 offset;
+    for (offset = 0; offset < imageSize; offset += sizeof(chunk))
+    {
+        const U4 size = MIN(imageSize - offset, (U4)sizeof(chunk));
+        ReadImageSegments(pImage, offset, chunk, size);
+        UpdateUbxChecksumU4(&a, &b, chunk, size);
+    }
 
     // build the payload to do the same on the hardware
     U4 dataAligned[4] = { address, imageSize, a, b };
-    UBX_HEAD_t *msg;
     if (version >= 2)
     {
         //              version region
         U1 data[18] = { 0x01, !updateRam };
         memcpy(&data[2], dataAligned, sizeof(dataAligned));
         // check the CRC on the receiver
-        msg = rcvPollMessage(pRx, UBX_CLASS_UPD, UBX_UPD_CRC, (CH*)data, sizeof(data), CRC_TIMEOUT);
+        return rcvRequestInit(pReq, UBX_CLASS_UPD, UBX_UPD_CRC, (CH*)data, sizeof(data), FALSE, CRC_TIMEOUT);
     }
-    else
+    // check the CRC on the receiver
+    return rcvRequestInit(pReq, UBX_CLASS_UPD, UBX_UPD_CRC, (CH*)dataAligned, sizeof(dataAligned), FALSE, CRC_TIMEOUT);
+}
+
+//! check the reply to imageCrcRequest()
+/*!
+    \param msg         reply
+    \return #TRUE if the CRC on the receiver matches the image
+*/
+static BOOL imageCrcReply(UBX_HEAD_t const *msg)
+{
+    U1 success = 0;
+    if (msg->size == 5)
     {
-        // check the CRC on the receiver
-        msg = rcvPollMessage(pRx, UBX_CLASS_UPD, UBX_UPD_CRC, (CH*)dataAligned, sizeof(dataAligned), CRC_TIMEOUT);
+        memcpy(&success, (const U1*)(msg)+UBX_HEAD_SIZE + 4, 1);
     }
-    if (msg == NULL)
+    return success ? TRUE : FALSE;
+}
+
+//! Prepare disabling the periodic output of the port the receiver is connected on
+/*!
+    Restricts the output protocols of the connected port to UBX in the RAM
+    configuration, so the receiver stops sending NMEA (and RTCM) while we are
+    polling. The setting is lost with the safeboot or the final reset.
+
+    \param  pReq        request to prepare, see rcvRequestInit()
+    \param  pPrt        current configuration of the connected port (CFG-PRT poll)
+    \param  generation  hardware generation of the receiver
+    \return             #TRUE if the request is to be sent, #FALSE if there is
+                        nothing to disable or it can't be done
+*/
+static BOOL quiesceRequest(RCV_REQUEST_t *pReq, UBX_CFG_PRT_t const *pPrt, U4 generation)
+{
+    assert(pReq && pPrt);
+    if ((pPrt->outProtoMask & ~0x1) == 0)
     {
-        MESSAGE(MSG_ERR, "Polling verify message failed");
+        MESSAGE(MSG_DBG, "Port outputs UBX only already");
         return FALSE;
     }
 
-    U1 success = 0;
-    if (msg->size == 5)
+    if (generation >= 90)
     {
-        memcpy(&success, (U1*)(msg)+UBX_HEAD_SIZE + 4, 1);
+        // CFG-<port>OUTPROT-NMEA and -RTCM3X keys, indexed by the port id
+        static const U4 nmeaKeys[]  = { 0x10720002, 0x10740002, 0x10760002, 0x10780002, 0x107A0002 };
+        static const U4 rtcm3Keys[] = { 0x10720004, 0x10740004, 0x10760004, 0x10780004, 0x107A0004 };
+        if (pPrt->portId >= NUMOF(nmeaKeys))
+        {
+            return FALSE;
+        }
+        //              version layer(RAM) reserved  key(4) val   key(4) val
+        U1 valset[14] = { 0x00,   0x01,    0, 0 };
+        memcpy(&valset[4], &nmeaKeys[pPrt->portId], sizeof(U4));
+        valset[8] = 0;
+        memcpy(&valset[9], &rtcm3Keys[pPrt->portId], sizeof(U4));
+        valset[13] = 0;
+        return rcvRequestInit(pReq, UBX_CLASS_CFG, UBX_CFG_VALSET, (CH*)valset, sizeof(valset), TRUE, POLL_TIMEOUT);
     }
-
-    free(msg);
-    return success ? TRUE : FALSE;
+    UBX_CFG_PRT_t prtcfg;
+    memcpy(&prtcfg, pPrt, sizeof(prtcfg));
+    prtcfg.outProtoMask = 0x1;          //UBX only
+    return rcvRequestInit(pReq, UBX_CLASS_CFG, UBX_CFG_PORT, (CH*)&prtcfg, sizeof(prtcfg), TRUE, POLL_TIMEOUT);
 }
 
 static void doReset(RCV_DATA_t *pRx, BOOL reset)
@@ -218,1124 +429,3427 @@ static void doReset(RCV_DATA_t *pRx, BOOL reset)
     }
 }
 
-static BOOL updateImageToRam(RCV_DATA_t* pRx, const CH* pImageStart, U4 ImageSize)
+
+//! FIS loaded for one flash device
+typedef struct UPD_FIS_s
 {
-    APP_UBX_UPD_IMG_PAYLOAD_t imgPayload;
-    U2 sent = 0;
-    U sendStart = 0;
-    U acked = 0;
-    U timeLimit = TIME_GET() + POLL_TIMEOUT;
-    BOOL success = FALSE;
-    if (pRx == NULL || pImageStart == NULL)
+    U4                jedec;        //!< JEDEC ID of the flash
+    MERGEFIS_RETVAL_t ret;          //!< result of mergefis_db_load()
+    CH*               fis;          //!< FIS, NULL if loading failed
+    size_t            fisSize;      //!< size of the FIS
+} UPD_FIS_t;
+
+//! data shared by the receivers of a fleet update
+typedef struct UPD_SHARED_s
+{
+    const FWHEADER_t* pData;        //!< image, loaded once and never modified, NULL if not needed
+    size_t       fileSize;          //!< size of the image file
+    U4           imageGeneration;   //!< generation of the image, see ValidateImage()
+    MUTEX_pt     lock;              //!< protects the members below
+    U4           next;              //!< index of the next port to update
+    U4           fisCount;          //!< number of FIS loaded
+    UPD_FIS_t    fis[UPD_FIS_CACHE_SIZE]; //!< FIS loaded so far, by flash device
+    BOOL         fisDbRead;         //!< FIS file read into fisDb
+    MERGEFIS_DB_t fisDb;            //!< FIS file, read when the first FIS is needed
+} UPD_SHARED_t;
+
+//! host side preparation of an update, done by workers while the receiver is brought up
+typedef struct UPD_HOST_s
+{
+    const UPD_PARAMS_t* p;          //!< update options
+    LOG_CTX_t*   pLog;              //!< log context of the update
+    MUTEX_pt     lock;              //!< protects imageDone and fisDone, NULL if no worker was started
+    BOOL         imagePending;      //!< image is being loaded, see updWaitImage()
+    BOOL         imageDone;         //!< image loaded, its worker can be joined
+    THREAD_pt    imageThread;       //!< worker loading the image, NULL if loaded in the update thread
+    IMG_FILE_t   file;              //!< image file, empty if it couldn't be loaded
+    U4           imageGeneration;   //!< generation of the image, 0 if not valid
+    FWFOOTERINFO_t fwFooter;        //!< data extracted from the image footer
+    BOOL         fisDone;           //!< FIS file read, its worker can be joined
+    THREAD_pt    fisThread;         //!< worker reading the FIS file, NULL if read in the update thread
+    MERGEFIS_DB_t fisDb;            //!< FIS file
+} UPD_HOST_t;
+
+//! result of a step of the preparation or the completion of an update
+typedef enum UPD_STEP_e
+{
+    UPD_STEP_BUSY,                  //!< step again, see updDue()
+    UPD_STEP_DONE,                  //!< done successfully
+    UPD_STEP_FAILED                 //!< failed
+} UPD_STEP_t;
+
+//! stage of the preparation and the completion of an update, see updPrepareStep() and updFinishStep()
+typedef enum UPD_STAGE_e
+{
+    UPD_STAGE_CONNECT,              //!< connect to the receiver
+    UPD_STAGE_TRAINING,             //!< training sequence and MON-VER poll, once the baudrate settled
+    UPD_STAGE_HELLO_REPLY,          //!< wait for MON-VER
+    UPD_STAGE_CURRENT,              //!< compare the running firmware with the image, see updIsCurrent()
+    UPD_STAGE_CURRENT_CRC_REPLY,    //!< wait for the CRC over the image range on the flash, see updIsCurrent()
+    UPD_STAGE_PORT,                 //!< poll CFG-PRT
+    UPD_STAGE_PORT_REPLY,           //!< wait for CFG-PRT
+    UPD_STAGE_QUIESCE_REPLY,        //!< wait for the periodic output to be disabled
+    UPD_STAGE_IDENTITY,             //!< poll SEC-UNIQID
+    UPD_STAGE_IDENTITY_REPLY,       //!< wait for SEC-UNIQID
+    UPD_STAGE_ROM_CRC,              //!< read the CRC of the ROM
+    UPD_STAGE_ROM_CRC_REPLY,        //!< wait for the CRC of the ROM
+    UPD_STAGE_LOADER,               //!< prepare the receiver for the update
+    UPD_STAGE_USB_ALT_DOWNL_REPLY,  //!< wait for the ack of the flash invalidation
+    UPD_STAGE_USB_ALT_AUTH_REPLY,   //!< wait for the ack of the authenticated flash invalidation
+    UPD_STAGE_USB_ALT_REENUM,       //!< reenumerate the port after the reboot
+    UPD_STAGE_SAFEBOOT,             //!< command the safeboot or start the loader task
+    UPD_STAGE_SAFEBOOT_REENUM,      //!< reenumerate the port after the safeboot
+    UPD_STAGE_SAFEBOOT_TRAINING,    //!< training sequence and MON-VER poll in safeboot
+    UPD_STAGE_SAFEBOOT_HELLO_REPLY, //!< wait for MON-VER in safeboot
+    UPD_STAGE_LDR_REPLY,            //!< wait for the ack of the loader task start
+    UPD_STAGE_IDEN_REPLY,           //!< wait for the flash loader identification
+    UPD_STAGE_FLASH,                //!< detect the flash
+    UPD_STAGE_FLASH_REPLY,          //!< wait for the flash detection
+    UPD_STAGE_FIS,                  //!< load the FIS
+    UPD_STAGE_FIS_REPLY,            //!< wait for the FIS of the receiver
+    UPD_STAGE_MERGE,                //!< merge the FIS and command the update baudrate
+    UPD_STAGE_BAUD_SWITCH,          //!< switch to the update baudrate, once the command was sent
+    UPD_STAGE_BAUD_CHECK,           //!< poll MON-VER at the update baudrate, once it settled
+    UPD_STAGE_BAUD_REPLY,           //!< wait for MON-VER at the update baudrate
+    UPD_STAGE_PATCH_RAM_REPLY,      //!< wait for the ack of the u-blox 7 patch code
+    UPD_STAGE_PATCH_FPB_REPLY,      //!< wait for the ack of the u-blox 7 patch activation
+    UPD_STAGE_FIS_SEND,             //!< send the FIS to a u-blox 9
+    UPD_STAGE_FIS_SEND_REPLY,       //!< wait for the ack of the FIS
+    UPD_STAGE_SETUP,                //!< set up the flash download or the RAM update
+    UPD_STAGE_SPI_CFG_REPLY,        //!< wait for the ack of the SPI configuration
+    UPD_STAGE_CERASE_REPLY,         //!< wait for the ack of the chip erase
+    UPD_STAGE_RAM,                  //!< download to the RAM
+    UPD_STAGE_PREPARE_END,          //!< wait for the workers of the host side preparation, see updPrepareEnd()
+    UPD_STAGE_FINISH,               //!< complete the update after the download
+    UPD_STAGE_INV_PATCH_REPLY,      //!< wait for the ack of the u-blox 7 patch invalidation
+    UPD_STAGE_MARKER,               //!< write the file system marker
+    UPD_STAGE_MARKER_REPLY,         //!< wait for the marker to be written
+    UPD_STAGE_RESTART,              //!< restart the receiver to verify a large image
+    UPD_STAGE_RESTART_REENUM,       //!< reenumerate the port after the restart
+    UPD_STAGE_RESTART_LOADER,       //!< bring up the receiver after the restart
+    UPD_STAGE_RESTART_LDR_REPLY,    //!< wait for the ack of the loader task start
+    UPD_STAGE_RESTART_HELLO_REPLY,  //!< wait for MON-VER after the restart
+    UPD_STAGE_VERIFY,               //!< poll the CRC of the image
+    UPD_STAGE_VERIFY_REPLY,         //!< wait for the CRC of the image
+    UPD_STAGE_RESET,                //!< reset the receiver
+    UPD_STAGE_DONE                  //!< nothing left to do
+} UPD_STAGE_t;
+
+//! state of the update of one receiver
+typedef struct UPD_TARGET_s
+{
+    CH           port[UPD_PORT_NAME_SIZE]; //!< port the receiver is connected to
+    RCV_DATA_t   rx;                //!< connection to the receiver
+    BOOL         rcvConnected;      //!< connection to the receiver open
+    BOOL         DoSafeBoot;        //!< send the safeboot command (not in USB alternative mode)
+    FWHEADER_t*  pData;             //!< image, the image file or a modified copy
+    BOOL         ownData;           //!< pData allocated for this target, not the image file
+    IMG_FILE_t   file;              //!< image file loaded for this target, empty for the shared one
+    CH*          pPrefix;           //!< FIS written in front of the image, NULL if none
+    IMG_SEGMENTS_t image;           //!< image to download: pPrefix, pData and padding
+    size_t       fileSize;          //!< size of the image to download
+    U4           FwBase;            //!< start address of the image
+    U4           generation;        //!< hardware generation of the receiver
+    U4           hwRomVer;          //!< ROM version of the receiver
+    BOOL         isUsbPort;         //!< receiver connected over USB
+    BLOCK_ARR_t  FlashOrg;          //!< organization of the flash
+    UPD_CORE_t*  upd;               //!< state of the flash download, NULL if done otherwise
+    UPD_SHARED_t* pShared;          //!< data shared with the other receivers of a fleet update, NULL if none
+    BOOL         idEnabled;         //!< id is to be looked up and stored in the identity cache
+    BOOL         idCached;          //!< id was found in the identity cache
+    BOOL         idChanged;         //!< id has to be written to the identity cache
+    IDC_ENTRY_t  id;                //!< properties of the receiver that don't change between updates
+    BOOL         linkEnabled;       //!< link profile is to be loaded and stored
+    CH           linkKey[LNK_KEY_SIZE]; //!< key of the link profile
+    LNK_PROFILE_t link;             //!< link profile learned in the previous updates
+    BOOL         current;           //!< receiver runs the image already, nothing to do
+    UPD_STAGE_t  stage;             //!< next stage of the preparation or the completion
+    BOOL         sleeping;          //!< nothing is done before wakeTime
+    U4           wakeTime;          //!< time the receiver is expected to be up again
+    U4           reenumAttempt;     //!< attempts of the port re-enumeration so far, see updReenumerate()
+    RCV_REQUEST_t req;              //!< request the stage waits for, released when answered
+    RCV_AUTOBAUD_t autobaud;        //!< MON-VER poll trying the baudrates, released when answered
+    UPD_HOST_t   host;              //!< host side preparation
+    BOOL         prepared;          //!< result of the preparation, see updPrepareEnd()
+    U4           startTime;         //!< start of the preparation
+    U4           imageGeneration;   //!< generation of the image, see ValidateImage()
+    U1           rcvPortId;         //!< port of the receiver we are connected to
+    BOOL         isSpiPort;         //!< receiver connected over SPI
+    CH           swVer[30];         //!< software version from MON-VER
+    CH           hwVer[10];         //!< hardware version from MON-VER
+    U2           FlashManId;        //!< manufacturer id of the flash
+    U2           FlashDevId;        //!< device id of the flash
+    U4           FlashSize;         //!< size of the flash
+    CH*          fis;               //!< FIS of the flash, NULL if none
+    size_t       fisSize;           //!< size of the FIS
+    MERGEFIS_RETVAL_t fisRet;       //!< result of loading the FIS
+    U4           ramSent;           //!< UPD-IMG messages sent to the RAM
+    U4           ramSendStart;      //!< offset of the next UPD-IMG message
+    U4           ramAcked;          //!< UPD-IMG messages acknowledged
+    U4           ramTimeLimit;      //!< time the next acknowledge is due
+} UPD_TARGET_t;
+
+//! split a port name with several I2C addresses into one port name per receiver
+/*!
+    "I2C0:0x42,0x43" expands to "I2C0:0x42" and "I2C0:0x43", any other
+    port name is taken as it is.
+
+    \param ComPort     port name given by the user
+    \param pTargets    targets receiving the port names, NULL to count them only
+    \return number of targets, 0 if the port name is invalid
+*/
+static U4 splitPorts(const char* ComPort, UPD_TARGET_t *pTargets)
+{
+    const char* pAddr = strrchr(ComPort, ':');
+    if (!pAddr || !strchr(pAddr, ','))
     {
-        return FALSE;
+        if (strlen(ComPort) >= UPD_PORT_NAME_SIZE)
+        {
+            MESSAGE(MSG_ERR, "Port name too long");
+            return 0;
+        }
+        if (pTargets)
+        {
+            strcpy(pTargets[0].port, ComPort);
+        }
+        return 1;
     }
-    while ((acked * sizeof(imgPayload.chunkData)) < ImageSize)
+    const size_t prefix = pAddr + 1 - ComPort;
+    U4 count = 0;
+    do
     {
-        // check if less than 5 packets are pending (receiver only allocates 4*1000butes, 1 buffer has to be always free to avoid rxBuf alloc, One message is 514bytes)
-        if ((sent - acked) < 5 && (sendStart < ImageSize))
+        pAddr++;
+        size_t len = strcspn(pAddr, ",");
+        if (count == UPD_MAX_TARGETS)
         {
-            const size_t packetSize = sizeof(imgPayload.chunkData);
-            size_t sendSize;
-            if ((sendStart + packetSize) > ImageSize)
-            {
-                sendSize = ImageSize - sendStart;
-            }
-            else
-            {
-                sendSize = packetSize;
-            }
-            // send one packet
-            imgPayload.chunkNum = sent;
-
-            memcpy(imgPayload.chunkData, (CH*)pImageStart + sendStart, sendSize);
-            if (sendSize < packetSize)
-            {
-                // clear the rest of the buffer
-                memset(&imgPayload.chunkData[sendSize], 0, packetSize - sendSize);
-            }
-            if (rcvSendMessage(pRx, UBX_CLASS_UPD, UBX_UPD_IMG, (CH*)&imgPayload, sizeof(imgPayload)) != 1)
-            {
-                MESSAGE(MSG_ERR, "Chunk %d not accepted by receiver", sent);
-                break;
-            }
-            sent++;
-            sendStart += packetSize;
+            MESSAGE(MSG_ERR, "Too many receivers, at most %u supported", UPD_MAX_TARGETS);
+            return 0;
         }
-
-        // check if we received an ack
-        UBX_HEAD_t *ack = rcvReceiveMessage(pRx, 0, UBX_CLASS_ACK, -1);
-        if (ack != NULL)
+        if (!len || (prefix + len >= UPD_PORT_NAME_SIZE))
         {
-            UBX_ACK_ACK_t *pAck = (UBX_ACK_ACK_t*)((U1*)ack + UBX_HEAD_SIZE);
-            if (pAck->clsId == UBX_CLASS_UPD &&
-                pAck->msgId == UBX_UPD_IMG)
-            {
-                if (ack->msgId != UBX_ACK_ACK)
-                {
-                    MESSAGE(MSG_ERR, "Received NACK for chunk %d ", (acked+1));
-                    break;
-                }
-
-                // we received an ack message for one UPD-IMG message
-                // push out the timeout
-                timeLimit = TIME_GET() + POLL_TIMEOUT;
-                acked++;
-            }
-            else
-            {
-                MESSAGE(MSG_WARN, "Received unexpected (N)ACK");
-            }
-            free(ack);
+            MESSAGE(MSG_ERR, "Invalid port name '%s'", ComPort);
+            return 0;
         }
-
-        // check if we timed out
-        if (TIME_GET() > timeLimit)
+        if (pTargets)
         {
-            MESSAGE(MSG_ERR, "Downloading to RAM timed out. sent %u, acked %u", sent, acked);
-            break;
+            memcpy(pTargets[count].port, ComPort, prefix);
+            memcpy(pTargets[count].port + prefix, pAddr, len);
+            pTargets[count].port[prefix + len] = 0;
         }
+        count++;
+        pAddr += len;
     }
-    // check if we finished
-    if ((acked * sizeof(imgPayload.chunkData)) >= ImageSize)
-    {
-        success = TRUE;
-    }
-    return success;
+    while (*pAddr == ',');
+    return count;
 }
 
-
-BOOL UpdateFirmware(IN const char*          BinaryFileName,
-                    IN const char*          FlashDefFileName,
-                    IN const char*          FisFileName,
-                    IN const char*          ComPort,
-                    IN const unsigned int   Baudrate,
-                    IN const unsigned int   BaudrateSafe,
-                    IN const unsigned int   BaudrateUpd,
-                    IN       BOOL           DoSafeBoot,
-                    IN const BOOL           DoReset,
-                    IN const BOOL           DoAutobaud,
-                    IN const BOOL           EraseWholeFlash,
-                    IN const BOOL           EraseOnly,
-                    IN const BOOL           TrainingSequence,
-                    IN const BOOL           doChipErase,
-                    IN       BOOL           noFisMerging,
-                    IN       BOOL           updateRam,
-                    IN const BOOL           usbAltMode,
-                    IN const int            Verbose,
-                    IN const BOOL           fisOnly)
+//! load the FIS of a flash device from the FIS file
+/*!
+    In a fleet update the FIS file is parsed once per flash device and every
+    receiver gets its own copy of the FIS.
+
+    \param t       update target
+    \param p       update options
+    \param db      FIS file read for this receiver, not used in a fleet update
+    \param jedec   JEDEC ID of the flash device
+    \param fis     receives the FIS, to be released with free()
+    \param fisSize receives the size of the FIS
+    \return success / error code of mergefis_db_load()
+*/
+static MERGEFIS_RETVAL_t updLoadFis(UPD_TARGET_t *t, const UPD_PARAMS_t *p, const MERGEFIS_DB_t *db, U4 jedec, CH **fis, size_t *fisSize)
 {
-    FWHEADER_t* pData = NULL;
-    size_t fileSize = 0;
-    //'verbose' is globally declared in platform.h
-    verbose = Verbose;
-    BOOL success = FALSE;
-    BOOL isUsbPort = FALSE;
-    BOOL rcvConnected = FALSE;
-    BOOL eraseInProgres = FALSE;
-    BOOL flashNotNeeded = FALSE;
-    BOOL isSpiPort = FALSE;
-    U4 generation = 0;
-    U4 FwBase = 0;
-    U4 imageGeneration = 0;
-    RCV_DATA_t rx;
-    FWFOOTERINFO_t fwFooter={0};
-    BLOCK_ARR_t FlashOrg;
-    memset(&FlashOrg, 0, sizeof(FlashOrg));
-
-    UPD_CORE_t *upd=NULL;
-    if (updateRam != 0)
-    {
-        flashNotNeeded = TRUE;
+    UPD_SHARED_t *s = t->pShared;
+    if (!s)
+    {
+        return mergefis_db_load(fis, fisSize, db, jedec);
     }
-    MESSAGE(MSG_LEV0, "u-blox Firmware Update Tool version %s", PRODUCTVERSTR);
 
-    do
+    MERGEFIS_RETVAL_t ret;
+    U4 ix;
+    MUTEX_LOCK(s->lock);
+    if (!s->fisDbRead)
+    {
+        mergefis_db_open(&s->fisDb, p->FisFileName);
+        s->fisDbRead = TRUE;
+    }
+    for (ix = 0; (ix < s->fisCount) && (s->fis[ix].jedec != jedec); ix++)
+        ;
+    if (ix == NUMOF(s->fis))
+    {
+        // cache full, load it for this receiver only
+        MUTEX_UNLOCK(s->lock);
+        return mergefis_db_load(fis, fisSize, &s->fisDb, jedec);
+    }
+    if (ix == s->fisCount)
     {
-        if (!EraseOnly && !fisOnly)
+        UPD_FIS_t *f = &s->fis[s->fisCount++];
+        f->jedec = jedec;
+        f->ret = mergefis_db_load(&f->fis, &f->fisSize, &s->fisDb, jedec);
+    }
+    ret = s->fis[ix].ret;
+    *fis = NULL;
+    *fisSize = 0;
+    if (s->fis[ix].fis)
+    {
+        *fis = malloc(s->fis[ix].fisSize);
+        if (*fis)
         {
-            MESSAGE(MSG_LEV0, "Updating Firmware '%s' of receiver over '%s'",
-                    BinaryFileName, ComPort);
-            MESSAGE(MSG_DBG, "Opening and buffering image file");
-            if (!OpenAndBufferFile(BinaryFileName, &pData, &fileSize))
-            {
-                break;
-            }
-            MESSAGE(MSG_DBG, "Verifying image");
-            //we got the file content, check if it is a valid image
-            imageGeneration = ValidateImage(pData, fileSize, &fwFooter);
+            memcpy(*fis, s->fis[ix].fis, s->fis[ix].fisSize);
+            *fisSize = s->fis[ix].fisSize;
+        }
+        else
+        {
+            ret = MERGEFIS_UNKNOWN;
+        }
+    }
+    MUTEX_UNLOCK(s->lock);
+    return ret;
+}
 
-            if (imageGeneration == 0)
-            {
-                MESSAGE(MSG_ERR, "Image not valid.");
-                break;
-            }
+//! prepare identifying the receiver
+/*!
+    \param t       update target
+    \return #TRUE if SEC-UNIQID is polled, the reply goes to updLookupIdentity()
+*/
+static BOOL updIdentityRequest(UPD_TARGET_t *t)
+{
+    // polled once only, older receivers don't know the message
+    if ((t->generation < 80) ||
+        !rcvRequestInit(&t->req, UBX_CLASS_SEC, UBX_SEC_UNIQID, NULL, 0, FALSE, POLL_TIMEOUT))
+    {
+        return FALSE;
+    }
+    t->req.sends = 1;
+    return TRUE;
+}
 
+//! check if the receiver runs the image already
+/*!
+    Compares the software version reported in MON-VER with the version
+    string of the image. With \a p->SkipCurrent 2 the CRC over the image
+    range on the flash is compared as well, the only way to tell for images
+    without a version string (u-blox 9 and later).
+
+    \param t                update target, connected
+    \param p                update options
+    \return 1 if the update can be skipped, 0 if not, -1 if the CRC over
+            the image range is polled, see imageCrcReply()
+*/
+static int updIsCurrent(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    CH imgVer[100];
+    const BOOL hasVersion = GetImageVersion(t->pData, t->image.bodySize, imgVer, sizeof(imgVer));
+    if (hasVersion)
+    {
+        if (strcmp(imgVer, t->swVer) != 0)
+        {
+            MESSAGE(MSG_LEV1, "Receiver runs '%s', image is '%s'", t->swVer, imgVer);
+            return 0;
         }
+        MESSAGE(MSG_LEV1, "Receiver runs the image version '%s'", imgVer);
+    }
+    else if (p->SkipCurrent < 2)
+    {
+        MESSAGE(MSG_LEV1, "Image has no version string to compare with '%s'", t->swVer);
+        return 0;
+    }
+    if (p->SkipCurrent < 2)
+    {
+        return 1;
+    }
 
+    if ((t->generation < 90) && !p->noFisMerging)
+    {
+        // the FIS is merged into the image on the flash, its CRC differs from the file
+        MESSAGE(MSG_DBG, "Flash CRC not comparable, the FIS is merged into the image");
+        return hasVersion ? 1 : 0;
+    }
+    const U4 fwBase = (t->generation >= 90 && t->imageGeneration >= 91) ?
+        sizeof(DRV_SPI_MEM_FIS_t) : t->pData->v1.pBase;
+    return imageCrcRequest(&t->req, &t->image, fwBase, FALSE, (t->generation >= 90) ? 2 : 1) ? -1 : 0;
+}
 
+//! identify the receiver and look it up in the identity cache
+/*!
+    \param t       update target
+    \param p       update options
+    \param uniqId  SEC-UNIQID, NULL if not known
+*/
+static void updLookupIdentity(UPD_TARGET_t *t, const UPD_PARAMS_t *p, UBX_HEAD_t const *uniqId)
+{
+    if (uniqId && (uniqId->size > 4))
+    {
+        // version, 3 reserved bytes, unique ID
+        idcMakeKey(&t->id, (const U1*)uniqId + UBX_HEAD_SIZE + 4, uniqId->size - 4, t->port, t->hwVer, t->swVer);
+    }
+    else
+    {
+        idcMakeKey(&t->id, NULL, 0, t->port, t->hwVer, t->swVer);
+    }
+    if (p->IdCacheFileName && *p->IdCacheFileName)
+    {
+        t->idEnabled = TRUE;
+        t->idCached = idcLookup(p->IdCacheFileName, &t->id);
+        MESSAGE(MSG_DBG, "Receiver %s %s", t->id.key,
+                t->idCached ? "found in the identity cache" : "not cached yet");
+    }
+}
 
+//! load the link profile of the receiver
+/*!
+    \param t       update target
+    \param p       update options
+*/
+static void updLoadLink(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    const SER_HANDLE_t *pHandle = t->rx.mPortHandle;
+    if (!p->StateDir || !*p->StateDir || !t->id.key[0] || !pHandle)
+    {
+        return;
+    }
+    const CH* transport = (pHandle->pOps && pHandle->pOps->pName) ? pHandle->pOps->pName : "";
+    if (strlen(t->id.key) + strlen(transport) + 16 > sizeof(t->linkKey))
+    {
+        return;
+    }
+    sprintf(t->linkKey, "%s@%s:%u", t->id.key, transport, pHandle->baudrate);
+    t->linkEnabled = TRUE;
+    if (!lnkLoad(p->StateDir, t->linkKey, &t->link) || !t->link.updates)
+    {
+        MESSAGE(MSG_DBG, "No link profile for %s yet", t->linkKey);
+    }
+}
 
-        /***************************************************
-         * connect to the receiver with the given baudrate *
-         ***************************************************/
-            rcvConnected = rcvConnect(&rx, ComPort, Baudrate);
+//! queue depth of the next download
+/*!
+    The profile never raises a depth above its default: it is lowered by
+    one after a run with retries and moves back up by one after a run
+    without, until it reaches the default again.
+
+    \param depth       depth of the previous download, 0 if unknown
+    \param retries     retries in the previous download
+    \param maxDepth    default depth
+    \return depth of the next download
+*/
+static U4 updLinkDepth(U4 depth, U4 retries, U4 maxDepth)
+{
+    if (!depth)
+    {
+        return maxDepth;
+    }
+    depth = MIN(depth, maxDepth);
+    return retries ? MAX(depth - 1, 1) : MIN(depth + 1, maxDepth);
+}
 
-        if (!rcvConnected)
-            break;
+//! write window of the download, from the link profile of the receiver
+/*!
+    \param t       update target, link profile loaded
+    \return number of writes to queue in the receiver
+*/
+static U4 updLinkWindow(const UPD_TARGET_t *t)
+{
+    return t->link.updates ?
+        updLinkDepth(t->link.window, t->link.writeRetries, DEFAULT_MAX_PACKETS) : DEFAULT_MAX_PACKETS;
+}
 
+//! seed the link parameters of the download with the link profile of the receiver
+/*!
+    The timeouts are set from the longest times measured before with some
+    margin. The write window is passed to updInit(), see updLinkWindow(),
+    the erase-ahead depth follows the same rule, see updLinkDepth().
 
-        /***************************************************
-         * try to communicate with the receiver (MON-VER)  *
-         ***************************************************/
-        if(TrainingSequence)
-            rcvSendTrainingSequence(&rx);
+    \param t       update target, t->upd initialized
+*/
+static void updSeedLink(UPD_TARGET_t *t)
+{
+    if (!t->link.updates)
+    {
+        return;
+    }
+    UPD_CORE_t *upd = t->upd;
+    if (t->link.ackRttMax)
+    {
+        upd->WriteTimeout = MIN(MAX(4 * t->link.ackRttMax + 200, 500), WRITE_TIMEOUT);
+    }
+    if (t->link.eraseTimeMax)
+    {
+        upd->EraseTimeout = MIN(MAX(3 * t->link.eraseTimeMax + 500, 2000), ERASE_TIMEOUT);
+    }
+    upd->MaxPendingErases = updLinkDepth(t->link.eraseAhead, t->link.eraseRetries, MAX_PENDING_ERASES);
+    MESSAGE(MSG_DBG, "Link profile %s from %u updates: window %u, erase ahead %u, write timeout %u ms, erase timeout %u ms",
+            t->linkKey, t->link.updates, upd->MaxPendingWritesNum, upd->MaxPendingErases,
+            upd->WriteTimeout, upd->EraseTimeout);
+}
 
-        UBX_HEAD_t* monVer = DoAutobaud ?
-            rcvDoAutobaud(&rx, TrainingSequence) :
-            rcvPollMessage(&rx, UBX_CLASS_MON, UBX_MON_VER, NULL, 0, POLL_TIMEOUT);
-        if( monVer == NULL )
-        {
-            MESSAGE(MSG_ERR, "Version poll failed.");
-            break;
-        }
-        MESSAGE(MSG_DBG, "Received Version information");
-        generation = extractHwGeneration(monVer);
-        free(monVer);
-        U4 romSize =
-            (generation == 50) ? 384*1024 : // 384kB ROM in u-blox5
-            (generation == 51 ||
-             generation == 60) ? 448*1024 : // 448kB ROM in G51 && u-blox6
-            (generation == 70) ? 512*1024 : // 512kB ROM in u-blox7
-            (generation == 80) ? 544*1024 : // 544kB ROM in u-blox8
-            (generation == 90) ? 672*1024 : // 650kB ROM in u-blox9
-             0;
+//! store the link parameters measured in the download in the link profile of the receiver
+/*!
+    \param t       update target, t->upd holds the measurements
+    \param p       update options
+*/
+static void updStoreLink(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    const UPD_CORE_t *upd = t->upd;
+    if (!t->linkEnabled || !upd)
+    {
+        return;
+    }
+    LNK_PROFILE_t *l = &t->link;
+    l->updates++;
+    l->baudrate     = t->rx.mPortHandle ? t->rx.mPortHandle->baudrate : 0;
+    l->window       = upd->MaxPendingWritesNum;
+    l->eraseAhead   = upd->MaxPendingErases;
+    l->ackRtt       = upd->AckRttCount ? upd->AckRttSum / upd->AckRttCount : 0;
+    l->ackRttMax    = upd->AckRttMax;
+    l->eraseTime    = upd->SectorsErased ? upd->EraseTimeSum / upd->SectorsErased : 0;
+    l->eraseTimeMax = upd->EraseTimeMax;
+    l->writeRetries = upd->WriteRetries;
+    l->eraseRetries = upd->EraseRetries;
+    MESSAGE(MSG_DBG, "Link %s: ack rtt %u/%u ms, erase %u/%u ms, %u write and %u erase retries",
+            t->linkKey, l->ackRtt, l->ackRttMax, l->eraseTime, l->eraseTimeMax,
+            l->writeRetries, l->eraseRetries);
+    if (!lnkStore(p->StateDir, t->linkKey, l))
+    {
+        MESSAGE(MSG_WARN, "Could not write the link profile to '%s'", p->StateDir);
+    }
+}
 
-        // check for valid ROM size not needed for u-blox10
-        if ( (!romSize) && (generation < 100) )
-        {
-            MESSAGE(MSG_ERR, "Could not get correct ROM size");
-            break;
-        }
+//! drop the link profile the download was seeded with after the download failed
+/*!
+    The seeded timeouts are shorter than the defaults. If the link or the
+    flash got slower the next update would fail the same way, it starts
+    with the default link parameters instead.
+
+    \param t       update target
+    \param p       update options
+*/
+static void updDropLink(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    if (!t->linkEnabled || !t->link.updates)
+    {
+        return;
+    }
+    if (lnkRemove(p->StateDir, t->linkKey))
+    {
+        MESSAGE(MSG_DBG, "Link profile %s dropped", t->linkKey);
+    }
+    t->link.updates = 0;
+}
+
+//! write the properties learned about the receiver to the identity cache
+/*!
+    \param t       update target
+    \param p       update options
+*/
+static void updStoreIdentity(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    if (t->pShared)
+    {
+        MUTEX_LOCK(t->pShared->lock);
+    }
+    if (!idcStore(p->IdCacheFileName, &t->id))
+    {
+        MESSAGE(MSG_WARN, "Could not write the identity cache '%s'", p->IdCacheFileName);
+    }
+    if (t->pShared)
+    {
+        MUTEX_UNLOCK(t->pShared->lock);
+    }
+    t->idChanged = FALSE;
+}
+
+//! take the FIS from the identity cache if the flash is the same
+/*!
+    \param t       update target, receives the FIS in t->fis
+    \param jedec   JEDEC ID of the flash device
+    \return #TRUE if the FIS was taken from the cache, it is to be read from the receiver otherwise
+*/
+static BOOL updCachedFis(UPD_TARGET_t *t, U4 jedec)
+{
+    if (!t->idCached || !t->id.fisSize || !t->id.jedecValid || (t->id.jedec != jedec))
+    {
+        return FALSE;
+    }
+    t->fis = (CH*)malloc(t->id.fisSize);
+    if (!t->fis)
+    {
+        t->fisRet = MERGEFIS_UNKNOWN;
+        return TRUE;
+    }
+    MESSAGE(MSG_DBG, "FIS taken from the identity cache");
+    memcpy(t->fis, t->id.fis, t->id.fisSize);
+    t->fisSize = t->id.fisSize;
+    t->fisRet = MERGEFIS_OK;
+    return TRUE;
+}
+
+//! take the FIS read from the receiver and keep it in the identity cache
+/*!
+    \param t       update target, receives the FIS in t->fis
+    \param fisMsg  reply to the UPD-FIS poll, NULL if it timed out
+*/
+static void updReadFis(UPD_TARGET_t *t, UBX_HEAD_t const *fisMsg)
+{
+    t->fisRet = getNoFisMergingData(&t->fis, &t->fisSize, fisMsg);
+    if (t->idEnabled && (t->fisRet == MERGEFIS_OK) && (t->fisSize <= sizeof(t->id.fis)))
+    {
+        memcpy(t->id.fis, t->fis, t->fisSize);
+        t->id.fisSize = t->fisSize;
+        t->idChanged = TRUE;
+    }
+}
+
+//! size of the window of UPD-IMG messages not acknowledged yet
+/*!
+    The receiver only allocates 4*1000 bytes, one buffer has to be free
+    always to avoid the allocation of the rx buffer, one message is 514 bytes.
+*/
+#define RAM_WINDOW 5
+
+//! time between the checks for the workers of the host side preparation [ms]
+#define HOST_POLL  10
+
+//! let the receiver boot, nothing is done before the given time has passed
+/*!
+    \param t       update target
+    \param time    time to wait [ms]
+*/
+static void updSleep(UPD_TARGET_t *t, U4 time)
+{
+    t->sleeping = TRUE;
+    t->wakeTime = TIME_GET() + time;
+}
+
+//! check if the receiver boots or the link settles
+/*!
+    \param t       update target
+    \return #TRUE if the next step is not due yet
+*/
+static BOOL updSleeping(UPD_TARGET_t *t)
+{
+    const U4 now = TIME_GET();
+    if (t->sleeping && ((I4)(t->wakeTime - now) > 0))
+    {
+        return TRUE;
+    }
+    t->sleeping = FALSE;
+    return t->rcvConnected && ((I4)(t->rx.mReadyTime - now) > 0);
+}
+
+//! set the image to download, without prefix
+/*!
+    \param t       update target
+    \param pData   image, the image file or a copy owned by the target
+    \param size    size of the image, padded with 0xFF to whole words
+*/
+static void updSetImage(UPD_TARGET_t *t, FWHEADER_t* pData, size_t size)
+{
+    t->pData = pData;
+    InitImageSegments(&t->image, pData, size);
+    t->fileSize = GetImageSegmentsSize(&t->image);
+}
+
+//! signal that a worker of the host side preparation is done
+/*!
+    \param h       host side preparation
+    \param pDone   flag of the worker
+*/
+static void updHostSignal(UPD_HOST_t *h, BOOL *pDone)
+{
+    if (h->lock)
+    {
+        MUTEX_LOCK(h->lock);
+    }
+    *pDone = TRUE;
+    if (h->lock)
+    {
+        MUTEX_UNLOCK(h->lock);
+    }
+}
+
+//! check if a worker of the host side preparation is done
+/*!
+    \param h       host side preparation
+    \param pDone   flag of the worker
+    \return #TRUE if the worker signalled that it is done, it can be joined
+*/
+static BOOL updHostDone(UPD_HOST_t *h, const BOOL *pDone)
+{
+    BOOL done;
+    if (h->lock)
+    {
+        MUTEX_LOCK(h->lock);
+    }
+    done = *pDone;
+    if (h->lock)
+    {
+        MUTEX_UNLOCK(h->lock);
+    }
+    return done;
+}
+
+//! load and validate the image
+/*!
+    \param pArg    UPD_HOST_t of the update
+*/
+static void updLoadImageWorker(void* pArg)
+{
+    UPD_HOST_t *h = (UPD_HOST_t*)pArg;
+    LOG_CTX_t* pPrevLog = LOG_BIND(h->pLog);
+    const U4 start = TIME_GET();
+    MESSAGE(MSG_DBG, "Opening image file");
+    if (MapImageFile(h->p->BinaryFileName, &h->file))
+    {
+        MESSAGE(MSG_DBG, "Verifying image");
+        h->imageGeneration = ValidateImage((const FWHEADER_t*)h->file.pData, h->file.size, &h->fwFooter);
+    }
+    MESSAGE(MSG_DBG, "Image loaded in %u ms", TIME_GET() - start);
+    LOG_BIND(pPrevLog);
+    updHostSignal(h, &h->imageDone);
+}
+
+//! read the FIS file into memory
+/*!
+    \param pArg    UPD_HOST_t of the update
+*/
+static void updReadFisWorker(void* pArg)
+{
+    UPD_HOST_t *h = (UPD_HOST_t*)pArg;
+    LOG_CTX_t* pPrevLog = LOG_BIND(h->pLog);
+    const U4 start = TIME_GET();
+    mergefis_db_open(&h->fisDb, h->p->FisFileName);
+    MESSAGE(MSG_DBG, "FIS file read in %u ms", TIME_GET() - start);
+    LOG_BIND(pPrevLog);
+    updHostSignal(h, &h->fisDone);
+}
+
+//! start the host side preparation of an update
+/*!
+    The image is loaded and validated and the FIS file is read by workers
+    while the receiver is connected and identified. If no worker can be
+    started, the work is done right away.
+
+    \param h       host side preparation to start
+    \param t       update target
+    \param p       update options
+*/
+static void updStartHost(UPD_HOST_t *h, const UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    memset(h, 0, sizeof(*h));
+    h->p = p;
+    h->pLog = LOG_CURRENT();
+    h->lock = MUTEX_CREATE();
+    if (!p->EraseOnly && !p->fisOnly && !t->pShared)
+    {
+        h->imagePending = TRUE;
+        h->imageThread = h->lock ? THREAD_START(updLoadImageWorker, h) : NULL;
+        if (!h->imageThread)
+        {
+            updLoadImageWorker(h);
+        }
+    }
+    // a fleet update reads the FIS file once for all receivers
+    if (p->FisFileName && *p->FisFileName && !t->pShared)
+    {
+        h->fisThread = h->lock ? THREAD_START(updReadFisWorker, h) : NULL;
+        if (!h->fisThread)
+        {
+            updReadFisWorker(h);
+        }
+    }
+    else
+    {
+        h->fisDone = TRUE;
+    }
+}
+
+//! take over the image loaded by updStartHost()
+/*!
+    The image is handed over to the target, also if it isn't valid. The
+    worker is joined only once it signalled that it is done, until then
+    the stage is repeated after #HOST_POLL.
+
+    \param t       update target, receives the image and its generation
+    \return #UPD_STEP_DONE if a valid image was loaded or none is to be
+            loaded, #UPD_STEP_BUSY if it is still being loaded
+*/
+static UPD_STEP_t updWaitImage(UPD_TARGET_t *t)
+{
+    UPD_HOST_t *h = &t->host;
+    if (!h->imagePending)
+    {
+        return UPD_STEP_DONE;
+    }
+    if (!updHostDone(h, &h->imageDone))
+    {
+        updSleep(t, HOST_POLL);
+        return UPD_STEP_BUSY;
+    }
+    if (h->imageThread)
+    {
+        THREAD_JOIN(h->imageThread);
+        h->imageThread = NULL;
+    }
+    h->imagePending = FALSE;
+    if (!h->file.pData)
+    {
+        return UPD_STEP_FAILED;
+    }
+    t->file = h->file;
+    memset(&h->file, 0, sizeof(h->file));
+    updSetImage(t, (FWHEADER_t*)t->file.pData, t->file.size);
+    t->imageGeneration = h->imageGeneration;
+    if (h->imageGeneration == 0)
+    {
+        MESSAGE(MSG_ERR, "Image not valid.");
+        return UPD_STEP_FAILED;
+    }
+    return UPD_STEP_DONE;
+}
+
+//! take over the FIS file read by updStartHost()
+/*!
+    The worker is joined only once it signalled that it is done, until
+    then the stage is repeated after #HOST_POLL.
+
+    \param t       update target
+    \return #TRUE if the FIS file was read into t->host.fisDb
+*/
+static BOOL updWaitFis(UPD_TARGET_t *t)
+{
+    UPD_HOST_t *h = &t->host;
+    if (!updHostDone(h, &h->fisDone))
+    {
+        updSleep(t, HOST_POLL);
+        return FALSE;
+    }
+    if (h->fisThread)
+    {
+        THREAD_JOIN(h->fisThread);
+        h->fisThread = NULL;
+    }
+    return TRUE;
+}
+
+//! check if a worker of the host side preparation still runs
+/*!
+    \param h       host side preparation, zeroed or started by updStartHost()
+    \return #TRUE if a worker didn't signal yet that it is done
+*/
+static BOOL updHostBusy(UPD_HOST_t *h)
+{
+    return (h->imageThread && !updHostDone(h, &h->imageDone)) ||
+           (h->fisThread && !updHostDone(h, &h->fisDone));
+}
+
+//! stop the host side preparation
+/*!
+    Joins the workers, this only blocks if one still runs, see updHostBusy().
+
+    \param h       host side preparation, zeroed or started by updStartHost()
+*/
+static void updStopHost(UPD_HOST_t *h)
+{
+    if (h->imageThread)
+    {
+        THREAD_JOIN(h->imageThread);
+        h->imageThread = NULL;
+    }
+    if (h->fisThread)
+    {
+        THREAD_JOIN(h->fisThread);
+        h->fisThread = NULL;
+    }
+    UnmapImageFile(&h->file);
+    mergefis_db_close(&h->fisDb);
+    MUTEX_DELETE(h->lock);
+    h->lock = NULL;
+}
+
+//! get the time the next step of the preparation or the completion is due
+/*!
+    \param t       update target
+    \return time of the next step, earlier if data from the receiver arrives
+*/
+static U4 updDue(const UPD_TARGET_t *t)
+{
+    const U4 now = TIME_GET();
+    if (t->sleeping && ((I4)(t->wakeTime - now) > 0))
+    {
+        return t->wakeTime;
+    }
+    if (!t->rcvConnected)
+    {
+        return now;
+    }
+    if (t->autobaud.req.pFrames)
+    {
+        return rcvAutobaudDeadline(&t->rx, &t->autobaud);
+    }
+    if (t->req.pFrames)
+    {
+        return rcvRequestDeadline(&t->rx, &t->req);
+    }
+    if (t->stage == UPD_STAGE_RAM)
+    {
+        // more to send if the window isn't full, otherwise wait for the acks
+        return (((t->ramSent - t->ramAcked) < RAM_WINDOW) &&
+                (t->ramSendStart < GetImageSegmentsSize(&t->image))) ? now : t->ramTimeLimit;
+    }
+    return ((I4)(t->rx.mReadyTime - now) > 0) ? t->rx.mReadyTime : now;
+}
+
+//! block until the next step is due or data from the receiver arrives
+/*!
+    \param t       update target
+    \param time    time the next step is due, see updDue()
+*/
+static void updWait(UPD_TARGET_t *t, U4 time)
+{
+    const I4 wait = (I4)(time - TIME_GET());
+    if (wait <= 0)
+    {
+        return;
+    }
+    if (!t->rcvConnected || (t->sleeping && ((I4)(t->wakeTime - time) >= 0)))
+    {
+        // nothing to read while the receiver boots
+        TIME_SLEEP((U4)wait);
+        return;
+    }
+    rcvWaitUntil(&t->rx, time);
+}
+
+//! send a message and wait for the reply in the next steps, see updReply()
+/*!
+    \param t           update target
+    \param classId     class of the message
+    \param msgId       id of the message
+    \param payload     payload, NULL if none
+    \param payloadSize size of the payload
+    \param ack         the reply is the ACK-ACK or ACK-NAK of the message
+    \param timeout     time to wait for the reply before the message is sent again
+    \return #TRUE on success
+*/
+static BOOL updRequest(UPD_TARGET_t *t, U1 classId, U1 msgId, const CH* payload, U4 payloadSize, BOOL ack, U4 timeout)
+{
+    if (!rcvRequestInit(&t->req, classId, msgId, payload, payloadSize, ack, timeout))
+    {
+        MESSAGE(MSG_ERR, "Alloc failed");
+        rcvRequestRelease(&t->req);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//! check for the reply to the request of the target
+/*!
+    \param t       update target, t->req prepared
+    \param ppReply receives the reply, see rcvRequestCheck()
+    \return state of the request, released unless #RCV_REQ_PENDING
+*/
+static RCV_REQ_STATE_t updReply(UPD_TARGET_t *t, UBX_HEAD_t **ppReply)
+{
+    const RCV_REQ_STATE_t state = rcvRequestCheck(&t->rx, &t->req, ppReply);
+    if (state != RCV_REQ_PENDING)
+    {
+        rcvRequestRelease(&t->req);
+    }
+    return state;
+}
+
+//! poll MON-VER, trying the baudrates with autobaud, see updHello()
+/*!
+    \param t       update target
+    \param p       update options
+    \return #TRUE on success
+*/
+static BOOL updHelloStart(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    if (!p->DoAutobaud)
+    {
+        return updRequest(t, UBX_CLASS_MON, UBX_MON_VER, NULL, 0, FALSE, POLL_TIMEOUT);
+    }
+    if (!rcvAutobaudStart(&t->autobaud, p->TrainingSequence))
+    {
+        MESSAGE(MSG_ERR, "Alloc failed");
+        rcvRequestRelease(&t->autobaud.req);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//! check for MON-VER polled by updHelloStart()
+/*!
+    \param t       update target
+    \param ppMonVer receives MON-VER if it arrived, NULL otherwise
+    \return #TRUE if the poll is still pending
+*/
+static BOOL updHello(UPD_TARGET_t *t, UBX_HEAD_t **ppMonVer)
+{
+    if (!t->autobaud.req.pFrames)
+    {
+        return (updReply(t, ppMonVer) == RCV_REQ_PENDING);
+    }
+    if (rcvAutobaudCheck(&t->rx, &t->autobaud, ppMonVer) == RCV_REQ_PENDING)
+    {
+        return TRUE;
+    }
+    rcvRequestRelease(&t->autobaud.req);
+    return FALSE;
+}
+
+//! reopen the port after the receiver rebooted, without waiting
+/*!
+    One attempt of rcvReenumerateStep(), the next one is due once the
+    target woke up again.
+
+    \param t       update target
+    \return #SER_REENUM_PENDING until the port is back or lost
+*/
+static SER_REENUM_t updReenumerate(UPD_TARGET_t *t)
+{
+    U4 wait = 0;
+    const SER_REENUM_t state = rcvReenumerateStep(&t->rx, t->isUsbPort, t->reenumAttempt++, &wait);
+    if (state == SER_REENUM_PENDING)
+    {
+        updSleep(t, wait);
+    }
+    else
+    {
+        t->reenumAttempt = 0;
+    }
+    return state;
+}
+
+//! start the download to the RAM, see updRamStep()
+/*!
+    \param t       update target
+*/
+static void updRamStart(UPD_TARGET_t *t)
+{
+    t->ramSent = 0;
+    t->ramSendStart = 0;
+    t->ramAcked = 0;
+    t->ramTimeLimit = TIME_GET() + POLL_TIMEOUT;
+    t->stage = UPD_STAGE_RAM;
+}
+
+//! download the image to the RAM, without waiting
+/*!
+    Sends UPD-IMG messages while less than #RAM_WINDOW are pending and
+    counts the acknowledges received so far.
+
+    \param t       update target
+    \return #UPD_STEP_BUSY until all messages are acknowledged
+*/
+static UPD_STEP_t updRamStep(UPD_TARGET_t *t)
+{
+    const IMG_SEGMENTS_t* pImage = &t->image;
+    const U4 ImageSize = (U4)GetImageSegmentsSize(pImage);
+    APP_UBX_UPD_IMG_PAYLOAD_t imgPayload;
+    const size_t packetSize = sizeof(imgPayload.chunkData);
+    while (((t->ramSent - t->ramAcked) < RAM_WINDOW) && (t->ramSendStart < ImageSize))
+    {
+        size_t sendSize;
+        if ((t->ramSendStart + packetSize) > ImageSize)
+        {
+            sendSize = ImageSize - t->ramSendStart;
+        }
+        else
+        {
+            sendSize = packetSize;
+        }
+        // send one packet
+        imgPayload.chunkNum = (U2)t->ramSent;
+
+        ReadImageSegments(pImage, t->ramSendStart, imgPayload.chunkData, sendSize);
+        if (sendSize < packetSize)
+        {
+            // clear the rest of the buffer
+            memset(&imgPayload.chunkData[sendSize], 0, packetSize - sendSize);
+        }
+        if (rcvSendMessage(&t->rx, UBX_CLASS_UPD, UBX_UPD_IMG, (CH*)&imgPayload, sizeof(imgPayload)) != 1)
+        {
+            MESSAGE(MSG_ERR, "Chunk %d not accepted by receiver", t->ramSent);
+            return UPD_STEP_FAILED;
+        }
+        t->ramSent++;
+        t->ramSendStart += packetSize;
+    }
+
+    // check if we received acks
+    UBX_HEAD_t *ack;
+    while ((ack = rcvReceiveMessage(&t->rx, 0, UBX_CLASS_ACK, -1)) != NULL)
+    {
+        UBX_ACK_ACK_t *pAck = (UBX_ACK_ACK_t*)((U1*)ack + UBX_HEAD_SIZE);
+        if (pAck->clsId == UBX_CLASS_UPD &&
+            pAck->msgId == UBX_UPD_IMG)
+        {
+            if (ack->msgId != UBX_ACK_ACK)
+            {
+                MESSAGE(MSG_ERR, "Received NACK for chunk %d ", (t->ramAcked+1));
+                rcvReleaseMessage(&t->rx, ack);
+                return UPD_STEP_FAILED;
+            }
+
+            // we received an ack message for one UPD-IMG message
+            // push out the timeout
+            t->ramTimeLimit = TIME_GET() + POLL_TIMEOUT;
+            t->ramAcked++;
+        }
+        else
+        {
+            MESSAGE(MSG_WARN, "Received unexpected (N)ACK");
+        }
+        rcvReleaseMessage(&t->rx, ack);
+    }
+
+    // check if we finished
+    if ((t->ramAcked * packetSize) >= ImageSize)
+    {
+        return UPD_STEP_DONE;
+    }
+    // check if we timed out
+    if ((I4)(TIME_GET() - t->ramTimeLimit) > 0)
+    {
+        MESSAGE(MSG_ERR, "Downloading to RAM timed out. sent %u, acked %u", t->ramSent, t->ramAcked);
+        return UPD_STEP_FAILED;
+    }
+    return UPD_STEP_BUSY;
+}
+
+//! identify the ROM by its CRC and check that the image is compatible
+/*!
+    \param t       update target
+    \param p       update options
+    \param crcVal  CRC of the ROM
+    \return #TRUE if the update can go on
+*/
+static BOOL updCheckRom(UPD_TARGET_t *t, const UPD_PARAMS_t *p, U4 crcVal)
+{
+    MESSAGE(MSG_LEV2, "ROM CRC: 0x%08X", crcVal);
+    t->hwRomVer = romVersion(crcVal);
+    if (!t->hwRomVer && !p->EraseOnly)
+    {
+        MESSAGE(MSG_ERR, "u-blox %d.%d ROM version unknown (0x%08X)",
+                t->generation/10, t->generation%10, crcVal);
+        return FALSE;
+    }
+    MESSAGE(MSG_LEV2, "u-blox%d ROM%d.%02d hardware detected (0x%08X)",
+        t->generation/10, t->hwRomVer/100, t->hwRomVer%100, crcVal);
+
+
+
+    /***************************************************
+     * check that the image is compatible              *
+     ***************************************************/
+    if (p->EraseOnly || p->fisOnly)
+    {
+        // no image available, no check needed
+    }
+    else if ( (t->imageGeneration / 10) != (t->generation / 10) &&
+             ((t->imageGeneration == 91) && (t->generation != 100)))
+    {
+        MESSAGE(MSG_ERR, "Receiver generation (%d) incompatible with this image (%d)!",
+            t->generation, t->imageGeneration);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//! get the flash organization and merge the FIS loaded before into the image
+/*!
+    \param t       update target, t->fis and t->fisRet loaded
+    \param p       update options
+    \return #TRUE on success
+*/
+static BOOL updMergeFis(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    const BOOL flashNotNeeded = (p->updateRam != 0);
+    const U2 FlashManId = t->FlashManId;
+    const U2 FlashDevId = t->FlashDevId;
+    U4 FlashSize = 0;
+    CH *fis = t->fis;
+    size_t fisSize = t->fisSize;
+    MERGEFIS_RETVAL_t ret = t->fisRet;
+    BOOL success = FALSE;
+
+    do
+    {
+        if(t->generation >= 70)
+        {
+            BLOCK_DEF_t flashDef;
+
+            if (t->generation < 90 || !flashNotNeeded)
+            {
+                if (ret == MERGEFIS_OK)
+                {
+                    flashDef.Count = mergefis_get_sector_count(fis);
+                    flashDef.Size = mergefis_get_sector_size(fis);
+                    addBlock(&t->FlashOrg, &flashDef);
+                    FlashSize = flashDef.Count * flashDef.Size;
+                    if (p->fisOnly)
+                    {
+                        // we don't have to merge but just send the FIS
+                        t->fileSize = 0x1000;
+
+                        // Is FIS size to big?
+                        if (fisSize > (t->fileSize - 0x40) || !fisSize || !fis)
+                        {
+                            if (fis)
+                                free(fis);
+                            fis = NULL;
+                            fisSize = 0;
+                            break;
+                        }
+                        if (t->pData != NULL)
+                        {
+                            if (t->ownData)
+                                free(t->pData);
+                            t->pData = NULL;
+                        }
+
+                        CH *pFis = malloc(t->fileSize);
+                        if (!pFis)
+                        {
+                            free(fis);
+                            fis = NULL;
+                            fisSize = 0;
+                            break;
+                        }
+                        t->ownData = TRUE;
+                        if (t->generation >= 90)
+                        {
+                            fisSize = sizeof(DRV_SPI_MEM_FIS_t);
+                            // just copy the fis into the image at the start
+                            memcpy(pFis, fis, sizeof(DRV_SPI_MEM_FIS_t));
+                            updSetImage(t, (FWHEADER_t*)pFis, sizeof(DRV_SPI_MEM_FIS_t));
+                        }
+                        else
+                        {
+                            // Set header part to 0, the rest will be overwritten
+                            memset(pFis, 0x0, 0x40);
+                            // Set the rest of pFis to 0xff
+                            memset(&pFis[0x40], 0xff, t->fileSize - 0x40);
+                            // Copy the actual data after the header
+                            memcpy(&pFis[0x40], fis, fisSize);
+                            updSetImage(t, (FWHEADER_t*)pFis, t->fileSize);
+                        }
+                    }
+                    else if (t->pData != NULL && p->noFisMerging)
+                    {
+                        MESSAGE(MSG_DBG, "Not merging anything");
+                    }
+                    else if (t->pData != NULL)
+                    {
+                        if (t->generation >= 90)
+                        {
+                            // the fis is written in front of the image, without copying the image
+                            t->pPrefix = malloc(sizeof(DRV_SPI_MEM_FIS_t));
+                            if (t->pPrefix == NULL)
+                            {
+                                MESSAGE(MSG_ERR, "malloc failed");
+                                break;
+                            }
+                            memcpy(t->pPrefix, fis, sizeof(DRV_SPI_MEM_FIS_t));
+                            t->image.pPrefix = (const U1*)t->pPrefix;
+                            t->image.prefixSize = sizeof(DRV_SPI_MEM_FIS_t);
+                            t->fileSize = GetImageSegmentsSize(&t->image);
+                            t->FwBase = 0;
+                        }
+                        else
+                        {
+                            // merge the FIS information into the firmware
+                            if (!t->ownData)
+                            {
+                                // don't modify the image file, it is mapped read-only
+                                // or shared with the other receivers
+                                FWHEADER_t* pCopy = (FWHEADER_t*)malloc(t->fileSize);
+                                if (pCopy == NULL)
+                                {
+                                    MESSAGE(MSG_ERR, "malloc failed");
+                                    break;
+                                }
+                                ReadImageSegments(&t->image, 0, pCopy, t->fileSize);
+                                updSetImage(t, pCopy, t->fileSize);
+                                t->ownData = TRUE;
+                            }
+                            U4 imageSize = (t->pData->v1.pEnd & ~0x1) - t->pData->v1.pBase + sizeof(U8);
+                            ret = mergefis_merge((CH*)t->pData, imageSize, fis);
+                        }
+                    }
+
+
+                    // check for failure
+                    if (ret != MERGEFIS_OK && !p->noFisMerging)
+                    {
+                        MESSAGE(MSG_LEV1, "The merging failed");
+                        break;
+                    }
+                    else if (!p->noFisMerging)
+                    {
+                        // success
+                        MESSAGE(MSG_DBG, "FIS information merged");
+                    }
+
+                }
+                else
+                {
+                    // something went wrong when loading the FIS file
+                    // check the reason
+                    switch (ret)
+                    {
+                    case MERGEFIS_FILE_NOT_FOUND:
+                        MESSAGE(MSG_ERR, "Could not open the FIS file %s", p->FisFileName);
+                        break;
+                    case MERGEFIS_VERSION_ERROR:
+                        MESSAGE(MSG_ERR, "FIS version not matching\n");
+                        break;
+                    case MERGEFIS_INCORRECT_XML:
+                        MESSAGE(MSG_ERR, "There is an error in the XML file\n");
+                        break;
+                    case MERGEFIS_JEDEC_NOT_SUPPORTED:
+                        MESSAGE(MSG_ERR, "Flash (ManId: 0x%04X DevId: 0x%04X) not supported\n", FlashManId, FlashDevId);
+                        break;
+                    case MERGEFIS_CODE_CORRUPTED:
+                        MESSAGE(MSG_ERR, "Code in XML file is corrupted\n");
+                        break;
+                    case MERGEFIS_CRC_FAILURE:
+                        MESSAGE(MSG_ERR, "CRC failure\n");
+                        break;
+                    default:
+                        MESSAGE(MSG_ERR, "An unknown error occurred\n");
+                        break;
+                    }
+                    break;
+                }
+            }
+        }
+        else
+        {
+            // search for flash info in provided flash definition file
+            if(!GetFlashOrganisation(FlashManId, FlashDevId,
+                &t->FlashOrg, &FlashSize, p->FlashDefFileName))
+            {
+                MESSAGE(MSG_ERR, "Could not open file '%s'", p->FlashDefFileName);
+                MESSAGE(MSG_ERR, "No flash organization information available for ManID 0x%04X, DevID 0x%04X", FlashManId, FlashDevId);
+                break;
+            }
+        }
+
+        DumpFlashInfo(&t->FlashOrg, FlashSize);
+        // check if flash size is at least as big as firmware to load
+        if (t->generation < 90 || !(p->updateRam != 0))
+        {
+            if (FlashSize < t->fileSize)
+            {
+                MESSAGE(MSG_ERR, "Flash too small for image.");
+                break;
+            }
+        }
+        success = TRUE;
+    } while (FALSE);
+
+    t->fis = fis;
+    t->fisSize = fisSize;
+    t->FlashSize = FlashSize;
+    return success;
+}
+
+//! end the preparation of the receiver
+/*!
+    \param t       update target
+    \param p       update options
+    \param success preparation successful
+    \return #UPD_STEP_DONE or #UPD_STEP_FAILED, #UPD_STEP_BUSY while a
+            worker of the host side preparation still runs after a failure
+*/
+static UPD_STEP_t updPrepareEnd(UPD_TARGET_t *t, const UPD_PARAMS_t *p, BOOL success)
+{
+    // the workers may still run after a failure, they are joined once done
+    t->prepared = success;
+    t->stage = UPD_STAGE_PREPARE_END;
+    if (updHostBusy(&t->host))
+    {
+        updSleep(t, HOST_POLL);
+        return UPD_STEP_BUSY;
+    }
+    if (success && !t->current)
+    {
+        // ready for the download
+        MESSAGE(MSG_DBG, "Ready for the download after %u ms, peak memory use %u kB",
+                TIME_GET() - t->startTime, MEM_PEAK());
+    }
+    updStopHost(&t->host);
+    free(t->fis); // free the memory
+    t->fis = NULL;
+    rcvRequestRelease(&t->req);
+    rcvRequestRelease(&t->autobaud.req);
+    if (t->idChanged)
+    {
+        updStoreIdentity(t, p);
+    }
+    t->stage = UPD_STAGE_FINISH;
+    return success ? UPD_STEP_DONE : UPD_STEP_FAILED;
+}
+
+//! skip the update, the receiver runs the image already
+/*!
+    \param t       update target
+    \param p       update options
+    \return #UPD_STEP_DONE
+*/
+static UPD_STEP_t updSkip(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    const U4 baud = p->BaudrateUpd ? p->BaudrateUpd : p->Baudrate;
+    MESSAGE(MSG_LEV0, "Receiver over '%s' is current, update skipped after %u ms "
+            "(download of %u kB, about %u s at %u baud, saved)",
+            t->port, TIME_GET() - t->startTime, (U4)(t->fileSize / 1024),
+            baud ? (U4)(t->fileSize * 10 / baud) : 0, baud);
+    t->current = TRUE;
+    return updPrepareEnd(t, p, TRUE);
+}
+
+//! set up the flash download
+/*!
+    \param t         update target
+    \param p         update options
+    \param chipErase the chip erase was started, no sector has to be erased
+    \return #UPD_STEP_DONE or #UPD_STEP_FAILED
+*/
+static UPD_STEP_t updSetupDownload(UPD_TARGET_t *t, const UPD_PARAMS_t *p, BOOL chipErase)
+{
+    I4 numberSectors;
+    if (chipErase)
+    {
+        // we don't have to erase any sector afterwards because we do a chip erase
+        numberSectors = 0;
+    }
+    else if(p->EraseWholeFlash)
+    {
+        // erase all the sectors
+        numberSectors = GetSectorNrForSize(0, t->FlashSize, &t->FlashOrg);
+    }
+    else
+    {
+        // erase only the needed sectors
+        numberSectors = (p->EraseOnly) ? 1 : GetSectorNrForSize(0, t->fileSize, &t->FlashOrg);
+    }
 
+    I4 numberPackets = (t->fileSize % PACKETSIZE) ?
+        t->fileSize / PACKETSIZE + 1 : t->fileSize / PACKETSIZE;
+    updLoadLink(t, p);
+    t->upd = updInit(&t->rx, numberSectors, numberPackets, &t->FlashOrg, t->FlashSize, updLinkWindow(t), chipErase);
+    if(!t->upd)
+        return updPrepareEnd(t, p, FALSE);
+    updSeedLink(t);
+    return updPrepareEnd(t, p, TRUE);
+}
 
+//! connect to the receiver and prepare it for the download, one step at a time
+/*!
+    Everything up to the flash download: load the image, identify the
+    receiver, enter safeboot, merge the FIS and switch to the update
+    baudrate. The RAM update is done completely. A step sends a message
+    or checks for its reply, the receiver is given time to boot and the
+    link to settle in between, see updDue().
+
+    \param t       update target
+    \param p       update options
+    \return #UPD_STEP_BUSY until done, the download is to be done after
+            #UPD_STEP_DONE if t->upd is set
+*/
+static UPD_STEP_t updPrepareStep(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    const BOOL flashNotNeeded = (p->updateRam != 0);
+    UBX_HEAD_t *msg = NULL;
+    RCV_REQ_STATE_t state;
+    if (updSleeping(t))
+    {
+        return UPD_STEP_BUSY;
+    }
 
+    switch (t->stage)
+    {
+    case UPD_STAGE_PREPARE_END:
+        return updPrepareEnd(t, p, t->prepared);
+
+    case UPD_STAGE_CONNECT:
+        t->startTime = TIME_GET();
+        t->rcvPortId = UBX_CFG_PRT_PORT_UART1;
+        updStartHost(&t->host, t, p);
+        if (!p->EraseOnly && !p->fisOnly)
+        {
+            MESSAGE(MSG_LEV0, "Updating Firmware '%s' of receiver over '%s'",
+                    p->BinaryFileName, t->port);
+            if (t->pShared)
+            {
+                // loaded and validated once for all receivers, copied before it is modified
+                updSetImage(t, (FWHEADER_t*)t->pShared->pData, t->pShared->fileSize);
+                t->imageGeneration = t->pShared->imageGeneration;
+            }
+            // otherwise loaded and validated by updStartHost() while the
+            // receiver is connected, see updWaitImage()
+        }
 
+        /***************************************************
+         * connect to the receiver with the given baudrate *
+         ***************************************************/
+        t->rcvConnected = rcvConnect(&t->rx, t->port, p->Baudrate);
+        if (!t->rcvConnected)
+            return updPrepareEnd(t, p, FALSE);
+        t->stage = UPD_STAGE_TRAINING;
+        break;
 
+    case UPD_STAGE_TRAINING:
         /***************************************************
-         * read the CRC of the ROM                         *
+         * try to communicate with the receiver (MON-VER)  *
          ***************************************************/
-        U4 crcVal = 0x66666666;
-        if (generation >= 90 && imageGeneration >= 91)
-        {
-            UBX_HEAD_t* romCrc = NULL;
-            FwBase = (updateRam != 0) ? RAM_BASE : sizeof(DRV_SPI_MEM_FIS_t);
-            MESSAGE(MSG_DBG, "Sending ROM CRC Poll");
-            romCrc = rcvPollMessage(&rx, UBX_CLASS_UPD, UBX_UPD_ROM, NULL, 0, POLL_TIMEOUT);
-            if (romCrc == NULL)
-            {
-                MESSAGE(MSG_ERR, "Could not get ROM CRC");
-                break;
-            }
-            else
-            {
-                memcpy(&crcVal, (U1*)romCrc + UBX_HEAD_SIZE + 2 * sizeof(U4), sizeof(crcVal));
-                free(romCrc);
-            }
+        if(p->TrainingSequence)
+            rcvSendTrainingSequence(&t->rx);
+        if (!updHelloStart(t, p))
+            return updPrepareEnd(t, p, FALSE);
+        t->stage = UPD_STAGE_HELLO_REPLY;
+        break;
+
+    case UPD_STAGE_HELLO_REPLY:
+        if (updHello(t, &msg))
+            break;
+        if( msg == NULL )
+        {
+            MESSAGE(MSG_ERR, "Version poll failed.");
+            return updPrepareEnd(t, p, FALSE);
         }
-        else
+        MESSAGE(MSG_DBG, "Received Version information");
+        t->generation = extractHwGeneration(msg);
+        monVerString(msg,  0, sizeof(t->swVer), t->swVer);
+        monVerString(msg, 30, sizeof(t->hwVer), t->hwVer);
+        rcvReleaseMessage(&t->rx, msg);
+        // check for valid ROM size not needed for u-blox10
+        if ( (!romSize(t->generation)) && (t->generation < 100) )
         {
-            BOOL fail = TRUE;
-            U4 CRCSize = 4;
-            U4 romBase = (generation >= 70) ? 0x00000000 : 0x00200000;
-            U4 payload[3] = { romBase + romSize - CRCSize, CRCSize, 0 };
-            U1 payloadAuth[] = { 0x9C, 0x59, 0xC5, 0x22, 0xEC, 0x34, 0x1A, 0x1A, 0x30, 0xCC, 0xB1, 0xFB, 0x69, 0xCB, 0xAD, 0x9A, 0x41, 0x83, 0x6E, 0xDD, 0x27, 0xE4, 0xFB, 0xA6, 0x8C, 0x71, 0xE3, 0xAB, 0x8A, 0xA4, 0x0D, 0x20, 0xFC, 0x7F, 0x08, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; // Read u-blox8 CRC auth
-            U4 retryCount;
-            FwBase = (pData) ? pData->v1.pBase : FLASH_BASE;
-            MESSAGE(MSG_DBG, "Sending ROM CRC-Mix-Read");
-            for (retryCount = 0; (retryCount < RETRY_COUNT) && fail; retryCount++)
-            {
-                if (!rcvSendMessage(&rx, UBX_CLASS_UPD, UBX_UPD_UPLOAD, (CH *)payload, sizeof(payload)) ||
-                    !rcvSendMessage(&rx, UBX_CLASS_UPD, UBX_UPD_AUTHREAD, (CH *)payloadAuth, sizeof(payloadAuth)))
-                {
-                    break; // fail
-                }
-                const U4 TOTIME = TIME_GET() + POLL_TIMEOUT; // compute the deadline
-                do
-                {
-                    U4 now = TIME_GET();
-                    UBX_HEAD_t* msg = rcvReceiveMessage(&rx, TOTIME > now ? TOTIME - now : 0, UBX_CLASS_UPD, -1);
-                    if (msg == NULL)
-                    {
-                        break;
-                    }
-                    if (msg->msgId == UBX_UPD_UPLOAD)
-                    {
-                        memcpy(&crcVal, (U1*)msg + UBX_HEAD_SIZE + 12, sizeof(crcVal));
-                        fail = FALSE;
-                    }
-                    else if (msg->msgId == UBX_UPD_AUTHREAD)
-                    {
-                        memcpy(&crcVal, (U1*)msg + UBX_HEAD_SIZE + sizeof(payloadAuth), sizeof(crcVal));
-                        fail = FALSE;
-                    }
-                    free(msg);
-                } while ((TIME_GET() < TOTIME) && fail);
-            }
-            if(fail)
-            {
-                MESSAGE(MSG_ERR, "Could not get ROM CRC");
-                break;
-            }
-
+            MESSAGE(MSG_ERR, "Could not get correct ROM size");
+            return updPrepareEnd(t, p, FALSE);
         }
-        MESSAGE(MSG_LEV2, "ROM CRC: 0x%08X", crcVal);
-        U4 hwRomVer = (crcVal == 0x00000000) ? 200 : // u-blox5
-                      (crcVal == 0xE046F6C8) ? 300 :
-                      (crcVal == 0x3CB3E4FF) ? 400 :
-                      (crcVal == 0x806AF596) ? 500 :
-                      (crcVal == 0xEA00D0BD) ? 510 :
-                      (crcVal == 0xB5CD6FC1) ? 600 : // u-blox6
-                      (crcVal == 0x2BA123BA) ? 601 :
-                      (crcVal == 0x288646C9) ? 602 :
-                      (crcVal == 0xB94D4114) ? 701 :
-                      (crcVal == 0x494DF1F9) ? 703 :
-                      (crcVal == 0xd5fce753) ?  10 : // u-blox7 ROM0.10
-                      (crcVal == 0xfce598b1) ?  11 : //         ROM0.11
-                      (crcVal == 0xed152ade) ?  14 : //         ROM0.14
-                      (crcVal == 0x100E368D) ? 100 : //         ROM1.00
-                      (crcVal == 0xDFAA666C) ?  21 : // u-blox8 ROM0.21
-                      (crcVal == 0x041D115D) ?  22 : // u-blox8 ROM0.22
-                      (crcVal == 0xA15AF099) ? 201 : // u-blox8 ROM2.01
-                      (crcVal == 0x2FEF89EA) ? 301 : //         ROM3.01
-                      (crcVal == 0x1893C329) ? 351 : //         ROM3.51
-                      (crcVal == 0xCAAF619C) ? 40  : // u-blox9 ROM0.40
-                      (crcVal == 0xDD3FE36C) ? 101 : //         ROM1.01
-                      (crcVal == 0x118B2060) ? 102 : //         ROM1.02
-                      (crcVal == 0x3BFC8935) ? 404 : //         ROM4.04
-                      0;
-        if (!hwRomVer && !EraseOnly)
-        {
-            MESSAGE(MSG_ERR, "u-blox %d.%d ROM version unknown (0x%08X)",
-                    generation/10, generation%10, crcVal);
+        t->stage = p->SkipCurrent ? UPD_STAGE_CURRENT : UPD_STAGE_PORT;
+        break;
+
+    case UPD_STAGE_CURRENT:
+    {
+        /***************************************************
+         * skip the update if the receiver runs the image  *
+         * already, before anything is changed on it       *
+         ***************************************************/
+        const UPD_STEP_t image = updWaitImage(t);
+        if (image == UPD_STEP_BUSY)
             break;
+        if (image == UPD_STEP_FAILED)
+            return updPrepareEnd(t, p, FALSE);
+        t->stage = UPD_STAGE_PORT;
+        if (t->pData && (p->updateRam == 0))
+        {
+            const int current = updIsCurrent(t, p);
+            if (current > 0)
+                return updSkip(t, p);
+            if (current < 0)
+                t->stage = UPD_STAGE_CURRENT_CRC_REPLY;
         }
-        MESSAGE(MSG_LEV2, "u-blox%d ROM%d.%02d hardware detected (0x%08X)",
-            generation/10, hwRomVer/100, hwRomVer%100, crcVal);
-
+        break;
+    }
 
+    case UPD_STAGE_CURRENT_CRC_REPLY:
+        if (updReply(t, &msg) == RCV_REQ_PENDING)
+            break;
+        if (msg == NULL)
+        {
+            MESSAGE(MSG_LEV1, "Receiver doesn't report the flash CRC while running");
+        }
+        else
+        {
+            const BOOL crcOk = imageCrcReply(msg);
+            rcvReleaseMessage(&t->rx, msg);
+            MESSAGE(MSG_LEV1, "Flash CRC over the image range %s", crcOk ? "matches" : "differs");
+            if (crcOk)
+                return updSkip(t, p);
+        }
+        t->stage = UPD_STAGE_PORT;
+        break;
 
+    case UPD_STAGE_PORT:
         /***************************************************
-         * check that the image is compatible              *
+         * find out if connected via USB and silence the   *
+         * periodic output of the connected port           *
          ***************************************************/
-        if (EraseOnly || fisOnly)
+        // autodetect the receiver port
+        MESSAGE(MSG_LEV1, "Getting Port connection to receiver");
+        if (!updRequest(t, UBX_CLASS_CFG, UBX_CFG_PORT, NULL, 0, FALSE, POLL_TIMEOUT))
+            return updPrepareEnd(t, p, FALSE);
+        t->stage = UPD_STAGE_PORT_REPLY;
+        break;
+
+    case UPD_STAGE_PORT_REPLY:
+    {
+        if (updReply(t, &msg) == RCV_REQ_PENDING)
+            break;
+        if(msg == NULL)
+        {
+            MESSAGE(MSG_DBG, "Getting Port connection timed out");
+            return updPrepareEnd(t, p, FALSE);
+        }
+        UBX_CFG_PRT_t *prt = (UBX_CFG_PRT_t*)((U1*)msg+UBX_HEAD_SIZE);
+        const CH* portName[6] = {"I2C", "UART1", "UART2", "USB", "SPI", "?\?\?" };
+        MESSAGE(MSG_DBG, "Connected port is: %s", portName[MIN(prt->portId,5)]);
+
+        // remember the port we are talking to, the baudrate switch has to be applied to it
+        t->rcvPortId = prt->portId;
+        if (prt->portId == UBX_CFG_PRT_PORT_USB)
+        {
+            t->isUsbPort = TRUE;
+        }
+        if (prt->portId == UBX_CFG_PRT_PORT_SPI)
         {
-            // no image available, no check needed
+            t->isSpiPort = TRUE;
         }
-        else if ( (imageGeneration / 10) != (generation / 10) &&
-                 ((imageGeneration == 91) && (generation != 100)))
+
+        // silence the periodic output of the port such that the replies to
+        // our polls don't have to queue behind NMEA messages
+        t->stage = UPD_STAGE_IDENTITY;
+        if ((msg->size >= sizeof(UBX_CFG_PRT_t)) &&
+            quiesceRequest(&t->req, prt, t->generation))
         {
-            MESSAGE(MSG_ERR, "Receiver generation (%d) incompatible with this image (%d)!",
-                generation, imageGeneration);
+            t->stage = UPD_STAGE_QUIESCE_REPLY;
+        }
+        rcvReleaseMessage(&t->rx, msg);
+        break;
+    }
+
+    case UPD_STAGE_QUIESCE_REPLY:
+        state = updReply(t, NULL);
+        if (state == RCV_REQ_PENDING)
             break;
+        MESSAGE(MSG_DBG, "Periodic output %s", (state == RCV_REQ_REPLY) ? "disabled" : "could not be disabled");
+        t->stage = UPD_STAGE_IDENTITY;
+        break;
+
+    case UPD_STAGE_IDENTITY:
+        /***************************************************
+         * look up the receiver in the identity cache      *
+         ***************************************************/
+        t->stage = UPD_STAGE_ROM_CRC;
+        if ((p->IdCacheFileName && *p->IdCacheFileName) ||
+            (p->StateDir && *p->StateDir))
+        {
+            if (updIdentityRequest(t))
+                t->stage = UPD_STAGE_IDENTITY_REPLY;
+            else
+                updLookupIdentity(t, p, NULL);
         }
+        break;
 
+    case UPD_STAGE_IDENTITY_REPLY:
+        if (updReply(t, &msg) == RCV_REQ_PENDING)
+            break;
+        updLookupIdentity(t, p, msg);
+        rcvReleaseMessage(&t->rx, msg);
+        t->stage = UPD_STAGE_ROM_CRC;
+        break;
 
+    case UPD_STAGE_ROM_CRC:
+    {
+        /***************************************************
+         * the image is needed from here on                *
+         ***************************************************/
+        const UPD_STEP_t image = updWaitImage(t);
+        if (image == UPD_STEP_BUSY)
+            break;
+        if (image == UPD_STEP_FAILED)
+            return updPrepareEnd(t, p, FALSE);
 
+        /***************************************************
+         * read the CRC of the ROM                         *
+         ***************************************************/
+        const BOOL romPoll = (t->generation >= 90 && t->imageGeneration >= 91);
+        if (romPoll)
+        {
+            t->FwBase = (p->updateRam != 0) ? RAM_BASE : sizeof(DRV_SPI_MEM_FIS_t);
+        }
+        else
+        {
+            t->FwBase = (t->pData) ? t->pData->v1.pBase : FLASH_BASE;
+        }
+        if (t->idCached && t->id.romCrcValid)
+        {
+            MESSAGE(MSG_DBG, "ROM CRC taken from the identity cache");
+            if (!updCheckRom(t, p, t->id.romCrc))
+                return updPrepareEnd(t, p, FALSE);
+            t->stage = UPD_STAGE_LOADER;
+        }
+        else if (!romCrcRequest(&t->req, t->generation, romPoll))
+        {
+            MESSAGE(MSG_ERR, "Could not get ROM CRC");
+            return updPrepareEnd(t, p, FALSE);
+        }
+        else
+        {
+            t->stage = UPD_STAGE_ROM_CRC_REPLY;
+        }
+        break;
+    }
 
+    case UPD_STAGE_ROM_CRC_REPLY:
+    {
+        if (updReply(t, &msg) == RCV_REQ_PENDING)
+            break;
+        if (msg == NULL)
+        {
+            MESSAGE(MSG_ERR, "Could not get ROM CRC");
+            return updPrepareEnd(t, p, FALSE);
+        }
+        const U4 crcVal = romCrcReply(msg);
+        rcvReleaseMessage(&t->rx, msg);
+        if (t->idEnabled)
+        {
+            t->id.romCrc = crcVal;
+            t->id.romCrcValid = TRUE;
+            t->idChanged = TRUE;
+        }
+        if (!updCheckRom(t, p, crcVal))
+            return updPrepareEnd(t, p, FALSE);
+        t->stage = UPD_STAGE_LOADER;
+        break;
+    }
 
+    case UPD_STAGE_LOADER:
         /***************************************************
-         * find out if connected via USB                   *
+         * Prepare the receiver for firmware update        *
+         * - either send to safeboot                       *
+         * - or start the loader task and disable GPS      *
          ***************************************************/
+        t->stage = UPD_STAGE_SAFEBOOT;
+        if (p->usbAltMode)
+        {
+            U4 payload[3];
+            memset(payload, 0, sizeof(payload));
+            payload[0] = FLASH_BASE + 12;   //base address + 12 is base address
+            payload[1] = 0x00000100;        //flags -> BIT8 = FLASH-Write
+            payload[2] = 0x00000000;        //data
+            if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_DOWNL, (CH*)payload, sizeof(payload), TRUE, POLL_TIMEOUT))
+                return updPrepareEnd(t, p, FALSE);
+            t->stage = UPD_STAGE_USB_ALT_DOWNL_REPLY;
+        }
+        break;
+
+    case UPD_STAGE_USB_ALT_DOWNL_REPLY:
+        if ((state = updReply(t, NULL)) == RCV_REQ_PENDING)
+            break;
+        if (state != RCV_REQ_REPLY)
+        {
+            // compose the payload for the new UBX-UPD-AUTHWRITE message (introduced with FW3.00)
+            // !IMPORTANT regenerate hash if any data in this message is changed!
+            const U1 hash[32] = { 0x55, 0x70, 0xC3, 0x2B, 0x19, 0xA7, 0xA5, 0xC9, 0x28, 0x3B, 0xDD, 0xE8, 0xD5, 0x89, 0xC4, 0x91, 0x8F, 0xE5, 0x32, 0x8B, 0x20, 0x24, 0x1B, 0x45, 0x54, 0xDB, 0x30, 0x0D, 0x35, 0xBB, 0xE1, 0x1E };
+            U4 payloadAuth[11];
+            memset(payloadAuth, 0, sizeof(payloadAuth));
+            memcpy(payloadAuth, hash, sizeof(hash)); // initialize hash
+            payloadAuth[8] = FLASH_BASE;        // base address of FLASH
+            payloadAuth[9] = 0x00000100;        // flags -> flashWrite
+            payloadAuth[10] = HW_IMG_MAGIC_DOM;       // UBLOX8 magic word (To prevent FS from starting in FW301)
+            if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_AUTHWRITE, (CH*)payloadAuth, sizeof(payloadAuth), TRUE, POLL_TIMEOUT))
+                return updPrepareEnd(t, p, FALSE);
+            t->stage = UPD_STAGE_USB_ALT_AUTH_REPLY;
+            break;
+        }
+        doReset(&t->rx, TRUE);
+        updSleep(t, 100); // wait until receiver is booted up (reset only)
+        t->stage = UPD_STAGE_USB_ALT_REENUM;
+        break;
+
+    case UPD_STAGE_USB_ALT_AUTH_REPLY:
+        if ((state = updReply(t, NULL)) == RCV_REQ_PENDING)
+            break;
+        if (state != RCV_REQ_REPLY)
+        {
+            MESSAGE(MSG_ERR, "Invalidating flash failed");
+            return updPrepareEnd(t, p, FALSE);
+        }
+        doReset(&t->rx, TRUE);
+        updSleep(t, 100); // wait until receiver is booted up (reset only)
+        t->stage = UPD_STAGE_USB_ALT_REENUM;
+        break;
+
+    case UPD_STAGE_USB_ALT_REENUM:
+    {
+        // Reenumerate the port, retried while it isn't back yet
+        const SER_REENUM_t reenum = updReenumerate(t);
+        if (reenum == SER_REENUM_PENDING)
+        {
+            break;
+        }
+        if (reenum != SER_REENUM_DONE)
         {
-            // autodetect the receiver port
+            MESSAGE(MSG_ERR, "Reenumerate failed");
+            return updPrepareEnd(t, p, FALSE);
+        }
+        t->DoSafeBoot = FALSE;
+        t->stage = UPD_STAGE_SAFEBOOT;
+        break;
+    }
 
-            MESSAGE(MSG_LEV1, "Getting Port connection to receiver");
-            UBX_HEAD_t *portCfgMsg = rcvPollMessage(&rx, UBX_CLASS_CFG, UBX_CFG_PORT, NULL, 0, POLL_TIMEOUT);
-            if(portCfgMsg == NULL)
+    case UPD_STAGE_SAFEBOOT:
+        if (t->DoSafeBoot)
+        {
+            //send safeboot command
+            MESSAGE(MSG_LEV1, "Commanding Safeboot");
+            if( !rcvSendMessage(&t->rx, UBX_CLASS_UPD, UBX_UPD_SAFE, NULL, 0) )
             {
-                MESSAGE(MSG_DBG, "Getting Port connection timed out");
-                break;
+                MESSAGE(MSG_ERR, "Safeboot failed.");
+                return updPrepareEnd(t, p, FALSE);
             }
-            UBX_CFG_PRT_t *prt = (UBX_CFG_PRT_t*)((U1*)portCfgMsg+UBX_HEAD_SIZE);
-            const CH* portName[6] = {"I2C", "UART1", "UART2", "USB", "SPI", "?\?\?" };
-            MESSAGE(MSG_DBG, "Connected port is: %s", portName[MIN(prt->portId,5)]);
 
-            if (prt->portId == 3)
+            // wait for the message to be transmitted and the receiver to finish
+            // re-boot (some extended POST checks are performed),
+            // checks takes more time in u-blox9
+            updSleep(t, (t->generation == 90) ? 500 + 300 : 500);
+            t->stage = UPD_STAGE_SAFEBOOT_REENUM;
+        }
+        else
+        {
+            // Start the loader task
+            MESSAGE(MSG_LEV1, "Starting LDR TSK");
+            CH pPayload[1] = { 0x01 };
+
+            // this message is assumed to be OK if ACKed or NAKed
+            if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_SAFE, pPayload, sizeof(pPayload), TRUE, POLL_TIMEOUT))
+                return updPrepareEnd(t, p, FALSE);
+            t->stage = UPD_STAGE_LDR_REPLY;
+        }
+        break;
+
+    case UPD_STAGE_SAFEBOOT_REENUM:
+    {
+        // Reenumerate the port, retried while it isn't back yet
+        const SER_REENUM_t reenum = updReenumerate(t);
+        if (reenum == SER_REENUM_PENDING)
+        {
+            break;
+        }
+        if (reenum != SER_REENUM_DONE)
+        {
+            MESSAGE(MSG_ERR, "Reenumerate failed");
+            return updPrepareEnd(t, p, FALSE);
+        }
+
+        // set the safeboot baudrate if not USB port
+        if(!t->isUsbPort)
+        {
+            if( !rcvSetBaud(&t->rx, p->BaudrateSafe) )
             {
-                isUsbPort = TRUE;
+                MESSAGE(MSG_ERR, "Safeboot Baud rate set failed.");
+                return updPrepareEnd(t, p, FALSE);
             }
-            if (prt->portId == 4)
+        }
+        // the training sequence is sent once the port settled
+        t->stage = UPD_STAGE_SAFEBOOT_TRAINING;
+        break;
+    }
+
+    case UPD_STAGE_SAFEBOOT_TRAINING:
+        // send the training sequence
+        if(p->TrainingSequence)
+        {
+            if( !rcvSendTrainingSequence(&t->rx) )
             {
-                isSpiPort = TRUE;
+                MESSAGE(MSG_ERR, "Sending training sequence failed");
+                return updPrepareEnd(t, p, FALSE);
             }
+        }
+        if (!updHelloStart(t, p))
+            return updPrepareEnd(t, p, FALSE);
+        t->stage = UPD_STAGE_SAFEBOOT_HELLO_REPLY;
+        break;
+
+    case UPD_STAGE_SAFEBOOT_HELLO_REPLY:
+        if (updHello(t, &msg))
+            break;
+        if(msg == NULL)
+        {
+            MESSAGE(MSG_ERR, "Version is null");
+            return updPrepareEnd(t, p, FALSE);
+        }
+        rcvReleaseMessage(&t->rx, msg);
+        t->stage = UPD_STAGE_FLASH;
+        break;
+
+    case UPD_STAGE_LDR_REPLY:
+        if ((state = updReply(t, NULL)) == RCV_REQ_PENDING)
+            break;
+        if (state == RCV_REQ_TIMEOUT)
+        {
+            MESSAGE(MSG_ERR, "Starting flash loader failed");
+        }
+        else
+        {
+            MESSAGE(MSG_DBG, "LDR TSK started successfully");
+        }
+
+        // Identify the flash loader
+        MESSAGE(MSG_LEV1, "Identify flash loader");
+        if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_IDEN, NULL, 0, FALSE, POLL_TIMEOUT))
+            return updPrepareEnd(t, p, FALSE);
+        t->stage = UPD_STAGE_IDEN_REPLY;
+        break;
+
+    case UPD_STAGE_IDEN_REPLY:
+    {
+        if (updReply(t, &msg) == RCV_REQ_PENDING)
+            break;
+        if( msg == NULL || msg->size != 1)
+        {
+            MESSAGE(MSG_ERR, "Identify of flash loader failed");
+            if(msg != NULL)
+                rcvReleaseMessage(&t->rx, msg);
 
-            free(portCfgMsg);
+            return updPrepareEnd(t, p, FALSE);
+        }
+        U1 majorN = (*((U1*)(msg)+UBX_HEAD_SIZE) & 0xF0) >> 4;
+        U1 minorN = (*((U1*)(msg)+UBX_HEAD_SIZE) & 0x0F);
+        MESSAGE(MSG_DBG, "Uploader version %u.%u detected", majorN, minorN);
+        rcvReleaseMessage(&t->rx, msg);
+
+        // disable GPS
+        MESSAGE(MSG_LEV1, "Stop GPS operation");
+        CH data[4] = { 0, 0, 8, 0 };
+        // don't expect ACK
+        if (!rcvSendMessage(&t->rx, UBX_CLASS_CFG, UBX_CFG_RST, data, sizeof(data)))
+        {
+            MESSAGE(MSG_ERR, "Stopping GPS failed");
+            return updPrepareEnd(t, p, FALSE);
         }
+        t->stage = UPD_STAGE_FLASH;
+        break;
+    }
 
+    case UPD_STAGE_FLASH:
         /***************************************************
-         * Prepare the receiver for firmware update        *
-         * - either send to safeboot                       *
-         * - or start the loader task and disable GPS      *
+         * Detect the flash                                *
          ***************************************************/
-        if (usbAltMode)
+        t->FlashManId = 0;
+        t->FlashDevId = 0;
+        t->stage = UPD_STAGE_FIS;
+        if (t->generation < 90 || !flashNotNeeded)
         {
-            U4 payload[3];
-            memset(payload, 0, sizeof(payload));
-            payload[0] = FLASH_BASE + 12;   //base address + 12 is base address
-            payload[1] = 0x00000100;        //flags -> BIT8 = FLASH-Write
-            payload[2] = 0x00000000;        //data
-            if ( rcvAckMessage(&rx, UBX_CLASS_UPD, UBX_UPD_DOWNL, (CH*)payload, sizeof(payload), POLL_TIMEOUT)!= 1 )
+
+            MESSAGE(MSG_LEV1, "Detecting Flash manufacturer and device IDs");
+            // detect flash version
+            if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_FLDET, (CH*)&t->FwBase, 4, FALSE, POLL_TIMEOUT))
+                return updPrepareEnd(t, p, FALSE);
+            t->stage = UPD_STAGE_FLASH_REPLY;
+        }
+        break;
+
+    case UPD_STAGE_FLASH_REPLY:
+        if (updReply(t, &msg) == RCV_REQ_PENDING)
+            break;
+        if(msg == NULL)
+        {
+            MESSAGE(MSG_ERR, "Flash Detection timed out");
+            return updPrepareEnd(t, p, FALSE);
+        }
+        else if(msg->size == 8)
+        {
+            memcpy(&t->FlashManId,(U1*)((U1*)msg+UBX_HEAD_SIZE+4),sizeof(t->FlashManId));
+            memcpy(&t->FlashDevId,(U1*)((U1*)msg+UBX_HEAD_SIZE+6),sizeof(t->FlashDevId));
+            MESSAGE(MSG_DBG, "Flash ManId: 0x%04X DevId: 0x%04X", t->FlashManId, t->FlashDevId);
+            rcvReleaseMessage(&t->rx, msg);
+        }
+        else
+        {
+            MESSAGE(MSG_ERR, "Received unexpected answer.");
+            rcvReleaseMessage(&t->rx, msg);
+            return updPrepareEnd(t, p, FALSE);
+        }
+        t->stage = UPD_STAGE_FIS;
+        break;
+
+    case UPD_STAGE_FIS:
+    {
+        const U4 jedec = ((t->FlashManId & 0xFFFF) << 16) + (t->FlashDevId & 0xFFFF);
+        if (t->idEnabled && (t->generation < 90 || !flashNotNeeded) &&
+            (!t->id.jedecValid || (t->id.jedec != jedec)))
+        {
+            // the flash detection is always done, it validates the cached FIS
+            if (t->id.jedecValid)
+            {
+                MESSAGE(MSG_WARN, "Flash differs from the identity cache, reading the FIS again");
+            }
+            t->id.jedec = jedec;
+            t->id.jedecValid = TRUE;
+            t->id.fisSize = 0;
+            t->idChanged = TRUE;
+        }
+        /***************************************************
+         * Load the FIS                                    *
+         ***************************************************/
+        t->fisRet = MERGEFIS_OK;
+        t->stage = UPD_STAGE_MERGE;
+        if ((t->generation >= 70) && (t->generation < 90 || !flashNotNeeded))
+        {
+            if (t->generation >= 90 && p->noFisMerging) // Don't try to load FIS from file
             {
-                // compose the payload for the new UBX-UPD-AUTHWRITE message (introduced with FW3.00)
-                // !IMPORTANT regenerate hash if any data in this message is changed!
-                const U1 hash[32] = { 0x55, 0x70, 0xC3, 0x2B, 0x19, 0xA7, 0xA5, 0xC9, 0x28, 0x3B, 0xDD, 0xE8, 0xD5, 0x89, 0xC4, 0x91, 0x8F, 0xE5, 0x32, 0x8B, 0x20, 0x24, 0x1B, 0x45, 0x54, 0xDB, 0x30, 0x0D, 0x35, 0xBB, 0xE1, 0x1E };
-                U4 payloadAuth[11];
-                memset(payloadAuth, 0, sizeof(payloadAuth));
-                memcpy(payloadAuth, hash, sizeof(hash)); // initialize hash
-                payloadAuth[8] = FLASH_BASE;        // base address of FLASH
-                payloadAuth[9] = 0x00000100;        // flags -> flashWrite
-                payloadAuth[10] = HW_IMG_MAGIC_DOM;       // UBLOX8 magic word (To prevent FS from starting in FW301)
-                if (rcvAckMessage(&rx, UBX_CLASS_UPD, UBX_UPD_AUTHWRITE, (CH*)payloadAuth, sizeof(payloadAuth), POLL_TIMEOUT) != 1)
+                if (!updCachedFis(t, jedec))
                 {
-                    MESSAGE(MSG_ERR, "Invalidating flash failed");
-                    break;
+                    if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_FIS, NULL, 0, FALSE, POLL_TIMEOUT))
+                        return updPrepareEnd(t, p, FALSE);
+                    t->stage = UPD_STAGE_FIS_REPLY;
                 }
             }
+            else if (!updWaitFis(t))
+            {
+                // the FIS file is still read, try again
+                t->stage = UPD_STAGE_FIS;
+            }
+            else
+            {
+                // try to load the FIS file
+                t->fisRet = updLoadFis(t, p, &t->host.fisDb, jedec, &t->fis, &t->fisSize);
+            }
+        }
+        break;
+    }
+
+    case UPD_STAGE_FIS_REPLY:
+        if (updReply(t, &msg) == RCV_REQ_PENDING)
+            break;
+        updReadFis(t, msg);
+        rcvReleaseMessage(&t->rx, msg);
+        t->stage = UPD_STAGE_MERGE;
+        break;
+
+    case UPD_STAGE_MERGE:
+        /***************************************************
+         * Do the FIS merging                              *
+         ***************************************************/
+        if (!updMergeFis(t, p))
+        {
+            return updPrepareEnd(t, p, FALSE);
+        }
+
+        /***************************************************
+         * Switch to the update baudrate                   *
+         ***************************************************/
+        if (t->rcvPortId == UBX_CFG_PRT_PORT_UART1 ||
+            t->rcvPortId == UBX_CFG_PRT_PORT_UART2)
+        {
+            // only a UART has a baudrate on the receiver side. the mode field of
+            // the other ports has a different meaning, so leave them untouched
+            UBX_CFG_PRT_t prtcfg;
+            memset(&prtcfg, 0, sizeof(prtcfg));
+            prtcfg.portId       = t->rcvPortId; //the UART we are connected to
+            prtcfg.mode         = (1<<7) |
+                                  (1<<6) |
+                                  (1<<11);      //8N1
+            prtcfg.baudrate     = p->BaudrateUpd;
+            prtcfg.inProtoMask  = 0x1;          //UBX only
+            prtcfg.outProtoMask = 0x1;          //UBX only
+            MESSAGE(MSG_DBG, "Switching UART%u to %u baud", t->rcvPortId, p->BaudrateUpd);
+            rcvSendMessage(&t->rx, UBX_CLASS_CFG, UBX_CFG_PORT, (CH*)&prtcfg, sizeof(prtcfg));
+
+            // the receiver switches once the message is transmitted
+            updSleep(t, 200);
+        }
+        t->stage = UPD_STAGE_BAUD_SWITCH;
+        break;
+
+    case UPD_STAGE_BAUD_SWITCH:
+        rcvSetBaud(&t->rx, p->BaudrateUpd);
+        // flushed once the baudrate settled
+        t->stage = UPD_STAGE_BAUD_CHECK;
+        break;
+
+    case UPD_STAGE_BAUD_CHECK:
+        rcvFlushBuffer(&t->rx);
+        if (!updRequest(t, UBX_CLASS_MON, UBX_MON_VER, NULL, 0, FALSE, POLL_TIMEOUT))
+            return updPrepareEnd(t, p, FALSE);
+        t->stage = UPD_STAGE_BAUD_REPLY;
+        break;
+
+    case UPD_STAGE_BAUD_REPLY:
+        if (updReply(t, &msg) == RCV_REQ_PENDING)
+            break;
+        if(msg == NULL)
+        {
+            MESSAGE(MSG_ERR, "Failed polling MON-VER\n");
+            return updPrepareEnd(t, p, FALSE);
+        }
+        rcvReleaseMessage(&t->rx, msg);
+
+        /***************************************************
+         * Send patch for u-blox 7                         *
+         ***************************************************/
+        t->stage = UPD_STAGE_FIS_SEND;
+        if(t->generation == 70 && t->hwRomVer == 100)
+        {
+            MESSAGE(MSG_DBG, "Sending patch to fix too small erase timeout");
+            U1 ram[] = { 0x98, 0x01, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x38, 0x9c, 0x1c };
+            if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_DOWNL, (CH*)ram, sizeof(ram), TRUE, POLL_TIMEOUT))
+                return updPrepareEnd(t, p, FALSE);
+            t->stage = UPD_STAGE_PATCH_RAM_REPLY;
+        }
+        break;
 
-            doReset(&rx, TRUE);
+    case UPD_STAGE_PATCH_RAM_REPLY:
+    {
+        if ((state = updReply(t, NULL)) == RCV_REQ_PENDING)
+            break;
+        U1 fpb[] = { 0x20, 0x20, 0x00, 0xE0, 0x00, 0x00, 0x00, 0x00, 0xed, 0x78, 0x04, 0x00 };
+        if ((state != RCV_REQ_REPLY) ||
+            !updRequest(t, UBX_CLASS_UPD, UBX_UPD_DOWNL, (CH*)fpb, sizeof(fpb), TRUE, POLL_TIMEOUT))
+        {
+            MESSAGE(MSG_ERR, "Failed to send patch");
+            return updPrepareEnd(t, p, FALSE);
+        }
+        t->stage = UPD_STAGE_PATCH_FPB_REPLY;
+        break;
+    }
 
-            TIME_SLEEP(100); // wait until receiver is booted up (reset only)
-            // Reenumerate the port
-            if (!rcvReenumerate(&rx, isUsbPort))
-            {
-                MESSAGE(MSG_ERR, "Reenumerate failed");
-                break;
-            }
-            DoSafeBoot = FALSE;
+    case UPD_STAGE_PATCH_FPB_REPLY:
+        if ((state = updReply(t, NULL)) == RCV_REQ_PENDING)
+            break;
+        if (state != RCV_REQ_REPLY)
+        {
+            MESSAGE(MSG_ERR, "Failed to send patch");
+            return updPrepareEnd(t, p, FALSE);
         }
-        if (DoSafeBoot)
+        t->stage = UPD_STAGE_FIS_SEND;
+        break;
+
+    case UPD_STAGE_FIS_SEND:
+        /***************************************************
+         * Update FIS for U-blox 9                         *
+         ***************************************************/
+        t->stage = UPD_STAGE_SETUP;
+        if(!(p->updateRam != 0) && t->generation >= 90 && !p->noFisMerging)
         {
-            //send safeboot command
-            MESSAGE(MSG_LEV1, "Commanding Safeboot");
-            if( !rcvSendMessage(&rx, UBX_CLASS_UPD, UBX_UPD_SAFE, NULL, 0) )
+            if (!t->fis)
             {
-                MESSAGE(MSG_ERR, "Safeboot failed.");
-                break;
+                MESSAGE(MSG_ERR, "FIS erroneously empty");
+                return updPrepareEnd(t, p, FALSE);
             }
+            if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_FIS, t->fis, sizeof(DRV_SPI_MEM_FIS_t), TRUE, POLL_TIMEOUT))
+                return updPrepareEnd(t, p, FALSE);
+            t->stage = UPD_STAGE_FIS_SEND_REPLY;
+        }
+        break;
 
-            // wait for the message to be transmitted and the receiver to finish
-            // re-boot (some extended POST checks are performed)
-            TIME_SLEEP(500);
+    case UPD_STAGE_FIS_SEND_REPLY:
+        if ((state = updReply(t, NULL)) == RCV_REQ_PENDING)
+            break;
+        if (state == RCV_REQ_TIMEOUT)
+        {
+            MESSAGE(MSG_WARN, "FIS message timed out");
+        }
+        else if (state == RCV_REQ_NAK)
+        {
+            MESSAGE(MSG_WARN, "FIS not accepted by receiver");
+        }
+        else
+        {
+            MESSAGE(MSG_DBG, "FIS sent to the receiver");
+        }
+        t->stage = UPD_STAGE_SETUP;
+        break;
 
-            // checks takes more time in u-blox9
-            if (generation == 90)
+    case UPD_STAGE_SETUP:
+        free(t->fis); // free the memory
+        t->fis = NULL;
+        if(t->generation >= 90 && p->updateRam != 0)
+        {
+            if(!t->pData)
+                return updPrepareEnd(t, p, FALSE);
+            /***************************************************
+             * Do the RAM update                               *
+             ***************************************************/
+            MESSAGE(MSG_LEV1, "Receiver info collected, downloading to RAM...");
+            if (t->isSpiPort)
             {
-                TIME_SLEEP(300);
-            }
+                CH spiCfgPayload[] = { 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 }; // UBX only, FF sup disabled, CPOL=CPHA=0, Tx ready disabled
 
-            // Reenumerate the port
-            if(!rcvReenumerate(&rx, isUsbPort))
-            {
-                MESSAGE(MSG_ERR, "Reenumerate failed");
-                break;
+                if (!updRequest(t, UBX_CLASS_CFG, UBX_CFG_PORT, spiCfgPayload, sizeof(spiCfgPayload), TRUE, POLL_TIMEOUT))
+                    return updPrepareEnd(t, p, FALSE);
+                t->stage = UPD_STAGE_SPI_CFG_REPLY;
             }
-
-            // set the safeboot baudrate if not USB port
-            if(!isUsbPort)
+            else
             {
-                if( !rcvSetBaud(&rx, BaudrateSafe) )
-                {
-                    MESSAGE(MSG_ERR, "Safeboot Baud rate set failed.");
-                    break;
-                }
+                updRamStart(t);
             }
-
-            // send the training sequence
-            if(TrainingSequence)
+        }
+        else if(p->doChipErase)
+        {
+            /***************************************************
+             * Do the flash update                             *
+             ***************************************************/
+            if(t->generation > 70)
             {
-                if( !rcvSendTrainingSequence(&rx) )
-                {
-                    MESSAGE(MSG_ERR, "Sending training sequence failed");
-                    break;
-                }
+                if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_CERASE, NULL, 0, TRUE, POLL_TIMEOUT))
+                    return updPrepareEnd(t, p, FALSE);
+                t->stage = UPD_STAGE_CERASE_REPLY;
             }
-
-
-            monVer = DoAutobaud ?
-                     rcvDoAutobaud(&rx, TrainingSequence) :
-                     rcvPollMessage(&rx, UBX_CLASS_MON, UBX_MON_VER, NULL, 0, POLL_TIMEOUT);
-
-            if(monVer == NULL)
+            else
             {
-                MESSAGE(MSG_ERR, "Version is null");
-                break;
+                MESSAGE(MSG_ERR, "Chip erase no supported on this platform");
+                return updPrepareEnd(t, p, FALSE);
             }
-            free(monVer);
         }
         else
         {
-            // Start the loader task
-            MESSAGE(MSG_LEV1, "Starting LDR TSK");
-            CH pPayload[1] = { 0x01 };
+            return updSetupDownload(t, p, FALSE);
+        }
+        break;
 
-            // this message is assumed to be OK if ACKed or NAKed
-            if( rcvAckMessage(&rx, UBX_CLASS_UPD, UBX_UPD_SAFE, pPayload, sizeof(pPayload), POLL_TIMEOUT) == -1 )
-            {
-                MESSAGE(MSG_ERR, "Starting flash loader failed");
-            }
-            else
+    case UPD_STAGE_SPI_CFG_REPLY:
+        if ((state = updReply(t, NULL)) == RCV_REQ_PENDING)
+            break;
+        if (state != RCV_REQ_REPLY)
+        {
+            MESSAGE(MSG_ERR, "SPI configuration not accepted");
+            if (t->imageGeneration == 90)
             {
-                MESSAGE(MSG_DBG, "LDR TSK started successfully");
+                MESSAGE(MSG_ERR, "MPW chip needs to be fused with patch 2 (spiCfg)");
             }
+            return updPrepareEnd(t, p, FALSE);
+        }
+        updRamStart(t);
+        break;
 
+    case UPD_STAGE_CERASE_REPLY:
+        if ((state = updReply(t, NULL)) == RCV_REQ_PENDING)
+            break;
+        if (state != RCV_REQ_REPLY)
+        {
+            MESSAGE(MSG_ERR, "Could not send chip erase command. Does the ROM support it?");
+            return updPrepareEnd(t, p, FALSE);
+        }
+        MESSAGE(MSG_LEV2, "Chip erase started");
+        return updSetupDownload(t, p, TRUE);
 
-            // Identify the flash loader
-            MESSAGE(MSG_LEV1, "Identify flash loader");
-            UBX_HEAD_t *msg = rcvPollMessage(&rx, UBX_CLASS_UPD, UBX_UPD_IDEN, NULL, 0, POLL_TIMEOUT);
-            if( msg == NULL || msg->size != 1)
-            {
-                MESSAGE(MSG_ERR, "Identify of flash loader failed");
-                if(msg != NULL)
-                    free(msg);
+    case UPD_STAGE_RAM:
+    {
+        const UPD_STEP_t step = updRamStep(t);
+        if (step == UPD_STEP_FAILED)
+        {
+            MESSAGE(MSG_ERR, "RAM image update failed");
+            return updPrepareEnd(t, p, FALSE);
+        }
+        if (step == UPD_STEP_DONE)
+        {
+            return updPrepareEnd(t, p, TRUE);
+        }
+        break;
+    }
 
-                break;
-            }
-            U1 majorN = (*((U1*)(msg)+UBX_HEAD_SIZE) & 0xF0) >> 4;
-            U1 minorN = (*((U1*)(msg)+UBX_HEAD_SIZE) & 0x0F);
-            MESSAGE(MSG_DBG, "Uploader version %u.%u detected", majorN, minorN);
-            free(msg);
+    default:
+        return UPD_STEP_FAILED;
+    }
+    return UPD_STEP_BUSY;
+}
 
-            // disable GPS
-            MESSAGE(MSG_LEV1, "Stop GPS operation");
-            CH data[4] = { 0, 0, 8, 0 };
-            // don't expect ACK
-            if (!rcvSendMessage(&rx, UBX_CLASS_CFG, UBX_CFG_RST, data, sizeof(data)))
-            {
-                MESSAGE(MSG_ERR, "Stopping GPS failed");
-                break;
-            }
-        }
+//! connect to the receiver and prepare it for the download
+/*!
+    Blocks until updPrepareStep() is done.
+
+    \param t       update target
+    \param p       update options
+    \return #TRUE on success, the download is to be done if t->upd is set
+*/
+static BOOL updPrepare(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    UPD_STEP_t step;
+    while ((step = updPrepareStep(t, p)) == UPD_STEP_BUSY)
+    {
+        updWait(t, updDue(t));
+    }
+    return (step == UPD_STEP_DONE);
+}
 
+//! end the completion of the update
+/*!
+    \param t       update target
+    \param p       update options
+    \param success update successful
+    \return #UPD_STEP_DONE or #UPD_STEP_FAILED
+*/
+static UPD_STEP_t updFinishEnd(UPD_TARGET_t *t, const UPD_PARAMS_t *p, BOOL success)
+{
+    if (success)
+    {
+        updStoreLink(t, p);
+    }
+    else
+    {
+        updDropLink(t, p);
+    }
+    rcvRequestRelease(&t->req);
+    rcvRequestRelease(&t->autobaud.req);
+    t->stage = UPD_STAGE_DONE;
+    return success ? UPD_STEP_DONE : UPD_STEP_FAILED;
+}
 
+//! complete the update after the download, one step at a time
+/*!
+    \param t       update target
+    \param p       update options
+    \return #UPD_STEP_BUSY until done, see updDue()
+*/
+static UPD_STEP_t updFinishStep(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    UBX_HEAD_t *msg = NULL;
+    RCV_REQ_STATE_t state;
+    if (updSleeping(t))
+    {
+        return UPD_STEP_BUSY;
+    }
 
+    switch (t->stage)
+    {
+    case UPD_STAGE_FINISH:
         /***************************************************
-         * Detect the flash                                *
+         * Invalidate patch for u-blox 7                   *
          ***************************************************/
-
-        U2 FlashManId = 0;
-        U2 FlashDevId = 0;
-        if (generation < 90 || !flashNotNeeded)
+        t->stage = UPD_STAGE_MARKER;
+        if(t->generation == 70 && t->hwRomVer == 100)
         {
+            MESSAGE(MSG_DBG, "Invalidating timeout patch");
+            U1 payloadInvPatch[] = { 0x20, 0x20, 0x00, 0xE0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+            if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_DOWNL, (CH*)payloadInvPatch, sizeof(payloadInvPatch), TRUE, POLL_TIMEOUT))
+                return updFinishEnd(t, p, FALSE);
+            t->stage = UPD_STAGE_INV_PATCH_REPLY;
+        }
+        break;
 
-            MESSAGE(MSG_LEV1, "Detecting Flash manufacturer and device IDs");
-            // detect flash version
-            UBX_HEAD_t *flashMsg = rcvPollMessage(&rx, UBX_CLASS_UPD, UBX_UPD_FLDET, (CH*)&FwBase, 4, POLL_TIMEOUT);
-            if(flashMsg == NULL)
-            {
-                MESSAGE(MSG_ERR, "Flash Detection timed out");
-                break;
-            }
-            else if(flashMsg->size == 8)
-            {
-                memcpy(&FlashManId,(U1*)((U1*)flashMsg+UBX_HEAD_SIZE+4),sizeof(FlashManId));
-                memcpy(&FlashDevId,(U1*)((U1*)flashMsg+UBX_HEAD_SIZE+6),sizeof(FlashDevId));
-                MESSAGE(MSG_DBG, "Flash ManId: 0x%04X DevId: 0x%04X", FlashManId, FlashDevId);
-                free(flashMsg);
-            }
-            else
-            {
-                MESSAGE(MSG_ERR, "Received unexpected answer.");
-                free(flashMsg);
-                break;
-            }
+    case UPD_STAGE_INV_PATCH_REPLY:
+        if ((state = updReply(t, NULL)) == RCV_REQ_PENDING)
+            break;
+        if (state != RCV_REQ_REPLY)
+        {
+            MESSAGE(MSG_ERR, "Failed to invalidate patch");
+            return updFinishEnd(t, p, FALSE);
         }
-        const U4 jedec = ((FlashManId & 0xFFFF) << 16) + (FlashDevId & 0xFFFF);
+        t->stage = UPD_STAGE_MARKER;
+        break;
+
+    case UPD_STAGE_MARKER:
         /***************************************************
-         * Do the FIS merging                              *
+         * Write the marker to the flash to indicate       *
+         * the FS that the flash was completely erased     *
+         * Only u-blox8 supports this feature              *
+         * later platforms address this issue differently  *
+         * without the need for FW update tool support     *
          ***************************************************/
-        U4 FlashSize = 0;
-        CH *fis = NULL;
-        size_t fisSize=0;
-        MERGEFIS_RETVAL_t ret = MERGEFIS_OK;
-
-        if(generation >= 70)
+        t->stage = UPD_STAGE_RESTART;
+        if (p->EraseWholeFlash && t->generation == 80)
         {
-            BLOCK_DEF_t flashDef;
-
-            if (generation < 90 || !flashNotNeeded)
+            // check if the marker has to be written
+            U4 address = 0;
+            U4 marker = 0xffffffff;
+            BOOL imageSupportsFeature = FALSE;
+            if (p->fisOnly)
             {
-                if (generation >= 90 && noFisMerging) // Don't try to load FIS from file
-                {
-                    ret = getNoFisMergingData(&fis, &fisSize, &rx);
-                }
-                else
-                {
-                    // try to load the FIS file
-                    ret = mergefis_load(&fis, &fisSize, FisFileName, jedec);
-                }
-                if (ret == MERGEFIS_OK)
-                {
-                    flashDef.Count = mergefis_get_sector_count(fis);
-                    flashDef.Size = mergefis_get_sector_size(fis);
-                    addBlock(&FlashOrg, &flashDef);
-                    FlashSize = flashDef.Count * flashDef.Size;
-                    if (fisOnly)
-                    {
-                        // we don't have to merge but just send the FIS
-                        fileSize = 0x1000;
-
-                        // Is FIS size to big?
-                        if (fisSize > (fileSize - 0x40) || !fisSize || !fis)
-                        {
-                            if (fis)
-                                free(fis);
-                            fis = NULL;
-                            fisSize = 0;
-                            break;
-                        }
-                        if (pData != NULL)
-                        {
-                            free(pData);
-                            pData = NULL;
-                        }
-
-                        CH *pFis = malloc(fileSize);
-                        if (!pFis)
-                        {
-                            free(fis);
-                            fis = NULL;
-                            fisSize = 0;
-                            break;
-                        }
-                        if (generation >= 90)
-                        {
-                            fisSize = sizeof(DRV_SPI_MEM_FIS_t);
-                            pData = (FWHEADER_t*)pFis;
-                            // just copy the fis into the image at the start
-                            memcpy(pData, fis, sizeof(DRV_SPI_MEM_FIS_t));
-                            fileSize = sizeof(DRV_SPI_MEM_FIS_t);
-                        }
-                        else
-                        {
-                            // Set header part to 0, the rest will be overwritten
-                            memset(pFis, 0x0, 0x40);
-                            // Set the rest of pFis to 0xff
-                            memset(&pFis[0x40], 0xff, fileSize - 0x40);
-                            // Copy the actual data after the header
-                            memcpy(&pFis[0x40], fis, fisSize);
-                            pData = (FWHEADER_t*)pFis;
-                        }
-                    }
-                    else if (pData != NULL && noFisMerging)
-                    {
-                        MESSAGE(MSG_DBG, "Not merging anything");
-                    }
-                    else if (pData != NULL)
-                    {
-                        if (generation >= 90)
-                        {
-                            U4 newSize = fileSize + sizeof(DRV_SPI_MEM_FIS_t);
-                            CH* pData2 = malloc(newSize);
-                            if (pData2 == NULL)
-                            {
-                                MESSAGE(MSG_ERR, "malloc failed");
-                                break;
-                            }
-                            // just copy the fis into the image at the start
-                            memcpy(pData2, fis, sizeof(DRV_SPI_MEM_FIS_t));
-                            memcpy(pData2 + sizeof(DRV_SPI_MEM_FIS_t), pData, fileSize);
-                            free(pData);
-
-                            pData = (FWHEADER_t*)pData2;
-                            fileSize = newSize;
-                            FwBase = 0;
-                        }
-                        else
-                        {
-                            // merge the FIS information into the firmware
-                            U4 imageSize = (pData->v1.pEnd & ~0x1) - pData->v1.pBase + sizeof(U8);
-                            ret = mergefis_merge((CH*)pData, imageSize, fis);
-                        }
-                    }
-
-
-                    // check for failure
-                    if (ret != MERGEFIS_OK && !noFisMerging)
-                    {
-                        MESSAGE(MSG_LEV1, "The merging failed");
-                        break;
-                    }
-                    else if (!noFisMerging)
-                    {
-                        // success
-                        MESSAGE(MSG_DBG, "FIS information merged");
-                    }
+                // we are going to run from ROM -> write the marker to the second sector
+                address = 0x1000;
 
-                }
-                else
+                // u-blox8 ROM 3.01 supports this feature
+                if ( t->hwRomVer == 301 )
                 {
-                    // something went wrong when loading the FIS file
-                    // check the reason
-                    switch (ret)
-                    {
-                    case MERGEFIS_FILE_NOT_FOUND:
-                        MESSAGE(MSG_ERR, "Could not open the FIS file %s", FisFileName);
-                        break;
-                    case MERGEFIS_VERSION_ERROR:
-                        MESSAGE(MSG_ERR, "FIS version not matching\n");
-                        break;
-                    case MERGEFIS_INCORRECT_XML:
-                        MESSAGE(MSG_ERR, "There is an error in the XML file\n");
-                        break;
-                    case MERGEFIS_JEDEC_NOT_SUPPORTED:
-                        MESSAGE(MSG_ERR, "Flash (ManId: 0x%04X DevId: 0x%04X) not supported\n", FlashManId, FlashDevId);
-                        break;
-                    case MERGEFIS_CODE_CORRUPTED:
-                        MESSAGE(MSG_ERR, "Code in XML file is corrupted\n");
-                        break;
-                    case MERGEFIS_CRC_FAILURE:
-                        MESSAGE(MSG_ERR, "CRC failure\n");
-                        break;
-                    default:
-                        MESSAGE(MSG_ERR, "An unknown error occurred\n");
-                        break;
-                    }
-                    break;
+                    imageSupportsFeature = TRUE;
+                    marker = 0xee7b8f34;
                 }
             }
-        }
-        else
-        {
-            // search for flash info in provided flash definition file
-            if(!GetFlashOrganisation(FlashManId, FlashDevId,
-                &FlashOrg, &FlashSize, FlashDefFileName))
+            else if (!p->EraseOnly)
+            {
+                if(!t->pData)
+                    return updFinishEnd(t, p, FALSE);
+                // we are going to run from flash -> write the marker to the first sector following the image
+                address = (((t->FwBase + t->fileSize) / 0x1000) + 1) * 0x1000;
+                if( t->pData->v1.fsErasedMarker != 0xFFFFFFFF )
+                {
+                    imageSupportsFeature = TRUE;
+                    marker = t->pData->v1.fsErasedMarker;
+                }
+            }
+
+            if( imageSupportsFeature )
             {
-                MESSAGE(MSG_ERR, "Could not open file '%s'", FlashDefFileName);
-                MESSAGE(MSG_ERR, "No flash organization information available for ManID 0x%04X, DevID 0x%04X", FlashManId, FlashDevId);
-                break;
+                if(!t->pData)
+                    return updFinishEnd(t, p, FALSE);
+                MESSAGE(MSG_LEV1, "Writing marker for the file system to speed up first initialization");
+
+                const U4 writeSize = sizeof(t->pData->v1.fsErasedMarker);
+                const U4 length = writeSize + 8;
+                CH data[sizeof(t->pData->v1.fsErasedMarker) + 8];
+
+                //copy data to the send buffer
+                memcpy(data + 0, &address,   4);                // Address
+                memcpy(data + 4, &writeSize, 4);                // Data size
+                memcpy(data + 8, &marker,    sizeof(marker));   // Marker
+                if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_FLWRI, data, length, FALSE, WRITE_TIMEOUT))
+                    return updFinishEnd(t, p, FALSE);
+                t->stage = UPD_STAGE_MARKER_REPLY;
             }
         }
+        break;
 
-        DumpFlashInfo(&FlashOrg, FlashSize);
-        // check if flash size is at least as big as firmware to load
-        if (generation < 90 || !(updateRam != 0))
+    case UPD_STAGE_MARKER_REPLY:
+        if (updReply(t, &msg) == RCV_REQ_PENDING)
+            break;
+        if( msg == NULL )
         {
-            if (FlashSize < fileSize)
-            {
-                MESSAGE(MSG_ERR, "Flash too small for image.");
-                break;
-            }
+            MESSAGE(MSG_ERR, "Failed to write the marker");
+            return updFinishEnd(t, p, FALSE);
         }
+        rcvReleaseMessage(&t->rx, msg);
+        t->stage = UPD_STAGE_RESTART;
+        break;
 
+    case UPD_STAGE_RESTART:
+    {
         /***************************************************
-         * Switch to the update baudrate                   *
+         * Restart receiver if image is too large          *
+         * (Workaround for ROM bug)                        *
          ***************************************************/
-        UBX_CFG_PRT_t prtcfg;
-        memset(&prtcfg, 0, sizeof(prtcfg));
-        prtcfg.portId       = 1;            //LEA-5 has only USART1 for serial comm
-        prtcfg.mode         = (1<<7) |
-                              (1<<6) |
-                              (1<<11);      //8N1
-        prtcfg.baudrate     = BaudrateUpd;
-        prtcfg.inProtoMask  = 0x1;          //UBX only
-        prtcfg.outProtoMask = 0x1;          //UBX only
-        rcvSendMessage(&rx, UBX_CLASS_CFG, UBX_CFG_PORT, (CH*)&prtcfg, sizeof(prtcfg));
+        BOOL isGen70Rom100 = (t->generation == 70 && t->hwRomVer == 100);
+        BOOL isGen80Rom22Or201 = (t->generation == 80 && (t->hwRomVer == 22 || t->hwRomVer == 201));
+        t->stage = UPD_STAGE_VERIFY;
+        if( (t->fileSize > 128 * 4096) && (isGen70Rom100 || isGen80Rom22Or201))
+        {
+            //send safeboot command
+            if (!t->isUsbPort)
+            {
+                MESSAGE(MSG_LEV1, "Commanding Safeboot");
+                if (!rcvSendMessage(&t->rx, UBX_CLASS_UPD, UBX_UPD_SAFE, NULL, 0))
+                {
+                    MESSAGE(MSG_ERR, "Safeboot failed.");
+                    return updFinishEnd(t, p, FALSE);
+                }
+                updSleep(t, 500); // wait until receiver is booted up
+            }
+            else
+            {
+                doReset(&t->rx, TRUE);
+                updSleep(t, 100); // wait until receiver is booted up
+            }
+            t->stage = UPD_STAGE_RESTART_REENUM;
+        }
+        break;
+    }
 
-        TIME_SLEEP(200);
+    case UPD_STAGE_RESTART_REENUM:
+    {
+        // Reenumerate the port, retried while it isn't back yet
+        const SER_REENUM_t reenum = updReenumerate(t);
+        if (reenum == SER_REENUM_PENDING)
+        {
+            break;
+        }
+        if (reenum != SER_REENUM_DONE)
+        {
+            MESSAGE(MSG_ERR, "Reenumerate failed");
+            return updFinishEnd(t, p, FALSE);
+        }
 
-        rcvSetBaud(&rx, BaudrateUpd);
-        rcvFlushBuffer(&rx);
+        // set the safeboot baudrate if not USB port
+        if (!t->isUsbPort)
+        {
+            if (!rcvSetBaud(&t->rx, p->BaudrateSafe))
+            {
+                MESSAGE(MSG_ERR, "Safeboot Baud rate set failed.");
+                return updFinishEnd(t, p, FALSE);
+            }
+        }
+        // the training sequence is sent once the port settled
+        t->stage = UPD_STAGE_RESTART_LOADER;
+        break;
+    }
 
-        monVer = rcvPollMessage(&rx, UBX_CLASS_MON, UBX_MON_VER, NULL, 0, POLL_TIMEOUT);
-        if(monVer == NULL)
+    case UPD_STAGE_RESTART_LOADER:
+        if (!t->isUsbPort)
         {
-            MESSAGE(MSG_ERR, "Failed polling MON-VER\n");
-            break;
+            // send the training sequence
+            if (p->TrainingSequence)
+            {
+                if (!rcvSendTrainingSequence(&t->rx))
+                {
+                    MESSAGE(MSG_ERR, "Sending training sequence failed");
+                    return updFinishEnd(t, p, FALSE);
+                }
+            }
+            if (!updHelloStart(t, p))
+                return updFinishEnd(t, p, FALSE);
+            t->stage = UPD_STAGE_RESTART_HELLO_REPLY;
         }
         else
         {
-            free(monVer);
+            // disable GPS
+            MESSAGE(MSG_LEV1, "Stop GPS operation");
+            CH data[4] = { 0, 0, 8, 0 };
+            // don't expect ACK
+            if (!rcvSendMessage(&t->rx, UBX_CLASS_CFG, UBX_CFG_RST, data, sizeof(data)))
+            {
+                MESSAGE(MSG_ERR, "Stopping GPS failed");
+                return updFinishEnd(t, p, FALSE);
+            }
+            // Start the loader task
+            MESSAGE(MSG_LEV1, "Starting LDR TSK");
+            CH pPayload[1] = { 0x01 };
+            // this message is assumed to be OK if ACKed or NAKed
+            if (!updRequest(t, UBX_CLASS_UPD, UBX_UPD_SAFE, pPayload, sizeof(pPayload), TRUE, POLL_TIMEOUT))
+                return updFinishEnd(t, p, FALSE);
+            t->stage = UPD_STAGE_RESTART_LDR_REPLY;
         }
+        break;
 
+    case UPD_STAGE_RESTART_LDR_REPLY:
+        if ((state = updReply(t, NULL)) == RCV_REQ_PENDING)
+            break;
+        if (state == RCV_REQ_TIMEOUT)
+        {
+            MESSAGE(MSG_ERR, "Starting flash loader failed");
+        }
+        else
+        {
+            MESSAGE(MSG_DBG, "LDR TSK started successfully");
+        }
+        if (!updHelloStart(t, p))
+            return updFinishEnd(t, p, FALSE);
+        t->stage = UPD_STAGE_RESTART_HELLO_REPLY;
+        break;
 
+    case UPD_STAGE_RESTART_HELLO_REPLY:
+        if (updHello(t, &msg))
+            break;
+        if (msg == NULL)
+        {
+            MESSAGE(MSG_ERR, "Version is null");
+            return updFinishEnd(t, p, FALSE);
+        }
+        rcvReleaseMessage(&t->rx, msg);
+        t->stage = UPD_STAGE_VERIFY;
+        break;
 
-
+    case UPD_STAGE_VERIFY:
         /***************************************************
-         * Send patch for u-blox 7                         *
+         * Verify that the image was written correctly     *
          ***************************************************/
-        if(generation == 70 && hwRomVer == 100)
+        t->stage = UPD_STAGE_RESET;
+        if (!p->fisOnly && !p->EraseOnly)
         {
-            MESSAGE(MSG_DBG, "Sending patch to fix too small erase timeout");
-            U1 ram[] = { 0x98, 0x01, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x38, 0x9c, 0x1c };
-            U1 fpb[] = { 0x20, 0x20, 0x00, 0xE0, 0x00, 0x00, 0x00, 0x00, 0xed, 0x78, 0x04, 0x00 };
-            if( (rcvAckMessage(&rx, UBX_CLASS_UPD, UBX_UPD_DOWNL, (CH*)ram, sizeof(ram), POLL_TIMEOUT) != 1) ||
-                (rcvAckMessage(&rx, UBX_CLASS_UPD, UBX_UPD_DOWNL, (CH*)fpb, sizeof(fpb), POLL_TIMEOUT) != 1) )
+            MESSAGE(MSG_LEV1, "Verifying Image on hardware");
+            if (!imageCrcRequest(&t->req, &t->image, t->FwBase, (p->updateRam != 0), (t->generation >= 90) ? 2 : 1))
             {
-                MESSAGE(MSG_ERR, "Failed to send patch");
-                break;
+                MESSAGE(MSG_ERR, "Verify failed");
+                return updFinishEnd(t, p, FALSE);
             }
+            t->stage = UPD_STAGE_VERIFY_REPLY;
+        }
+        break;
+
+    case UPD_STAGE_VERIFY_REPLY:
+    {
+        if (updReply(t, &msg) == RCV_REQ_PENDING)
+            break;
+        if (msg == NULL)
+        {
+            MESSAGE(MSG_ERR, "Polling verify message failed");
+        }
+        const BOOL verifySuccess = msg ? imageCrcReply(msg) : FALSE;
+        rcvReleaseMessage(&t->rx, msg);
+        if (!verifySuccess)
+        {
+            MESSAGE(MSG_LEV1,"CRC check ERROR");
+            MESSAGE(MSG_ERR, "Verify failed");
+            return updFinishEnd(t, p, FALSE);
         }
+        MESSAGE(MSG_LEV1, "CRC check SUCCESS");
+        t->stage = UPD_STAGE_RESET;
+        break;
+    }
+
+    case UPD_STAGE_RESET:
         /***************************************************
-         * Update FIS for U-blox 9                         *
+         * Reset the receiver                              *
          ***************************************************/
-        if(!(updateRam != 0) && generation >= 90 && !noFisMerging)
+        if (p->DoReset && p->updateRam != 0)
         {
-            if (!fis)
             {
-                MESSAGE(MSG_ERR, "FIS erroneously empty");
-                break;
+                // we cannot use UPD-RBOOT in this case
+                // -> use CFG-RST instead
+                CH data[4] = { -1, -1, 1, 0 };
+                rcvSendMessage(&t->rx, UBX_CLASS_CFG, UBX_CFG_RST, data, sizeof(data));
             }
+        }
+        else
+        {
+            doReset(&t->rx, p->DoReset);
+        }
+        // Everything is fine
+        return updFinishEnd(t, p, TRUE);
 
-            int state = rcvAckMessage(&rx, UBX_CLASS_UPD, UBX_UPD_FIS, fis, sizeof(DRV_SPI_MEM_FIS_t), POLL_TIMEOUT);
+    default:
+        return UPD_STEP_FAILED;
+    }
+    return UPD_STEP_BUSY;
+}
 
-            if (state == -1)
-            {
-                MESSAGE(MSG_WARN, "FIS message timed out");
-            }
-            else if (state == 0)
-            {
-                MESSAGE(MSG_WARN, "FIS not accepted by receiver");
-            }
-            else
-            {
-                MESSAGE(MSG_DBG, "FIS sent to the receiver");
-            }
-        }
-        free(fis); // free the memory
+//! complete the update after the download
+/*!
+    Blocks until updFinishStep() is done.
+
+    \param t       update target
+    \param p       update options
+    \return #TRUE on success
+*/
+static BOOL updFinish(UPD_TARGET_t *t, const UPD_PARAMS_t *p)
+{
+    UPD_STEP_t step;
+    while ((step = updFinishStep(t, p)) == UPD_STEP_BUSY)
+    {
+        updWait(t, updDue(t));
+    }
+    return (step == UPD_STEP_DONE);
+}
 
+//! release the connection and the memory of a target
+/*!
+    \param t       update target
+*/
+static void updRelease(UPD_TARGET_t *t)
+{
+    // the preparation may have been aborted, its workers are waited for
+    updStopHost(&t->host);
+    free(t->fis);
+    t->fis = NULL;
+    rcvRequestRelease(&t->req);
+    rcvRequestRelease(&t->autobaud.req);
 
+    // Clean up receiver interface if required
+    if( t->rcvConnected )
+        rcvDisconnect(&t->rx);
 
+    //clean up and exit
+    if (t->pData && t->ownData)
+    {
+        free(t->pData);
+    }
+    free(t->pPrefix);
+    UnmapImageFile(&t->file);
 
+    // Free update core structure
+    if(t->upd)
+        updDeinit(t->upd);
 
+    clearBlocks(&t->FlashOrg);
+}
 
+//! update the receivers on one port
+/*!
+    \param ComPort     port name given by the user, may list several I2C addresses
+    \param p           update options
+    \param pShared     data shared with the other ports of a fleet update, NULL if none
+    \return #TRUE if all receivers were updated successfully
+*/
+static BOOL updRun(const char* ComPort, const UPD_PARAMS_t *p, UPD_SHARED_t *pShared)
+{
+    const U4 count = splitPorts(ComPort, NULL);
+    UPD_TARGET_t *pTargets = count ? (UPD_TARGET_t*)calloc(count, sizeof(UPD_TARGET_t)) : NULL;
+    if (!pTargets)
+    {
+        return FALSE;
+    }
+    splitPorts(ComPort, pTargets);
+    UPD_TARGET_t *dlTargets[UPD_MAX_TARGETS];
+    UPD_CORE_t *upds[UPD_MAX_TARGETS];
+    BOOL ok[UPD_MAX_TARGETS];
+    U4 downloads = 0;
+    U4 ix;
+
+    // prepare the receivers one after the other
+    for (ix = 0; ix < count; ix++)
+    {
+        UPD_TARGET_t *t = &pTargets[ix];
+        t->DoSafeBoot = p->DoSafeBoot;
+        t->pShared = pShared;
+        ok[ix] = updPrepare(t, p);
+        if (ok[ix] && t->upd)
+        {
+            dlTargets[downloads] = t;
+            upds[downloads++] = t->upd;
+        }
+    }
 
-        if(generation >= 90 && updateRam != 0)
+    // download to all of them at once, interleaving the bus transactions
+    if (downloads)
+    {
+        BOOL dlOk[UPD_MAX_TARGETS];
+        const U4 startTime = TIME_GET();
+        const U4 startCpu  = TIME_CPU();
+        if (downloads == 1)
         {
-            if(!pData)
-                break;
-            /***************************************************
-             * Do the RAM update                               *
-             ***************************************************/
-            MESSAGE(MSG_LEV1, "Receiver info collected, downloading to RAM...");
-            BOOL ramSuc = FALSE;
-            if (isSpiPort)
+            dlOk[0] = updUpdate(upds[0], &dlTargets[0]->image, dlTargets[0]->FwBase);
+        }
+        else
+        {
+            for (ix = 0; ix < downloads; ix++)
             {
-                CH spiCfgPayload[] = { 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 }; // UBX only, FF sup disabled, CPOL=CPHA=0, Tx ready disabled
-
-                if (rcvAckMessage(&rx, UBX_CLASS_CFG, UBX_CFG_PORT, spiCfgPayload, sizeof(spiCfgPayload), POLL_TIMEOUT) != 1)
-                {
-                    MESSAGE(MSG_ERR, "SPI configuration not accepted");
-                    if (imageGeneration == 90)
-                    {
-                        MESSAGE(MSG_ERR, "MPW chip needs to be fused with patch 2 (spiCfg)");
-                    }
-                    break;
-                }
+                updStart(upds[ix], &dlTargets[ix]->image, dlTargets[ix]->FwBase);
             }
-            ramSuc = updateImageToRam(&rx, (CH*)pData, fileSize);
-            if (ramSuc == FALSE)
+            updUpdateMulti(upds, dlOk, downloads);
+        }
+        MESSAGE(MSG_DBG, "Download took %u ms, host CPU %u ms",
+                TIME_GET() - startTime, TIME_CPU() - startCpu);
+        for (ix = 0; ix < downloads; ix++)
+        {
+            ok[dlTargets[ix] - pTargets] = dlOk[ix];
+            if (!dlOk[ix])
             {
-                MESSAGE(MSG_ERR, "RAM image update failed");
-                break;
+                updDropLink(dlTargets[ix], p);
             }
+        }
+    }
 
+    BOOL success = TRUE;
+    for (ix = 0; ix < count; ix++)
+    {
+        UPD_TARGET_t *t = &pTargets[ix];
+        if (ok[ix] && !t->current)
+        {
+            ok[ix] = updFinish(t, p);
         }
-        else
+        updRelease(t);
+        if (count > 1)
         {
-            /***************************************************
-             * Do the flash update                             *
-             ***************************************************/
-            I4 numberSectors;
-            if(doChipErase)
-            {
-                if(generation > 70)
-                {
-                    // we don't have to erase any sector afterwards because we do a chip erase
-                    numberSectors = 0;
+            MESSAGE(MSG_LEV0, "Firmware Update over %s %s", t->port, ok[ix] ? "SUCCESS" : "FAILED");
+        }
+        success = success && ok[ix];
+    }
+    free(pTargets);
+    return success;
+}
 
-                    if(rcvAckMessage(&rx, UBX_CLASS_UPD, UBX_UPD_CERASE, NULL, 0, POLL_TIMEOUT) != 1)
-                    {
-                        MESSAGE(MSG_ERR, "Could not send chip erase command. Does the ROM support it?");
-                        break;
-                    }
-                    else
-                    {
-                        MESSAGE(MSG_LEV2, "Chip erase started");
-                        eraseInProgres = TRUE;
-                    }
-                }
-                else
-                {
-                    MESSAGE(MSG_ERR, "Chip erase no supported on this platform");
-                    break;
-                }
-            }
-            else
-            {
-                if(EraseWholeFlash)
-                {
-                    // erase all the sectors
-                    numberSectors = GetSectorNrForSize(0, FlashSize, &FlashOrg);
-                }
-                else
-                {
-                    // erase only the needed sectors
-                    numberSectors = (EraseOnly) ? 1 : GetSectorNrForSize(0, fileSize, &FlashOrg);
-                }
-            }
+//! initialize the log context of an update
+/*!
+    The messages go to the output of \a pOuter, so a caller that bound a
+    log context with its own output also gets the messages of the update.
 
-            I4 numberPackets = (fileSize % PACKETSIZE) ?
-                fileSize / PACKETSIZE + 1 : fileSize / PACKETSIZE;
-            upd = updInit(&rx, numberSectors, numberPackets, &FlashOrg, FlashSize, DEFAULT_MAX_PACKETS, eraseInProgres);
-            if(!upd)
-                break;
+    \param pCtx        log context to initialize
+    \param verbosity   verbosity of the update
+    \param pPrefix     printed in front of every message, NULL for none
+    \param pOuter      log context of the caller, NULL for none
+*/
+static void updLogInit(LOG_CTX_t *pCtx, int verbosity, const CH *pPrefix, const LOG_CTX_t *pOuter)
+{
+    LOG_INIT(pCtx, verbosity, pPrefix);
+    if (pOuter)
+    {
+        pCtx->pfnOutput = pOuter->pfnOutput;
+        pCtx->pUser     = pOuter->pUser;
+    }
+}
 
-            if (!updUpdate(upd, pData, fileSize, FwBase))
-                break;
+//! step-driven update of one receiver
+struct UPD_SESSION_s
+{
+    UPD_PARAMS_t    params;         //!< update options
+    UPD_TARGET_t    target;         //!< the receiver
+    UPD_PHASE_t     phase;          //!< current phase
+    BOOL            success;        //!< no step failed so far
+    BOOL            released;       //!< connection and memory of the target released
+    LOG_CTX_t       log;            //!< log context, bound while stepping
+    UPD_PROGRESS_FN pfnProgress;    //!< progress callback, NULL for none
+    void*           pUser;          //!< argument of pfnProgress
+    UPD_PROGRESS_t  progress;       //!< progress reported last
+    U4              startTime;      //!< start of the download
+    U4              startCpu;       //!< host CPU time at the start of the download
+};
+
+BOOL UpdateFirmware(IN const char*          BinaryFileName,
+                    IN const char*          FlashDefFileName,
+                    IN const char*          FisFileName,
+                    IN const char*          ComPort,
+                    IN const unsigned int   Baudrate,
+                    IN const unsigned int   BaudrateSafe,
+                    IN const unsigned int   BaudrateUpd,
+                    IN       BOOL           DoSafeBoot,
+                    IN const BOOL           DoReset,
+                    IN const BOOL           DoAutobaud,
+                    IN const BOOL           EraseWholeFlash,
+                    IN const BOOL           EraseOnly,
+                    IN const BOOL           TrainingSequence,
+                    IN const BOOL           doChipErase,
+                    IN       BOOL           noFisMerging,
+                    IN       BOOL           updateRam,
+                    IN const BOOL           usbAltMode,
+                    IN const int            Verbose,
+                    IN const BOOL           fisOnly)
+{
+    const UPD_PARAMS_t params =
+    {
+        BinaryFileName, FlashDefFileName, FisFileName,
+        Baudrate, BaudrateSafe, BaudrateUpd,
+        DoSafeBoot, DoReset, DoAutobaud, EraseWholeFlash, EraseOnly,
+        TrainingSequence, doChipErase, noFisMerging, updateRam, usbAltMode,
+        Verbose, fisOnly, NULL, NULL, 0
+    };
+    return UpdatePort(&params, ComPort);
+}
+
+BOOL UpdatePort(IN const UPD_PARAMS_t*  pParams,
+                IN const char*          ComPort)
+{
+    LOG_CTX_t log;
+    updLogInit(&log, pParams->Verbose, NULL, LOG_CURRENT());
+    LOG_CTX_t* pPrevLog = LOG_BIND(&log);
+    MESSAGE(MSG_LEV0, "u-blox Firmware Update Tool version %s", PRODUCTVERSTR);
 
+    BOOL success = FALSE;
+    const U4 count = splitPorts(ComPort, NULL);
+    if (count > 1)
+    {
+        // several receivers on one bus, interleaved by updRun()
+        success = updRun(ComPort, pParams, NULL);
+    }
+    else if (count == 1)
+    {
+        UPD_SESSION_t* pSession = UpdateBegin(pParams, ComPort, NULL, NULL);
+        while (pSession && UpdateStep(pSession))
+        {
+            // block until the receiver answers or the next step is due
+            updWait(&pSession->target, UpdateNextDeadline(pSession));
         }
+        success = UpdateEnd(pSession);
+    }
+    LOG_BIND(pPrevLog);
+    return success;
+}
+
+//! one port of a fleet update
+typedef struct UPD_FLEET_PORT_s
+{
+    CH*          port;              //!< port name
+    BOOL         success;           //!< update successful
+    U4           duration;          //!< duration of the update [ms]
+} UPD_FLEET_PORT_t;
 
+//! fleet update, shared by all worker threads
+typedef struct UPD_FLEET_s
+{
+    const UPD_PARAMS_t* p;          //!< update options
+    UPD_SHARED_t        shared;     //!< image and FIS shared by the receivers
+    UPD_FLEET_PORT_t*   pPorts;     //!< ports to update
+    U4                  count;      //!< number of ports
+    int                 verbosity;  //!< verbosity of the ports
+    U4                  startTime;  //!< start of the updates, the messages of all ports are time stamped relative to it
+    const LOG_CTX_t*    pLog;       //!< log context of the fleet, the ports log to its output
+} UPD_FLEET_t;
+
+//! worker thread of a fleet update, updates one port after the other
+/*!
+    \param pArg    fleet update (UPD_FLEET_t)
+*/
+static void updFleetWorker(void* pArg)
+{
+    UPD_FLEET_t *f = (UPD_FLEET_t*)pArg;
+    for (;;)
+    {
+        MUTEX_LOCK(f->shared.lock);
+        const U4 ix = f->shared.next++;
+        MUTEX_UNLOCK(f->shared.lock);
+        if (ix >= f->count)
+            break;
 
+        UPD_FLEET_PORT_t *pPort = &f->pPorts[ix];
+        LOG_CTX_t log;
+        updLogInit(&log, f->verbosity, pPort->port, f->pLog);
+        log.tick = f->startTime;
+        LOG_BIND(&log);
+        const U4 start = TIME_GET();
+        pPort->success = updRun(pPort->port, f->p, &f->shared);
+        pPort->duration = TIME_GET() - start;
+        MESSAGE(MSG_LEV0, "Firmware Update %s", pPort->success ? "SUCCESS" : "FAILED");
+        LOG_BIND(NULL);
+    }
+}
 
+BOOL UpdateFleet(IN const UPD_PARAMS_t*      pParams,
+                 IN const char* const*       pPorts,
+                 IN const unsigned int       numPorts,
+                 IN const unsigned int       maxParallel)
+{
+    LOG_CTX_t log;
+    updLogInit(&log, pParams->Verbose, NULL, LOG_CURRENT());
+    LOG_CTX_t* pPrevLog = LOG_BIND(&log);
+    MESSAGE(MSG_LEV0, "u-blox Firmware Update Tool version %s", PRODUCTVERSTR);
 
-        /***************************************************
-         * Invalidate patch for u-blox 7                   *
-         ***************************************************/
-        if(generation == 70 && hwRomVer == 100)
+    UPD_FLEET_t fleet;
+    memset(&fleet, 0, sizeof(fleet));
+    fleet.p = pParams;
+    fleet.pLog = &log;
+    fleet.verbosity = pParams->Verbose;
+    if (fleet.verbosity > 1)
+    {
+        // the dumps of the ports would overwrite each other
+        MESSAGE(MSG_WARN, "No packet dump when updating several ports at once");
+        fleet.verbosity = 1;
+    }
+    BOOL success = FALSE;
+    IMG_FILE_t file = { NULL, 0, FALSE };
+    CH* names[UPD_FLEET_MAX_PORTS];
+    U4 count = 0;
+    U4 ix;
+
+    do
+    {
+        // expand the wildcards
+        for (ix = 0; ix < numPorts; ix++)
         {
-            MESSAGE(MSG_DBG, "Invalidating timeout patch");
-            U1 payloadInvPatch[] = { 0x20, 0x20, 0x00, 0xE0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-            if( rcvAckMessage(&rx, UBX_CLASS_UPD, UBX_UPD_DOWNL, (CH*)payloadInvPatch, sizeof(payloadInvPatch), POLL_TIMEOUT) != 1 )
+            const U4 n = SER_EXPAND(pPorts[ix], &names[count], NUMOF(names) - count);
+            if (n == 0)
             {
-                MESSAGE(MSG_ERR, "Failed to invalidate patch");
+                MESSAGE(MSG_ERR, "No port matching '%s'", pPorts[ix]);
                 break;
             }
+            count += n;
         }
+        if (ix < numPorts)
+            break;
+        fleet.pPorts = (UPD_FLEET_PORT_t*)calloc(count, sizeof(UPD_FLEET_PORT_t));
+        if (!fleet.pPorts)
+            break;
+        for (ix = 0; ix < count; ix++)
+        {
+            fleet.pPorts[ix].port = names[ix];
+        }
+        fleet.count = count;
 
-
-
-
-
-        /***************************************************
-         * Write the marker to the flash to indicate       *
-         * the FS that the flash was completely erased     *
-         * Only u-blox8 supports this feature              *
-         * later platforms address this issue differently  *
-         * without the need for FW update tool support     *
-         ***************************************************/
-        if (EraseWholeFlash && generation == 80)
+        // load and validate the image once for all receivers
+        if (!pParams->EraseOnly && !pParams->fisOnly)
         {
-            // check if the marker has to be written
-            U4 address = 0;
-            U4 marker = 0xffffffff;
-            BOOL imageSupportsFeature = FALSE;
-            if (fisOnly)
+            FWFOOTERINFO_t fwFooter={0};
+            MESSAGE(MSG_DBG, "Opening image file");
+            if (!MapImageFile(pParams->BinaryFileName, &file))
             {
-                // we are going to run from ROM -> write the marker to the second sector
-                address = 0x1000;
-
-                // u-blox8 ROM 3.01 supports this feature
-                if ( hwRomVer == 301 )
-                {
-                    imageSupportsFeature = TRUE;
-                    marker = 0xee7b8f34;
-                }
+                break;
             }
-            else if (!EraseOnly)
+            MESSAGE(MSG_DBG, "Verifying image");
+            fleet.shared.pData = (const FWHEADER_t*)file.pData;
+            fleet.shared.fileSize = file.size;
+            fleet.shared.imageGeneration = ValidateImage(fleet.shared.pData, fleet.shared.fileSize, &fwFooter);
+            if (fleet.shared.imageGeneration == 0)
             {
-                if(!pData)
-                    break;
-                // we are going to run from flash -> write the marker to the first sector following the image
-                address = (((FwBase + fileSize) / 0x1000) + 1) * 0x1000;
-                if( pData->v1.fsErasedMarker != 0xFFFFFFFF )
-                {
-                    imageSupportsFeature = TRUE;
-                    marker = pData->v1.fsErasedMarker;
-                }
+                MESSAGE(MSG_ERR, "Image not valid.");
+                break;
             }
+        }
+        fleet.shared.lock = MUTEX_CREATE();
+        if (!fleet.shared.lock)
+            break;
 
-            if( imageSupportsFeature )
+        // the built-in transports must be registered before opening ports concurrently
+        SER_INIT();
+        THREAD_pt threads[UPD_FLEET_MAX_PORTS];
+        U4 numThreads = (maxParallel && (maxParallel < count)) ? maxParallel : count;
+        const U4 startTime = TIME_GET();
+        fleet.startTime = log.tick;
+        MESSAGE(MSG_LEV0, "Updating %u ports, %u at once", count, numThreads);
+        for (ix = 0; ix < numThreads; ix++)
+        {
+            threads[ix] = THREAD_START(updFleetWorker, &fleet);
+            if (!threads[ix])
             {
-                if(!pData)
-                    break;
-                MESSAGE(MSG_LEV1, "Writing marker for the file system to speed up first initialization");
-
-                const U4 writeSize = sizeof(pData->v1.fsErasedMarker);
-                const U4 length = writeSize + 8;
-                CH *data = malloc(length);
-                if (!data)
-                    break;
-
-                //copy data to the send buffer
-                memcpy(data + 0, &address,   4);                // Address
-                memcpy(data + 4, &writeSize, 4);                // Data size
-                memcpy(data + 8, &marker,    sizeof(marker));   // Marker
-                UBX_HEAD_t *msg = rcvPollMessage(&rx, UBX_CLASS_UPD, UBX_UPD_FLWRI,
-                        data, length, WRITE_TIMEOUT);
-                free(data);
-                if( msg == NULL )
-                {
-                    MESSAGE(MSG_ERR, "Failed to write the marker");
-                    break;
-                }
-                free(msg);
+                MESSAGE(MSG_WARN, "Could not start more than %u threads", ix);
+                break;
             }
         }
+        numThreads = ix;
+        if (numThreads == 0)
+        {
+            updFleetWorker(&fleet);
+            LOG_BIND(&log);
+        }
+        for (ix = 0; ix < numThreads; ix++)
+        {
+            THREAD_JOIN(threads[ix]);
+        }
+        const U4 wallTime = TIME_GET() - startTime;
 
+        // summary
+        U4 good = 0;
+        U4 sum = 0;
+        MESSAGE(MSG_LEV0, "Fleet update summary:");
+        for (ix = 0; ix < count; ix++)
+        {
+            const UPD_FLEET_PORT_t *pPort = &fleet.pPorts[ix];
+            MESSAGE(MSG_LEV0, "  %-32s %-7s %7.1f s", pPort->port,
+                    pPort->success ? "SUCCESS" : "FAILED", 0.001 * pPort->duration);
+            good += pPort->success ? 1 : 0;
+            sum += pPort->duration;
+        }
+        MESSAGE(MSG_LEV0, "%u of %u receivers updated in %.1f s (%.1f s one after the other)",
+                good, count, 0.001 * wallTime, 0.001 * sum);
+        success = (good == count);
+    }
+    while (FALSE);
 
+    for (ix = 0; ix < fleet.shared.fisCount; ix++)
+    {
+        free(fleet.shared.fis[ix].fis);
+    }
+    mergefis_db_close(&fleet.shared.fisDb);
+    MUTEX_DELETE(fleet.shared.lock);
+    UnmapImageFile(&file);
+    free(fleet.pPorts);
+    for (ix = 0; ix < count; ix++)
+    {
+        free(names[ix]);
+    }
+    LOG_BIND(pPrevLog);
+    return success;
+}
 
+//! one port of an inventory
+typedef struct UPD_INV_PORT_s
+{
+    CH*          port;              //!< port name
+    U4           baudrate;          //!< baudrate the receiver answered at, 0 if none found
+    U4           generation;        //!< hardware generation of the receiver
+    CH           hwVersion[10];     //!< hardware version from MON-VER
+    CH           swVersion[30];     //!< software version from MON-VER
+    CH           fwVersion[30];     //!< firmware version (FWVER extension) from MON-VER
+    BOOL         romCrcValid;       //!< romCrc was read
+    U4           romCrc;            //!< CRC of the ROM
+    BOOL         jedecValid;        //!< jedec was read
+    U4           jedec;             //!< JEDEC ID of the flash
+} UPD_INV_PORT_t;
+
+//! inventory, shared by all worker threads
+typedef struct UPD_INV_s
+{
+    const UPD_PARAMS_t* p;          //!< options (baudrate, training sequence, verbosity)
+    UPD_INVENTORY_t     depth;      //!< what to read from every receiver
+    UPD_INV_PORT_t*     pPorts;     //!< ports to probe
+    U4                  count;      //!< number of ports
+    MUTEX_pt            lock;       //!< protects next
+    U4                  next;       //!< index of the next port to probe
+    int                 verbosity;  //!< verbosity of the ports
+    U4                  startTime;  //!< start of the inventory
+    const LOG_CTX_t*    pLog;       //!< log context of the inventory, the ports log to its output
+} UPD_INV_t;
+
+//! identify the receiver on one port of an inventory
+/*!
+    \param inv     inventory
+    \param pPort   port to probe
+    \param pRx     connection to use
+*/
+static void updIdentify(const UPD_INV_t *inv, UPD_INV_PORT_t *pPort, RCV_DATA_t *pRx)
+{
+    if (!rcvConnect(pRx, pPort->port, inv->p->Baudrate))
+    {
+        rcvDisconnect(pRx);
+        return;
+    }
 
+    // the given baudrate first, then the autobaud list on serial ports
+    UBX_HEAD_t* monVer = rcvProbe(pRx, 0, inv->p->TrainingSequence, PROBE_TIMEOUT);
+    U4 ix;
+    for (ix = 0; !monVer && (pRx->mPortHandle->type == COM) && (ix < NUMOF(gAutoBaudRates)); ix++)
+    {
+        if (gAutoBaudRates[ix] != inv->p->Baudrate)
+        {
+            MESSAGE(MSG_DBG, "Trying baudrate %u", gAutoBaudRates[ix]);
+            monVer = rcvProbe(pRx, gAutoBaudRates[ix], inv->p->TrainingSequence, PROBE_TIMEOUT);
+        }
+    }
+    if (!monVer)
+    {
+        MESSAGE(MSG_DBG, "No receiver found");
+        rcvDisconnect(pRx);
+        return;
+    }
+    pPort->baudrate = pRx->mPortHandle->baudrate;
+    pPort->generation = extractHwGeneration(monVer);
+    monVerString(monVer,  0, sizeof(pPort->swVersion), pPort->swVersion);
+    monVerString(monVer, 30, sizeof(pPort->hwVersion), pPort->hwVersion);
+    for (ix = 40; ix + 30 <= monVer->size; ix += 30)
+    {
+        CH ext[30];
+        if (monVerString(monVer, ix, sizeof(ext), ext) && (strncmp(ext, "FWVER=", 6) == 0))
+        {
+            strcpy(pPort->fwVersion, ext + 6);
+        }
+    }
+    rcvReleaseMessage(pRx, monVer);
 
-        /***************************************************
-         * Restart receiver if image is too large          *
-         * (Workaround for ROM bug)                        *
-         ***************************************************/
-        BOOL isGen70Rom100 = (generation == 70 && hwRomVer == 100);
-        BOOL isGen80Rom22Or201 = (generation == 80 && (hwRomVer == 22 || hwRomVer == 201));
-        if( (fileSize > 128 * 4096) && (isGen70Rom100 || isGen80Rom22Or201))
+    if ((inv->depth >= UPD_INVENTORY_ROM) && romSize(pPort->generation))
+    {
+        pPort->romCrcValid = readRomCrc(pRx, pPort->generation, (pPort->generation >= 90), &pPort->romCrc);
+        if (!pPort->romCrcValid)
         {
-            //send safeboot command
-            if (!isUsbPort)
-            {
-                MESSAGE(MSG_LEV1, "Commanding Safeboot");
-                if (!rcvSendMessage(&rx, UBX_CLASS_UPD, UBX_UPD_SAFE, NULL, 0))
-                {
-                    MESSAGE(MSG_ERR, "Safeboot failed.");
-                    break;
-                }
-                TIME_SLEEP(500); // wait until receiver is booted up
-            }
-            else
-            {
-                doReset(&rx, TRUE);
-                TIME_SLEEP(100); // wait until receiver is booted up
-            }
+            MESSAGE(MSG_WARN, "Could not get ROM CRC");
+        }
+    }
+    if (inv->depth >= UPD_INVENTORY_FLASH)
+    {
+        // only answered by the flash loader (safeboot or loader task started)
+        U4 base = (pPort->generation >= 90) ? sizeof(DRV_SPI_MEM_FIS_t) : FLASH_BASE;
+        UBX_HEAD_t *flashMsg = rcvPollMessage(pRx, UBX_CLASS_UPD, UBX_UPD_FLDET, (CH*)&base, sizeof(base), PROBE_TIMEOUT);
+        if (flashMsg && (flashMsg->size == 8))
+        {
+            U2 manId, devId;
+            memcpy(&manId, (U1*)flashMsg + UBX_HEAD_SIZE + 4, sizeof(manId));
+            memcpy(&devId, (U1*)flashMsg + UBX_HEAD_SIZE + 6, sizeof(devId));
+            pPort->jedec = ((U4)manId << 16) | devId;
+            pPort->jedecValid = TRUE;
+        }
+        else
+        {
+            MESSAGE(MSG_DBG, "No flash detection reply");
+        }
+        rcvReleaseMessage(pRx, flashMsg);
+    }
+    rcvDisconnect(pRx);
+}
+
+//! worker thread of an inventory, probes one port after the other
+/*!
+    \param pArg    inventory (UPD_INV_t)
+*/
+static void updInventoryWorker(void* pArg)
+{
+    UPD_INV_t *inv = (UPD_INV_t*)pArg;
+    RCV_DATA_t *pRx = (RCV_DATA_t*)malloc(sizeof(RCV_DATA_t));
+    if (!pRx)
+        return;
+    for (;;)
+    {
+        MUTEX_LOCK(inv->lock);
+        const U4 ix = inv->next++;
+        MUTEX_UNLOCK(inv->lock);
+        if (ix >= inv->count)
+            break;
 
+        LOG_CTX_t log;
+        updLogInit(&log, inv->verbosity, inv->pPorts[ix].port, inv->pLog);
+        log.tick = inv->startTime;
+        LOG_BIND(&log);
+        updIdentify(inv, &inv->pPorts[ix], pRx);
+        LOG_BIND(NULL);
+    }
+    free(pRx);
+}
 
-            // Reenumerate the port
-            if (!rcvReenumerate(&rx, isUsbPort))
-            {
-                MESSAGE(MSG_ERR, "Reenumerate failed");
+BOOL UpdateInventory(IN const UPD_PARAMS_t*      pParams,
+                     IN const char* const*       pPorts,
+                     IN const unsigned int       numPorts,
+                     IN const UPD_INVENTORY_t    depth)
+{
+    LOG_CTX_t log;
+    updLogInit(&log, pParams->Verbose, NULL, LOG_CURRENT());
+    LOG_CTX_t* pPrevLog = LOG_BIND(&log);
+
+    UPD_INV_t inv;
+    memset(&inv, 0, sizeof(inv));
+    inv.p = pParams;
+    inv.pLog = &log;
+    inv.depth = depth;
+    inv.verbosity = (pParams->Verbose > 1) ? 1 : pParams->Verbose;
+    U4 found = 0;
+    CH* names[UPD_FLEET_MAX_PORTS];
+    U4 count = 0;
+    U4 ix;
+
+    do
+    {
+        for (ix = 0; ix < numPorts; ix++)
+        {
+            count += SER_EXPAND(pPorts[ix], &names[count], NUMOF(names) - count);
+        }
+        if (!count)
+        {
+            MESSAGE(MSG_ERR, "No port to probe");
+            break;
+        }
+        inv.pPorts = (UPD_INV_PORT_t*)calloc(count, sizeof(UPD_INV_PORT_t));
+        inv.lock = MUTEX_CREATE();
+        if (!inv.pPorts || !inv.lock)
+            break;
+        for (ix = 0; ix < count; ix++)
+        {
+            inv.pPorts[ix].port = names[ix];
+        }
+        inv.count = count;
+
+        // all ports at once, the scan takes as long as the slowest port
+        SER_INIT();
+        THREAD_pt threads[UPD_FLEET_MAX_PORTS];
+        U4 numThreads;
+        const U4 startTime = TIME_GET();
+        inv.startTime = log.tick;
+        for (numThreads = 0; numThreads < count; numThreads++)
+        {
+            threads[numThreads] = THREAD_START(updInventoryWorker, &inv);
+            if (!threads[numThreads])
                 break;
-            }
+        }
+        if (numThreads == 0)
+        {
+            updInventoryWorker(&inv);
+            LOG_BIND(&log);
+        }
+        for (ix = 0; ix < numThreads; ix++)
+        {
+            THREAD_JOIN(threads[ix]);
+        }
 
-            // set the safeboot baudrate if not USB port
-            if (!isUsbPort)
+        // the table goes to stdout, the messages to stderr
+        printf("port\tbaud\thw\tgen\trom\tromcrc\tsw\tfw\tjedec\n");
+        for (ix = 0; ix < count; ix++)
+        {
+            const UPD_INV_PORT_t *pPort = &inv.pPorts[ix];
+            if (!pPort->baudrate)
             {
-                if (!rcvSetBaud(&rx, BaudrateSafe))
-                {
-                    MESSAGE(MSG_ERR, "Safeboot Baud rate set failed.");
-                    break;
-                }
-                // send the training sequence
-                if (TrainingSequence)
-                {
-                    if (!rcvSendTrainingSequence(&rx))
-                    {
-                        MESSAGE(MSG_ERR, "Sending training sequence failed");
-                        break;
-                    }
-                }
+                printf("%s\t-\t-\t-\t-\t-\t-\t-\t-\n", pPort->port);
+                continue;
             }
-            else
+            CH rom[16] = "-";
+            CH romCrc[16] = "-";
+            CH jedec[16] = "-";
+            if (pPort->romCrcValid)
             {
-                // disable GPS
-                MESSAGE(MSG_LEV1, "Stop GPS operation");
-                CH data[4] = { 0, 0, 8, 0 };
-                // don't expect ACK
-                if (!rcvSendMessage(&rx, UBX_CLASS_CFG, UBX_CFG_RST, data, sizeof(data)))
-                {
-                    MESSAGE(MSG_ERR, "Stopping GPS failed");
-                    break;
-                }
-                // Start the loader task
-                MESSAGE(MSG_LEV1, "Starting LDR TSK");
-                CH pPayload[1] = { 0x01 };
-                // this message is assumed to be OK if ACKed or NAKed
-                if (rcvAckMessage(&rx, UBX_CLASS_UPD, UBX_UPD_SAFE, pPayload, sizeof(pPayload), POLL_TIMEOUT) == -1)
+                const U4 romVer = romVersion(pPort->romCrc);
+                if (romVer)
                 {
-                    MESSAGE(MSG_ERR, "Starting flash loader failed");
+                    sprintf(rom, "%u.%02u", romVer / 100, romVer % 100);
                 }
-                else
-                {
-                    MESSAGE(MSG_DBG, "LDR TSK started successfully");
-                }
-
+                sprintf(romCrc, "0x%08X", pPort->romCrc);
             }
-            monVer = DoAutobaud ?
-                rcvDoAutobaud(&rx, TrainingSequence) :
-                rcvPollMessage(&rx, UBX_CLASS_MON, UBX_MON_VER, NULL, 0, POLL_TIMEOUT);
-
-            if (monVer == NULL)
+            if (pPort->jedecValid)
             {
-                MESSAGE(MSG_ERR, "Version is null");
-                break;
+                sprintf(jedec, "0x%08X", pPort->jedec);
             }
-            free(monVer);
+            printf("%s\t%u\t%s\t%u.%u\t%s\t%s\t%s\t%s\t%s\n",
+                   pPort->port, pPort->baudrate,
+                   *pPort->hwVersion ? pPort->hwVersion : "-",
+                   pPort->generation / 10, pPort->generation % 10,
+                   rom, romCrc,
+                   *pPort->swVersion ? pPort->swVersion : "-",
+                   *pPort->fwVersion ? pPort->fwVersion : "-",
+                   jedec);
+            found++;
         }
+        fflush(stdout);
+        MESSAGE(MSG_LEV0, "%u receivers found on %u ports in %.1f s",
+                found, count, 0.001 * (TIME_GET() - startTime));
+    }
+    while (FALSE);
 
+    MUTEX_DELETE(inv.lock);
+    free(inv.pPorts);
+    for (ix = 0; ix < count; ix++)
+    {
+        free(names[ix]);
+    }
+    LOG_BIND(pPrevLog);
+    return (found != 0);
+}
 
-
-
-
-        /***************************************************
-         * Verify that the image was written correctly     *
-         ***************************************************/
-        if (!fisOnly && !EraseOnly)
+//! report the progress of a session if it changed
+/*!
+    \param pSession    session
+*/
+static void updReportProgress(UPD_SESSION_t* pSession)
+{
+    UPD_PROGRESS_t progress = { pSession->phase, 0, 0 };
+    const UPD_CORE_t* upd = pSession->target.upd;
+    if ((pSession->phase == UPD_PHASE_DOWNLOAD) && upd)
+    {
+        progress.done  = upd->SectorsErased + upd->PacketsWritten;
+        progress.total = upd->NumberSectors + upd->NumberPackets;
+    }
+    if ((progress.phase != pSession->progress.phase) ||
+        (progress.done  != pSession->progress.done)  ||
+        (progress.total != pSession->progress.total))
+    {
+        pSession->progress = progress;
+        if (pSession->pfnProgress)
         {
-            BOOL verifySuccess;
-            MESSAGE(MSG_LEV1, "Verifying Image on hardware");
-            verifySuccess = verifyImage(&rx, pData, fileSize, FwBase, (updateRam != 0), (generation >= 90) ? 2 : 1);
-            if (!verifySuccess)
-            {
-                MESSAGE(MSG_LEV1,"CRC check ERROR");
-                MESSAGE(MSG_ERR, "Verify failed");
-                break;
-            }
-            MESSAGE(MSG_LEV1, "CRC check SUCCESS");
-
+            pSession->pfnProgress(pSession->pUser, &progress);
         }
+    }
+}
 
+UPD_SESSION_t* UpdateBegin(IN const UPD_PARAMS_t*    pParams,
+                           IN const char*            ComPort,
+                           IN UPD_PROGRESS_FN        pfnProgress,
+                           IN void*                  pUser)
+{
+    const U4 count = splitPorts(ComPort, NULL);
+    if (count != 1)
+    {
+        if (count > 1)
+        {
+            MESSAGE(MSG_ERR, "One receiver per update session");
+        }
+        return NULL;
+    }
+    UPD_SESSION_t* pSession = (UPD_SESSION_t*)calloc(1, sizeof(UPD_SESSION_t));
+    if (!pSession)
+    {
+        MESSAGE(MSG_ERR, "Alloc failed");
+        return NULL;
+    }
+    pSession->params = *pParams;
+    splitPorts(ComPort, &pSession->target);
+    pSession->target.DoSafeBoot = pParams->DoSafeBoot;
+    pSession->phase = UPD_PHASE_PREPARE;
+    pSession->success = TRUE;
+    // log like the caller, but with the verbosity of the update
+    if (LOG_CURRENT())
+    {
+        pSession->log = *LOG_CURRENT();
+        pSession->log.verbose = pParams->Verbose;
+    }
+    else
+    {
+        LOG_INIT(&pSession->log, pParams->Verbose, NULL);
+    }
+    pSession->pfnProgress = pfnProgress;
+    pSession->pUser = pUser;
+    // report the first phase on the first step
+    pSession->progress.phase = UPD_PHASE_DONE;
+    return pSession;
+}
 
-
-
-
-        /***************************************************
-         * Reset the receiver                              *
-         ***************************************************/
-        if (DoReset && updateRam != 0)
+BOOL UpdateStep(IN UPD_SESSION_t* pSession)
+{
+    UPD_TARGET_t *t = &pSession->target;
+    LOG_CTX_t* pPrevLog = LOG_BIND(&pSession->log);
+    updReportProgress(pSession);
+    switch (pSession->phase)
+    {
+    case UPD_PHASE_PREPARE:
+    {
+        const UPD_STEP_t step = updPrepareStep(t, &pSession->params);
+        if (step == UPD_STEP_BUSY)
         {
-            {
-                // we cannot use UPD-RBOOT in this case
-                // -> use CFG-RST instead
-                CH data[4] = { -1, -1, 1, 0 };
-                rcvSendMessage(&rx, UBX_CLASS_CFG, UBX_CFG_RST, data, sizeof(data));
-            }
+            break;
+        }
+        pSession->success = (step == UPD_STEP_DONE);
+        if (!pSession->success || t->current)
+        {
+            pSession->phase = UPD_PHASE_DONE;
+        }
+        else if (t->upd)
+        {
+            updStart(t->upd, &t->image, t->FwBase);
+            pSession->startTime = TIME_GET();
+            pSession->startCpu  = TIME_CPU();
+            pSession->phase = UPD_PHASE_DOWNLOAD;
         }
         else
         {
-            doReset(&rx, DoReset);
+            pSession->phase = UPD_PHASE_FINISH;
         }
-        // Everything is fine
-        success = TRUE;
+        break;
+    }
 
-    } while (FALSE);
+    case UPD_PHASE_DOWNLOAD:
+    {
+        BOOL done = FALSE;
+        pSession->success = updStep(t->upd, &done);
+        if (pSession->success && done)
+        {
+            pSession->success = updComplete(t->upd);
+            MESSAGE(MSG_DBG, "Download took %u ms, host CPU %u ms",
+                    TIME_GET() - pSession->startTime, TIME_CPU() - pSession->startCpu);
+        }
+        if (!pSession->success)
+        {
+            updDropLink(t, &pSession->params);
+            pSession->phase = UPD_PHASE_DONE;
+        }
+        else if (done)
+        {
+            pSession->phase = UPD_PHASE_FINISH;
+        }
+        break;
+    }
 
-    // Clean up receiver interface if required
-    if( rcvConnected )
-        rcvDisconnect(&rx);
+    case UPD_PHASE_FINISH:
+    {
+        const UPD_STEP_t step = updFinishStep(t, &pSession->params);
+        if (step != UPD_STEP_BUSY)
+        {
+            pSession->success = (step == UPD_STEP_DONE);
+            pSession->phase = UPD_PHASE_DONE;
+        }
+        break;
+    }
 
-    //clean up and exit
-    if (pData)
+    case UPD_PHASE_DONE:
+    default:
+        break;
+    }
+    if ((pSession->phase == UPD_PHASE_DONE) && !pSession->released)
+    {
+        // close the port right away, not only in UpdateEnd()
+        updRelease(t);
+        pSession->released = TRUE;
+    }
+    else if (t->rcvConnected && (SER_CAPS(t->rx.mPortHandle) & SER_CAP_WRITE_BUFFERED))
     {
-        free(pData);
+        // the caller waits on UpdateFd() for the answer to what was written
+        SER_FLUSH(t->rx.mPortHandle);
     }
+    updReportProgress(pSession);
+    LOG_BIND(pPrevLog);
+    return (pSession->phase != UPD_PHASE_DONE);
+}
 
-    // Free update core structure
-    if(upd)
-        updDeinit(upd);
+int UpdateFd(IN UPD_SESSION_t* pSession)
+{
+    UPD_TARGET_t *t = &pSession->target;
+    // nothing to read while the receiver boots or the link settles
+    return (t->rcvConnected && !pSession->released && !updSleeping(t)) ? SER_FD(t->rx.mPortHandle) : -1;
+}
+
+unsigned int UpdateNextDeadline(IN UPD_SESSION_t* pSession)
+{
+    const U4 now = TIME_GET();
+    const UPD_CORE_t* upd = pSession->target.upd;
+    if ((pSession->phase == UPD_PHASE_PREPARE) || (pSession->phase == UPD_PHASE_FINISH))
+    {
+        return updDue(&pSession->target);
+    }
+    if ((pSession->phase != UPD_PHASE_DOWNLOAD) || !upd)
+    {
+        return now;
+    }
+    // wait for the receiver if the write window is full, poll again soon otherwise
+    return now + ((upd->PendingWrites < upd->MaxPendingWritesNum) ? 1 : IDLE_WAIT);
+}
 
-    clearBlocks(&FlashOrg);
+BOOL UpdateEnd(IN UPD_SESSION_t* pSession)
+{
+    if (!pSession)
+    {
+        return FALSE;
+    }
+    const BOOL success = pSession->success && (pSession->phase == UPD_PHASE_DONE);
+    if (!pSession->released)
+    {
+        LOG_CTX_t* pPrevLog = LOG_BIND(&pSession->log);
+        MESSAGE(MSG_WARN, "Update over %s aborted", pSession->target.port);
+        updRelease(&pSession->target);
+        LOG_BIND(pPrevLog);
+    }
+    free(pSession);
     return success;
 }
@@ -35,6 +35,34 @@
 #include "flash.h"
 
 #define DEFAULT_MAX_PACKETS 10 //!< Default maximum pending commands in receiver
+#define UPD_FLEET_MAX_PORTS 256 //!< maximum number of ports of a fleet update
+
+//! Update options, see UpdateFirmware() for a description
+typedef struct UPD_PARAMS_s
+{
+    const char*  BinaryFileName;    //!< file name of the firmware image
+    const char*  FlashDefFileName;  //!< file name of the flash definition file
+    const char*  FisFileName;       //!< file name of the FIS definition file
+    unsigned int Baudrate;          //!< baudrate of the receiver port
+    unsigned int BaudrateSafe;      //!< baudrate in safeboot
+    unsigned int BaudrateUpd;       //!< baudrate during the update
+    BOOL         DoSafeBoot;        //!< send the safeboot command
+    BOOL         DoReset;           //!< reset the receiver after the update
+    BOOL         DoAutobaud;        //!< autobaud if the baudrate fails
+    BOOL         EraseWholeFlash;   //!< erase the whole flash
+    BOOL         EraseOnly;         //!< only erase the flash
+    BOOL         TrainingSequence;  //!< send the training sequence
+    BOOL         doChipErase;       //!< chip erase instead of sector erases
+    BOOL         noFisMerging;      //!< don't merge the FIS into the image
+    BOOL         updateRam;         //!< update the u-blox 9 RAM
+    BOOL         usbAltMode;        //!< USB alternative mode
+    int          Verbose;           //!< verbose mode
+    BOOL         fisOnly;           //!< program only the FIS
+    const char*  IdCacheFileName;   //!< file caching the ROM CRC, flash and FIS per receiver, NULL or "" for none
+    const char*  StateDir;          //!< directory keeping the link profiles of the receivers, NULL or "" for none
+    unsigned int SkipCurrent;       //!< skip the update of receivers running the image: 0 never, 1 same version, 2 same version and flash CRC
+} UPD_PARAMS_t;
+
 //! Perform Firmware update process
 /*!
     Handles the Firmware update process for u-blox receivers
@@ -79,4 +107,168 @@ BOOL UpdateFirmware(IN const char*          BinaryFileName,
                     IN const int            Verbose,
                     IN const BOOL           fisOnly);
 
+//! Perform the firmware update with the options in a structure
+/*!
+    Same as UpdateFirmware(), additionally supports the options not
+    available as its arguments (identity cache).
+
+    \param  pParams             update options
+    \param  ComPort             port name, see UpdateFirmware()
+    \return success state
+*/
+BOOL UpdatePort(IN const UPD_PARAMS_t*  pParams,
+                IN const char*          ComPort);
+
+//! Update the receivers on several ports concurrently
+/*!
+    Loads and validates the image once and updates the receivers on all
+    \a pPorts with it, at most \a maxParallel at the same time, each in its
+    own thread. Port names with wildcards (e.g. "/dev/ttyUSB*") are expanded,
+    see SER_EXPAND(). The messages of every port are prefixed with the port
+    name, a summary with the result and duration per port is printed at the
+    end. If the calling thread has a log context with an output (see
+    LOG_CTX_t::pfnOutput), all messages go there.
+
+    The packet dump (\a pParams->Verbose 2) is not supported. Ports of the
+    same Aardvark adapter must be given as one port name, see UpdateFirmware().
+
+    \param  pParams             update options
+    \param  pPorts              port names
+    \param  numPorts            number of entries in \a pPorts
+    \param  maxParallel         maximum number of receivers updated at once, 0 for all
+    \return #TRUE if all receivers were updated successfully
+*/
+BOOL UpdateFleet(IN const UPD_PARAMS_t*      pParams,
+                 IN const char* const*       pPorts,
+                 IN const unsigned int       numPorts,
+                 IN const unsigned int       maxParallel);
+
+//! what UpdateInventory() reads from every receiver
+typedef enum UPD_INVENTORY_e
+{
+    UPD_INVENTORY_VERSION,        //!< baudrate and versions (MON-VER)
+    UPD_INVENTORY_ROM,            //!< also the ROM version (CRC of the ROM)
+    UPD_INVENTORY_FLASH           //!< also the JEDEC ID of the flash (flash loader only)
+} UPD_INVENTORY_t;
+
+//! Identify the receivers on several ports concurrently
+/*!
+    Probes all \a pPorts at once, each in its own thread, and prints a table
+    with one tab separated line per port to stdout: port name, baudrate,
+    hardware version, hardware generation, ROM version, ROM CRC, software
+    version, firmware version and JEDEC ID of the flash. Fields that could
+    not be read are "-", all fields but the port name if no receiver answered.
+    Port names with wildcards (e.g. "/dev/ttyUSB*") are expanded, see
+    SER_EXPAND().
+
+    The receivers are polled with MON-VER at \a pParams->Baudrate and, on
+    serial ports, at the autobaud rates, waiting #PROBE_TIMEOUT per
+    baudrate. Nothing is changed on the receivers, so the flash is only
+    detected if the flash loader is running already (safeboot).
+
+    \param  pParams             options, only the baudrate, the training sequence
+                                and the verbosity are used
+    \param  pPorts              port names
+    \param  numPorts            number of entries in \a pPorts
+    \param  depth               what to read from the receivers
+    \return #TRUE if at least one receiver was found
+*/
+BOOL UpdateInventory(IN const UPD_PARAMS_t*      pParams,
+                     IN const char* const*       pPorts,
+                     IN const unsigned int       numPorts,
+                     IN const UPD_INVENTORY_t    depth);
+
+/*! \name Step-driven update
+    Runs the update of one receiver from the caller's event loop instead of
+    blocking in UpdateFirmware(), so one thread can drive several updates:
+
+    \code
+    UPD_SESSION_t* s = UpdateBegin(&params, "/dev/ttyUSB0", onProgress, pUser);
+    while (s && UpdateStep(s))
+    {
+        // wait until UpdateFd(s) is readable or UpdateNextDeadline(s) is due
+    }
+    BOOL success = UpdateEnd(s);
+    \endcode
+
+    UpdateStep() doesn't wait for the receiver: a step sends a message or
+    takes the reply, the time the receiver needs to boot and the link to
+    settle is left to the caller through UpdateNextDeadline(), as are the
+    attempts to reopen a USB port while the receiver re-enumerates.
+@{ */
+
+//! phase of a step-driven update
+typedef enum UPD_PHASE_e
+{
+    UPD_PHASE_PREPARE,            //!< connecting, identifying the receiver, entering safeboot
+    UPD_PHASE_DOWNLOAD,           //!< erasing and writing the flash
+    UPD_PHASE_FINISH,             //!< verifying the image and resetting the receiver
+    UPD_PHASE_DONE                //!< finished, see UpdateEnd() for the result
+} UPD_PHASE_t;
+
+//! progress of a step-driven update
+typedef struct UPD_PROGRESS_s
+{
+    UPD_PHASE_t  phase;           //!< current phase
+    unsigned int done;            //!< sectors erased plus packets written so far
+    unsigned int total;           //!< sectors to erase plus packets to write, 0 outside the download
+} UPD_PROGRESS_t;
+
+//! progress callback, called from UpdateStep() whenever the progress changed
+typedef void (*UPD_PROGRESS_FN)(void* pUser, const UPD_PROGRESS_t* pProgress);
+
+typedef struct UPD_SESSION_s UPD_SESSION_t; //!< step-driven update, see UpdateBegin()
+
+//! Start a step-driven update
+/*!
+    Only allocates the session, the receiver is contacted by UpdateStep().
+    The strings of \a pParams must stay valid until UpdateEnd().
+
+    \param  pParams             update options
+    \param  ComPort             port of the receiver (one receiver per session)
+    \param  pfnProgress         progress callback, NULL for none
+    \param  pUser               argument of \a pfnProgress
+    \return session on success, NULL on failure
+*/
+UPD_SESSION_t* UpdateBegin(IN const UPD_PARAMS_t*    pParams,
+                           IN const char*            ComPort,
+                           IN UPD_PROGRESS_FN        pfnProgress,
+                           IN void*                  pUser);
+
+//! Do the next step of a step-driven update
+/*!
+    \param  pSession            session returned by UpdateBegin()
+    \return #TRUE if more steps are needed, #FALSE when done
+*/
+BOOL UpdateStep(IN UPD_SESSION_t* pSession);
+
+//! Get the descriptor of a step-driven update to wait on
+/*!
+    \param  pSession            session returned by UpdateBegin()
+    \return descriptor becoming readable when the receiver sent data, -1 if
+            the port has none (see SER_FD()) or while the receiver boots, the
+            link settles or the port is reopened, only UpdateNextDeadline()
+            applies then
+*/
+int UpdateFd(IN UPD_SESSION_t* pSession);
+
+//! Get the time of the next step of a step-driven update
+/*!
+    \param  pSession            session returned by UpdateBegin()
+    \return time (see TIME_GET()) UpdateStep() is to be called at the latest,
+            now if it is to be called right away
+*/
+unsigned int UpdateNextDeadline(IN UPD_SESSION_t* pSession);
+
+//! End a step-driven update
+/*!
+    Aborts the update if it isn't done yet and releases the session.
+
+    \param  pSession            session returned by UpdateBegin(), may be NULL
+    \return #TRUE if the update was completed successfully
+*/
+BOOL UpdateEnd(IN UPD_SESSION_t* pSession);
+
+/*! @} */
+
 #endif //__UPDATE_H
@@ -44,7 +44,7 @@
  */
 static BOOL CanSendParentCommands(UPD_CORE_t *upd)
 {
-    return ((verbose < 2) && (upd->Rx->mPortHandle->type == STDINOUT));
+    return ((LOG_VERBOSE() < 2) && (upd->Rx->mPortHandle->type == STDINOUT));
 }
 
 /*!
@@ -58,7 +58,6 @@ static BOOL updSendWrite(UPD_CORE_t *upd, U4 Packet)
 {
     assert(upd);
     U4 tgtAddr = upd->FwBase + Packet * PACKETSIZE;
-    U1* srcAddr = (U1*)upd->pData + Packet * PACKETSIZE;
     U4 WriteSize = PACKETSIZE;
 
     if (upd->ImageSize < ((Packet+1) * PACKETSIZE))
@@ -79,10 +78,11 @@ static BOOL updSendWrite(UPD_CORE_t *upd, U4 Packet)
     memcpy(pSendData+0, &tgtAddr,   4); //Address
     memcpy(pSendData+4, &WriteSize, 4); //Data size
     //copy data to send buffer
-    memcpy(pSendData+8, srcAddr, WriteSize);
+    ReadImageSegments(upd->pImage, Packet * PACKETSIZE, pSendData+8, WriteSize);
 
     BOOL success = rcvSendMessage(upd->Rx, UBX_CLASS_UPD, UBX_UPD_FLWRI, pSendData, PayloadLength);
     free(pSendData);
+    upd->MsgCount++;
 
     return success;
 }
@@ -90,7 +90,7 @@ static BOOL updSendWrite(UPD_CORE_t *upd, U4 Packet)
 /*!
  * Dump the current progress of the update. The output is done
  * if either the DUMPINTERVAL timeout expired or the force
- * parameter is TRUE. Note that verbose has to be larger than 1
+ * parameter is TRUE. Note that the verbosity has to be larger than 1
  * for this output to be generated
  *
  * \param upd               handler
@@ -100,7 +100,7 @@ static void updDumpAck(UPD_CORE_t *upd, BOOL force)
 {
     assert(upd);
 
-    if ((verbose>1) && ((TIME_GET() - upd->sLastDumpTime) > DUMPINTERVAL || force))
+    if ((LOG_VERBOSE()>1) && !upd->NoDump && ((TIME_GET() - upd->sLastDumpTime) > DUMPINTERVAL || force))
     {
         CONSOLE_RESTORE_POS();
         upd->sLastDumpTime = TIME_GET();
@@ -196,9 +196,9 @@ static BOOL updProcessMessages(UPD_CORE_t *upd)
         UBX_HEAD_t *msg = rcvReceiveMessage(upd->Rx, 0, UBX_CLASS_UPD, -1);
         if(msg == NULL)
         {
-            TIME_SLEEP(1);
             return TRUE;
         }
+        upd->MsgCount++;
         if (msg->size == UBX_UPD_ERASE_DATA1_PAYLOAD_SIZE && msg->msgId == UBX_UPD_ERASE)
         {
             U4 Address;
@@ -220,6 +220,10 @@ static BOOL updProcessMessages(UPD_CORE_t *upd)
                         upd->pWriteState[packet] = ACK_ERASE_ACK;
                     }
                     upd->PendingErases--;
+                    upd->SectorsErased++;
+                    const U4 eraseTime = TIME_GET() + upd->EraseTimeout - upd->pEraseTimeout[Sector];
+                    upd->EraseTimeSum += eraseTime;
+                    upd->EraseTimeMax = MAX(upd->EraseTimeMax, eraseTime);
                     if (CanSendParentCommands(upd))
                     {
                         MESSAGE_PLAIN("<INF>ERASE_ACK %i<\\INF>", Sector);
@@ -254,6 +258,17 @@ static BOOL updProcessMessages(UPD_CORE_t *upd)
                     if (upd->pWriteState[Packet] == ACK_WRITE_SENT ||    //as expected
                         upd->pWriteState[Packet] == ACK_WRITE_ACK)       //written twice successfully
                     {
+                        if (upd->pWriteState[Packet] == ACK_WRITE_SENT)
+                        {
+                            upd->PacketsWritten++;
+                            if (!upd->eraseInProgres)
+                            {
+                                const U4 rtt = TIME_GET() + upd->WriteTimeout - upd->pWriteTimeout[Packet];
+                                upd->AckRttSum += rtt;
+                                upd->AckRttMax = MAX(upd->AckRttMax, rtt);
+                                upd->AckRttCount++;
+                            }
+                        }
                         upd->pWriteState[Packet] = ACK_WRITE_ACK;
                         if(upd->PendingWrites)
                         {
@@ -272,7 +287,7 @@ static BOOL updProcessMessages(UPD_CORE_t *upd)
                     //write failed, don't retry -> flash seems to be corrupt
                     MESSAGE(MSG_ERR, "Defect flash (write failed) in range 0x%08X:0x%08X",
                         Address, Address+PACKETSIZE);
-                    free(msg);
+                    rcvReleaseMessage(upd->Rx, msg);
                     return FALSE;
                 }
             }
@@ -288,6 +303,7 @@ static BOOL updProcessMessages(UPD_CORE_t *upd)
                 if (((U1*)msg)[UBX_HEAD_SIZE] != 1)
                 {
                     MESSAGE(MSG_ERR, "Chip erase failed");
+                    rcvReleaseMessage(upd->Rx, msg);
                     return FALSE;
                 }
                 else
@@ -296,7 +312,7 @@ static BOOL updProcessMessages(UPD_CORE_t *upd)
                 }
             }
         }
-        free(msg);
+        rcvReleaseMessage(upd->Rx, msg);
     }
 }
 
@@ -333,6 +349,7 @@ static BOOL updEraseSector(UPD_CORE_t *upd)
                 (upd->pEraseTimeout[sector] <= now) )
             {
                 upd->PendingErases--;
+                upd->EraseRetries++;
                 if (++upd->pEraseRetryCnt[sector] > ERASE_RETRIES)
                 {
                     MESSAGE(MSG_ERR, "Erase retries for sector %d exceeded.", sector);
@@ -341,7 +358,7 @@ static BOOL updEraseSector(UPD_CORE_t *upd)
                 MESSAGE(MSG_WARN, "Sending erase retry for sector %d", sector);
             }
             // don't overflow the receiver
-            if ( (upd->PendingErases < MAX_PENDING_ERASES) &&
+            if ( (upd->PendingErases < upd->MaxPendingErases) &&
                 (upd->pEraseTimeout[sector] <= now) )
             {
                 updDumpAck(upd, FALSE);
@@ -351,7 +368,8 @@ static BOOL updEraseSector(UPD_CORE_t *upd)
                 if ( rcvSendMessage(upd->Rx, UBX_CLASS_UPD, UBX_UPD_ERASE, (CH*)&Address, 4) )
                 {
                     upd->PendingErases++;
-                    upd->pEraseTimeout[sector] = TIME_GET() + ERASE_TIMEOUT;
+                    upd->MsgCount++;
+                    upd->pEraseTimeout[sector] = TIME_GET() + upd->EraseTimeout;
                     upd->pEraseState[sector]   = ACK_ERASE_SENT;
                     if (packetNr < upd->NumberPackets)
                     {
@@ -381,7 +399,8 @@ static BOOL updEraseSector(UPD_CORE_t *upd)
 /*!
  * Send one flash write packet command to the receiver (calls updSendWrite).
  * Either a new write command or a write command for a packet with
- * expired timeout is sent.
+ * expired timeout is sent. If the port collects writes (network), all
+ * packets fitting into the receiver queue are sent in one go.
  *
  * \param upd               handler
  * \return TRUE if successful
@@ -391,10 +410,11 @@ static BOOL updWritePacket(UPD_CORE_t *upd)
     assert(upd);
 
     //check each packet
-    const U4 timeout = upd->eraseInProgres ? CHIP_ERASE_TIMEOUT : WRITE_TIMEOUT;
+    const U4 timeout = upd->eraseInProgres ? CHIP_ERASE_TIMEOUT : upd->WriteTimeout;
     I4 packet = upd->writtenUntil;
     BOOL foundLastWritten = FALSE;
     BOOL sent = FALSE;
+    const BOOL burst = (SER_CAPS(upd->Rx->mPortHandle) & SER_CAP_WRITE_BUFFERED) != 0;
     // send the not yet sent write packets
     // don't overflow the receiver
     while (packet < upd->NumberPackets && !sent && upd->PendingWrites < upd->MaxPendingWritesNum)
@@ -416,7 +436,7 @@ static BOOL updWritePacket(UPD_CORE_t *upd)
                 {
                 upd->PendingWrites++;
                     upd->pWriteTimeout[packet] = TIME_GET() + timeout;
-                    sent = TRUE; //do not send further packets in this loop
+                    sent = !burst; //do not send further packets in this loop
                     if (CanSendParentCommands(upd))
                     {
                         MESSAGE_PLAIN("<INF>WRITE %i %i<\\INF>", packet, upd->NumberPackets);
@@ -445,6 +465,7 @@ static BOOL updWritePacket(UPD_CORE_t *upd)
                 --upd->PendingWrites;
             }
             upd->pWriteRetryCnt[packet]++;
+            upd->WriteRetries++;
             if (upd->pWriteRetryCnt[packet] > WRITE_RETRIES)
             {
                 MESSAGE(MSG_ERR, "Write retries for packet %d exceeded.", packet);
@@ -458,7 +479,7 @@ static BOOL updWritePacket(UPD_CORE_t *upd)
                 {
                     upd->PendingWrites++;
                     upd->pWriteTimeout[packet] = TIME_GET() + timeout;
-                    sent = TRUE; //do not send further packets in this loop
+                    sent = !burst; //do not send further packets in this loop
                     if (CanSendParentCommands(upd))
                     {
                         MESSAGE_PLAIN("<INF>WRITE_AGAIN %i %i<\\INF>", packet, upd->NumberPackets);
@@ -474,6 +495,10 @@ static BOOL updWritePacket(UPD_CORE_t *upd)
         packet++;
     }
 
+    if (burst)
+    {
+        SER_FLUSH(upd->Rx->mPortHandle);
+    }
     return TRUE;
 }
 
@@ -506,6 +531,9 @@ UPD_CORE_t* updInit( RCV_DATA_t *rx
     upd->FlashSize = flashSize;
 
     upd->MaxPendingWritesNum = MaxPendingWritesNum;
+    upd->MaxPendingErases = MAX_PENDING_ERASES;
+    upd->WriteTimeout = WRITE_TIMEOUT;
+    upd->EraseTimeout = ERASE_TIMEOUT;
     upd->eraseInProgres = eraseInProgres;
     upd->PendingErases  = 0;
     upd->PendingWrites  = 0;
@@ -542,7 +570,7 @@ UPD_CORE_t* updInit( RCV_DATA_t *rx
 
     MESSAGE(MSG_LEV1, "Receiver info collected, downloading to flash...");
 
-    if(verbose > 1)
+    if(LOG_VERBOSE() > 1)
     {
         I4 numPacketsOverall = (upd->NumberSectors == 0)?upd->NumberPackets:GetPacketNrForSector(upd->NumberSectors, upd->FlashOrg, PACKETSIZE);
 
@@ -575,72 +603,83 @@ void updDeinit(UPD_CORE_t *upd)
     free(upd);
 }
 
-BOOL updUpdate(UPD_CORE_t *upd, FWHEADER_t* data, size_t size, U4 fwBase)
+void updStart(UPD_CORE_t *upd, const IMG_SEGMENTS_t* image, U4 fwBase)
 {
-    assert(upd);
+    assert(upd && image);
 
-    upd->pData = data;
-    upd->ImageSize = size;
+    upd->pImage = image;
+    upd->ImageSize = GetImageSegmentsSize(image);
     upd->FwBase = fwBase;
 
-    BOOL writeComplete = (upd->NumberPackets == 0);
-    BOOL eraseComplete = (upd->NumberSectors == 0);
+    upd->WriteComplete = (upd->NumberPackets == 0);
+    upd->EraseComplete = (upd->NumberSectors == 0);
     updDumpAck(upd, TRUE);
-    // loop around until everything is written and erased
-    while( !writeComplete || !eraseComplete )
+}
+
+BOOL updStep(UPD_CORE_t *upd, BOOL *pDone)
+{
+    assert(upd && pDone);
+
+    *pDone = FALSE;
+    if( !upd->EraseComplete )
     {
-        if( !eraseComplete )
-        {
-            // try to send an erase command
-            if( !updEraseSector(upd) )
-                return FALSE;
+        // try to send an erase command
+        if( !updEraseSector(upd) )
+            return FALSE;
 
-            updDumpAck(upd, FALSE);
+        updDumpAck(upd, FALSE);
 
-            // receive messages
-            if( !updProcessMessages(upd) )
-                return FALSE;
+        // receive messages
+        if( !updProcessMessages(upd) )
+            return FALSE;
 
-            // check if everything is erased completely
-            eraseComplete = TRUE;
-            I4 sector;
-            for(sector = 0; sector < upd->NumberSectors; sector++)
+        // check if everything is erased completely
+        upd->EraseComplete = TRUE;
+        I4 sector;
+        for(sector = 0; sector < upd->NumberSectors; sector++)
+        {
+            if (upd->pEraseState[sector] != ACK_ERASE_ACK)
             {
-                if (upd->pEraseState[sector] != ACK_ERASE_ACK)
-                {
-                    eraseComplete = FALSE;
-                    break;
-                }
+                upd->EraseComplete = FALSE;
+                break;
             }
         }
-        if( !writeComplete )
+    }
+    if( !upd->WriteComplete )
+    {
+        // try to send write command
+        if (!updWritePacket(upd))
         {
-            // try to send write command
-            if (!updWritePacket(upd))
-            {
-                return FALSE;
-            }
-            updDumpAck(upd, FALSE);
+            return FALSE;
+        }
+        updDumpAck(upd, FALSE);
 
-            // receive messages
-            if( !updProcessMessages(upd) )
-            {
-                return FALSE;
-            }
+        // receive messages
+        if( !updProcessMessages(upd) )
+        {
+            return FALSE;
+        }
 
-            // check if everything was written completely
-            writeComplete = TRUE;
-            I4 pack;
-            for(pack = 0; pack < upd->NumberPackets; pack++)
+        // check if everything was written completely
+        upd->WriteComplete = TRUE;
+        I4 pack;
+        for(pack = 0; pack < upd->NumberPackets; pack++)
+        {
+            if (upd->pWriteState[pack] != ACK_WRITE_ACK)
             {
-                if (upd->pWriteState[pack] != ACK_WRITE_ACK)
-                {
-                    writeComplete = FALSE;
-                    break;
-                }
+                upd->WriteComplete = FALSE;
+                break;
             }
         }
     }
+    *pDone = upd->WriteComplete && upd->EraseComplete;
+    return TRUE;
+}
+
+BOOL updComplete(UPD_CORE_t *upd)
+{
+    assert(upd);
+
     updDumpAck(upd, TRUE);
     if (upd->eraseInProgres)
     {
@@ -659,9 +698,96 @@ BOOL updUpdate(UPD_CORE_t *upd, FWHEADER_t* data, size_t size, U4 fwBase)
             else
             {
                 MESSAGE(MSG_ERR, "Chip erase failed");
+                rcvReleaseMessage(upd->Rx, cErase);
                 return FALSE;
             }
         }
+        rcvReleaseMessage(upd->Rx, cErase);
+    }
+    return TRUE;
+}
+
+BOOL updUpdate(UPD_CORE_t *upd, const IMG_SEGMENTS_t* image, U4 fwBase)
+{
+    assert(upd);
+
+    updStart(upd, image, fwBase);
+    // loop around until everything is written and erased
+    BOOL done = FALSE;
+    for(;;)
+    {
+        if (!updStep(upd, &done))
+            return FALSE;
+        if (done)
+            break;
+        // block until the receiver answers if the write window is full
+        SER_WAIT(upd->Rx->mPortHandle,
+                 (upd->PendingWrites < upd->MaxPendingWritesNum) ? 1 : IDLE_WAIT);
+    }
+    return updComplete(upd);
+}
+
+BOOL updUpdateMulti(UPD_CORE_t *upd[], BOOL success[], U4 count)
+{
+    assert(upd && success);
+
+    BOOL *pDone = (BOOL*) calloc(count, sizeof(BOOL));
+    if (!pDone)
+    {
+        MESSAGE(MSG_ERR, "Alloc failed");
+        return FALSE;
+    }
+    U4 active = count;
+    U4 ix;
+    for (ix = 0; ix < count; ix++)
+    {
+        assert(upd[ix]);
+        // the progress dumps of the receivers would overwrite each other
+        upd[ix]->NoDump = TRUE;
+        success[ix] = TRUE;
+    }
+    while (active)
+    {
+        // give every receiver a turn, the ones busy erasing cost a length
+        // query at most and leave the bus to the others
+        U4 msgCount = 0;
+        SER_HANDLE_pt pWait = NULL;
+        for (ix = 0; ix < count; ix++)
+        {
+            if (!success[ix] || pDone[ix])
+                continue;
+            U4 before = upd[ix]->MsgCount;
+            if (!updStep(upd[ix], &pDone[ix]))
+            {
+                MESSAGE(MSG_ERR, "Update over %s failed", upd[ix]->Rx->mPortHandle->pName);
+                success[ix] = FALSE;
+                active--;
+                continue;
+            }
+            msgCount += upd[ix]->MsgCount - before;
+            if (pDone[ix])
+            {
+                success[ix] = updComplete(upd[ix]);
+                MESSAGE(MSG_LEV1, "Download over %s %s", upd[ix]->Rx->mPortHandle->pName,
+                        success[ix] ? "complete" : "failed");
+                active--;
+            }
+            else if (!pWait)
+            {
+                pWait = upd[ix]->Rx->mPortHandle;
+            }
+        }
+        // nothing sent nor received by any receiver, don't loop at 100% CPU
+        if (!msgCount && pWait)
+        {
+            SER_WAIT(pWait, 1);
+        }
+    }
+    free(pDone);
+    for (ix = 0; ix < count; ix++)
+    {
+        if (!success[ix])
+            return FALSE;
     }
     return TRUE;
 }
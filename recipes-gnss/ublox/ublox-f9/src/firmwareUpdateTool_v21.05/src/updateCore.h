@@ -45,6 +45,7 @@
 #define RAM_BASE          0x00800000   //!< RAM base address
 #define DUMPINTERVAL            1000   //!< timeout between two dumps when verbose > 1
 #define CONSOLE_WIDTH             80   //!< Width of the console
+#define IDLE_WAIT                 10   //!< longest wait for acknowledges while no further packet may be sent
 
 #define MAX_PENDING_ERASES         2   //!< The maximum number of erase commands to be present in the receiver queue
 
@@ -72,7 +73,7 @@ typedef struct
     BLOCK_ARR_t *FlashOrg;      //!< flash organization
     U4 FlashSize;               //!< size of the flash
     U4 FwBase;                  //!< start address of the firmware on the flash
-    FWHEADER_t* pData;          //!< pointer to the data to write
+    const IMG_SEGMENTS_t* pImage; //!< data to write
     U4 ImageSize;               //!< size of the image
 
     U4 *pEraseTimeout;          //!< array to store timeouts for the to be erased sectors
@@ -90,6 +91,27 @@ typedef struct
 
     U4 MaxPendingWritesNum;     //!< max number of which can be queued in the receiver writes pending
     BOOL eraseInProgres;        //!< Erase in progress
+    BOOL EraseComplete;         //!< all sectors erased
+    BOOL WriteComplete;         //!< all packets written
+
+    U4 MsgCount;                //!< number of messages sent and received, tells if a step did anything
+    U4 SectorsErased;           //!< number of sectors erased so far
+    U4 PacketsWritten;          //!< number of packets written so far
+    BOOL NoDump;                //!< don't dump the progress, the console is shared with other updates
+
+    // link parameters, defaults set by updInit(), may be changed before updStart()
+    U4 MaxPendingErases;        //!< number of erases queued in the receiver (erase-ahead depth)
+    U4 WriteTimeout;            //!< time to wait for a write acknowledge before sending it again
+    U4 EraseTimeout;            //!< time to wait for an erase acknowledge before sending it again
+
+    // link measurements
+    U4 AckRttSum;               //!< sum of the write acknowledge round trip times
+    U4 AckRttMax;               //!< longest write acknowledge round trip time
+    U4 AckRttCount;             //!< number of round trip times in AckRttSum
+    U4 EraseTimeSum;            //!< sum of the sector erase times (from sending the erase)
+    U4 EraseTimeMax;            //!< longest sector erase time
+    U4 WriteRetries;            //!< number of writes sent again after a timeout
+    U4 EraseRetries;            //!< number of erases sent again after a timeout
 } UPD_CORE_t;
 
 /*!
@@ -124,10 +146,52 @@ void updDeinit(UPD_CORE_t *upd);
  * Do the update.
  *
  * \param upd                   control structure
- * \param data                  pointer to the data to write
- * \param size                  size of the data
+ * \param image                 data to write, has to stay valid during the update
  * \param fwBase                start address of the firmware on the flash
  * \return TRUE if successful
  */
-BOOL updUpdate(UPD_CORE_t *upd, FWHEADER_t* data, size_t size, U4 fwBase);
+BOOL updUpdate(UPD_CORE_t *upd, const IMG_SEGMENTS_t* image, U4 fwBase);
+
+/*!
+ * Prepare the update to be done step by step with updStep().
+ *
+ * \param upd                   control structure
+ * \param image                 data to write, has to stay valid during the update
+ * \param fwBase                start address of the firmware on the flash
+ */
+void updStart(UPD_CORE_t *upd, const IMG_SEGMENTS_t* image, U4 fwBase);
+
+/*!
+ * Do one step of the update: send the erase and write commands the
+ * receiver can take and process its replies. Doesn't wait for the
+ * receiver.
+ *
+ * \param upd                   control structure
+ * \param pDone                 set to TRUE when everything is erased and written
+ * \return TRUE if successful
+ */
+BOOL updStep(UPD_CORE_t *upd, BOOL *pDone);
+
+/*!
+ * Complete the update after updStep() reported it done: wait for the
+ * chip erase to finish if one was started before the update.
+ *
+ * \param upd                   control structure
+ * \return TRUE if successful
+ */
+BOOL updComplete(UPD_CORE_t *upd);
+
+/*!
+ * Do the update of several receivers at once.
+ *
+ * Meant for receivers sharing one bus: the receivers get a step each in
+ * turn, so while one is busy erasing a sector the transactions of the
+ * others use the bus. Each update has to be prepared with updStart().
+ *
+ * \param upd                   control structures
+ * \param success               receives the success state of each update
+ * \param count                 number of updates
+ * \return TRUE if all updates were successful
+ */
+BOOL updUpdateMulti(UPD_CORE_t *upd[], BOOL success[], U4 count);
 
@@ -0,0 +1,206 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+/*!
+  \file
+  \brief  Throughput of the UBX parser on mixed NMEA and UBX input
+
+  Feeds a stream of NMEA sentences, acknowledges, UPD-FLWRI replies, MON-VER
+  and large UBX messages to UbxParse() in reads of different sizes, the way
+  the receiver's buffer does, and prints the bytes parsed per second. The
+  same is done with UbxSearchMsg(), which starts every search over, for
+  comparison. Fails if a parser doesn't find every UBX message.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "ubxmsg.h"
+#include "checksum.h"
+
+#define STREAM_SIZE   (1024*1024)   //!< size of the stream parsed
+#define BUFFER_SIZE   (4*UBX_MAX_FRAME_SIZE) //!< size of the receive buffer
+#define MIN_DURATION  1000          //!< minimum duration of a measurement [ms]
+
+//! stream parsed
+typedef struct STREAM_s
+{
+    U1* p;                          //!< data
+    U4  size;                       //!< bytes used
+    U4  messages;                   //!< UBX messages in the stream
+} STREAM_t;
+
+//! append data to the stream
+static BOOL streamPut(STREAM_t* pStream, const void* p, U4 size)
+{
+    if (pStream->size + size > STREAM_SIZE)
+    {
+        return FALSE;
+    }
+    memcpy(pStream->p + pStream->size, p, size);
+    pStream->size += size;
+    return TRUE;
+}
+
+//! append a UBX message to the stream
+static BOOL streamUbx(STREAM_t* pStream, U1 classId, U1 msgId, const U1* pPayload, U4 size)
+{
+    U1 head[6] = { UBX_SYNC_CHAR_1, UBX_SYNC_CHAR_2, classId, msgId, (U1)size, (U1)(size >> 8) };
+    U1 chk[2] = { 0, 0 };
+    UpdateUbxChecksumU1(&chk[0], &chk[1], head + 2, sizeof(head) - 2);
+    UpdateUbxChecksumU1(&chk[0], &chk[1], pPayload, size);
+    if (pStream->size + sizeof(head) + size + sizeof(chk) > STREAM_SIZE)
+    {
+        return FALSE;
+    }
+    streamPut(pStream, head, sizeof(head));
+    streamPut(pStream, pPayload, size);
+    streamPut(pStream, chk, sizeof(chk));
+    pStream->messages++;
+    return TRUE;
+}
+
+//! fill the stream with the output of a receiver during an update
+static void streamFill(STREAM_t* pStream)
+{
+    static const CH* nmea[] =
+    {
+        "$GNGGA,092725.00,4717.11399,N,00833.91590,E,1,08,1.01,499.6,M,48.0,M,,*5B\r\n",
+        "$GNRMC,092725.00,A,4717.11437,N,00833.91522,E,0.004,77.52,091202,,,A*57\r\n",
+        "$GPGSV,3,1,11,03,03,111,00,04,15,270,00,06,01,010,00,13,06,292,00*74\r\n",
+    };
+    U1 payload[1024];
+    U4 i;
+    for (i = 0; i < sizeof(payload); i++)
+    {
+        payload[i] = (U1)(i * 7);
+    }
+    BOOL room = TRUE;
+    for (i = 0; room; i++)
+    {
+        room = streamPut(pStream, nmea[i % 3], (U4)strlen(nmea[i % 3]));
+        // ACK-ACK, UPD-FLWRI reply, every 8th time MON-VER and UPD-FIS
+        room = room && streamUbx(pStream, UBX_CLASS_ACK, UBX_ACK_ACK, payload, 2);
+        room = room && streamUbx(pStream, UBX_CLASS_UPD, UBX_UPD_FLWRI, payload, UBX_UPD_FLWRI_DATA1_PAYLOAD_SIZE);
+        if ((i % 8) == 0)
+        {
+            room = room && streamUbx(pStream, UBX_CLASS_MON, UBX_MON_VER, payload, 160);
+            room = room && streamUbx(pStream, UBX_CLASS_UPD, UBX_UPD_FIS, payload, sizeof(payload));
+        }
+    }
+}
+
+//! parse the stream once in reads of \a chunk bytes, return the number of messages found
+static U4 parseStream(const STREAM_t* pStream, U1* pBuf, U4 chunk, BOOL incremental)
+{
+    UBX_PARSER_t parser;
+    U4 begin = 0;
+    U4 end = 0;
+    U4 pos = 0;
+    U4 found = 0;
+    UbxParserInit(&parser);
+    while (pos < pStream->size)
+    {
+        // receive the next chunk, drop what was consumed if the buffer is full
+        const U4 size = MIN(chunk, pStream->size - pos);
+        if (end + size > BUFFER_SIZE)
+        {
+            memmove(pBuf, pBuf + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        memcpy(pBuf + end, pStream->p + pos, size);
+        end += size;
+        pos += size;
+
+        U1* pMsg;
+        for (;;)
+        {
+            const BOOL ok = incremental ? UbxParse(&parser, pBuf + begin, end - begin, &pMsg)
+                                        : UbxSearchMsg(pBuf + begin, end - begin, &pMsg);
+            begin = (U4)(pMsg - pBuf);
+            if (!ok)
+            {
+                break;
+            }
+            UBX_HEAD_t head;
+            memcpy(&head, pMsg, sizeof(head));
+            begin += UBX_FRAME_SIZE + head.size;
+            found++;
+        }
+    }
+    return found;
+}
+
+//! measure the throughput of a parser, return FALSE if it missed messages
+static BOOL measure(const STREAM_t* pStream, U1* pBuf, U4 chunk, BOOL incremental)
+{
+    U4 passes = 0;
+    const U4 start = TIME_GET();
+    U4 duration;
+    do
+    {
+        if (parseStream(pStream, pBuf, chunk, incremental) != pStream->messages)
+        {
+            printf("FAIL: %s missed messages with reads of %u bytes\n",
+                   incremental ? "UbxParse" : "UbxSearchMsg", chunk);
+            return FALSE;
+        }
+        passes++;
+        duration = TIME_GET() - start;
+    } while (duration < MIN_DURATION);
+    const double rate = (double)pStream->size * passes / duration / 1000.0;
+    printf("%-12s reads of %5u bytes: %8.1f MB/s\n",
+           incremental ? "UbxParse" : "UbxSearchMsg", chunk, rate);
+    return TRUE;
+}
+
+int main(void)
+{
+    static const U4 chunks[] = { 32, 256, 4096 };
+    STREAM_t stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.p = (U1*)malloc(STREAM_SIZE);
+    U1* pBuf = (U1*)malloc(BUFFER_SIZE);
+    if (!stream.p || !pBuf)
+    {
+        printf("FAIL: out of memory\n");
+        return 1;
+    }
+    streamFill(&stream);
+    printf("Parsing %u bytes with %u UBX messages\n", stream.size, stream.messages);
+
+    BOOL ok = TRUE;
+    U4 i;
+    for (i = 0; ok && (i < sizeof(chunks)/sizeof(chunks[0])); i++)
+    {
+        ok = measure(&stream, pBuf, chunks[i], TRUE) &&
+             measure(&stream, pBuf, chunks[i], FALSE);
+    }
+    free(pBuf);
+    free(stream.p);
+    return ok ? 0 : 1;
+}
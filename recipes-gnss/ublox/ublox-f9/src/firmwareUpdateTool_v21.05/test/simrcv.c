@@ -0,0 +1,776 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+/*!
+  \file
+  \brief  Simulated u-blox 9 receiver for the tests
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "ubxmsg.h"
+#include "checksum.h"
+#include "mergefis.h"
+#include "update.h"
+#include "simrcv.h"
+
+#define SIM_MAX_PORTS       64      //!< maximum number of receivers reachable over the "sim:" transport
+#define SIM_NAME_SIZE       32      //!< maximum length of a port name including the terminating zero
+#define SIM_MAX_FRAME_SIZE  (2*8192) //!< largest frame the simulated receivers accept
+#define SIM_FLASH_MANID     ((SIM_JEDEC >> 16) & 0xFFFF) //!< manufacturer ID of the simulated flash
+#define SIM_FLASH_DEVID     (SIM_JEDEC & 0xFFFF)         //!< device ID of the simulated flash
+#define SIM_I2C_REG_LENGTH  0xFD    //!< I2C register of the number of bytes to send (high byte)
+#define SIM_I2C_REG_STREAM  0xFF    //!< I2C register of the data stream
+
+//! simulated receiver
+struct SIM_RCV_s
+{
+    SIM_CONFIG_t cfg;                       //!< options
+    BOOL         loader;                    //!< flash loader running (safeboot or loader task)
+    BOOL         nmea;                      //!< NMEA output enabled
+    U4           reboots;                   //!< reboots commanded
+    U4           nmeaCount;                 //!< NMEA sentences sent
+    U1*          pFlash;                    //!< flash, SIM_FLASH_SIZE bytes
+    U1           in[SIM_MAX_FRAME_SIZE];    //!< frame being received
+    U4           inSize;                    //!< bytes of the frame received so far
+    U1*          pOut;                      //!< data to send
+    U4           outRd;                     //!< index of the first byte to send
+    U4           outWr;                     //!< index behind the last byte to send
+    U4           outCap;                    //!< size of pOut
+    U1           i2cReg;                    //!< I2C register pointer
+    U2           i2cLength;                 //!< I2C length registers, latched when the high byte is read
+};
+
+//! receiver reachable over the "sim:" transport
+typedef struct SIM_PORT_s
+{
+    CH           name[SIM_NAME_SIZE];       //!< port name without "sim:"
+    SIM_RCV_t*   s;                         //!< receiver
+} SIM_PORT_t;
+
+//! receivers reachable over the "sim:" transport, not locked, see simAdd()
+static SIM_PORT_t s_simPorts[SIM_MAX_PORTS];
+static U4 s_simPortCount = 0;               //!< number of entries in s_simPorts
+
+SIM_RCV_t* simCreate(IN const SIM_CONFIG_t* pCfg)
+{
+    SIM_RCV_t* s = (SIM_RCV_t*)calloc(1, sizeof(SIM_RCV_t));
+    if (!s)
+    {
+        return NULL;
+    }
+    s->pFlash = (U1*)malloc(SIM_FLASH_SIZE);
+    if (!s->pFlash)
+    {
+        free(s);
+        return NULL;
+    }
+    // some old firmware, not erased
+    memset(s->pFlash, 0x00, SIM_FLASH_SIZE);
+    s->cfg = *pCfg;
+    s->nmea = pCfg->nmea;
+    s->i2cReg = SIM_I2C_REG_STREAM;
+    return s;
+}
+
+void simDelete(IN SIM_RCV_t* s)
+{
+    if (s)
+    {
+        free(s->pFlash);
+        free(s->pOut);
+        free(s);
+    }
+}
+
+//! queue data to send
+/*!
+    \param s       receiver
+    \param p       data
+    \param size    size of the data
+*/
+static void simQueue(SIM_RCV_t* s, const void* p, U4 size)
+{
+    if (s->outWr + size > s->outCap)
+    {
+        // drop what was read, grow if that isn't enough
+        memmove(s->pOut, s->pOut + s->outRd, s->outWr - s->outRd);
+        s->outWr -= s->outRd;
+        s->outRd = 0;
+        if (s->outWr + size > s->outCap)
+        {
+            const U4 cap = MAX(2 * s->outCap, s->outWr + size);
+            U1* pOut = (U1*)realloc(s->pOut, cap);
+            if (!pOut)
+            {
+                return;
+            }
+            s->pOut = pOut;
+            s->outCap = cap;
+        }
+    }
+    memcpy(s->pOut + s->outWr, p, size);
+    s->outWr += size;
+}
+
+//! queue a NMEA sentence if the NMEA output is enabled
+/*!
+    \param s       receiver
+*/
+static void simNmea(SIM_RCV_t* s)
+{
+    CH line[100];
+    CH body[80];
+    if (!s->nmea)
+    {
+        return;
+    }
+    sprintf(body, "GNGGA,%06u.00,4717.11399,N,00833.91590,E,1,08,1.01,499.6,M,48.0,M,,",
+            (s->nmeaCount++ % 86400));
+    U1 chk = 0;
+    const CH* pCh;
+    for (pCh = body; *pCh; pCh++)
+    {
+        chk ^= (U1)*pCh;
+    }
+    sprintf(line, "$%s*%02X\r\n", body, chk);
+    simQueue(s, line, (U4)strlen(line));
+}
+
+//! queue a UBX message
+/*!
+    \param s       receiver
+    \param classId class of the message
+    \param msgId   id of the message
+    \param p       payload
+    \param size    size of the payload
+*/
+static void simReply(SIM_RCV_t* s, U1 classId, U1 msgId, const void* p, U4 size)
+{
+    U1 frame[SIM_MAX_FRAME_SIZE];
+    if (UBX_FRAME_SIZE + size > sizeof(frame))
+    {
+        return;
+    }
+    frame[0] = UBX_SYNC_CHAR_1;
+    frame[1] = UBX_SYNC_CHAR_2;
+    frame[2] = classId;
+    frame[3] = msgId;
+    frame[4] = (U1)size;
+    frame[5] = (U1)(size >> 8);
+    memcpy(frame + UBX_HEAD_SIZE, p, size);
+    const U2 chk = GetUbxChecksumU1(frame + 2, UBX_HEAD_SIZE - 2 + size);
+    frame[UBX_HEAD_SIZE + size]     = (U1)chk;
+    frame[UBX_HEAD_SIZE + size + 1] = (U1)(chk >> 8);
+    // the replies queue behind the periodic output
+    simNmea(s);
+    simQueue(s, frame, UBX_FRAME_SIZE + size);
+}
+
+//! queue an acknowledge
+/*!
+    \param s       receiver
+    \param classId class of the message acknowledged
+    \param msgId   id of the message acknowledged
+    \param ack     #TRUE for ACK-ACK, #FALSE for ACK-NAK
+*/
+static void simAck(SIM_RCV_t* s, U1 classId, U1 msgId, BOOL ack)
+{
+    const U1 payload[2] = { classId, msgId };
+    simReply(s, UBX_CLASS_ACK, ack ? UBX_ACK_ACK : UBX_ACK_NAK, payload, sizeof(payload));
+}
+
+//! reboot the receiver into the firmware or the safeboot loader
+/*!
+    \param s        receiver
+    \param safeboot reboot into safeboot
+*/
+static void simReboot(SIM_RCV_t* s, BOOL safeboot)
+{
+    s->reboots++;
+    s->loader = safeboot;
+    s->nmea = s->cfg.nmea && !safeboot;
+    // the output queued is lost
+    s->outRd = s->outWr = 0;
+}
+
+//! answer a message of class CFG
+/*!
+    \param s       receiver
+    \param msgId   id of the message
+    \param p       payload
+    \param size    size of the payload
+*/
+static void simCfg(SIM_RCV_t* s, U1 msgId, const U1* p, U4 size)
+{
+    switch (msgId)
+    {
+    case UBX_CFG_PORT:
+        if (size == 0)
+        {
+            UBX_CFG_PRT_t prt;
+            memset(&prt, 0, sizeof(prt));
+            prt.portId = s->cfg.portId;
+            prt.mode = (1<<7) | (1<<6) | (1<<11);
+            prt.baudrate = 9600;
+            prt.inProtoMask = 0x7;
+            prt.outProtoMask = s->nmea ? 0x3 : 0x1;
+            simReply(s, UBX_CLASS_CFG, UBX_CFG_PORT, &prt, sizeof(prt));
+        }
+        else if (size >= sizeof(UBX_CFG_PRT_t))
+        {
+            UBX_CFG_PRT_t prt;
+            memcpy(&prt, p, sizeof(prt));
+            if (prt.portId == s->cfg.portId)
+            {
+                s->nmea = s->nmea && (prt.outProtoMask & 0x2);
+            }
+            simAck(s, UBX_CLASS_CFG, UBX_CFG_PORT, TRUE);
+        }
+        break;
+
+    case UBX_CFG_VALSET:
+        // only used to disable the NMEA output
+        s->nmea = FALSE;
+        simAck(s, UBX_CLASS_CFG, UBX_CFG_VALSET, TRUE);
+        break;
+
+    case UBX_CFG_RST:
+        // resetMode 8 stops the GNSS only, not acknowledged
+        if ((size >= 4) && (p[2] != 8))
+        {
+            simReboot(s, FALSE);
+        }
+        else
+        {
+            s->nmea = FALSE;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+//! answer a message of class UPD
+/*!
+    \param s       receiver
+    \param msgId   id of the message
+    \param p       payload
+    \param size    size of the payload
+*/
+static void simUpd(SIM_RCV_t* s, U1 msgId, const U1* p, U4 size)
+{
+    U1 reply[16];
+    U4 address;
+    switch (msgId)
+    {
+    case UBX_UPD_SAFE:
+        if (size == 0)
+        {
+            // reboot into safeboot, there is no reply
+            simReboot(s, TRUE);
+        }
+        else
+        {
+            // start the loader task
+            s->loader = TRUE;
+            simAck(s, UBX_CLASS_UPD, UBX_UPD_SAFE, TRUE);
+        }
+        break;
+
+    case UBX_UPD_ROM:
+        memset(reply, 0, 12);
+        reply[0] = 0x01;
+        address = SIM_ROM_CRC;
+        memcpy(&reply[8], &address, sizeof(address));
+        simReply(s, UBX_CLASS_UPD, UBX_UPD_ROM, reply, 12);
+        break;
+
+    case UBX_UPD_IDEN:
+        if (s->loader)
+        {
+            reply[0] = 0x23;
+            simReply(s, UBX_CLASS_UPD, UBX_UPD_IDEN, reply, 1);
+        }
+        break;
+
+    case UBX_UPD_FLDET:
+        if (s->loader && (size == 4))
+        {
+            const U2 manId = SIM_FLASH_MANID;
+            const U2 devId = SIM_FLASH_DEVID;
+            memcpy(&reply[0], p, 4);
+            memcpy(&reply[4], &manId, sizeof(manId));
+            memcpy(&reply[6], &devId, sizeof(devId));
+            simReply(s, UBX_CLASS_UPD, UBX_UPD_FLDET, reply, 8);
+        }
+        break;
+
+    case UBX_UPD_FIS:
+        if (s->loader)
+        {
+            simAck(s, UBX_CLASS_UPD, UBX_UPD_FIS, size == sizeof(DRV_SPI_MEM_FIS_t));
+        }
+        break;
+
+    case UBX_UPD_ERASE:
+        if (s->loader && (size == 4))
+        {
+            memcpy(&address, p, sizeof(address));
+            reply[4] = (address < SIM_FLASH_SIZE);
+            if (reply[4])
+            {
+                memset(s->pFlash + (address & ~(SIM_SECTOR_SIZE - 1)), 0xFF, SIM_SECTOR_SIZE);
+            }
+            memcpy(&reply[0], &address, sizeof(address));
+            simReply(s, UBX_CLASS_UPD, UBX_UPD_ERASE, reply, UBX_UPD_ERASE_DATA1_PAYLOAD_SIZE);
+        }
+        break;
+
+    case UBX_UPD_CERASE:
+        if (s->loader)
+        {
+            memset(s->pFlash, 0xFF, SIM_FLASH_SIZE);
+            simAck(s, UBX_CLASS_UPD, UBX_UPD_CERASE, TRUE);
+            reply[0] = 1;
+            simReply(s, UBX_CLASS_UPD, UBX_UPD_CERASE, reply, UBX_UPD_CERASE_DATA1_PAYLOAD_SIZE);
+        }
+        break;
+
+    case UBX_UPD_FLWRI:
+        if (s->loader && (size > 8))
+        {
+            U4 writeSize;
+            memcpy(&address, p, sizeof(address));
+            memcpy(&writeSize, p + 4, sizeof(writeSize));
+            reply[4] = (writeSize == size - 8) && (address + writeSize <= SIM_FLASH_SIZE);
+            if (reply[4])
+            {
+                // flash bits can only be cleared, writing to a sector not erased fails the verification
+                U4 i;
+                for (i = 0; i < writeSize; i++)
+                {
+                    s->pFlash[address + i] &= p[8 + i];
+                }
+            }
+            memcpy(&reply[0], &address, sizeof(address));
+            simReply(s, UBX_CLASS_UPD, UBX_UPD_FLWRI, reply, UBX_UPD_FLWRI_DATA1_PAYLOAD_SIZE);
+        }
+        break;
+
+    case UBX_UPD_CRC:
+        if (size == 18)
+        {
+            // version, region, address, size, checksum a and b
+            U4 param[4];
+            U4 a = 0;
+            U4 b = 0;
+            memcpy(param, p + 2, sizeof(param));
+            reply[4] = 0;
+            if ((param[0] + param[1] <= SIM_FLASH_SIZE) && !(param[0] & 3))
+            {
+                GetUbxChecksumU4(&a, &b, (const U4*)(s->pFlash + param[0]), param[1]);
+                reply[4] = (a == param[2]) && (b == param[3]);
+            }
+            memcpy(&reply[0], &param[0], sizeof(param[0]));
+            simReply(s, UBX_CLASS_UPD, UBX_UPD_CRC, reply, 5);
+        }
+        break;
+
+    case UBX_UPD_RBOOT:
+        simReboot(s, FALSE);
+        break;
+
+    default:
+        break;
+    }
+}
+
+//! answer a complete message
+/*!
+    \param s       receiver
+    \param pMsg    message, checksum verified
+*/
+static void simHandle(SIM_RCV_t* s, const U1* pMsg)
+{
+    const U1 classId = pMsg[2];
+    const U1 msgId = pMsg[3];
+    const U4 size = pMsg[4] | ((U4)pMsg[5] << 8);
+    const U1* p = pMsg + UBX_HEAD_SIZE;
+    if ((classId == UBX_CLASS_MON) && (msgId == UBX_MON_VER) && (size == 0))
+    {
+        U1 ver[40 + 30];
+        memset(ver, 0, sizeof(ver));
+        strcpy((CH*)ver, s->loader ? "ROM BOOT 1.02 (sim)" : "EXT CORE 1.00 (sim)");
+        strcpy((CH*)ver + 30, "00190000");
+        strcpy((CH*)ver + 40, "FWVER=SIM 1.00");
+        simReply(s, UBX_CLASS_MON, UBX_MON_VER, ver, sizeof(ver));
+    }
+    else if (classId == UBX_CLASS_CFG)
+    {
+        simCfg(s, msgId, p, size);
+    }
+    else if (classId == UBX_CLASS_UPD)
+    {
+        simUpd(s, msgId, p, size);
+    }
+}
+
+void simWrite(INOUT SIM_RCV_t* s, IN const U1* p, IN U4 size)
+{
+    U4 i;
+    for (i = 0; i < size; i++)
+    {
+        const U1 c = p[i];
+        if ((s->inSize == 0) && (c != UBX_SYNC_CHAR_1))
+        {
+            // idle bytes, training sequence, garbage
+            continue;
+        }
+        if ((s->inSize == 1) && (c != UBX_SYNC_CHAR_2))
+        {
+            s->inSize = (c == UBX_SYNC_CHAR_1) ? 1 : 0;
+            continue;
+        }
+        s->in[s->inSize++] = c;
+        if (s->inSize < UBX_HEAD_SIZE)
+        {
+            continue;
+        }
+        const U4 frameSize = UBX_FRAME_SIZE + (s->in[4] | ((U4)s->in[5] << 8));
+        if (frameSize > sizeof(s->in))
+        {
+            s->inSize = 0;
+            continue;
+        }
+        if (s->inSize < frameSize)
+        {
+            continue;
+        }
+        const U2 chk = GetUbxChecksumU1(s->in + 2, frameSize - 4);
+        if (((U1)chk == s->in[frameSize - 2]) && ((U1)(chk >> 8) == s->in[frameSize - 1]))
+        {
+            simHandle(s, s->in);
+        }
+        s->inSize = 0;
+    }
+}
+
+U4 simRead(INOUT SIM_RCV_t* s, OUT U1* p, IN U4 size)
+{
+    const U4 n = MIN(size, s->outWr - s->outRd);
+    memcpy(p, s->pOut + s->outRd, n);
+    s->outRd += n;
+    return n;
+}
+
+U4 simPending(IN const SIM_RCV_t* s)
+{
+    return s->outWr - s->outRd;
+}
+
+const U1* simFlash(IN const SIM_RCV_t* s)
+{
+    return s->pFlash;
+}
+
+U4 simReboots(IN const SIM_RCV_t* s)
+{
+    return s->reboots;
+}
+
+BOOL simSpiTransfer(void* pArg, U4 speed, const U1* pTx, U1* pRx, U4 size)
+{
+    SIM_RCV_t* s = (SIM_RCV_t*)pArg;
+    // the receiver sends what it had queued before the transfer
+    const U4 n = simRead(s, pRx, size);
+    memset(pRx + n, 0xFF, size - n);
+    simWrite(s, pTx, size);
+    return TRUE;
+}
+
+BOOL simI2cTransfer(void* pArg, U2 addr, const U1* pTx, U4 txSize, U1* pRx, U4 rxSize)
+{
+    SIM_RCV_t* s = (SIM_RCV_t*)pArg;
+    U4 ix;
+    if (addr != SIM_I2C_ADDR)
+    {
+        // nobody acknowledges the address
+        errno = ENXIO;
+        return FALSE;
+    }
+    if (txSize == 1)
+    {
+        // a single byte sets the register pointer
+        s->i2cReg = pTx[0];
+    }
+    else if (txSize > 1)
+    {
+        simWrite(s, pTx, txSize);
+    }
+    for (ix = 0; ix < rxSize; ix++)
+    {
+        switch (s->i2cReg)
+        {
+        case SIM_I2C_REG_LENGTH:
+            s->i2cLength = (U2)MIN(simPending(s), 0xFFFE);
+            pRx[ix] = (U1)(s->i2cLength >> 8);
+            s->i2cReg++;
+            break;
+        case SIM_I2C_REG_LENGTH + 1:
+            pRx[ix] = (U1)s->i2cLength;
+            s->i2cReg++;
+            break;
+        case SIM_I2C_REG_STREAM:
+            // the pointer stays at the stream register, 0xFF if there is nothing to send
+            if (!simRead(s, &pRx[ix], 1))
+            {
+                pRx[ix] = 0xFF;
+            }
+            break;
+        default:
+            pRx[ix] = 0x00;
+            s->i2cReg++;
+            break;
+        }
+    }
+    return TRUE;
+}
+
+//=====================================================================
+// "sim:" TRANSPORT
+//=====================================================================
+
+static BOOL SIM_SER_MATCH(const CH* name)
+{
+    return strncmp(name, "sim:", 4) == 0;
+}
+
+static BOOL SIM_SER_OPEN(SER_HANDLE_pt h, const CH* name)
+{
+    U4 ix;
+    for (ix = 0; ix < s_simPortCount; ix++)
+    {
+        if (strcmp(s_simPorts[ix].name, name + 4) == 0)
+        {
+            // SER_HANDLE_t::pData is freed when the port is closed
+            SIM_RCV_t** ppSim = (SIM_RCV_t**)malloc(sizeof(SIM_RCV_t*));
+            if (!ppSim)
+            {
+                return FALSE;
+            }
+            *ppSim = s_simPorts[ix].s;
+            h->pData = ppSim;
+            h->handle = (HANDLE)1;
+            return TRUE;
+        }
+    }
+    MESSAGE(MSG_ERR, "No simulated receiver '%s'", name);
+    return FALSE;
+}
+
+static void SIM_SER_CLOSE(SER_HANDLE_pt h)
+{
+}
+
+static U4 SIM_SER_WRITE(SER_HANDLE_pt h, const void* p, U4 size)
+{
+    simWrite(*(SIM_RCV_t**)h->pData, (const U1*)p, size);
+    return size;
+}
+
+static U4 SIM_SER_READ(SER_HANDLE_pt h, void* p, U4 size)
+{
+    return simRead(*(SIM_RCV_t**)h->pData, (U1*)p, size);
+}
+
+static BOOL SIM_SER_BAUDRATE(SER_HANDLE_pt h, U4 br)
+{
+    return TRUE;
+}
+
+static U4 SIM_SER_PENDING(SER_HANDLE_pt h)
+{
+    return simPending(*(SIM_RCV_t**)h->pData);
+}
+
+static void SIM_SER_WAIT(SER_HANDLE_pt h, U4 timeout)
+{
+    // the receiver answers right away, there is nothing to wait for
+    if (!simPending(*(SIM_RCV_t**)h->pData))
+    {
+        TIME_SLEEP(1);
+    }
+}
+
+static SER_OPS_t s_serOpsSim =
+{
+    "SIM", USR, SER_CAP_FULL_DUPLEX, 0, TRUE,
+    SIM_SER_MATCH, SIM_SER_OPEN, SIM_SER_CLOSE, SIM_SER_WRITE, SIM_SER_READ, SIM_SER_BAUDRATE,
+    NULL, NULL, SIM_SER_PENDING, NULL, NULL, NULL, SIM_SER_WAIT,
+    NULL
+};
+
+void simRegister(void)
+{
+    static BOOL done = FALSE;
+    if (!done)
+    {
+        SER_REGISTER(&s_serOpsSim);
+        done = TRUE;
+    }
+}
+
+BOOL simAdd(IN const CH* name, IN SIM_RCV_t* s)
+{
+    if ((s_simPortCount == SIM_MAX_PORTS) || (strlen(name) >= SIM_NAME_SIZE))
+    {
+        return FALSE;
+    }
+    strcpy(s_simPorts[s_simPortCount].name, name);
+    s_simPorts[s_simPortCount].s = s;
+    s_simPortCount++;
+    return TRUE;
+}
+
+void simRemoveAll(void)
+{
+    s_simPortCount = 0;
+}
+
+//=====================================================================
+// IMAGE
+//=====================================================================
+
+BOOL simWriteImage(IN const CH* fileName, IN U4 size, IN U4 seed, OUT U1** ppImage, OUT U4* pFileSize)
+{
+    const U4 numberOfImages = 1;
+    const U4 footerSize = 5 * sizeof(U4) + numberOfImages * sizeof(U4);
+    const U4 fileSize = size + footerSize;
+    U1* pImage = (U1*)malloc(fileSize);
+    if (!pImage || (size < 64) || (size & 3))
+    {
+        free(pImage);
+        return FALSE;
+    }
+
+    // xorshift, with runs of erased flash the 0xFF filter of SPI drops
+    U4 x = seed ? seed : 1;
+    U4 i;
+    for (i = 0; i < size; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        pImage[i] = ((i % 8192) >= 7168) ? 0xFF : (U1)x;
+    }
+    // no UBX magic, the image is scrambled like a u-blox 9 image
+    memcpy(pImage, "SIM9", 4);
+
+    // footer: CRC, image sizes, number of images, configuration size, version, magic
+    U1* pFooter = pImage + size;
+    const U4 fields[4] = { size, numberOfImages, 0, 0 };
+    memcpy(pFooter + 4, fields, sizeof(fields));
+    memcpy(pFooter + 4 + sizeof(fields), "UBFL", 4);
+    const U4 crc = lib_crc_crc32(0xF5D4C69, pFooter + 4, footerSize - 4);
+    memcpy(pFooter, &crc, sizeof(crc));
+
+    FILE* f = fopen(fileName, "wb");
+    BOOL ok = (f != NULL) && (fwrite(pImage, 1, fileSize, f) == fileSize);
+    if (f && (fclose(f) != 0))
+    {
+        ok = FALSE;
+    }
+    if (ok && ppImage)
+    {
+        *ppImage = pImage;
+    }
+    else
+    {
+        free(pImage);
+    }
+    if (pFileSize)
+    {
+        *pFileSize = fileSize;
+    }
+    return ok;
+}
+
+//=====================================================================
+// UPDATE
+//=====================================================================
+
+BOOL simUpdate(IN const CH* imageFile, IN const CH* port, IN U4 baudrate)
+{
+    return UpdateFirmware(imageFile, "", SIM_FIS_FILE, port,
+                          baudrate, baudrate, baudrate,
+                          FALSE,   // DoSafeBoot
+                          TRUE,    // DoReset
+                          FALSE,   // DoAutobaud
+                          FALSE,   // EraseWholeFlash
+                          FALSE,   // EraseOnly
+                          FALSE,   // TrainingSequence
+                          FALSE,   // doChipErase
+                          FALSE,   // noFisMerging
+                          FALSE,   // updateRam
+                          FALSE,   // usbAltMode
+                          0,       // Verbose
+                          FALSE);  // fisOnly
+}
+
+BOOL simCheckFlash(IN const SIM_RCV_t* s, IN const U1* pImage, IN U4 fileSize, IN U4 reboots)
+{
+    // the FIS header of the flash is merged in front of the image
+    const U4 prefixSize = sizeof(DRV_SPI_MEM_FIS_t);
+    CH* pFis = NULL;
+    size_t fisSize = 0;
+    BOOL ok = FALSE;
+    if (mergefis_load(&pFis, &fisSize, SIM_FIS_FILE, SIM_JEDEC) != MERGEFIS_OK)
+    {
+        printf("FAIL: no FIS for JEDEC ID %06X in %s\n", SIM_JEDEC, SIM_FIS_FILE);
+    }
+    else if ((fisSize < prefixSize) || (memcmp(s->pFlash, pFis, prefixSize) != 0))
+    {
+        printf("FAIL: flash doesn't start with the FIS\n");
+    }
+    else if (memcmp(s->pFlash + prefixSize, pImage, fileSize) != 0)
+    {
+        printf("FAIL: flash differs from the image\n");
+    }
+    else if (s->reboots != reboots)
+    {
+        printf("FAIL: %u reboots instead of %u\n", s->reboots, reboots);
+    }
+    else
+    {
+        ok = TRUE;
+    }
+    free(pFis);
+    return ok;
+}
@@ -0,0 +1,208 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+/*!
+  \file
+  \brief  Simulated u-blox 9 receiver for the tests
+
+  Answers the messages of an update (MON-VER, CFG-PRT, UPD-ROM, UPD-FLDET,
+  UPD-ERASE, UPD-FLWRI, UPD-CRC, ...) on a byte stream and keeps the flash
+  in memory, so a test can run a complete update and compare the flash with
+  the image. The receivers are reached over the "sim:<name>" transport, see
+  simRegister(), over the spidev transport, see simSpiTransfer(), or over
+  the i2c-dev transport, see simI2cTransfer().
+*/
+
+#ifndef __SIMRCV_H
+#define __SIMRCV_H
+
+#include "types.h"
+
+#define SIM_FLASH_SIZE      (2*1024*1024) //!< flash size of the simulated receivers
+#define SIM_SECTOR_SIZE     4096          //!< sector size of the simulated flash
+#define SIM_JEDEC       0x00EF4015        //!< JEDEC ID of the simulated flash (in fis/flash_200061.xml)
+#define SIM_ROM_CRC     0x118B2060        //!< ROM CRC of the simulated receivers (u-blox 9 ROM 1.02)
+#define SIM_I2C_ADDR          0x42        //!< I2C address of the simulated receivers
+#define SIM_FIS_FILE    "fis/flash_200061.xml" //!< FIS file with the flash of the simulated receivers
+
+//! options of a simulated receiver
+typedef struct SIM_CONFIG_s
+{
+    U1           portId;          //!< port the receiver reports it is connected to, see UBX_CFG_PRT_PORT_UART1 etc.
+    BOOL         nmea;            //!< output NMEA after every reply until it is disabled by CFG-VALSET or CFG-PRT
+} SIM_CONFIG_t;
+
+typedef struct SIM_RCV_s SIM_RCV_t; //!< simulated receiver, see simCreate()
+
+//! Create a simulated receiver
+/*!
+    The receiver runs its firmware until it is commanded to safeboot or
+    the flash loader is started, the flash is filled with 0x00.
+
+    \param pCfg    options of the receiver
+    \return receiver, NULL if out of memory
+*/
+SIM_RCV_t* simCreate(IN const SIM_CONFIG_t* pCfg);
+
+//! Delete a simulated receiver
+/*!
+    \param s       receiver returned by simCreate(), may be NULL
+*/
+void simDelete(IN SIM_RCV_t* s);
+
+//! Hand data sent by the host to a simulated receiver
+/*!
+    The messages are answered right away, the replies are queued for
+    simRead().
+
+    \param s       receiver
+    \param p       data sent by the host
+    \param size    size of the data
+*/
+void simWrite(INOUT SIM_RCV_t* s, IN const U1* p, IN U4 size);
+
+//! Get the data sent by a simulated receiver
+/*!
+    \param s       receiver
+    \param p       buffer receiving the data
+    \param size    size of the buffer
+    \return number of bytes copied, 0 if the receiver has nothing to send
+*/
+U4 simRead(INOUT SIM_RCV_t* s, OUT U1* p, IN U4 size);
+
+//! Get the number of bytes a simulated receiver has to send
+/*!
+    \param s       receiver
+    \return number of bytes queued for simRead()
+*/
+U4 simPending(IN const SIM_RCV_t* s);
+
+//! Get the flash of a simulated receiver
+/*!
+    \param s       receiver
+    \return the #SIM_FLASH_SIZE bytes of the flash
+*/
+const U1* simFlash(IN const SIM_RCV_t* s);
+
+//! Get the number of reboots commanded
+/*!
+    \param s       receiver
+    \return number of UPD-RBOOT and CFG-RST hardware resets received
+*/
+U4 simReboots(IN const SIM_RCV_t* s);
+
+//! Register the "sim:" transport
+/*!
+    Port "sim:<name>" connects to the receiver added with simAdd() under
+    \a name. The table of receivers isn't locked, so all receivers have
+    to be added before the first port is opened.
+*/
+void simRegister(void);
+
+//! Make a simulated receiver reachable over the "sim:" transport
+/*!
+    \param name    name of the port without "sim:"
+    \param s       receiver
+    \return #TRUE on success, #FALSE if there is no room for more receivers
+*/
+BOOL simAdd(IN const CH* name, IN SIM_RCV_t* s);
+
+//! Remove all receivers from the "sim:" transport
+void simRemoveAll(void);
+
+//! Full-duplex SPI transfer with a simulated receiver
+/*!
+    Matches SPIDEV_XFER_FN, the receiver is passed as \a pArg to
+    SPIDEV_SET_TRANSFER(). Clocks in 0xFF when the receiver has nothing
+    to send, like a real receiver.
+
+    \param pArg    receiver (SIM_RCV_t)
+    \param speed   SPI clock, not used
+    \param pTx     data sent by the host
+    \param pRx     receives the data sent by the receiver
+    \param size    number of bytes to transfer
+    \return #TRUE
+*/
+BOOL simSpiTransfer(void* pArg, U4 speed, const U1* pTx, U1* pRx, U4 size);
+
+//! I2C transfer with a simulated receiver
+/*!
+    Matches I2CDEV_XFER_FN, the receiver is passed as \a pArg to
+    I2CDEV_SET_TRANSFER(). Like a real receiver, a write of one byte sets
+    the register pointer, longer writes are message data, and reads return
+    the length registers 0xFD/0xFE and the stream register 0xFF, which
+    reads 0xFF when the receiver has nothing to send.
+
+    \param pArg    receiver (SIM_RCV_t)
+    \param addr    I2C address, only #SIM_I2C_ADDR acknowledges
+    \param pTx     data written by the host
+    \param txSize  number of bytes written
+    \param pRx     receives the data read
+    \param rxSize  number of bytes read
+    \return #TRUE, #FALSE if \a addr isn't #SIM_I2C_ADDR
+*/
+BOOL simI2cTransfer(void* pArg, U2 addr, const U1* pTx, U4 txSize, U1* pRx, U4 rxSize);
+
+//! Write a u-blox 9 image file for the tests
+/*!
+    The image has pseudo random contents with some runs of 0xFF and a
+    valid footer, ValidateImage() accepts it as a u-blox 9 image.
+
+    \param fileName    file to write
+    \param size        size of the image without the footer, a multiple of 4
+    \param seed        seed of the pseudo random contents
+    \param ppImage     receives a copy of the file, to be released with free(), may be NULL
+    \param pFileSize   receives the size of the file, may be NULL
+    \return #TRUE on success
+*/
+BOOL simWriteImage(IN const CH* fileName, IN U4 size, IN U4 seed, OUT U1** ppImage, OUT U4* pFileSize);
+
+//! Update a receiver with the default options of the tool
+/*!
+    Runs UpdateFirmware() with the FIS of #SIM_FIS_FILE, without safeboot,
+    autobaud and training sequence, and with a reset at the end.
+
+    \param imageFile   image to write, see simWriteImage()
+    \param port        port of the receiver
+    \param baudrate    baudrate used all along the update
+    \return #TRUE if the update succeeded
+*/
+BOOL simUpdate(IN const CH* imageFile, IN const CH* port, IN U4 baudrate);
+
+//! Check the flash of a simulated receiver after an update
+/*!
+    The flash has to start with the FIS of #SIM_FIS_FILE, followed by the
+    image, and the receiver has to be rebooted \a reboots times. The first
+    difference found is printed as a failure.
+
+    \param s           receiver
+    \param pImage      image file, see simWriteImage()
+    \param fileSize    size of the image file
+    \param reboots     number of reboots expected
+    \return #TRUE if the receiver was updated with the image
+*/
+BOOL simCheckFlash(IN const SIM_RCV_t* s, IN const U1* pImage, IN U4 fileSize, IN U4 reboots);
+
+#endif //__SIMRCV_H
@@ -0,0 +1,336 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+/*!
+  \file
+  \brief  Log contexts of concurrent updates
+
+  First several threads log through their own LOG_CTX_t at the same time,
+  every line, also the text of MESSAGE_PLAIN(), has to arrive at the output
+  of its own context with its own prefix and verbosity. Then UpdateFleet() updates several simulated
+  receivers in parallel, every receiver has to be updated and every message
+  about a port has to carry the prefix of that port.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "ubxmsg.h"
+#include "mergefis.h"
+#include "update.h"
+#include "simrcv.h"
+
+#define LOG_THREADS   8                 //!< threads logging at once
+#define LOG_LINES     20000             //!< lines logged by every thread
+#define FLEET_SIZE    8                 //!< receivers updated at once
+#define IMAGE_FILE    "bin/test_fleet.bin"  //!< image written for the test
+#define IMAGE_SIZE    (64*1024)         //!< size of the image without the footer
+#define FIS_FILE      "fis/flash_200061.xml" //!< FIS file with the flash of the simulated receivers
+
+//=====================================================================
+// LOG CONTEXTS OF THREADS
+//=====================================================================
+
+//! thread logging through its own context
+typedef struct LOG_WORKER_s
+{
+    U4         id;                      //!< number of the thread
+    CH         prefix[16];              //!< prefix of its context
+    int        verbose;                 //!< verbosity of its context
+    U4         lines;                   //!< lines received by the output of its context
+    U4         errors;                  //!< lines of other threads or without its prefix
+} LOG_WORKER_t;
+
+//! output of the context of a logging thread
+static void logWorkerOutput(void* pUser, MSG_LEVEL level, const CH* pLine)
+{
+    LOG_WORKER_t* w = (LOG_WORKER_t*)pUser;
+    U4 id = (U4)-1;
+    const CH* pText = strstr(pLine, "] ");
+    const CH* pPrefix = strstr(pLine, w->prefix);
+    if (!pText || !pPrefix || (pPrefix > pText) ||
+        (sscanf(pText + 2, "worker %u", &id) != 1) || (id != w->id))
+    {
+        w->errors++;
+    }
+    w->lines++;
+}
+
+//! logging thread
+static void logWorker(void* pArg)
+{
+    LOG_WORKER_t* w = (LOG_WORKER_t*)pArg;
+    LOG_CTX_t ctx;
+    LOG_INIT(&ctx, w->verbose, w->prefix);
+    ctx.pfnOutput = logWorkerOutput;
+    ctx.pUser = w;
+    U4 i;
+    for (i = 0; i < LOG_LINES; i++)
+    {
+        // rebind now and then, a nested context must not leak into other threads
+        if ((i % 100) == 0)
+        {
+            LOG_BIND(NULL);
+        }
+        LOG_BIND(&ctx);
+        MESSAGE(MSG_LEV0, "worker %u line %u", w->id, i);
+        // the blank line doesn't reach the output
+        MESSAGE_PLAIN("worker %u plain %u\n\n", w->id, i);
+        // only printed by the verbose contexts
+        MESSAGE(MSG_DBG, "worker %u debug %u", w->id, i);
+    }
+    LOG_BIND(NULL);
+}
+
+//! log from several threads at once
+static int testLogThreads(void)
+{
+    LOG_WORKER_t workers[LOG_THREADS];
+    THREAD_pt threads[LOG_THREADS];
+    U4 ix;
+    int failed = 0;
+    for (ix = 0; ix < LOG_THREADS; ix++)
+    {
+        memset(&workers[ix], 0, sizeof(workers[ix]));
+        workers[ix].id = ix;
+        workers[ix].verbose = ix & 1;
+        sprintf(workers[ix].prefix, "[w%u]", ix);
+        threads[ix] = THREAD_START(logWorker, &workers[ix]);
+        if (!threads[ix])
+        {
+            printf("FAIL: could not start thread %u\n", ix);
+            return 1;
+        }
+    }
+    for (ix = 0; ix < LOG_THREADS; ix++)
+    {
+        THREAD_JOIN(threads[ix]);
+        const U4 expected = workers[ix].verbose ? 3 * LOG_LINES : 2 * LOG_LINES;
+        if ((workers[ix].lines != expected) || workers[ix].errors)
+        {
+            printf("FAIL: thread %u got %u lines instead of %u, %u of them wrong\n",
+                   ix, workers[ix].lines, expected, workers[ix].errors);
+            failed++;
+        }
+    }
+    if (!failed)
+    {
+        printf("PASS: %u threads logging %u lines each\n", LOG_THREADS, LOG_LINES);
+    }
+    return failed;
+}
+
+//=====================================================================
+// FLEET UPDATE
+//=====================================================================
+
+//! messages of a fleet update
+typedef struct FLEET_LOG_s
+{
+    MUTEX_pt   lock;                    //!< protects the other fields, the ports log at once
+    CH**       pLines;                  //!< lines received
+    U4         count;                   //!< number of lines
+    U4         size;                    //!< size of pLines
+} FLEET_LOG_t;
+
+//! output of the log context of a fleet update
+static void fleetOutput(void* pUser, MSG_LEVEL level, const CH* pLine)
+{
+    FLEET_LOG_t* pLog = (FLEET_LOG_t*)pUser;
+    MUTEX_LOCK(pLog->lock);
+    if (pLog->count == pLog->size)
+    {
+        const U4 size = pLog->size ? 2 * pLog->size : 256;
+        CH** pLines = (CH**)realloc(pLog->pLines, size * sizeof(CH*));
+        if (pLines)
+        {
+            pLog->pLines = pLines;
+            pLog->size = size;
+        }
+    }
+    if (pLog->count < pLog->size)
+    {
+        pLog->pLines[pLog->count] = (CH*)malloc(strlen(pLine) + 1);
+        if (pLog->pLines[pLog->count])
+        {
+            strcpy(pLog->pLines[pLog->count++], pLine);
+        }
+    }
+    MUTEX_UNLOCK(pLog->lock);
+}
+
+//! check the messages of one port of a fleet update
+/*!
+    \param pLog    messages of the fleet update
+    \param port    name of the port
+    \return number of errors
+*/
+static int checkFleetLog(const FLEET_LOG_t* pLog, const CH* port)
+{
+    CH prefix[40];
+    CH quoted[40];
+    U4 lines = 0;
+    U4 results = 0;
+    U4 foreign = 0;
+    U4 ix;
+    sprintf(prefix, "[%s] ", port);
+    sprintf(quoted, "'%s'", port);
+    for (ix = 0; ix < pLog->count; ix++)
+    {
+        const CH* pLine = pLog->pLines[ix];
+        const BOOL own = (strstr(pLine, prefix) != NULL);
+        lines += own ? 1 : 0;
+        if (own && strstr(pLine, "Firmware Update SUCCESS"))
+        {
+            results++;
+        }
+        // the port is named in its own messages only (the summary has no prefix)
+        if (strstr(pLine, quoted) && !own)
+        {
+            foreign++;
+        }
+    }
+    if ((lines < 5) || (results != 1) || foreign)
+    {
+        printf("FAIL: %s has %u lines, %u results, %u lines of it with another prefix\n",
+               port, lines, results, foreign);
+        return 1;
+    }
+    return 0;
+}
+
+//! update several simulated receivers at once
+static int testFleet(void)
+{
+    SIM_RCV_t* sims[FLEET_SIZE];
+    CH names[FLEET_SIZE][16];
+    const CH* ports[FLEET_SIZE];
+    U1* pImage = NULL;
+    U4 fileSize = 0;
+    U4 ix;
+    int failed = 0;
+
+    // receiver ix on port "sim:<ix>"
+    simRegister();
+    for (ix = 0; ix < FLEET_SIZE; ix++)
+    {
+        SIM_CONFIG_t cfg;
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.portId = UBX_CFG_PRT_PORT_UART1;
+        cfg.nmea = TRUE;
+        sims[ix] = simCreate(&cfg);
+        sprintf(names[ix], "sim:%u", ix);
+        ports[ix] = names[ix];
+        if (!sims[ix] || !simAdd(names[ix] + 4, sims[ix]))
+        {
+            printf("FAIL: setup\n");
+            return 1;
+        }
+    }
+    if (!simWriteImage(IMAGE_FILE, IMAGE_SIZE, 0x4321, &pImage, &fileSize))
+    {
+        printf("FAIL: could not write %s\n", IMAGE_FILE);
+        return 1;
+    }
+
+    UPD_PARAMS_t params;
+    memset(&params, 0, sizeof(params));
+    params.BinaryFileName   = IMAGE_FILE;
+    params.FlashDefFileName = "";
+    params.FisFileName      = FIS_FILE;
+    params.Baudrate         = 9600;
+    params.BaudrateSafe     = 9600;
+    params.BaudrateUpd      = 115200;
+    params.DoReset          = TRUE;
+    params.Verbose          = 1;
+
+    FLEET_LOG_t fleetLog;
+    memset(&fleetLog, 0, sizeof(fleetLog));
+    fleetLog.lock = MUTEX_CREATE();
+    LOG_CTX_t ctx;
+    LOG_INIT(&ctx, 0, NULL);
+    ctx.pfnOutput = fleetOutput;
+    ctx.pUser = &fleetLog;
+    LOG_BIND(&ctx);
+    const BOOL ok = UpdateFleet(&params, ports, FLEET_SIZE, 0);
+    LOG_BIND(NULL);
+
+    if (!ok)
+    {
+        printf("FAIL: fleet update failed\n");
+        failed++;
+    }
+    CH* pFis = NULL;
+    size_t fisSize = 0;
+    const U4 prefixSize = sizeof(DRV_SPI_MEM_FIS_t);
+    if ((mergefis_load(&pFis, &fisSize, FIS_FILE, SIM_JEDEC) != MERGEFIS_OK) || (fisSize < prefixSize))
+    {
+        printf("FAIL: no FIS for JEDEC ID %06X in %s\n", SIM_JEDEC, FIS_FILE);
+        failed++;
+    }
+    for (ix = 0; !failed && (ix < FLEET_SIZE); ix++)
+    {
+        const U1* pFlash = simFlash(sims[ix]);
+        if ((memcmp(pFlash, pFis, prefixSize) != 0) ||
+            (memcmp(pFlash + prefixSize, pImage, fileSize) != 0) ||
+            (simReboots(sims[ix]) != 1))
+        {
+            printf("FAIL: receiver on %s not updated\n", ports[ix]);
+            failed++;
+        }
+    }
+    for (ix = 0; ix < FLEET_SIZE; ix++)
+    {
+        failed += checkFleetLog(&fleetLog, ports[ix]);
+    }
+    if (!failed)
+    {
+        printf("PASS: fleet update of %u receivers, %u lines logged\n", FLEET_SIZE, fleetLog.count);
+    }
+
+    for (ix = 0; ix < fleetLog.count; ix++)
+    {
+        free(fleetLog.pLines[ix]);
+    }
+    free(fleetLog.pLines);
+    MUTEX_DELETE(fleetLog.lock);
+    free(pFis);
+    remove(IMAGE_FILE);
+    free(pImage);
+    simRemoveAll();
+    for (ix = 0; ix < FLEET_SIZE; ix++)
+    {
+        simDelete(sims[ix]);
+    }
+    return failed;
+}
+
+int main(void)
+{
+    int failed = testLogThreads();
+    failed += testFleet();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,224 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+
+/*!
+  \file
+  \brief  Update over the i2c-dev transport against a simulated receiver
+
+  Replaces the i2c-dev transfers with I2CDEV_SET_TRANSFER(), so the update
+  of "/dev/i2c-1" runs through I2CDEV_WRITE(), I2CDEV_PENDING() and
+  I2CDEV_READ() (combined length query, stream register reads) without an
+  I2C bus, and compares the flash of the simulated receiver with the image.
+  The transfers are watched on the way: the stream register may only be
+  read directly as long as no write moved the register pointer, which is
+  also checked with a write in the middle of a reply. A second update
+  NACKs some of the writes, like a receiver with a full receive buffer,
+  which I2CDEV_WRITE() has to back off from and retry.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "ubxmsg.h"
+#include "simrcv.h"
+
+#define IMAGE_FILE  "bin/test_i2cdev.bin"  //!< image written for the test
+#define IMAGE_SIZE  (64*1024)              //!< size of the image without the footer
+#define PORT        "/dev/i2c-1"           //!< port updated
+#define NACK_EVERY  7                      //!< every how many writes the second update NACKs
+#define READ_SIZE   40                     //!< bytes read at once, more than are read along with the length
+
+//! transfers watched by testTransfer()
+typedef struct I2C_TEST_s
+{
+    SIM_RCV_t* s;             //!< receiver
+    U4         nackEvery;     //!< NACK every how many writes, 0 to NACK none
+    U4         writes;        //!< data writes
+    U4         nacks;         //!< data writes NACKed
+    BOOL       moved;         //!< data written since the register pointer was set
+    U4         streamReads;   //!< reads of the stream register without setting the register pointer
+    U4         staleReads;    //!< of these, reads after a data write
+} I2C_TEST_t;
+
+//! I2CDEV_XFER_FN counting the transfers and NACKing writes
+static BOOL testTransfer(void* pArg, U2 addr, const U1* pTx, U4 txSize, U1* pRx, U4 rxSize)
+{
+    I2C_TEST_t* t = (I2C_TEST_t*)pArg;
+    if (txSize > 1)
+    {
+        t->writes++;
+        if (t->nackEvery && ((t->writes % t->nackEvery) == 0))
+        {
+            t->nacks++;
+            errno = EREMOTEIO;
+            return FALSE;
+        }
+        t->moved = TRUE;
+    }
+    else if (txSize == 1)
+    {
+        t->moved = FALSE;
+    }
+    else if (rxSize)
+    {
+        t->streamReads++;
+        if (t->moved)
+        {
+            t->staleReads++;
+        }
+    }
+    return simI2cTransfer(t->s, addr, pTx, txSize, pRx, rxSize);
+}
+
+//! Write to a receiver in the middle of a reply
+/*!
+    The receiver is polled for MON-VER twice, the second time after only
+    the first bytes of the first reply were read. The read following the
+    second poll has to set the register pointer again.
+
+    \return number of failures
+*/
+static int testPendingAfterWrite(void)
+{
+    static const U1 pollMonVer[] = { 0xB5, 0x62, UBX_CLASS_MON, UBX_MON_VER, 0x00, 0x00, 0x0E, 0x34 };
+    SIM_CONFIG_t cfg;
+    I2C_TEST_t t;
+    U1 buf[READ_SIZE];
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.portId = UBX_CFG_PRT_PORT_I2C;
+    memset(&t, 0, sizeof(t));
+    t.s = simCreate(&cfg);
+    I2CDEV_SET_TRANSFER(testTransfer, &t);
+    SER_HANDLE_pt h = t.s ? SER_OPEN(PORT) : NULL;
+    I2CDEV_SET_TRANSFER(NULL, NULL);
+    if (!h)
+    {
+        printf("FAIL: setup\n");
+        simDelete(t.s);
+        return 1;
+    }
+
+    const BOOL first = (SER_WRITE(h, pollMonVer, sizeof(pollMonVer)) == sizeof(pollMonVer)) &&
+                       (SER_READ(h, buf, sizeof(buf)) == sizeof(buf)) &&
+                       (buf[0] == 0xB5) && (buf[1] == 0x62) && (SER_PENDING(h) > 0);
+    const U4 streamReads = t.streamReads;
+    const BOOL second = (SER_WRITE(h, pollMonVer, sizeof(pollMonVer)) == sizeof(pollMonVer)) &&
+                        (SER_READ(h, buf, sizeof(buf)) == sizeof(buf));
+    SER_CLOSE(h);
+
+    int failed = 0;
+    if (!first || !streamReads)
+    {
+        printf("FAIL: first reply not read partially\n");
+        failed++;
+    }
+    else if (!second || t.staleReads)
+    {
+        printf("FAIL: stream register read after a write\n");
+        failed++;
+    }
+    else
+    {
+        printf("PASS: i2c-dev write in the middle of a reply\n");
+    }
+    simDelete(t.s);
+    return failed;
+}
+
+//! Update a new receiver and check its flash
+/*!
+    \param nackEvery   NACK every how many writes, 0 to NACK none
+    \param pImage      image file
+    \param fileSize    size of the image file
+    \return number of failures
+*/
+static int testUpdate(U4 nackEvery, const U1* pImage, U4 fileSize)
+{
+    SIM_CONFIG_t cfg;
+    I2C_TEST_t t;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.portId = UBX_CFG_PRT_PORT_I2C;
+    cfg.nmea = TRUE;
+    memset(&t, 0, sizeof(t));
+    t.s = simCreate(&cfg);
+    t.nackEvery = nackEvery;
+    if (!t.s)
+    {
+        printf("FAIL: setup\n");
+        return 1;
+    }
+
+    I2CDEV_SET_TRANSFER(testTransfer, &t);
+    const BOOL ok = simUpdate(IMAGE_FILE, PORT, BaudrateDefaultI2C);
+    I2CDEV_SET_TRANSFER(NULL, NULL);
+
+    int failed = 0;
+    if (!ok)
+    {
+        printf("FAIL: update failed, %u of %u writes NACKed\n", t.nacks, t.writes);
+        failed++;
+    }
+    else if (!simCheckFlash(t.s, pImage, fileSize, 1))
+    {
+        failed++;
+    }
+    else if (t.staleReads || !t.streamReads)
+    {
+        printf("FAIL: %u of %u stream reads after a write\n", t.staleReads, t.streamReads);
+        failed++;
+    }
+    else if (nackEvery && !t.nacks)
+    {
+        printf("FAIL: no write NACKed\n");
+        failed++;
+    }
+    else
+    {
+        printf("PASS: i2c-dev update of %u bytes, %u stream reads, %u of %u writes NACKed\n",
+               fileSize, t.streamReads, t.nacks, t.writes);
+    }
+    simDelete(t.s);
+    return failed;
+}
+
+int main(void)
+{
+    U1* pImage = NULL;
+    U4 fileSize = 0;
+    if (!simWriteImage(IMAGE_FILE, IMAGE_SIZE, 0x2468, &pImage, &fileSize))
+    {
+        printf("FAIL: could not write %s\n", IMAGE_FILE);
+        return 1;
+    }
+    int failed = testPendingAfterWrite();
+    failed += testUpdate(0, pImage, fileSize);
+    failed += testUpdate(NACK_EVERY, pImage, fileSize);
+    remove(IMAGE_FILE);
+    free(pImage);
+    return failed ? 1 : 0;
+}
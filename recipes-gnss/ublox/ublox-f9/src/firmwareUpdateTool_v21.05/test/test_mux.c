@@ -0,0 +1,250 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+
+/*!
+  \file
+  \brief  Sharing a simulated receiver between a consumer and an updater
+
+  Serves a simulated receiver with MuxServe() and connects a consumer and
+  an update tool to its socket. The consumer receives the replies to the
+  polls of the update tool until UPD-SAFE, nothing while the receiver is in
+  safeboot, and talks to the receiver again after UPD-RBOOT. Its writes
+  are dropped while the update tool owns the port.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "platform.h"
+#include "ubxmsg.h"
+#include "mux.h"
+#include "simrcv.h"
+
+#define SOCK_PATH   "bin/test_mux.sock"  //!< socket of the multiplexer
+#define SIM_PORT    "sim:mux"            //!< port of the simulated receiver
+#define REPLY_TIME  1000                 //!< longest time to wait for a reply [ms]
+#define QUIET_TIME  200                  //!< time no reply may arrive [ms]
+
+//! serve the simulated receiver until SIGTERM
+static void* muxThread(void* pArg)
+{
+    ((void)pArg);
+    MuxServe(SIM_PORT, 9600, SOCK_PATH);
+    return NULL;
+}
+
+//! connect to the multiplexer, retrying while it starts up
+static int muxConnect(void)
+{
+    struct sockaddr_un sa;
+    U4 start = TIME_GET();
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, SOCK_PATH);
+    do
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ((fd >= 0) && (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0))
+        {
+            return fd;
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        TIME_SLEEP(10);
+    } while ((TIME_GET() - start) < REPLY_TIME);
+    return -1;
+}
+
+//! send a UBX message without payload
+static BOOL sendMsg(int fd, U1 classId, U1 msgId)
+{
+    CH* pMsg = NULL;
+    size_t size = 0;
+    if (!UbxCreateMessage(classId, msgId, NULL, 0, &pMsg, &size))
+    {
+        return FALSE;
+    }
+    const BOOL ok = (send(fd, pMsg, size, 0) == (ssize_t)size);
+    free(pMsg);
+    return ok;
+}
+
+//! wait for data starting with a pattern
+/*!
+    \param fd       socket
+    \param p        pattern to look for
+    \param size     size of the pattern
+    \param timeout  time to wait [ms]
+    \return #TRUE if the pattern was received
+*/
+static BOOL waitFor(int fd, const void* p, U4 size, U4 timeout)
+{
+    U1 buf[4096];
+    U4 len = 0;
+    U4 start = TIME_GET();
+    for (;;)
+    {
+        U4 i;
+        for (i = 0; i + size <= len; i++)
+        {
+            if (memcmp(buf + i, p, size) == 0)
+            {
+                return TRUE;
+            }
+        }
+        // keep the end of the data, the pattern may continue in the next chunk
+        if (len > sizeof(buf) / 2)
+        {
+            memmove(buf, buf + len - size, size);
+            len = size;
+        }
+        const U4 elapsed = TIME_GET() - start;
+        if (elapsed >= timeout)
+        {
+            return FALSE;
+        }
+        fd_set fds;
+        struct timeval tv = { 0, (timeout - elapsed) * 1000 };
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        if (select(fd + 1, &fds, NULL, NULL, &tv) > 0)
+        {
+            ssize_t got = recv(fd, buf + len, sizeof(buf) - len, 0);
+            if (got <= 0)
+            {
+                return FALSE;
+            }
+            len += (U4)got;
+        }
+    }
+}
+
+int main(void)
+{
+    static const U1 monVer[] = { UBX_SYNC_CHAR_1, UBX_SYNC_CHAR_2, UBX_CLASS_MON, UBX_MON_VER };
+    static const CH ok[] = MUX_REPLY_OK "\n";
+    SIM_CONFIG_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.portId = UBX_CFG_PRT_PORT_UART1;
+    cfg.nmea = TRUE;
+    SIM_RCV_t* s = simCreate(&cfg);
+    simRegister();
+    pthread_t thread;
+    if (!s || !simAdd(SIM_PORT + 4, s) || (pthread_create(&thread, NULL, muxThread, NULL) != 0))
+    {
+        printf("FAIL: setup\n");
+        return 1;
+    }
+
+    const int consumer = muxConnect();
+    const int updater = muxConnect();
+    int failed = 0;
+    if ((consumer < 0) || (updater < 0))
+    {
+        printf("FAIL: could not connect to %s\n", SOCK_PATH);
+        failed++;
+    }
+    else if (!sendMsg(consumer, UBX_CLASS_MON, UBX_MON_VER) ||
+             !waitFor(consumer, monVer, sizeof(monVer), REPLY_TIME))
+    {
+        printf("FAIL: consumer not served\n");
+        failed++;
+    }
+    else if ((send(updater, MUX_CMD_UPDATE, strlen(MUX_CMD_UPDATE), 0) != (ssize_t)strlen(MUX_CMD_UPDATE)) ||
+             !waitFor(updater, ok, strlen(ok), REPLY_TIME))
+    {
+        printf("FAIL: update refused\n");
+        failed++;
+    }
+    // until the safeboot, the consumer receives the receiver output
+    else if (!sendMsg(updater, UBX_CLASS_MON, UBX_MON_VER) ||
+             !waitFor(updater, monVer, sizeof(monVer), REPLY_TIME) ||
+             !waitFor(consumer, monVer, sizeof(monVer), REPLY_TIME))
+    {
+        printf("FAIL: reply before the safeboot not passed to both clients\n");
+        failed++;
+    }
+    // in safeboot, the consumer is paused and its writes are dropped
+    else if (!sendMsg(updater, UBX_CLASS_UPD, UBX_UPD_SAFE) ||
+             !sendMsg(consumer, UBX_CLASS_MON, UBX_MON_VER) ||
+             waitFor(updater, monVer, sizeof(monVer), QUIET_TIME))
+    {
+        printf("FAIL: consumer talked to the receiver during the update\n");
+        failed++;
+    }
+    else if (!sendMsg(updater, UBX_CLASS_MON, UBX_MON_VER) ||
+             !waitFor(updater, monVer, sizeof(monVer), REPLY_TIME) ||
+             waitFor(consumer, monVer, sizeof(monVer), QUIET_TIME))
+    {
+        printf("FAIL: consumer not paused in safeboot\n");
+        failed++;
+    }
+    else
+    {
+        // the clients are served in turn, the poll of the consumer must not
+        // overtake UPD-RBOOT
+        const BOOL rebooted = sendMsg(updater, UBX_CLASS_UPD, UBX_UPD_RBOOT);
+        TIME_SLEEP(QUIET_TIME);
+        if (!rebooted || !sendMsg(consumer, UBX_CLASS_MON, UBX_MON_VER) ||
+            !waitFor(consumer, monVer, sizeof(monVer), REPLY_TIME))
+        {
+            printf("FAIL: consumer not resumed after the reboot\n");
+            failed++;
+        }
+        else if (simReboots(s) != 2)
+        {
+            printf("FAIL: %u reboots instead of 2\n", simReboots(s));
+            failed++;
+        }
+        else
+        {
+            printf("PASS: consumer paused from UPD-SAFE to UPD-RBOOT\n");
+        }
+    }
+
+    if (consumer >= 0)
+    {
+        close(consumer);
+    }
+    if (updater >= 0)
+    {
+        close(updater);
+    }
+    // MuxServe() terminates on SIGTERM
+    raise(SIGTERM);
+    pthread_join(thread, NULL);
+    simRemoveAll();
+    simDelete(s);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,569 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+
+/*!
+  \file
+  \brief  Update over the network transport against a simulated receiver
+
+  A thread stands in for a terminal server on the loopback interface: it
+  passes the data of the connection to a simulated receiver and back. On
+  "127.0.0.1:<port>" it serves the HTTP requests setting the baudrate, see
+  NET_SET_HTTP_PORT(), on "rfc2217://127.0.0.1:<port>" it speaks telnet
+  and answers the COM-PORT-OPTION commands of RFC 2217 in-band. The update
+  runs through the buffered writes and flushes of the network transport,
+  the flash of the simulated receiver is compared with the image and the
+  baudrate requests and the duration are checked.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "platform.h"
+#include "ubxmsg.h"
+#include "mergefis.h"
+#include "update.h"
+#include "simrcv.h"
+
+#define IMAGE_FILE  "bin/test_net.bin"     //!< image written for the test
+#define IMAGE_SIZE  (64*1024)              //!< size of the image without the footer
+#define FIS_FILE    "fis/flash_200061.xml" //!< FIS file with the flash of the simulated receiver
+#define MAX_BAUDS   8                      //!< baudrate requests recorded
+#define MAX_TIME    3000                   //!< longest update, a write left in the buffer costs a poll timeout [ms]
+#define BAUD        9600                   //!< baudrate of the receiver
+#define BAUD_UPD    115200                 //!< baudrate of the update
+
+#define TELNET_SE           240            //!< end of sub-negotiation
+#define TELNET_SB           250            //!< start of sub-negotiation
+#define TELNET_WILL         251            //!< sender wants to enable an option
+#define TELNET_WONT         252            //!< sender refuses an option
+#define TELNET_DO           253            //!< sender wants the peer to enable an option
+#define TELNET_DONT         254            //!< sender wants the peer to disable an option
+#define TELNET_IAC          255            //!< interpret as command
+#define TELNET_BINARY         0            //!< option: 8 bit transmission
+#define TELNET_SGA            3            //!< option: suppress go ahead
+#define TELNET_COM_PORT      44            //!< option: COM-PORT-OPTION
+#define RFC2217_SET_BAUDRATE  1            //!< client command: set baudrate
+#define RFC2217_SERVER_OFFSET 100          //!< added to the command in the server replies
+
+//! telnet receive state of the server
+typedef enum SERVER_TELNET_e
+{
+    SERVER_TELNET_DATA = 0,            //!< data
+    SERVER_TELNET_IAC,                 //!< IAC received
+    SERVER_TELNET_OPT,                 //!< option of WILL/WONT/DO/DONT expected
+    SERVER_TELNET_SB,                  //!< inside sub-negotiation
+    SERVER_TELNET_SB_IAC               //!< IAC received inside sub-negotiation
+} SERVER_TELNET_t;
+
+//! terminal server on the loopback interface
+typedef struct NET_SERVER_s
+{
+    SIM_RCV_t*   s;                    //!< receiver behind the server
+    BOOL         rfc2217;              //!< telnet framing, the baudrate is set in-band (RFC 2217)
+    int          dataListen;           //!< socket accepting the data connections
+    int          httpListen;           //!< socket accepting the HTTP requests
+    U2           dataPort;             //!< port of \a dataListen
+    U2           httpPort;             //!< port of \a httpListen
+    pthread_mutex_t mutex;             //!< protects \a stop
+    BOOL         stop;                 //!< set to end the server thread
+    U4           connections;          //!< data connections accepted
+    U4           httpCount;            //!< HTTP requests served
+    int          portNum;              //!< serial port of the last HTTP baudrate request
+    U4           baudCount;            //!< baudrate requests served
+    U4           bauds[MAX_BAUDS];     //!< baudrates requested
+    U4           comPortCmds;          //!< RFC 2217 commands answered
+    SERVER_TELNET_t state;             //!< telnet receive state
+    U1           verb;                 //!< WILL/WONT/DO/DONT waiting for its option
+    U1           sbLen;                //!< number of bytes in \a sb
+    U1           sb[16];               //!< sub-negotiation received so far
+} NET_SERVER_t;
+
+//! open a listening socket on an arbitrary port of the loopback interface
+static int serverListen(U2* pPort)
+{
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    const int on = 1;
+    const int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family      = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ((bind(sock, (struct sockaddr*)&sa, sizeof(sa)) < 0) ||
+        (listen(sock, 4) < 0) ||
+        (getsockname(sock, (struct sockaddr*)&sa, &len) < 0))
+    {
+        close(sock);
+        return -1;
+    }
+    *pPort = ntohs(sa.sin_port);
+    return sock;
+}
+
+//! send all data on a blocking socket
+static void serverSend(int sock, const U1* p, U4 size)
+{
+    while (size)
+    {
+        const ssize_t n = send(sock, p, size, 0);
+        if (n <= 0)
+        {
+            return;
+        }
+        p    += n;
+        size -= (U4)n;
+    }
+}
+
+//! note a baudrate set by the client
+static void serverBaud(NET_SERVER_t* srv, U4 baud)
+{
+    if (srv->baudCount < MAX_BAUDS)
+    {
+        srv->bauds[srv->baudCount] = baud;
+    }
+    srv->baudCount++;
+}
+
+//! answer the baudrate request of NET_BAUDRATE()
+static void serverHttp(NET_SERVER_t* srv, int sock)
+{
+    static const CH reply[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+    CH request[512];
+    size_t len = 0;
+    request[0] = 0;
+    while (!strstr(request, "\r\n\r\n") && (len < sizeof(request) - 1))
+    {
+        const ssize_t n = recv(sock, request + len, sizeof(request) - 1 - len, 0);
+        if (n <= 0)
+        {
+            return;
+        }
+        len += (size_t)n;
+        request[len] = 0;
+    }
+    const CH* pPort = strstr(request, "portNum=");
+    const CH* pBaud = strstr(request, "baudRate=");
+    srv->httpCount++;
+    if (pPort && pBaud)
+    {
+        srv->portNum = atoi(pPort + 8);
+        serverBaud(srv, (U4)atol(pBaud + 9));
+    }
+    serverSend(sock, (const U1*)reply, sizeof(reply) - 1);
+}
+
+//! answer a telnet option request of the client
+/*!
+    Binary transmission and suppress go ahead are used in both directions,
+    COM-PORT-OPTION is accepted from the client.
+*/
+static void serverTelnetOption(int sock, U1 verb, U1 opt)
+{
+    const BOOL known = (opt == TELNET_BINARY) || (opt == TELNET_SGA) ||
+                       ((opt == TELNET_COM_PORT) && (verb == TELNET_WILL));
+    U1 reply[3] = { TELNET_IAC, 0, opt };
+    if (verb == TELNET_WILL)
+    {
+        reply[1] = known ? TELNET_DO : TELNET_DONT;
+    }
+    else if (verb == TELNET_DO)
+    {
+        reply[1] = known ? TELNET_WILL : TELNET_WONT;
+    }
+    else
+    {
+        return;
+    }
+    serverSend(sock, reply, sizeof(reply));
+}
+
+//! answer a RFC 2217 command of the client
+/*!
+    Confirms every command with the value received, notes the baudrates.
+*/
+static void serverComPort(NET_SERVER_t* srv, int sock)
+{
+    U1 reply[2 * sizeof(srv->sb) + 4];
+    U4 len = 0;
+    U4 ix;
+    if ((srv->sbLen < 2) || (srv->sb[0] != TELNET_COM_PORT))
+    {
+        return;
+    }
+    if ((srv->sb[1] == RFC2217_SET_BAUDRATE) && (srv->sbLen == 6))
+    {
+        serverBaud(srv, ((U4)srv->sb[2] << 24) | ((U4)srv->sb[3] << 16) |
+                        ((U4)srv->sb[4] <<  8) |  (U4)srv->sb[5]);
+    }
+    srv->comPortCmds++;
+    reply[len++] = TELNET_IAC;
+    reply[len++] = TELNET_SB;
+    reply[len++] = TELNET_COM_PORT;
+    reply[len++] = (U1)(srv->sb[1] + RFC2217_SERVER_OFFSET);
+    for (ix = 2; ix < srv->sbLen; ix++)
+    {
+        reply[len++] = srv->sb[ix];
+        if (srv->sb[ix] == TELNET_IAC)
+        {
+            reply[len++] = TELNET_IAC;
+        }
+    }
+    reply[len++] = TELNET_IAC;
+    reply[len++] = TELNET_SE;
+    serverSend(sock, reply, len);
+}
+
+//! remove the telnet commands from data received from the client
+/*!
+    \param srv     server
+    \param sock    connection to the client, receives the answers
+    \param p       received data, replaced by the data without commands
+    \param size    number of bytes received
+    \return number of data bytes
+*/
+static U4 serverTelnetFilter(NET_SERVER_t* srv, int sock, U1* p, U4 size)
+{
+    U4 rd;
+    U4 wr = 0;
+    for (rd = 0; rd < size; rd++)
+    {
+        const U1 c = p[rd];
+        switch (srv->state)
+        {
+        case SERVER_TELNET_DATA:
+            if (c == TELNET_IAC)
+            {
+                srv->state = SERVER_TELNET_IAC;
+            }
+            else
+            {
+                p[wr++] = c;
+            }
+            break;
+        case SERVER_TELNET_IAC:
+            srv->state = SERVER_TELNET_DATA;
+            if (c == TELNET_IAC)
+            {
+                p[wr++] = c;
+            }
+            else if ((c == TELNET_WILL) || (c == TELNET_WONT) || (c == TELNET_DO) || (c == TELNET_DONT))
+            {
+                srv->verb  = c;
+                srv->state = SERVER_TELNET_OPT;
+            }
+            else if (c == TELNET_SB)
+            {
+                srv->sbLen = 0;
+                srv->state = SERVER_TELNET_SB;
+            }
+            break;
+        case SERVER_TELNET_OPT:
+            serverTelnetOption(sock, srv->verb, c);
+            srv->state = SERVER_TELNET_DATA;
+            break;
+        case SERVER_TELNET_SB:
+            if (c == TELNET_IAC)
+            {
+                srv->state = SERVER_TELNET_SB_IAC;
+            }
+            else if (srv->sbLen < sizeof(srv->sb))
+            {
+                srv->sb[srv->sbLen++] = c;
+            }
+            break;
+        case SERVER_TELNET_SB_IAC:
+            if (c == TELNET_IAC)
+            {
+                if (srv->sbLen < sizeof(srv->sb))
+                {
+                    srv->sb[srv->sbLen++] = c;
+                }
+                srv->state = SERVER_TELNET_SB;
+                break;
+            }
+            srv->state = SERVER_TELNET_DATA;
+            serverComPort(srv, sock);
+            break;
+        }
+    }
+    return wr;
+}
+
+//! send data of the receiver to the client, doubling the IAC characters on telnet connections
+static void serverForward(NET_SERVER_t* srv, int sock, const U1* p, U4 size)
+{
+    U1 buf[2 * 256];
+    if (!srv->rfc2217)
+    {
+        serverSend(sock, p, size);
+        return;
+    }
+    while (size)
+    {
+        U4 len = 0;
+        while (size && (len < sizeof(buf) - 1))
+        {
+            buf[len++] = *p;
+            if (*p == TELNET_IAC)
+            {
+                buf[len++] = TELNET_IAC;
+            }
+            p++;
+            size--;
+        }
+        serverSend(sock, buf, len);
+    }
+}
+
+//! check if the server is to end
+static BOOL serverStopped(NET_SERVER_t* srv)
+{
+    pthread_mutex_lock(&srv->mutex);
+    const BOOL stop = srv->stop;
+    pthread_mutex_unlock(&srv->mutex);
+    return stop;
+}
+
+//! server thread, passes the data between the connection and the receiver
+static void* serverThread(void* pArg)
+{
+    NET_SERVER_t* srv = (NET_SERVER_t*)pArg;
+    int conn = -1;
+    U1 buf[4096];
+    // the last data of the update may still be in the connection when it is stopped
+    while (!serverStopped(srv) || (conn >= 0))
+    {
+        fd_set fds;
+        struct timeval tv = { 0, 1000 };
+        int maxFd = MAX(srv->dataListen, srv->httpListen);
+        FD_ZERO(&fds);
+        FD_SET(srv->dataListen, &fds);
+        FD_SET(srv->httpListen, &fds);
+        if (conn >= 0)
+        {
+            FD_SET(conn, &fds);
+            maxFd = MAX(maxFd, conn);
+        }
+        if (select(maxFd + 1, &fds, NULL, NULL, &tv) > 0)
+        {
+            if (FD_ISSET(srv->httpListen, &fds))
+            {
+                const int http = accept(srv->httpListen, NULL, NULL);
+                if (http >= 0)
+                {
+                    serverHttp(srv, http);
+                    close(http);
+                }
+            }
+            if (FD_ISSET(srv->dataListen, &fds))
+            {
+                // a new connection replaces the old one, like on a terminal server
+                const int sock = accept(srv->dataListen, NULL, NULL);
+                if (sock >= 0)
+                {
+                    if (conn >= 0)
+                    {
+                        close(conn);
+                    }
+                    conn = sock;
+                    srv->state = SERVER_TELNET_DATA;
+                    srv->connections++;
+                }
+            }
+            else if ((conn >= 0) && FD_ISSET(conn, &fds))
+            {
+                const ssize_t n = recv(conn, buf, sizeof(buf), 0);
+                if (n <= 0)
+                {
+                    close(conn);
+                    conn = -1;
+                }
+                else
+                {
+                    const U4 size = srv->rfc2217 ? serverTelnetFilter(srv, conn, buf, (U4)n) : (U4)n;
+                    simWrite(srv->s, buf, size);
+                }
+            }
+        }
+        // the receiver answers right away
+        U4 size;
+        while ((conn >= 0) && ((size = simRead(srv->s, buf, sizeof(buf))) > 0))
+        {
+            serverForward(srv, conn, buf, size);
+        }
+    }
+    return NULL;
+}
+
+
+//! update a simulated receiver behind a terminal server
+/*!
+    \param rfc2217     connect over RFC 2217 instead of plain TCP
+    \param pImage      contents of #IMAGE_FILE
+    \param fileSize    size of #IMAGE_FILE
+    \return number of failures
+*/
+static int testUpdate(BOOL rfc2217, const U1* pImage, U4 fileSize)
+{
+    SIM_CONFIG_t cfg;
+    NET_SERVER_t srv;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.portId = UBX_CFG_PRT_PORT_UART1;
+    cfg.nmea = TRUE;
+    memset(&srv, 0, sizeof(srv));
+    srv.s          = simCreate(&cfg);
+    srv.rfc2217    = rfc2217;
+    srv.dataListen = serverListen(&srv.dataPort);
+    srv.httpListen = serverListen(&srv.httpPort);
+    pthread_mutex_init(&srv.mutex, NULL);
+    pthread_t thread;
+    if (!srv.s || (srv.dataListen < 0) || (srv.httpListen < 0) ||
+        (pthread_create(&thread, NULL, serverThread, &srv) != 0))
+    {
+        printf("FAIL: could not start the server\n");
+        return 1;
+    }
+
+    CH port[48];
+    CH httpPort[8];
+    sprintf(port, "%s127.0.0.1:%u", rfc2217 ? "rfc2217://" : "", srv.dataPort);
+    sprintf(httpPort, "%u", srv.httpPort);
+    NET_SET_HTTP_PORT(httpPort);
+    const U4 start = TIME_GET();
+    const BOOL ok = UpdateFirmware(IMAGE_FILE, "", FIS_FILE, port,
+                                   BAUD, BAUD, BAUD_UPD,
+                                   FALSE,   // DoSafeBoot
+                                   TRUE,    // DoReset
+                                   FALSE,   // DoAutobaud
+                                   FALSE,   // EraseWholeFlash
+                                   FALSE,   // EraseOnly
+                                   FALSE,   // TrainingSequence
+                                   FALSE,   // doChipErase
+                                   FALSE,   // noFisMerging
+                                   FALSE,   // updateRam
+                                   FALSE,   // usbAltMode
+                                   0,       // Verbose
+                                   FALSE);  // fisOnly
+    const U4 duration = TIME_GET() - start;
+    NET_SET_HTTP_PORT(NULL);
+
+    pthread_mutex_lock(&srv.mutex);
+    srv.stop = TRUE;
+    pthread_mutex_unlock(&srv.mutex);
+    pthread_join(thread, NULL);
+
+    // the FIS header of the flash is merged in front of the image
+    const U1* pFlash = simFlash(srv.s);
+    const U4 prefixSize = sizeof(DRV_SPI_MEM_FIS_t);
+    CH* pFis = NULL;
+    size_t fisSize = 0;
+    U4 ix;
+    BOOL updBaud = FALSE;
+    for (ix = 0; ix < MIN(srv.baudCount, MAX_BAUDS); ix++)
+    {
+        updBaud = updBaud || (srv.bauds[ix] == BAUD_UPD);
+    }
+    // RFC 2217 ports set the baudrate in-band, the others over HTTP
+    const BOOL baudPath = rfc2217 ?
+        ((srv.httpCount == 0) && (srv.comPortCmds > srv.baudCount)) :
+        ((srv.httpCount == srv.baudCount) && (srv.portNum == (int)(srv.dataPort % 100) - 1));
+    int failed = 0;
+    if (!ok)
+    {
+        printf("FAIL: update over %s failed\n", port);
+        failed++;
+    }
+    else if (mergefis_load(&pFis, &fisSize, FIS_FILE, SIM_JEDEC) != MERGEFIS_OK)
+    {
+        printf("FAIL: no FIS for JEDEC ID %06X in %s\n", SIM_JEDEC, FIS_FILE);
+        failed++;
+    }
+    else if ((fisSize < prefixSize) || (memcmp(pFlash, pFis, prefixSize) != 0))
+    {
+        printf("FAIL: flash doesn't start with the FIS over %s\n", port);
+        failed++;
+    }
+    else if (memcmp(pFlash + prefixSize, pImage, fileSize) != 0)
+    {
+        printf("FAIL: flash differs from the image over %s\n", port);
+        failed++;
+    }
+    else if (simReboots(srv.s) != 1)
+    {
+        printf("FAIL: %u reboots instead of 1 over %s\n", simReboots(srv.s), port);
+        failed++;
+    }
+    else if (!srv.baudCount || (srv.bauds[0] != BAUD) || !updBaud || !baudPath)
+    {
+        printf("FAIL: %u baudrate requests over %s, first %u baud, %u over HTTP, %u RFC 2217 commands\n",
+               srv.baudCount, port, srv.baudCount ? srv.bauds[0] : 0, srv.httpCount, srv.comPortCmds);
+        failed++;
+    }
+    else if (duration > MAX_TIME)
+    {
+        printf("FAIL: update over %s took %u ms\n", port, duration);
+        failed++;
+    }
+    else
+    {
+        printf("PASS: update over %s of %u bytes in %u ms, %u connection(s), %u baudrate requests\n",
+               rfc2217 ? "RFC 2217" : "TCP", fileSize, duration, srv.connections, srv.baudCount);
+    }
+
+    free(pFis);
+    close(srv.dataListen);
+    close(srv.httpListen);
+    pthread_mutex_destroy(&srv.mutex);
+    simDelete(srv.s);
+    return failed;
+}
+
+int main(void)
+{
+    U1* pImage = NULL;
+    U4 fileSize = 0;
+    if (!simWriteImage(IMAGE_FILE, IMAGE_SIZE, 0x1357, &pImage, &fileSize))
+    {
+        printf("FAIL: could not write %s\n", IMAGE_FILE);
+        return 1;
+    }
+    int failed = testUpdate(FALSE, pImage, fileSize);
+    failed += testUpdate(TRUE, pImage, fileSize);
+    remove(IMAGE_FILE);
+    free(pImage);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,185 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+
+/*!
+  \file
+  \brief  Step-driven updates of two simulated receivers from one thread
+
+  Drives two sessions with UpdateStep() from one loop, one receiver is
+  commanded to safeboot, the other one is updated through the loader task
+  and found with autobaud. No step may block: the time the receivers need
+  to boot and the links to settle has to pass through UpdateNextDeadline(),
+  while the other session goes on. Both flashes are compared with the image.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "ubxmsg.h"
+#include "mergefis.h"
+#include "update.h"
+#include "simrcv.h"
+
+#define SESSIONS    2                     //!< sessions driven at once
+#define IMAGE_FILE  "bin/test_session.bin" //!< image written for the test
+#define IMAGE_SIZE  (64*1024)             //!< size of the image without the footer
+#define FIS_FILE    "fis/flash_200061.xml" //!< FIS file with the flash of the simulated receivers
+#define MAX_STEP    50                    //!< longest step allowed [ms]
+
+int main(void)
+{
+    SIM_RCV_t* sims[SESSIONS];
+    UPD_PARAMS_t params[SESSIONS];
+    UPD_SESSION_t* sessions[SESSIONS];
+    BOOL running[SESSIONS];
+    CH names[SESSIONS][16];
+    U1* pImage = NULL;
+    U4 fileSize = 0;
+    U4 ix;
+    int failed = 0;
+
+    simRegister();
+    for (ix = 0; ix < SESSIONS; ix++)
+    {
+        SIM_CONFIG_t cfg;
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.portId = UBX_CFG_PRT_PORT_UART1;
+        cfg.nmea = TRUE;
+        sims[ix] = simCreate(&cfg);
+        sprintf(names[ix], "sim:s%u", ix);
+        if (!sims[ix] || !simAdd(names[ix] + 4, sims[ix]))
+        {
+            printf("FAIL: setup\n");
+            return 1;
+        }
+    }
+    if (!simWriteImage(IMAGE_FILE, IMAGE_SIZE, 0x5678, &pImage, &fileSize))
+    {
+        printf("FAIL: could not write %s\n", IMAGE_FILE);
+        return 1;
+    }
+
+    for (ix = 0; ix < SESSIONS; ix++)
+    {
+        memset(&params[ix], 0, sizeof(params[ix]));
+        params[ix].BinaryFileName   = IMAGE_FILE;
+        params[ix].FlashDefFileName = "";
+        params[ix].FisFileName      = FIS_FILE;
+        params[ix].Baudrate         = 9600;
+        params[ix].BaudrateSafe     = 9600;
+        params[ix].BaudrateUpd      = 115200;
+        params[ix].DoSafeBoot       = (ix == 0);
+        params[ix].DoAutobaud       = (ix == 1);
+        params[ix].TrainingSequence = TRUE;
+        params[ix].DoReset          = TRUE;
+        params[ix].Verbose          = 0;
+        sessions[ix] = UpdateBegin(&params[ix], names[ix], NULL, NULL);
+        running[ix] = (sessions[ix] != NULL);
+    }
+
+    // step both sessions from this thread until they are done
+    const U4 start = TIME_GET();
+    U4 steps = 0;
+    U4 maxStep = 0;
+    BOOL busy = TRUE;
+    while (busy)
+    {
+        U4 due = TIME_GET() + 1000;
+        busy = FALSE;
+        for (ix = 0; ix < SESSIONS; ix++)
+        {
+            if (!running[ix])
+            {
+                continue;
+            }
+            const U4 stepStart = TIME_GET();
+            running[ix] = UpdateStep(sessions[ix]);
+            maxStep = MAX(maxStep, TIME_GET() - stepStart);
+            steps++;
+            if (running[ix])
+            {
+                const U4 next = UpdateNextDeadline(sessions[ix]);
+                due = ((I4)(next - due) < 0) ? next : due;
+                busy = TRUE;
+            }
+        }
+        // the simulated ports have no descriptor, poll them like SER_WAIT() does
+        if (busy && ((I4)(due - TIME_GET()) > 0))
+        {
+            TIME_SLEEP(1);
+        }
+    }
+    const U4 duration = TIME_GET() - start;
+
+    for (ix = 0; ix < SESSIONS; ix++)
+    {
+        if (!UpdateEnd(sessions[ix]))
+        {
+            printf("FAIL: update over %s failed\n", names[ix]);
+            failed++;
+        }
+    }
+    if (maxStep > MAX_STEP)
+    {
+        printf("FAIL: a step took %u ms\n", maxStep);
+        failed++;
+    }
+    CH* pFis = NULL;
+    size_t fisSize = 0;
+    const U4 prefixSize = sizeof(DRV_SPI_MEM_FIS_t);
+    if ((mergefis_load(&pFis, &fisSize, FIS_FILE, SIM_JEDEC) != MERGEFIS_OK) || (fisSize < prefixSize))
+    {
+        printf("FAIL: no FIS for JEDEC ID %06X in %s\n", SIM_JEDEC, FIS_FILE);
+        failed++;
+    }
+    for (ix = 0; !failed && (ix < SESSIONS); ix++)
+    {
+        const U1* pFlash = simFlash(sims[ix]);
+        if ((memcmp(pFlash, pFis, prefixSize) != 0) ||
+            (memcmp(pFlash + prefixSize, pImage, fileSize) != 0) ||
+            (simReboots(sims[ix]) != (params[ix].DoSafeBoot ? 2U : 1U)))
+        {
+            printf("FAIL: receiver on %s not updated\n", names[ix]);
+            failed++;
+        }
+    }
+    if (!failed)
+    {
+        printf("PASS: %u sessions in %u steps and %u ms, longest step %u ms\n",
+               SESSIONS, steps, duration, maxStep);
+    }
+
+    free(pFis);
+    remove(IMAGE_FILE);
+    free(pImage);
+    simRemoveAll();
+    for (ix = 0; ix < SESSIONS; ix++)
+    {
+        simDelete(sims[ix]);
+    }
+    return failed ? 1 : 0;
+}
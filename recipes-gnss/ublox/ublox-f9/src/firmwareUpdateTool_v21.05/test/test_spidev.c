@@ -0,0 +1,151 @@
+/*******************************************************************************
+ *
+ * Copyright (C) u-blox AG
+ * u-blox AG, Thalwil, Switzerland
+ *
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose without fee is hereby granted, provided that this entire notice
+ * is included in all copies of any software which is or includes a copy
+ * or modification of this software and in all copies of the supporting
+ * documentation for such software.
+ *
+ * THIS SOFTWARE IS BEING PROVIDED "AS IS", WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTY. IN PARTICULAR, NEITHER THE AUTHOR NOR U-BLOX MAKES ANY
+ * REPRESENTATION OR WARRANTY OF ANY KIND CONCERNING THE MERCHANTABILITY
+ * OF THIS SOFTWARE OR ITS FITNESS FOR ANY PARTICULAR PURPOSE.
+ *
+ *******************************************************************************
+ *
+ * Project: firmwareUpdateTool v21.05
+ * Purpose: Provide sample code to do a FW update
+ *
+ ******************************************************************************/
+
+/*!
+  \file
+  \brief  Update over the spidev transport against a simulated receiver
+
+  Replaces the spidev transfers with SPIDEV_SET_TRANSFER(), so the update
+  of "/dev/spidev0.0" runs through SPIDEV_WRITE() and SPIDEV_READ() (0xFF
+  filter, read buffer) without a SPI device, and compares the flash of the
+  simulated receiver with the image. Beforehand, short and long writes to
+  an idle receiver must not leave the idle bytes (0xFF) clocked in behind
+  for SPIDEV_READ(), while a reply clocked in by a write has to be kept.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+#include "ubxmsg.h"
+#include "simrcv.h"
+
+#define IMAGE_FILE  "bin/test_spidev.bin" //!< image written for the test
+#define IMAGE_SIZE  (200*1024)            //!< size of the image without the footer
+#define PORT        "/dev/spidev0.0"      //!< port updated
+
+//! Write to an idle receiver
+/*!
+    \param h       port
+    \param size    number of bytes to write
+    \return #TRUE if the write succeeded and nothing can be read afterwards
+*/
+static BOOL testIdleWrite(SER_HANDLE_pt h, U4 size)
+{
+    U1 buf[256];
+    memset(buf, 0x00, sizeof(buf));
+    return (SER_WRITE(h, buf, size) == size) && (SER_READ(h, buf, sizeof(buf)) == 0);
+}
+
+//! Write to a receiver while it is idle and while it has a reply to send
+/*!
+    \return number of failures
+*/
+static int testWrites(void)
+{
+    static const U1 pollMonVer[] = { 0xB5, 0x62, UBX_CLASS_MON, UBX_MON_VER, 0x00, 0x00, 0x0E, 0x34 };
+    SIM_CONFIG_t cfg;
+    U1 buf[8];
+    memset(buf, 0x00, sizeof(buf));
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.portId = UBX_CFG_PRT_PORT_SPI;
+    SIM_RCV_t* s = simCreate(&cfg);
+    SPIDEV_SET_TRANSFER(simSpiTransfer, s);
+    SER_HANDLE_pt h = s ? SER_OPEN(PORT) : NULL;
+    SPIDEV_SET_TRANSFER(NULL, NULL);
+    if (!h)
+    {
+        printf("FAIL: setup\n");
+        simDelete(s);
+        return 1;
+    }
+
+    int failed = 0;
+    if (!testIdleWrite(h, 8) || !testIdleWrite(h, 200))
+    {
+        printf("FAIL: idle bytes clocked in by a write read back\n");
+        failed++;
+    }
+    // the reply is clocked in by the write following the poll
+    else if ((SER_WRITE(h, pollMonVer, sizeof(pollMonVer)) != sizeof(pollMonVer)) ||
+             (SER_WRITE(h, buf, sizeof(buf)) != sizeof(buf)) ||
+             (SER_READ(h, buf, sizeof(buf)) != sizeof(buf)) ||
+             (buf[0] != 0xB5) || (buf[1] != 0x62) || (buf[2] != UBX_CLASS_MON) || (buf[3] != UBX_MON_VER))
+    {
+        printf("FAIL: reply clocked in by a write lost\n");
+        failed++;
+    }
+    else
+    {
+        printf("PASS: spidev writes to an idle and a busy receiver\n");
+    }
+    SER_CLOSE(h);
+    simDelete(s);
+    return failed;
+}
+
+int main(void)
+{
+    SIM_CONFIG_t cfg;
+    U1* pImage = NULL;
+    U4 fileSize = 0;
+    if (testWrites())
+    {
+        return 1;
+    }
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.portId = UBX_CFG_PRT_PORT_SPI;
+    cfg.nmea = TRUE;
+    SIM_RCV_t* s = simCreate(&cfg);
+    if (!s || !simWriteImage(IMAGE_FILE, IMAGE_SIZE, 0x1234, &pImage, &fileSize))
+    {
+        printf("FAIL: setup\n");
+        return 1;
+    }
+
+    SPIDEV_SET_TRANSFER(simSpiTransfer, s);
+    const BOOL ok = simUpdate(IMAGE_FILE, PORT, BaudrateDefaultSpiDev);
+    SPIDEV_SET_TRANSFER(NULL, NULL);
+
+    int failed = 0;
+    if (!ok)
+    {
+        printf("FAIL: update failed\n");
+        failed++;
+    }
+    else if (!simCheckFlash(s, pImage, fileSize, 1))
+    {
+        failed++;
+    }
+    else
+    {
+        printf("PASS: spidev update of %u bytes\n", fileSize);
+    }
+
+    remove(IMAGE_FILE);
+    free(pImage);
+    simDelete(s);
+    return failed ? 1 : 0;
+}